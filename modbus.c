@@ -1,5 +1,73 @@
 #include "modbus.h"
 #include <stdarg.h>
+#include <stddef.h>
+
+#ifdef MODBUS_TRACE
+#include "modbus_trace.h"
+// 记录跟踪事件, 实例未绑定跟踪缓冲区时不记录; 已取得当前时间时用MODBUS_TRACE_EVENT_AT
+#define MODBUS_TRACE_EVENT_AT(para, event, arg, time) do { if ((para)->m_trace != NULL) ModBus_Trace_record((para)->m_trace, (para)->m_traceId, (event), (uint16_t)(arg), (time)); } while (0)
+#define MODBUS_TRACE_EVENT(para, event, arg) MODBUS_TRACE_EVENT_AT(para, event, arg, ModBus_millis())
+#else
+#define MODBUS_TRACE_EVENT_AT(para, event, arg, time)
+#define MODBUS_TRACE_EVENT(para, event, arg)
+#endif // MODBUS_TRACE
+
+#ifdef MODBUS_STATS
+#include "modbus_stats.h"
+// 更新统计, 实例未绑定统计时不更新; 只在loop线程中调用
+#define MODBUS_STATS_COUNT(para, func, ...) do { if ((para)->m_stats != NULL) func((para)->m_stats, __VA_ARGS__); } while (0)
+#else
+#define MODBUS_STATS_COUNT(para, func, ...)
+#endif // MODBUS_STATS
+
+#ifdef MODBUS_CAPTURE
+#include "modbus_capture.h"
+// 写入捕获记录, 实例未绑定捕获时不记录; 只在loop线程中调用
+#define MODBUS_CAPTURE_RECORD(para, type, data, len) do { if ((para)->m_capture != NULL) ModBus_Capture_record((para)->m_capture, (type), (data), (len)); } while (0)
+#define MODBUS_CAPTURE_RECORD_BYTE(para, type, value) do { if ((para)->m_capture != NULL) { byte captureByte = (byte)(value); ModBus_Capture_record((para)->m_capture, (type), &captureByte, 1); } } while (0)
+#else
+#define MODBUS_CAPTURE_RECORD(para, type, data, len)
+#define MODBUS_CAPTURE_RECORD_BYTE(para, type, value)
+#endif // MODBUS_CAPTURE
+
+#ifdef MODBUS_LIFECYCLE
+#include "modbus_lifecycle.h"
+// 记录主机指令的生命周期时刻, 实例未绑定时不记录
+#define MODBUS_LIFECYCLE_HOOK(para, func) do { if ((para)->m_lifecycle != NULL) func((para)->m_lifecycle); } while (0)
+#define MODBUS_LIFECYCLE_HOOK_ARGS(para, func, ...) do { if ((para)->m_lifecycle != NULL) func((para)->m_lifecycle, __VA_ARGS__); } while (0)
+#else
+#define MODBUS_LIFECYCLE_HOOK(para, func)
+#define MODBUS_LIFECYCLE_HOOK_ARGS(para, func, ...)
+#endif // MODBUS_LIFECYCLE
+
+#if defined(MODBUS_BREAKER) && defined(MODBUS_MASTER)
+#include "modbus_breaker.h"
+#endif
+
+#if defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+// 主从机部分共用内存, ModBus_setup同时初始化两部分: 从机部分只与主机的发送队列重叠, 不能覆盖主机的状态字段
+MODBUS_STATIC_ASSERT(sizeof(ModBus_SlavePart_T) <= offsetof(ModBus_MasterPart_T, m_sendFramesN), role_overlap);
+#endif
+
+// 默认时间源
+static u32 ModBus_defaultClock(void)
+{
+	return (u32)millis();
+}
+
+static u32(*g_modbusClock)(void) = ModBus_defaultClock; // 协议内部使用的时间源
+
+// 替换时间源, 传入NULL恢复为millis()
+void ModBus_setClock(u32(*clock)(void))
+{
+	g_modbusClock = clock != NULL ? clock : ModBus_defaultClock;
+}
+
+// 协议内部使用的毫秒时间
+u32 ModBus_millis(void)
+{
+	return g_modbusClock();
+}
 
 /** 配置ModBus实例 **/
 /*** 参数 ***
@@ -12,8 +80,6 @@ void ModBus_setup( ModBus_parameter* ModBus_para, ModBus_Setting_T setting)
 	ModBus_para->m_address = setting.address;
 	ModBus_para->m_modeType = setting.frameType;
 	ModBus_para->m_receiveFrameBufferLen = 0;
-	ModBus_para->m_sendFramesN = 0;
-	ModBus_para->m_nextFrameIndex = 1; // 数据包序号从1开始
 
 	//ModBus_para->m_receiveBufferTmpLen = 0;
 	ModBus_para->m_pBeginReceiveBufferTmp = ModBus_para->m_receiveBufferTmp;
@@ -37,19 +103,50 @@ void ModBus_setup( ModBus_parameter* ModBus_para, ModBus_Setting_T setting)
 	ModBus_para->m_receiveTimeout = 4000u * 8u / setting.baudRate + 2u;
 	ModBus_para->m_sendTimeout = ((ModBus_para->m_registerAcessLimit * 4u + 20u) * 2000u + 7000u) * 8u / setting.baudRate + 5u;
 
-	ModBus_para->m_lastReceivedTime = ModBus_para->m_lastSentTime = millis();
+	ModBus_para->m_lastReceivedTime = ModBus_para->m_lastSentTime = ModBus_millis();
 
 	ModBus_para->m_faston = 0; // 默认关闭快速模式, 保证初始化的时候指令能按顺序被执行
+	ModBus_para->m_lengthFraming = 0;
 
 	ModBus_para->m_SendHandler = setting.sendHandler;
+	ModBus_para->m_SendHandlerEx = NULL;
+	ModBus_para->m_sendContext = NULL;
+#ifdef MODBUS_TRACE
+	ModBus_para->m_trace = NULL;
+	ModBus_para->m_traceId = 0;
+#endif
+#ifdef MODBUS_STATS
+	ModBus_para->m_stats = NULL;
+#endif
+#ifdef MODBUS_CAPTURE
+	ModBus_para->m_capture = NULL;
+#endif
+#ifdef MODBUS_LIFECYCLE
+	ModBus_para->m_lifecycle = NULL;
+#endif
 
 #ifdef MODBUS_MASTER // 主机
-	
+	ModBus_para->m_master.m_sendFramesN = 0;
+	ModBus_para->m_master.m_nextFrameIndex = 1; // 数据包序号从1开始
+	ModBus_para->m_master.m_waitingResponse = 0;
+	ModBus_para->m_master.m_mergeWrites = 0; // 默认关闭合并写入, 每条写入指令都发送
+	ModBus_para->m_master.m_submitQueue = NULL;
+#ifdef MODBUS_BREAKER
+	ModBus_para->m_master.m_breaker = NULL;
+#endif
+	ModBus_para->m_master.m_priorityAging = MODBUS_PRIORITY_AGING;
+	for (int i = 0; i < MODBUS_PRIORITY_N; i++)
+	{
+		ModBus_para->m_master.m_priorityLimits[i] = MODBUS_WAITFRAME_N;
+		ModBus_para->m_master.m_priorityWeights[i] = 0;
+		ModBus_para->m_master.m_priorityCredits[i] = 0;
+	}
 #endif
 
 #ifdef MODBUS_SLAVE // 从机
-	ModBus_para->m_GetRegisterHandler = NULL;
-	ModBus_para->m_SetRegisterHandler = NULL;
+	ModBus_para->m_slave.m_GetRegisterHandler = NULL;
+	ModBus_para->m_slave.m_SetRegisterHandler = NULL;
+	ModBus_para->m_slave.m_registerImage = NULL;
 #endif
 
 }
@@ -82,17 +179,11 @@ void ModBus_setTimeout(ModBus_parameter* ModBus_para, u32 receiveTimeout, u32 se
 		ModBus_para->m_sendTimeout = sendTimeout;
 }
 
-// RTU模式时, 产生CRC校验码并添加到数据尾部
-// Calculate CRC for outcoming buffer
-// and place it to end.
-// return total length
-static size_t GenCRC16(byte* buff, size_t len)
+// RTU模式时, 在crc基础上继续计算len个字节的CRC(初值0xFFFF), 可分段计算
+static uint16_t CRC16_update(uint16_t crc, const byte* buff, size_t len)
 {
-	uint16_t crc = 0xFFFF;
-	uint16_t pos = 0;
+	size_t pos = 0;
 	uint8_t i = 0;
-	uint8_t lo = 0;
-	uint8_t hi = 0;
 
 	for (pos = 0; pos < len; pos++)
 	{
@@ -109,11 +200,19 @@ static size_t GenCRC16(byte* buff, size_t len)
 				crc >>= 1;
 		}
 	}
-	lo = crc & 0xFF;
-	hi = (crc >> 8) & 0xFF;
+	return crc;
+}
+
+// RTU模式时, 产生CRC校验码并添加到数据尾部
+// Calculate CRC for outcoming buffer
+// and place it to end.
+// return total length
+static size_t GenCRC16(byte* buff, size_t len)
+{
+	uint16_t crc = CRC16_update(0xFFFF, buff, len);
 
-	buff[len++] = lo;
-	buff[len++] = hi;
+	buff[len++] = crc & 0xFF;
+	buff[len++] = (crc >> 8) & 0xFF;
 	return len;
 }
 
@@ -122,38 +221,50 @@ static size_t GenCRC16(byte* buff, size_t len)
 // Return 1 - if CRC is correct, overwise return 0
 static byte CheckCRC16(byte* buff, size_t len)
 {
-	uint16_t crc = 0xFFFF;
-	uint16_t pos = 0;
-	uint8_t i = 0;
-	uint8_t lo = 0;
-	uint8_t hi = 0;
+	uint16_t crc = CRC16_update(0xFFFF, buff, len - 2);
 
-	for (pos = 0; pos < len - 2; pos++)
+	if ((buff[len - 2] == (crc & 0xFF)) &&
+		(buff[len - 1] == ((crc >> 8) & 0xFF)))
 	{
-		crc ^= buff[pos];
+		return 1;
+	}
+	return 0;
+}
 
-		for (i = 8; i != 0; i--)
-		{
-			if ((crc & 0x0001) != 0)
-			{
-				crc >>= 1;
-				crc ^= 0xA001;
-			}
-			else
-				crc >>= 1;
-		}
+// 在帧尾部添加CRC校验码
+size_t ModBus_RTU_appendCRC(byte* frame, size_t len)
+{
+	return GenCRC16(frame, len);
+}
+
+// 检查帧的CRC校验码
+byte ModBus_RTU_checkCRC(const byte* frame, size_t len)
+{
+	return len > 2 && CheckCRC16((byte*)frame, len);
+}
+
+// 根据功能码计算请求帧长度(地址+PDU+校验码)
+size_t ModBus_RTU_requestSize(const byte* frame, size_t len)
+{
+	if (len < 2)
+	{
+		return 0;
 	}
-	lo = crc & 0xFF;
-	hi = (crc >> 8) & 0xFF;
-	if ((buff[len - 2] == lo) &&
-		(buff[len - 1] == hi))
+	switch (frame[1])
 	{
-		return 1;
+	case 0x01: // 读线圈
+	case 0x02: // 读离散输入
+	case READ_REGISTER:
+	case 0x04: // 读输入寄存器
+	case 0x05: // 写单线圈
+	case WRITE_SINGLE_REGISTER:
+		return 8; // 地址 功能码 数据(4) 校验码(2)
+	case 0x0F: // 写多线圈
+	case WRITE_MULTI_REGISTER:
+		return len >= 7 ? 9u + frame[6] : 0; // 地址 功能码 首地址(2) 个数(2) 字节数 数据 校验码(2)
+	default:
+		return 0;
 	}
-#ifdef _UNIT_TEST
-	printf("CRC Check ERROR\n");
-#endif // _UNIT_TEST
-	return 0;
 }
 
 // ASCII模式时, 产生LRC校验码并添加到数据尾部
@@ -180,9 +291,6 @@ static uint8_t CheckLRC(byte* buff, size_t len)
 	uchLRC = ((uint8_t)(-((char)uchLRC)));
 	if (LRC1 == uchLRC)
 		return 1;
-#ifdef _UNIT_TEST
-	printf("LRC Check ERROR\n");
-#endif // _UNIT_TEST
 	return 0;
 }
 
@@ -243,38 +351,251 @@ static size_t bin2char_s(byte* buff, size_t len, size_t maxLen)
 	return ret;
 }
 
-static MODBUS_FRAME_T* addFrame(ModBus_parameter* ModBus_para)
+#ifdef MODBUS_MASTER
+#include "modbus_queue.h"
+
+// 指令执行结束, 调用回调函数或将结果放入完成队列
+static void ModBus_completeFrame(ModBus_parameter* ModBus_para, MODBUS_FRAME_T* pFrame, MODBUS_STATUS_TYPE status, uint16_t count, u8 exception)
 {
-	MODBUS_FRAME_T* pFrame;
-	if (ModBus_para->m_sendFramesN >= MODBUS_WAITFRAME_N)
+	ModBus_Result_T result;
+#ifdef MODBUS_STATS
+	u32 callbackStart = ModBus_para->m_stats != NULL ? MODBUS_STATS_CLOCK() : 0;
+#endif
+	uint8_t unit = pFrame->unit;
+	void* responseHandler = pFrame->responseHandler;
+	ModBus_ResultHandler_T resultHandler = pFrame->resultHandler;
+	void* context = pFrame->context;
+	struct __MODBUS_Queue* completionQueue = pFrame->completionQueue;
+
+	// 回调函数中可能发送新指令并复用此帧, 先保存结果
+	result.index = pFrame->index;
+	result.status = status;
+	result.type = pFrame->type;
+	result.address = pFrame->address;
+	result.count = status == MODBUS_STATUS_OK ? count : 0;
+	result.data = (status == MODBUS_STATUS_OK && pFrame->type == READ_REGISTER) ? ModBus_para->m_registerData : NULL;
+	result.exception = exception;
+
+	if (responseHandler) // 原有回调函数, 失败传入参数(0,0); 被丢弃的指令不调用, 与之前一致
+	{
+		if (pFrame->type == READ_REGISTER)
+		{
+			if (status == MODBUS_STATUS_OK)
+				(*(GetReponseHandler_T)(responseHandler))(ModBus_para->m_registerData, count);
+			else if (status != MODBUS_STATUS_DROPPED)
+				(*(GetReponseHandler_T)(responseHandler))(0, 0);
+		}
+		else
+		{
+			if (status == MODBUS_STATUS_OK)
+				(*(SetReponseHandler_T)(responseHandler))(result.address, count);
+			else if (status == MODBUS_STATUS_INVALID || status == MODBUS_STATUS_SUPERSEDED)
+				(*(SetReponseHandler_T)(responseHandler))(result.address, 0);
+			else if (status != MODBUS_STATUS_DROPPED)
+				(*(SetReponseHandler_T)(responseHandler))(0, 0);
+		}
+	}
+#ifdef MODBUS_BREAKER
+	if (ModBus_para->m_master.m_breaker != NULL) // 回调函数中查询到的是更新后的设备状态
 	{
-		memcpy(ModBus_para->m_sendFrames, ModBus_para->m_sendFrames + 1, (ModBus_para->m_sendFramesN - 1) * sizeof(MODBUS_FRAME_T));
-		pFrame = ModBus_para->m_sendFrames + (ModBus_para->m_sendFramesN - 1);
+		ModBus_Breaker_finish(ModBus_para->m_master.m_breaker, unit, result.index, status);
 	}
-	else
+#endif
+	ModBus_deliverResult(resultHandler, context, completionQueue, &result);
+	MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countResult, unit, status, ModBus_millis() - ModBus_para->m_lastSentTime, MODBUS_STATS_CLOCK() - callbackStart);
+	MODBUS_LIFECYCLE_HOOK_ARGS(ModBus_para, ModBus_Lifecycle_finish, result.index, unit, (u8)result.type, status);
+}
+
+// 指令的有效优先级: 后台0, 普通1, 紧急2; 在缓存中等待每超过m_priorityAging毫秒提升一级
+static u8 ModBus_frameRank(const ModBus_parameter* ModBus_para, const MODBUS_FRAME_T* pFrame, u32 now)
+{
+	static const u8 baseRank[MODBUS_PRIORITY_N] = { 1, 2, 0 };
+	u32 rank = baseRank[pFrame->priority];
+	if (ModBus_para->m_master.m_priorityAging > 0)
 	{
-		pFrame = ModBus_para->m_sendFrames + (ModBus_para->m_sendFramesN++);
+		rank += (now - pFrame->time) / ModBus_para->m_master.m_priorityAging;
 	}
-	pFrame->index = ModBus_para->m_nextFrameIndex++;
-	if (ModBus_para->m_nextFrameIndex == 0) // 指令序号不为0
+	return (u8)(rank < 2 ? rank : 2);
+}
+
+// 添加指令到缓存末尾, 填写完成后由ModBus_admitFrame检查缓存个数; request为NULL时是普通优先级且没有带上下文的回调函数
+static MODBUS_FRAME_T* addFrame(ModBus_parameter* ModBus_para, const ModBus_Request_T* request)
+{
+	MODBUS_FRAME_T* pFrame = ModBus_para->m_master.m_sendFrames + (ModBus_para->m_master.m_sendFramesN++); // 缓存多分配的位置容纳超出的一条
+	pFrame->index = ModBus_para->m_master.m_nextFrameIndex++;
+	if (ModBus_para->m_master.m_nextFrameIndex == 0) // 指令序号不为0
 	{
-		ModBus_para->m_nextFrameIndex = 1;
+		ModBus_para->m_master.m_nextFrameIndex = 1;
 	}
 	pFrame->size = 0;
 	pFrame->responseHandler = NULL;
-	pFrame->time = millis();
-	MODBUS_DELAY_DEBUG(("Frame Len %d\n", ModBus_para->m_sendFramesN));
+	pFrame->resultHandler = request != NULL ? request->resultHandler : NULL;
+	pFrame->context = request != NULL ? request->context : NULL;
+	pFrame->completionQueue = request != NULL ? request->completionQueue : NULL;
+	pFrame->priority = request != NULL && request->priority < MODBUS_PRIORITY_N ? (u8)request->priority : MODBUS_PRIORITY_NORMAL;
+	pFrame->retries = request != NULL ? request->retries : 0;
+	pFrame->time = ModBus_millis();
+	MODBUS_LIFECYCLE_HOOK_ARGS(ModBus_para, ModBus_Lifecycle_enqueue, pFrame->index);
 	return pFrame;
 }
 
+// 合并写入模式下, 新写入指令代替同一设备同一寄存器范围的最近一条未发送写入指令, 放在其位置, 保留其等待时间
+// 中间有读取或部分写入重叠寄存器的指令时不合并; 被代替的指令以 MODBUS_STATUS_SUPERSEDED 结束, 合并后返回1
+static byte ModBus_mergeFrame(ModBus_parameter* ModBus_para)
+{
+	MODBUS_FRAME_T* frames = ModBus_para->m_master.m_sendFrames;
+	size_t n = ModBus_para->m_master.m_sendFramesN;
+	MODBUS_FRAME_T* pNew = frames + (n - 1);
+	uint32_t begin = pNew->address, end = begin + pNew->count;
+	if (pNew->type == READ_REGISTER)
+	{
+		return 0;
+	}
+	for (size_t i = n - 1; i-- > (ModBus_para->m_master.m_waitingResponse ? 1u : 0u);) // 从新到旧, 正在等待返回帧的指令已发送
+	{
+		MODBUS_FRAME_T* pFrame = frames + i;
+		if (pFrame->unit != pNew->unit || pFrame->address >= end || (uint32_t)pFrame->address + pFrame->count <= begin)
+		{
+			continue; // 不重叠
+		}
+		if (pFrame->type != READ_REGISTER && pFrame->address == pNew->address && pFrame->count == pNew->count)
+		{
+			MODBUS_FRAME_T superseded = *pFrame;
+			*pFrame = *pNew;
+			pFrame->time = superseded.time;
+			ModBus_para->m_master.m_sendFramesN--;
+			MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_QUEUE, ModBus_para->m_master.m_sendFramesN);
+			MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countQueue, ModBus_para->m_master.m_sendFramesN);
+			ModBus_completeFrame(ModBus_para, &superseded, MODBUS_STATUS_SUPERSEDED, 0, 0);
+			return 1;
+		}
+		return 0; // 读取或部分重叠的写入, 之前的写入必须先发送
+	}
+	return 0;
+}
+
+// 新指令填写完成后检查缓存: 超出所在优先级的个数上限时丢弃该优先级最早的未发送指令, 超出缓存个数时丢弃有效优先级最低的最早未发送指令
+// 被丢弃的指令以 MODBUS_STATUS_DROPPED 结束; 新指令本身被丢弃返回0
+static byte ModBus_admitFrame(ModBus_parameter* ModBus_para)
+{
+	MODBUS_FRAME_T* frames = ModBus_para->m_master.m_sendFrames;
+	size_t n = ModBus_para->m_master.m_sendFramesN, victim = n, classN = 0;
+	// 正在等待返回帧的第一条指令不能丢弃, 否则返回帧会对应到错误的指令; 缓存只有一条时丢弃新指令
+	size_t first = ModBus_para->m_master.m_waitingResponse ? 1 : 0;
+	u8 priority = frames[n - 1].priority;
+	if (ModBus_para->m_master.m_mergeWrites && ModBus_mergeFrame(ModBus_para))
+	{
+		return 1;
+	}
+	for (size_t i = ModBus_para->m_master.m_waitingResponse ? 1 : 0; i < n; i++)
+	{
+		if (frames[i].priority == priority && classN++ == 0)
+		{
+			victim = i; // 该优先级最早的未发送指令
+		}
+	}
+	if (classN <= ModBus_para->m_master.m_priorityLimits[priority])
+	{
+		victim = n;
+		if (n > MODBUS_WAITFRAME_N)
+		{
+			u32 now = ModBus_millis();
+			u8 lowest = 0xFF;
+			for (size_t i = first; i < n; i++)
+			{
+				u8 rank = ModBus_frameRank(ModBus_para, frames + i, now);
+				if (rank < lowest)
+				{
+					lowest = rank;
+					victim = i;
+				}
+			}
+		}
+	}
+	if (victim < n)
+	{
+		MODBUS_FRAME_T dropped = frames[victim];
+		memmove(frames + victim, frames + victim + 1, (n - victim - 1) * sizeof(MODBUS_FRAME_T));
+		ModBus_para->m_master.m_sendFramesN--;
+		MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_QUEUE, ModBus_para->m_master.m_sendFramesN);
+		MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countQueue, ModBus_para->m_master.m_sendFramesN);
+		ModBus_completeFrame(ModBus_para, &dropped, MODBUS_STATUS_DROPPED, 0, 0);
+		return victim != n - 1;
+	}
+	MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_QUEUE, ModBus_para->m_master.m_sendFramesN);
+	MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countQueue, ModBus_para->m_master.m_sendFramesN);
+	return 1;
+}
+
+// 选择下一条发送的指令移到缓存最前: 有效优先级最高的最早指令; 设置了权重时只在本轮还有发送数的优先级中选择, 都用完后开始新一轮
+static void ModBus_selectFrame(ModBus_parameter* ModBus_para, u32 now)
+{
+	MODBUS_FRAME_T* frames = ModBus_para->m_master.m_sendFrames;
+	u8* weights = ModBus_para->m_master.m_priorityWeights;
+	u8* credits = ModBus_para->m_master.m_priorityCredits;
+	byte weighted = (weights[0] | weights[1] | weights[2]) != 0;
+	size_t best = ModBus_para->m_master.m_sendFramesN;
+	u8 bestRank = 0;
+	for (int round = 0; round < 2 && best == ModBus_para->m_master.m_sendFramesN; round++)
+	{
+		for (size_t i = 0; i < ModBus_para->m_master.m_sendFramesN; i++)
+		{
+			u8 rank = ModBus_frameRank(ModBus_para, frames + i, now);
+			if ((!weighted || credits[frames[i].priority] > 0) && (best == ModBus_para->m_master.m_sendFramesN || rank > bestRank))
+			{
+				best = i;
+				bestRank = rank;
+			}
+		}
+		if (best == ModBus_para->m_master.m_sendFramesN) // 缓存中指令的优先级本轮发送数都已用完, 开始新一轮; 权重为0的优先级每轮发送一条
+		{
+			for (int k = 0; k < MODBUS_PRIORITY_N; k++)
+			{
+				credits[k] = weights[k] > 0 ? weights[k] : 1;
+			}
+		}
+	}
+	if (best > 0)
+	{
+		MODBUS_FRAME_T frame = frames[best];
+		memmove(frames + 1, frames, best * sizeof(MODBUS_FRAME_T));
+		frames[0] = frame;
+	}
+}
+
+/** 配置指令优先级 **/
+/*** 参数 ***
+** limit: 该优先级最多缓存的未发送指令数, 0 为不限制
+** weight: 加权出队时每轮最多发送的指令数, 全部为0时严格按优先级
+***/
+void ModBus_setPriority(ModBus_parameter* ModBus_para, MODBUS_PRIORITY_TYPE priority, u8 limit, u8 weight)
+{
+	if (priority >= MODBUS_PRIORITY_N)
+	{
+		return;
+	}
+	ModBus_para->m_master.m_priorityLimits[priority] = limit > 0 && limit < MODBUS_WAITFRAME_N ? limit : MODBUS_WAITFRAME_N;
+	ModBus_para->m_master.m_priorityWeights[priority] = weight;
+	ModBus_para->m_master.m_priorityCredits[priority] = weight;
+}
+
+// 指令等待每超过agingMs毫秒提升一个优先级
+void ModBus_setPriorityAging(ModBus_parameter* ModBus_para, u32 agingMs)
+{
+	ModBus_para->m_master.m_priorityAging = agingMs;
+}
+
+// 是否开启合并写入模式
+void ModBus_mergeWrites(ModBus_parameter* ModBus_para, byte on)
+{
+	ModBus_para->m_master.m_mergeWrites = on;
+}
+#endif // MODBUS_MASTER
+
 
 // 接收字节数据到ModBus协议, 一般在中断函数中调用(如串口接收中断)
 void ModBus_readByteFromOuter(ModBus_parameter* ModBus_para, byte receivedByte)
 {
-#ifdef _UNIT_TEST
-	printf("address %02x read byte: %02x\n", ModBus_para->m_address, receivedByte);
-#endif // _UNIT_TEST
-
 	/*** 此函数 内部 不可更改 ModBus_para->m_pBeginReceiveBufferTmp 值!!!!!!!!!!!!!
 	**** 此函数 外部 不可更改 ModBus_para->m_pEndReceiveBufferTmp 值!!!!!!!!!!!!!!!
 	**** 避免内存写冲突, 保证数据完整性***/
@@ -295,7 +616,44 @@ void ModBus_readByteFromOuter(ModBus_parameter* ModBus_para, byte receivedByte)
 			ModBus_para->m_pEndReceiveBufferTmp = ModBus_para->m_receiveBufferTmp + (MODBUS_BUFFER_SIZE - 1);
 		}
 	}
-	ModBus_para->m_lastReceivedTime = millis();
+	ModBus_para->m_lastReceivedTime = ModBus_millis();
+	MODBUS_TRACE_EVENT_AT(ModBus_para, MODBUS_TRACE_RX_BYTE, receivedByte, ModBus_para->m_lastReceivedTime);
+	MODBUS_LIFECYCLE_HOOK(ModBus_para, ModBus_Lifecycle_firstByte);
+}
+
+// 一次传递多个字节数据到ModBus协议, 最多两次内存拷贝
+// 循环存取区中的数据与逐字节调用ModBus_readByteFromOuter相同, 缓冲区满时保留先收到的字节, 丢弃多出的字节;
+// 不同之处: 逐字节接收会把丢弃的字节写入保留的空位(不属于数据), 批量接收不写入; 跟踪只记录一次RX_BLOCK事件, 值为传入的字节数
+void ModBus_readBytesFromOuter(ModBus_parameter* ModBus_para, const byte* data, size_t len)
+{
+	byte* pBegin = (byte*)ModBus_para->m_pBeginReceiveBufferTmp;
+	byte* pEnd = (byte*)ModBus_para->m_pEndReceiveBufferTmp;
+	byte* pBufferEnd = (byte*)ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE;
+	size_t used = pEnd >= pBegin ? (size_t)(pEnd - pBegin) : (size_t)MODBUS_BUFFER_SIZE - (size_t)(pBegin - pEnd);
+	size_t space = MODBUS_BUFFER_SIZE - 1 - used; // 保留一个位置区分满和空
+	size_t n = len < space ? len : space; // 超出剩余空间的字节丢弃
+	size_t first;
+	if (len == 0)
+	{
+		return;
+	}
+
+	first = (size_t)(pBufferEnd - pEnd);
+	if (first > n)
+	{
+		first = n;
+	}
+	memcpy(pEnd, data, first);
+	memcpy((byte*)ModBus_para->m_receiveBufferTmp, data + first, n - first);
+	pEnd += n;
+	if (pEnd >= pBufferEnd)
+	{
+		pEnd -= MODBUS_BUFFER_SIZE;
+	}
+	ModBus_para->m_pEndReceiveBufferTmp = pEnd; // 数据写入后再更新结束位置
+	ModBus_para->m_lastReceivedTime = ModBus_millis();
+	MODBUS_TRACE_EVENT_AT(ModBus_para, MODBUS_TRACE_RX_BLOCK, len, ModBus_para->m_lastReceivedTime);
+	MODBUS_LIFECYCLE_HOOK(ModBus_para, ModBus_Lifecycle_firstByte);
 }
 
 void ModBus_fastMode(ModBus_parameter* ModBus_para, byte faston)
@@ -303,6 +661,185 @@ void ModBus_fastMode(ModBus_parameter* ModBus_para, byte faston)
 	ModBus_para->m_faston = faston;
 }
 
+void ModBus_lengthFraming(ModBus_parameter* ModBus_para, byte on)
+{
+	ModBus_para->m_lengthFraming = on;
+}
+
+// 距离接收超时(帧间隔)的毫秒数; 缓冲区中有未处理的数据返回0, 没有未接收完的帧返回 MODBUS_DEADLINE_NONE
+static u32 ModBus_receiveDeadline(ModBus_parameter* ModBus_para, u32 now)
+{
+	u32 elapsed;
+	if (ModBus_para->m_pBeginReceiveBufferTmp != ModBus_para->m_pEndReceiveBufferTmp)
+	{
+		return 0;
+	}
+	if (ModBus_para->m_lengthFraming || ModBus_para->m_receiveFrameBufferLen == 0)
+	{
+		return MODBUS_DEADLINE_NONE;
+	}
+	elapsed = now - ModBus_para->m_lastReceivedTime;
+	return elapsed > ModBus_para->m_receiveTimeout ? 0 : ModBus_para->m_receiveTimeout + 1 - elapsed; // loop中超时条件为大于
+}
+
+// 绑定带上下文的发送数据函数
+void ModBus_attachSendHandler(ModBus_parameter* ModBus_para, void(*sendHandler)(void*, byte*, size_t), void* context)
+{
+	ModBus_para->m_SendHandlerEx = sendHandler;
+	ModBus_para->m_sendContext = context;
+}
+
+// 通过绑定的发送函数发送数据, 没有发送函数返回0
+static byte ModBus_send(ModBus_parameter* ModBus_para, byte* data, size_t size)
+{
+	MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_TX, size);
+	MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countTx, size);
+	MODBUS_CAPTURE_RECORD(ModBus_para, MODBUS_CAPTURE_TX, data, size);
+	if (ModBus_para->m_SendHandlerEx != NULL)
+	{
+		(*ModBus_para->m_SendHandlerEx)(ModBus_para->m_sendContext, data, size);
+		return 1;
+	}
+	if (ModBus_para->m_SendHandler != NULL)
+	{
+		(*ModBus_para->m_SendHandler)(data, size);
+		return 1;
+	}
+	return 0;
+}
+
+// loop开始时记录新接收的字节, 之后处理数据时发送的帧记录在其后
+static void ModBus_captureReceived(ModBus_parameter* ModBus_para)
+{
+#ifdef MODBUS_CAPTURE
+	if (ModBus_para->m_capture != NULL)
+	{
+		ModBus_Capture_received(ModBus_para->m_capture, ModBus_para);
+	}
+#endif
+}
+
+// 统计loop中取出的接收字节数: 循环存取区开始位置从begin移动到当前位置
+static void ModBus_countReceived(ModBus_parameter* ModBus_para, volatile byte* begin)
+{
+#ifdef MODBUS_STATS
+	volatile byte* end = ModBus_para->m_pBeginReceiveBufferTmp;
+	if (ModBus_para->m_stats != NULL && end != begin)
+	{
+		ModBus_Stats_countRx(ModBus_para->m_stats, end > begin ? (size_t)(end - begin) : (size_t)MODBUS_BUFFER_SIZE - (size_t)(begin - end), 0);
+	}
+#endif
+}
+
+#define MODBUS_RTU_SIZE_MORE ((size_t)-1) // 数据不足, 需继续接收才能确定帧长度
+#define MODBUS_RTU_RESYNC_CHECK_N 3 // 接收未超时时每次滑动查找最多检查CRC的候选帧个数, 其余候选帧在之后的loop中继续查找
+
+// RTU模式时, 以frame为起始的候选帧长度(含校验码); 功能码或长度不合理返回0, 数据不足返回 MODBUS_RTU_SIZE_MORE
+static size_t ModBus_RTU_candidateSize(ModBus_parameter* ModBus_para, const byte* frame, size_t len, u8 frameSize)
+{
+	if (len < 2)
+	{
+		return MODBUS_RTU_SIZE_MORE;
+	}
+#ifdef MODBUS_MASTER
+	if (ModBus_para->m_master.m_sendFramesN > 0) // 主机等待返回帧: 功能码与指令相同, 或为异常返回
+	{
+		uint8_t type = ModBus_para->m_master.m_sendFrames[0].type;
+		if (frame[1] == type)
+		{
+			return frameSize;
+		}
+		return frame[1] == (type | MODBUS_EXCEPTION_FLAG) ? 5u : 0u;
+	}
+#endif
+	switch (frame[1]) // 从机只接受能处理的请求
+	{
+	case READ_REGISTER:
+	case WRITE_SINGLE_REGISTER:
+		return 8;
+	case WRITE_MULTI_REGISTER:
+		if (len < 7)
+		{
+			return MODBUS_RTU_SIZE_MORE;
+		}
+		return 9u + frame[6] <= MODBUS_BUFFER_SIZE ? 9u + frame[6] : 0u;
+	default:
+		return 0;
+	}
+}
+
+/** RTU模式时, 接收缓冲区开头的帧校验失败后, 滑动查找帧起始 **/
+/*** 参数 ***
+** 从第二个字节开始, 地址相同且功能码合理的位置按帧长度检查CRC, 不必等待接收超时或清空缓冲区
+** 找到完整的帧: 移到缓冲区开头, 返回1, restSize为帧之后的数据长度
+** 找到未接收完的候选帧: 从该位置保留数据继续接收(接收超时后不再等待), 返回0
+** 接收未超时且已检查 MODBUS_RTU_RESYNC_CHECK_N 个候选帧: 从下一个候选帧(或之前未接收完的候选帧)保留数据, 返回0, 收到新数据或接收超时后继续查找
+** 都没有则清空缓冲区, 重新检测起始字节, 返回0
+***/
+static byte ModBus_RTU_resync(ModBus_parameter* ModBus_para, uint8_t address, u8 frameSize, byte isTimeout, size_t* restSize)
+{
+	byte* buffer = ModBus_para->m_receiveFrameBuffer;
+	size_t len = ModBus_para->m_receiveFrameBufferLen;
+	size_t partial = 0; // 第一个未接收完的候选帧位置, 0表示没有
+	size_t checked = 0; // 已检查CRC的候选帧个数, 噪声较多时限制每次的计算量
+	MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countError, MODBUS_STATS_RESYNC);
+	for (size_t k = 1; k < len; k++)
+	{
+		size_t size;
+		if (buffer[k] != address)
+		{
+			continue;
+		}
+		size = ModBus_RTU_candidateSize(ModBus_para, buffer + k, len - k, frameSize);
+		if (size == 0)
+		{
+			continue;
+		}
+		if (size == MODBUS_RTU_SIZE_MORE || size > len - k)
+		{
+			if (partial == 0)
+			{
+				partial = k;
+			}
+			continue;
+		}
+		if (!isTimeout && checked++ == MODBUS_RTU_RESYNC_CHECK_N) // 接收超时后缓冲区会被清空, 不限制个数
+		{
+			size_t keep = partial > 0 ? partial : k;
+			memmove(buffer, buffer + keep, len - keep);
+			ModBus_para->m_receiveFrameBufferLen = len - keep;
+			return 0;
+		}
+		if (size > 2 && CheckCRC16(buffer + k, size))
+		{
+			MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_FRAME_START, address);
+			memmove(buffer, buffer + k, len - k);
+			ModBus_para->m_receiveFrameBufferLen = size;
+			*restSize = len - k - size;
+			return 1;
+		}
+	}
+	if (partial > 0 && !isTimeout)
+	{
+		memmove(buffer, buffer + partial, len - partial);
+		ModBus_para->m_receiveFrameBufferLen = len - partial;
+		return 0;
+	}
+	ModBus_para->m_receiveFrameBufferLen = 0;
+	ModBus_para->m_hasDetectedBufferStart = 0; // 重新检测起始字节, 否则下一帧(可能是其他设备的帧)被当作本帧接收
+	return 0;
+}
+
+// 处理完一帧后保留帧之后的数据, 下次接收的数据接在其后(去除校验码时只减了1)
+static void ModBus_keepRestData(ModBus_parameter* ModBus_para, size_t restSize)
+{
+	if (restSize > 0)
+	{
+		memmove(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen + 1, restSize);
+	}
+	ModBus_para->m_receiveFrameBufferLen = restSize;
+	ModBus_para->m_hasDetectedBufferStart = restSize > 0;
+}
 
 // 检查接收数据包, 存在有效数据返回1, 否则返回0
 static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
@@ -311,16 +848,18 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 	byte* pEnd, *pBegin;
 	size_t lenBufferTmp;
 	u8 frameSize = 0;
+	uint8_t address = ModBus_para->m_address; // 有效数据包的设备地址
 
 #ifdef MODBUS_MASTER
-	if (ModBus_para->m_sendFramesN > 0)
+	if (ModBus_para->m_master.m_sendFramesN > 0)
 	{
-		frameSize = ModBus_para->m_sendFrames[0].responseSize;
+		frameSize = ModBus_para->m_master.m_sendFrames[0].responseSize;
+		address = ModBus_para->m_master.m_sendFrames[0].unit; // 返回帧地址与指令的目标设备相同
 	}
 #endif
 
-	pEnd = ModBus_para->m_pEndReceiveBufferTmp;
-	pBegin = ModBus_para->m_pBeginReceiveBufferTmp; // volatile变量必须赋值给非volatile变量再操作, 否则有一定几率出现数据不完整
+	pEnd = (byte*)ModBus_para->m_pEndReceiveBufferTmp;
+	pBegin = (byte*)ModBus_para->m_pBeginReceiveBufferTmp; // volatile变量必须赋值给非volatile变量再操作, 否则有一定几率出现数据不完整
 	lenBufferTmp = pEnd - pBegin;
 	if (pEnd < pBegin)
 	{
@@ -342,20 +881,25 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 			{
 				if (pBegin >= ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE)
 				{
-					pBegin = ModBus_para->m_receiveBufferTmp;
+					pBegin = (byte*)ModBus_para->m_receiveBufferTmp;
 				}
 				if (*pBegin == ':') // 检测到起始字符
 				{
 					ModBus_para->m_hasDetectedBufferStart = 1;
+					MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_FRAME_START, ':');
 					i++;
 					pBegin++;
 					if (pBegin >= ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE)
 					{
-						pBegin = ModBus_para->m_receiveBufferTmp;
+						pBegin = (byte*)ModBus_para->m_receiveBufferTmp;
 					}
 					break;
 				}
 			}
+			if (i > 1 || (!ModBus_para->m_hasDetectedBufferStart && lenBufferTmp > 0)) // 起始前有其他数据, 丢弃后重新同步
+			{
+				MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countError, MODBUS_STATS_RESYNC);
+			}
 		}
 		if (ModBus_para->m_hasDetectedBufferStart)
 		{// 检测结束字符
@@ -363,7 +907,7 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 			{
 				if (pBegin >= ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE)
 				{
-					pBegin = ModBus_para->m_receiveBufferTmp;
+					pBegin = (byte*)ModBus_para->m_receiveBufferTmp;
 				}
 				if (*pBegin == '\r') // 检测到结束字符
 				{
@@ -391,7 +935,7 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 		pBegin++;
 		if (pBegin >= ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE)
 		{
-			pBegin = ModBus_para->m_receiveBufferTmp;
+			pBegin = (byte*)ModBus_para->m_receiveBufferTmp;
 		}
 		if (*pBegin != '\n') // 如果下一个字符不是换行符, 则接收数据异常
 		{
@@ -403,7 +947,7 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 
 		ModBus_para->m_pBeginReceiveBufferTmp = pEnd;
 		ModBus_para->m_receiveFrameBufferLen = char2bin(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBufferLen);
-		if (ModBus_para->m_receiveFrameBuffer[0] != ModBus_para->m_address)
+		if (ModBus_para->m_receiveFrameBuffer[0] != address)
 		{
 			ModBus_para->m_hasDetectedBufferStart = 0;
 			ModBus_para->m_receiveFrameBufferLen = 0;
@@ -411,13 +955,14 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 		}
 		if (!CheckLRC(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBufferLen)) // 如果校验不通过
 		{
+			MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_CHECK_FAIL, ModBus_para->m_receiveFrameBufferLen);
+			MODBUS_CAPTURE_RECORD_BYTE(ModBus_para, MODBUS_CAPTURE_CHECK_FAIL, ModBus_para->m_receiveFrameBufferLen);
+			MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countError, MODBUS_STATS_CHECK_ERROR);
 			ModBus_para->m_hasDetectedBufferStart = 0;
 			ModBus_para->m_receiveFrameBufferLen = 0;
 			return 0;
 		}
 
-		//MODBUS_DEBUG(("ModBus rec: %*s\n", ModBus_para->m_receiveFrameBufferLen, ModBus_para->m_receiveFrameBuffer));
-
 		ModBus_para->m_receiveFrameBufferLen--; // 去除校验码
 		ModBus_para->m_hasDetectedBufferStart = 0;
 
@@ -425,8 +970,8 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 	}
 	case RTU:
 	{
-		byte isTimeout = 0;
-		if (lenBufferTmp == 0) // 由于接收超时, 没有接收到数据
+		byte isTimeout = 0, plausible;
+		if (lenBufferTmp == 0 && !ModBus_para->m_lengthFraming) // 由于接收超时, 没有接收到数据(按长度判断帧边界时为处理保留的数据)
 		{
 			isTimeout = 1;
 		}
@@ -434,35 +979,52 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 		{// 检测起始字节
 			for (i = 0; i < lenBufferTmp; i++, pBegin++)
 			{
-				if (*pBegin == ModBus_para->m_address) // 检测到地址
+				if (pBegin >= ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE)
+				{
+					pBegin = (byte*)ModBus_para->m_receiveBufferTmp;
+				}
+				if (*pBegin == address) // 检测到地址
 				{
 					ModBus_para->m_hasDetectedBufferStart = 1;
+					MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_FRAME_START, address);
 					ModBus_para->m_receiveFrameBuffer[ModBus_para->m_receiveFrameBufferLen++] = *pBegin;
 					i++;
 					pBegin++;
 					break;
 				}
 			}
-		}
+			if (i > 1 || (!ModBus_para->m_hasDetectedBufferStart && lenBufferTmp > 0)) // 起始前有其他数据, 丢弃后重新同步
+			{
+				MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countError, MODBUS_STATS_RESYNC);
+			}
+		}
 		if (ModBus_para->m_hasDetectedBufferStart)
 		{
 			// 拷贝所有临时缓冲区的数据到接收数据缓冲区
 			size_t newSize = lenBufferTmp - i;
+			size_t first = (size_t)(ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE - pBegin); // 到循环存取区末尾的字节数
 			if (ModBus_para->m_receiveFrameBufferLen + newSize > MODBUS_BUFFER_SIZE)
 			{
 				newSize = MODBUS_BUFFER_SIZE - ModBus_para->m_receiveFrameBufferLen;
 			}
-			if (pBegin <= pEnd)
-			{
-				memcpy(ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, pBegin, newSize);
-			}
-			else
+			if (first > newSize)
 			{
-				memcpy(ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, pBegin, (size_t)MODBUS_BUFFER_SIZE - (pBegin - ModBus_para->m_receiveBufferTmp));
-				memcpy(ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, (void*)ModBus_para->m_receiveBufferTmp, pEnd - ModBus_para->m_receiveBufferTmp);
+				first = newSize;
 			}
+			// 数据可能跨过循环存取区末尾, 分两段拷贝
+			memcpy(ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, pBegin, first);
+			memcpy(ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen + first, (void*)ModBus_para->m_receiveBufferTmp, newSize - first);
 			ModBus_para->m_receiveFrameBufferLen += newSize;
 			ModBus_para->m_pBeginReceiveBufferTmp = pEnd;
+			if (frameSize > 0 && ModBus_para->m_receiveFrameBufferLen >= 2 && (ModBus_para->m_receiveFrameBuffer[1] & MODBUS_EXCEPTION_FLAG))
+			{
+				frameSize = 5; // 异常返回帧: 地址 功能码 异常码 校验码(2)
+			}
+			else if (frameSize == 0 && ModBus_para->m_lengthFraming) // 从机按功能码计算请求帧长度
+			{
+				size_t requestSize = ModBus_RTU_requestSize(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBufferLen);
+				frameSize = (u8)(requestSize < MODBUS_BUFFER_SIZE ? requestSize : MODBUS_BUFFER_SIZE);
+			}
 		}
 		else // 没有检测到起始字符, 则接收数据异常
 		{
@@ -470,7 +1032,8 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 			ModBus_para->m_receiveFrameBufferLen = 0;
 			return 0;
 		}
-		if (!(isTimeout // 接收超时
+		plausible = ModBus_para->m_receiveFrameBufferLen < 2 || ModBus_RTU_candidateSize(ModBus_para, ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBufferLen, frameSize) != 0;
+		if (plausible && !(isTimeout // 接收超时
 			|| frameSize > 0 && ModBus_para->m_receiveFrameBufferLen >= frameSize // 数据包足够
 			|| ModBus_para->m_receiveFrameBufferLen >= MODBUS_BUFFER_SIZE)) // 缓冲区满
 		{
@@ -481,25 +1044,28 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 		{
 			ModBus_para->m_pBeginReceiveBufferTmp = pEnd;
 			ModBus_para->m_receiveFrameBufferLen = 0;
+			ModBus_para->m_hasDetectedBufferStart = 0;
 			return 0;
 		}
-		if (!CheckCRC16(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBufferLen)) // 如果校验不通过
+		if (!plausible) // 起始字节后的功能码不合理(误把数据当作地址), 不等待帧结束, 直接查找之后的帧起始
 		{
-			if (frameSize > 0 && frameSize < ModBus_para->m_receiveFrameBufferLen)  // 如果数据长度比m_responseFrameLen长, 则尝试以m_responseFrameLen长度接收
-			{	
-				if (!CheckCRC16(ModBus_para->m_receiveFrameBuffer, frameSize)) // 如果校验不通过, 不为超时或缓冲区满则返回继续接收
-				{
-					if (isTimeout || ModBus_para->m_receiveFrameBufferLen >= MODBUS_BUFFER_SIZE)
-						ModBus_para->m_receiveFrameBufferLen = 0;
-					return 0;
-				}
-
-				*restSize = ModBus_para->m_receiveFrameBufferLen - frameSize;// 待保留的数据长度
-				ModBus_para->m_receiveFrameBufferLen = frameSize;
+			if (!ModBus_RTU_resync(ModBus_para, address, frameSize, isTimeout, restSize))
+			{
+				return 0;
 			}
-			else
+		}
+		else if (frameSize > 0 && frameSize < ModBus_para->m_receiveFrameBufferLen && CheckCRC16(ModBus_para->m_receiveFrameBuffer, frameSize)) // 先以预期长度接收, 之后的数据保留
+		{
+			*restSize = ModBus_para->m_receiveFrameBufferLen - frameSize;// 待保留的数据长度
+			ModBus_para->m_receiveFrameBufferLen = frameSize;
+		}
+		else if (!CheckCRC16(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBufferLen)) // 如果校验不通过, 滑动查找之后的帧起始
+		{
+			MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_CHECK_FAIL, ModBus_para->m_receiveFrameBufferLen);
+			MODBUS_CAPTURE_RECORD_BYTE(ModBus_para, MODBUS_CAPTURE_CHECK_FAIL, ModBus_para->m_receiveFrameBufferLen);
+			MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countError, MODBUS_STATS_CHECK_ERROR);
+			if (!ModBus_RTU_resync(ModBus_para, address, frameSize, isTimeout, restSize))
 			{
-				ModBus_para->m_receiveFrameBufferLen = 0;
 				return 0;
 			}
 		}
@@ -513,11 +1079,24 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 		break;
 	}
 
+	MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_FRAME_END, ModBus_para->m_receiveFrameBufferLen);
+#ifdef MODBUS_CAPTURE
+	if (ModBus_para->m_capture != NULL) // 帧信息: 设备地址 功能码 帧长度(不含校验码)
+	{
+		byte frameInfo[3] = { ModBus_para->m_receiveFrameBuffer[0], ModBus_para->m_receiveFrameBuffer[1], (byte)ModBus_para->m_receiveFrameBufferLen };
+		ModBus_Capture_record(ModBus_para->m_capture, MODBUS_CAPTURE_FRAME, frameInfo, sizeof(frameInfo));
+	}
+#endif
+	MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countRx, 0, 1u);
 	return 1;
 }
 
 
 #ifdef MODBUS_MASTER
+static byte ModBus_getRegister_Unit(ModBus_parameter* ModBus_para, uint8_t unit, uint16_t address, uint16_t count, void(*GetReponseHandler)(uint16_t*, uint16_t), const ModBus_Request_T* request);
+static byte ModBus_setRegister_Unit(ModBus_parameter* ModBus_para, uint8_t unit, uint16_t address, uint16_t data, void(*SetReponseHandler)(uint16_t, uint16_t), const ModBus_Request_T* request);
+static byte ModBus_setRegisters_Unit(ModBus_parameter* ModBus_para, uint8_t unit, uint16_t address, uint16_t* data, uint16_t count, void(*SetReponseHandler)(uint16_t, uint16_t), const ModBus_Request_T* request);
+
 /** 读取寄存器 **/
 /*** 参数 ***
 ** address: 寄存器首地址
@@ -527,7 +1106,15 @@ static byte ModBus_detectFrame(ModBus_parameter* ModBus_para, size_t* restSize)
 ***/
 byte ModBus_getRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_t count, void(*GetReponseHandler)(uint16_t*, uint16_t))
 {
-	MODBUS_FRAME_T* pFrame = addFrame(ModBus_para);
+	return ModBus_getRegister_Unit(ModBus_para, ModBus_para->m_address, address, count, GetReponseHandler, NULL);
+}
+
+// 指定目标设备地址
+static byte ModBus_getRegister_Unit(ModBus_parameter* ModBus_para, uint8_t unit, uint16_t address, uint16_t count, void(*GetReponseHandler)(uint16_t*, uint16_t), const ModBus_Request_T* request)
+{
+	MODBUS_FRAME_T* pFrame = addFrame(ModBus_para, request);
+	byte index;
+	pFrame->unit = unit;
 	pFrame->type = READ_REGISTER;
 	pFrame->responseSize = 0;
 	pFrame->responseHandler = GetReponseHandler;
@@ -537,7 +1124,7 @@ byte ModBus_getRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_
 	{
 		pFrame->data[pFrame->size++] = ':';
 	}
-	pFrame->data[pFrame->size++] = ModBus_para->m_address; // 设备地址
+	pFrame->data[pFrame->size++] = unit; // 设备地址
 	pFrame->data[pFrame->size++] = READ_REGISTER; // 功能码, 读寄存器
 	pFrame->data[pFrame->size++] = (address >> 8) & 0x0FF; // 寄存器首地址高位
 	pFrame->data[pFrame->size++] = address & 0x0FF; // 寄存器首地址低位
@@ -560,7 +1147,8 @@ byte ModBus_getRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_
 		break;
 	}
 
-	return pFrame->index;
+	index = pFrame->index;
+	return ModBus_admitFrame(ModBus_para) ? index : 0;
 }
 
 /** 写单个寄存器 **/
@@ -572,7 +1160,15 @@ byte ModBus_getRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_
 ***/
 byte ModBus_setRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_t data, void(*SetReponseHandler)(uint16_t, uint16_t))
 {
-	MODBUS_FRAME_T* pFrame = addFrame(ModBus_para);
+	return ModBus_setRegister_Unit(ModBus_para, ModBus_para->m_address, address, data, SetReponseHandler, NULL);
+}
+
+// 指定目标设备地址
+static byte ModBus_setRegister_Unit(ModBus_parameter* ModBus_para, uint8_t unit, uint16_t address, uint16_t data, void(*SetReponseHandler)(uint16_t, uint16_t), const ModBus_Request_T* request)
+{
+	MODBUS_FRAME_T* pFrame = addFrame(ModBus_para, request);
+	byte index;
+	pFrame->unit = unit;
 	pFrame->type = WRITE_SINGLE_REGISTER;
 	pFrame->responseSize = 0;
 	pFrame->responseHandler = SetReponseHandler;
@@ -582,7 +1178,7 @@ byte ModBus_setRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_
 	{
 		pFrame->data[pFrame->size++] = ':';
 	}
-	pFrame->data[pFrame->size++] = ModBus_para->m_address; // 设备地址
+	pFrame->data[pFrame->size++] = unit; // 设备地址
 	pFrame->data[pFrame->size++] = WRITE_SINGLE_REGISTER; // 功能码, 写入单寄存器
 	pFrame->data[pFrame->size++] = (address >> 8) & 0x0FF; // 寄存器首地址高位
 	pFrame->data[pFrame->size++] = address & 0x0FF; // 寄存器首地址低位
@@ -605,7 +1201,8 @@ byte ModBus_setRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_
 		break;
 	}
 
-	return pFrame->index;
+	index = pFrame->index;
+	return ModBus_admitFrame(ModBus_para) ? index : 0;
 }
 
 /** 写多个寄存器 **/
@@ -618,7 +1215,15 @@ byte ModBus_setRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_
 ***/
 byte ModBus_setRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16_t* data, uint16_t count, void(*SetReponseHandler)(uint16_t, uint16_t))
 {
-	MODBUS_FRAME_T* pFrame = addFrame(ModBus_para);
+	return ModBus_setRegisters_Unit(ModBus_para, ModBus_para->m_address, address, data, count, SetReponseHandler, NULL);
+}
+
+// 指定目标设备地址
+static byte ModBus_setRegisters_Unit(ModBus_parameter* ModBus_para, uint8_t unit, uint16_t address, uint16_t* data, uint16_t count, void(*SetReponseHandler)(uint16_t, uint16_t), const ModBus_Request_T* request)
+{
+	MODBUS_FRAME_T* pFrame = addFrame(ModBus_para, request);
+	byte index;
+	pFrame->unit = unit;
 	pFrame->type = WRITE_MULTI_REGISTER;
 	pFrame->responseSize = 0;
 	pFrame->responseHandler = SetReponseHandler;
@@ -628,7 +1233,7 @@ byte ModBus_setRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16
 	{
 		pFrame->data[pFrame->size++] = ':';
 	}
-	pFrame->data[pFrame->size++] = ModBus_para->m_address; // 设备地址
+	pFrame->data[pFrame->size++] = unit; // 设备地址
 	pFrame->data[pFrame->size++] = WRITE_MULTI_REGISTER; // 功能码, 写入多寄存器
 	pFrame->data[pFrame->size++] = (address >> 8) & 0x0FF; // 寄存器首地址高位
 	pFrame->data[pFrame->size++] = address & 0x0FF; // 寄存器首地址低位
@@ -647,11 +1252,8 @@ byte ModBus_setRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16
 	}
 	if (count > ModBus_para->m_registerAcessLimit || pFrame->size + 2 * count + 2 > MODBUS_BUFFER_SIZE) // 如果超出最大数据量, 不发送, 立即调用回调函数
 	{
-		if (SetReponseHandler)
-		{
-			ModBus_para->m_sendFramesN--;
-			(*(SetReponseHandler))(address, 0);
-		}
+		ModBus_para->m_master.m_sendFramesN--;
+		ModBus_completeFrame(ModBus_para, pFrame, MODBUS_STATUS_INVALID, 0, 0);
 		return 0;
 	}
 	for (uint16_t i = 0; i < count; i++)
@@ -676,18 +1278,201 @@ byte ModBus_setRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16
 		break;
 	}
 
-	return pFrame->index;
+	index = pFrame->index;
+	return ModBus_admitFrame(ModBus_para) ? index : 0;
+}
+
+/** 发送通用指令 **/
+/*** 参数 ***
+** request: 指令描述
+** 返回指令序号(大于0), 参数无效或被丢弃返回0
+***/
+byte ModBus_request(ModBus_parameter* ModBus_para, const ModBus_Request_T* request)
+{
+	byte index = 0, queued = 1;
+	uint8_t unit = request->unit != 0 ? request->unit : ModBus_para->m_address;
+	switch (request->type) // 回调函数和优先级在加入缓存时设置, 指令被丢弃或写入个数超出时在其中结束
+	{
+	case READ_REGISTER:
+		if (request->count > 0 && request->count <= ModBus_para->m_registerAcessLimit)
+		{
+			index = ModBus_getRegister_Unit(ModBus_para, unit, request->address, request->count, NULL, request);
+		}
+		else
+		{
+			queued = 0;
+		}
+		break;
+	case WRITE_SINGLE_REGISTER:
+		index = ModBus_setRegister_Unit(ModBus_para, unit, request->address, request->data[0], NULL, request);
+		break;
+	case WRITE_MULTI_REGISTER:
+		if (request->count > 0)
+		{
+			index = ModBus_setRegisters_Unit(ModBus_para, unit, request->address, (uint16_t*)request->data, request->count, NULL, request);
+		}
+		else
+		{
+			queued = 0;
+		}
+		break;
+	default:
+		queued = 0;
+		break;
+	}
+
+	if (!queued) // 参数无效
+	{
+		MODBUS_FRAME_T frame = { 0 }; // 设备地址等字段会传给断路, 统计和生命周期记录
+		frame.unit = unit;
+		frame.type = request->type;
+		frame.address = request->address;
+		frame.responseHandler = NULL;
+		frame.resultHandler = request->resultHandler;
+		frame.context = request->context;
+		frame.completionQueue = request->completionQueue;
+		ModBus_completeFrame(ModBus_para, &frame, MODBUS_STATUS_INVALID, 0, 0);
+		return 0;
+	}
+	for (size_t i = 0; index != 0 && i < ModBus_para->m_master.m_sendFramesN; i++) // 新指令可能已在被丢弃的指令的回调函数中被丢弃
+	{
+		if (ModBus_para->m_master.m_sendFrames[i].index == index)
+		{
+			return index;
+		}
+	}
+	return 0;
+}
+
+// 解除缓存中指令的回调函数和上下文, 指令照常发送
+byte ModBus_detachRequest(ModBus_parameter* ModBus_para, byte index)
+{
+	for (size_t i = 0; index != 0 && i < ModBus_para->m_master.m_sendFramesN; i++)
+	{
+		MODBUS_FRAME_T* pFrame = ModBus_para->m_master.m_sendFrames + i;
+		if (pFrame->index == index)
+		{
+			pFrame->responseHandler = NULL;
+			pFrame->resultHandler = NULL;
+			pFrame->context = NULL;
+			pFrame->completionQueue = NULL;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** 生成指令的请求PDU **/
+/*** 参数 ***
+** pdu: PDU缓冲区
+** 返回PDU长度, 参数无效返回0
+***/
+size_t ModBus_Master_buildPDU(const ModBus_Request_T* request, byte* pdu)
+{
+	size_t len = 0;
+	pdu[len++] = request->type;
+	pdu[len++] = (request->address >> 8) & 0x0FF; // 寄存器首地址高位
+	pdu[len++] = request->address & 0x0FF; // 寄存器首地址低位
+	switch (request->type)
+	{
+	case READ_REGISTER:
+		if (request->count == 0 || request->count > MODBUS_REGISTER_LIMIT)
+		{
+			return 0;
+		}
+		pdu[len++] = (request->count >> 8) & 0x0FF; // 读寄存器个数高位
+		pdu[len++] = request->count & 0x0FF; // 读寄存器个数低位
+		break;
+	case WRITE_SINGLE_REGISTER:
+		pdu[len++] = (request->data[0] >> 8) & 0x0FF; // 数据高位
+		pdu[len++] = request->data[0] & 0x0FF; // 数据低位
+		break;
+	case WRITE_MULTI_REGISTER:
+		if (request->count == 0 || request->count > MODBUS_REGISTER_LIMIT)
+		{
+			return 0;
+		}
+		pdu[len++] = (request->count >> 8) & 0x0FF; // 寄存器个数高位
+		pdu[len++] = request->count & 0x0FF; // 寄存器个数低位
+		pdu[len++] = (byte)(request->count * 2); // 数据字节数
+		for (uint16_t i = 0; i < request->count; i++)
+		{
+			pdu[len++] = (request->data[i] >> 8) & 0x0FF; // 数据高位
+			pdu[len++] = request->data[i] & 0x0FF; // 数据低位
+		}
+		break;
+	default:
+		return 0;
+	}
+	return len;
 }
 
+/** 解析指令的返回PDU **/
+/*** 参数 ***
+** result: 解析结果, 读取的寄存器值写入data
+** 返回 MODBUS_STATUS_OK 或 MODBUS_STATUS_EXCEPTION, 与指令不对应返回 MODBUS_STATUS_INVALID
+***/
+MODBUS_STATUS_TYPE ModBus_Master_parsePDU(const ModBus_Request_T* request, const byte* pdu, size_t pduLen, ModBus_Result_T* result, uint16_t* data)
+{
+	result->type = request->type;
+	result->address = request->address;
+	result->count = 0;
+	result->data = NULL;
+	result->exception = 0;
+	result->status = MODBUS_STATUS_INVALID;
+	if (pduLen >= 2 && pdu[0] == (request->type | MODBUS_EXCEPTION_FLAG)) // 从机返回异常码
+	{
+		result->exception = pdu[1];
+		result->status = MODBUS_STATUS_EXCEPTION;
+		return result->status;
+	}
+	if (pduLen < 5 || pdu[0] != request->type)
+	{
+		return result->status;
+	}
+	switch (request->type)
+	{
+	case READ_REGISTER:
+		if (pdu[1] != request->count * 2 || pduLen != 2u + pdu[1])
+		{
+			return result->status;
+		}
+		for (uint16_t i = 0; i < request->count; i++)
+		{
+			data[i] = ((uint16_t)pdu[2 + 2 * i] << 8) + pdu[3 + 2 * i];
+		}
+		result->data = data;
+		result->count = request->count;
+		break;
+	case WRITE_SINGLE_REGISTER:
+		if (((uint16_t)pdu[1] << 8) + pdu[2] != request->address || ((uint16_t)pdu[3] << 8) + pdu[4] != request->data[0])
+		{
+			return result->status;
+		}
+		result->count = 1;
+		break;
+	case WRITE_MULTI_REGISTER:
+		if (((uint16_t)pdu[1] << 8) + pdu[2] != request->address || ((uint16_t)pdu[3] << 8) + pdu[4] != request->count)
+		{
+			return result->status;
+		}
+		result->count = request->count;
+		break;
+	default:
+		return result->status;
+	}
+	result->status = MODBUS_STATUS_OK;
+	return result->status;
+}
 
 // 接收数据结束, 处理数据, 存在有效数据返回1, 否则返回0
 static byte ModBus_parseReveivedBuff(ModBus_parameter* ModBus_para)
 {
 	size_t restSize;
 	MODBUS_FRAME_T* pFrame = NULL;
-	if (ModBus_para->m_sendFramesN > 0)
+	if (ModBus_para->m_master.m_sendFramesN > 0)
 	{
-		pFrame = ModBus_para->m_sendFrames;
+		pFrame = ModBus_para->m_master.m_sendFrames;
 	}
 	else // 如果没有等待返回帧, 则不处理数据
 	{
@@ -701,19 +1486,18 @@ static byte ModBus_parseReveivedBuff(ModBus_parameter* ModBus_para)
 		return 0;
 	}
 
-	MODBUS_DELAY_DEBUG(("Frame Delay %d\n", millis() - pFrame->time));
+	MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_RESPONSE, ModBus_para->m_receiveFrameBuffer[1]);
+	MODBUS_LIFECYCLE_HOOK_ARGS(ModBus_para, ModBus_Lifecycle_frameComplete, pFrame->index);
 	// 判断功能码
 	switch (ModBus_para->m_receiveFrameBuffer[1])
 	{
 	case READ_REGISTER:
 	{
 		u8 count = ModBus_para->m_receiveFrameBuffer[2];
-		MODBUS_DEBUG(("ModBus read reg response\n"));
 		if (count % 2 != 0 || pFrame->type != READ_REGISTER || count != pFrame->count * 2) // 数据异常
 		{
 			// 保留的未处理的数据
-			memcpy(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, restSize);
-			ModBus_para->m_receiveFrameBufferLen = restSize;
+			ModBus_keepRestData(ModBus_para, restSize);
 			return 0;
 		}
 		count >>= 1; // 除2
@@ -728,10 +1512,7 @@ static byte ModBus_parseReveivedBuff(ModBus_parameter* ModBus_para)
 		ModBus_para->m_registerCount = count;
 
 		// 回调函数
-		if (pFrame->responseHandler)
-		{
-			(*(GetReponseHandler_T)(pFrame->responseHandler))(ModBus_para->m_registerData, count);
-		}
+		ModBus_completeFrame(ModBus_para, pFrame, MODBUS_STATUS_OK, count, 0);
 		break;
 	}
 	case WRITE_SINGLE_REGISTER:
@@ -739,7 +1520,6 @@ static byte ModBus_parseReveivedBuff(ModBus_parameter* ModBus_para)
 		uint16_t address = (ModBus_para->m_receiveFrameBuffer[2] << 8) + ModBus_para->m_receiveFrameBuffer[3];
 		uint16_t data = (ModBus_para->m_receiveFrameBuffer[4] << 8) + ModBus_para->m_receiveFrameBuffer[5];
 		uint16_t dataSent;
-		MODBUS_DEBUG(("ModBus write 0x%04x %d response\n", address, data));
 		if (ModBus_para->m_modeType == ASCII)
 		{
 			byte data[4];
@@ -754,129 +1534,259 @@ static byte ModBus_parseReveivedBuff(ModBus_parameter* ModBus_para)
 		if (pFrame->type != WRITE_SINGLE_REGISTER || address != pFrame->address || dataSent != data) // 数据异常
 		{
 			// 保留的未处理的数据
-			memcpy(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, restSize);
-			ModBus_para->m_receiveFrameBufferLen = restSize;
+			ModBus_keepRestData(ModBus_para, restSize);
 			return 0;
 		}
 
 		// 回调函数
-		if (pFrame->responseHandler)
-		{
-			(*(SetReponseHandler_T)(pFrame->responseHandler))(address, 1);
-		}
+		ModBus_completeFrame(ModBus_para, pFrame, MODBUS_STATUS_OK, 1, 0);
 		break;
 	}
 	case WRITE_MULTI_REGISTER:
 	{
 		uint16_t address = (ModBus_para->m_receiveFrameBuffer[2] << 8) + ModBus_para->m_receiveFrameBuffer[3];
 		uint16_t count = (ModBus_para->m_receiveFrameBuffer[4] << 8) + ModBus_para->m_receiveFrameBuffer[5];
-		MODBUS_DEBUG(("ModBus write 0x%04x %d regs response\n", address, count));
 		if (pFrame->type != WRITE_MULTI_REGISTER || address != pFrame->address || count != pFrame->count) // 数据异常
 		{
 			// 保留的未处理的数据
-			memcpy(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, restSize);
-			ModBus_para->m_receiveFrameBufferLen = restSize;
+			ModBus_keepRestData(ModBus_para, restSize);
 			return 0;
 		}
 
 		// 回调函数
-		if (pFrame->responseHandler)
-		{
-			(*(SetReponseHandler_T)(pFrame->responseHandler))(address, count);
-		}
+		ModBus_completeFrame(ModBus_para, pFrame, MODBUS_STATUS_OK, count, 0);
 		break;
 	}
 	default:
-		memcpy(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, restSize);
-		ModBus_para->m_receiveFrameBufferLen = restSize;
+		if (ModBus_para->m_receiveFrameBuffer[1] == (pFrame->type | MODBUS_EXCEPTION_FLAG) && ModBus_para->m_receiveFrameBufferLen >= 3) // 从机返回异常码
+		{
+			MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_EXCEPTION, ModBus_para->m_receiveFrameBuffer[2]);
+			ModBus_completeFrame(ModBus_para, pFrame, MODBUS_STATUS_EXCEPTION, 0, ModBus_para->m_receiveFrameBuffer[2]);
+			break;
+		}
+		ModBus_keepRestData(ModBus_para, restSize);
 		return 0;
 		break;
 	}
 
-	memcpy(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, restSize);
-	ModBus_para->m_receiveFrameBufferLen = restSize;
+	ModBus_keepRestData(ModBus_para, restSize);
 
 	// 移除已返回指令
-	memcpy(ModBus_para->m_sendFrames, ModBus_para->m_sendFrames + 1, (--ModBus_para->m_sendFramesN) * sizeof(MODBUS_FRAME_T));
-	ModBus_para->m_waitingResponse = 0;
+	memmove(ModBus_para->m_master.m_sendFrames, ModBus_para->m_master.m_sendFrames + 1, (--ModBus_para->m_master.m_sendFramesN) * sizeof(MODBUS_FRAME_T));
+	ModBus_para->m_master.m_waitingResponse = 0;
 
 	return 1;
 }
 
+#ifdef MODBUS_BREAKER
+// 结束缓存中目标设备断路的未发送指令(MODBUS_STATUS_UNAVAILABLE), 不占用总线; 回调函数中加入的指令在下一次loop中检查
+static void ModBus_rejectUnavailable(ModBus_parameter* ModBus_para, u32 now)
+{
+	size_t n = ModBus_para->m_master.m_sendFramesN, i = 0;
+	for (size_t k = 0; k < n && i < ModBus_para->m_master.m_sendFramesN; k++)
+	{
+		MODBUS_FRAME_T* pFrame = ModBus_para->m_master.m_sendFrames + i;
+		if (ModBus_Breaker_isOpen(ModBus_para->m_master.m_breaker, pFrame->unit, now))
+		{
+			MODBUS_FRAME_T rejected = *pFrame;
+			memmove(pFrame, pFrame + 1, (ModBus_para->m_master.m_sendFramesN - i - 1) * sizeof(MODBUS_FRAME_T));
+			ModBus_para->m_master.m_sendFramesN--;
+			ModBus_completeFrame(ModBus_para, &rejected, MODBUS_STATUS_UNAVAILABLE, 0, 0);
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+#endif
+
 static void sendFrame_loop(ModBus_parameter* ModBus_para)
 {
-	u32 now = millis();
-	if (ModBus_para->m_waitingResponse && now - ModBus_para->m_lastSentTime < ModBus_para->m_sendTimeout || ModBus_para->m_sendFramesN == 0) // 等待返回帧未超时, 或没有待发送数据
+	u32 now = ModBus_millis();
+	if (ModBus_para->m_master.m_waitingResponse && now - ModBus_para->m_lastSentTime < ModBus_para->m_sendTimeout || ModBus_para->m_master.m_sendFramesN == 0) // 等待返回帧未超时, 或没有待发送数据
 	{
 		return;
 	}
-	if (ModBus_para->m_waitingResponse && now - ModBus_para->m_lastSentTime >= ModBus_para->m_sendTimeout) // 等待返回帧超时
+	if (ModBus_para->m_master.m_waitingResponse && now - ModBus_para->m_lastSentTime >= ModBus_para->m_sendTimeout) // 等待返回帧超时
 	{
-		MODBUS_FRAME_T* pFrame = ModBus_para->m_sendFrames;
-		MODBUS_DELAY_DEBUG(("Frame Timeout %d\n", millis() - pFrame->time));
-		if (pFrame->responseHandler) // 调用回调, 传入参数(0,0)
+		MODBUS_FRAME_T* pFrame = ModBus_para->m_master.m_sendFrames;
+		byte retry = pFrame->retries > 0;
+		MODBUS_TRACE_EVENT(ModBus_para, MODBUS_TRACE_TIMEOUT, pFrame->index);
+#ifdef MODBUS_BREAKER
+		if (ModBus_para->m_master.m_breaker != NULL && !ModBus_Breaker_timeout(ModBus_para->m_master.m_breaker, pFrame->unit, pFrame->index, now)) // 设备已断路, 不再重发
 		{
-			switch (pFrame->type)
-			{
-			case READ_REGISTER:
-				(*(GetReponseHandler_T)(pFrame->responseHandler))(0, 0);
-				break;
-			case WRITE_SINGLE_REGISTER:
-				(*(SetReponseHandler_T)(pFrame->responseHandler))(0, 0);
-				break;
-			case WRITE_MULTI_REGISTER:
-				(*(SetReponseHandler_T)(pFrame->responseHandler))(0, 0);
-				break;
-			default:
-				break;
-			}
+			retry = 0;
 		}
-			
-		memcpy(ModBus_para->m_sendFrames, ModBus_para->m_sendFrames + 1, (--ModBus_para->m_sendFramesN) * sizeof(MODBUS_FRAME_T)); // 移除已发送数据包
-		ModBus_para->m_waitingResponse = 0;
+#endif
+		if (retry) // 保留在缓存中重发
+		{
+			pFrame->retries--;
+		}
+		else
+		{
+			ModBus_completeFrame(ModBus_para, pFrame, MODBUS_STATUS_TIMEOUT, 0, 0); // 调用回调, 传入参数(0,0)
+		}
+		if (ModBus_para->m_lengthFraming) // 没有接收超时重置, 丢弃未接收完的返回帧
+		{
+			ModBus_para->m_receiveFrameBufferLen = 0;
+			ModBus_para->m_hasDetectedBufferStart = 0;
+		}
+
+		if (!retry)
+		{
+			memmove(ModBus_para->m_master.m_sendFrames, ModBus_para->m_master.m_sendFrames + 1, (--ModBus_para->m_master.m_sendFramesN) * sizeof(MODBUS_FRAME_T)); // 移除已发送数据包
+		}
+		ModBus_para->m_master.m_waitingResponse = 0;
 	}
-	if (!ModBus_para->m_waitingResponse && ModBus_para->m_sendFramesN > 0) // 不在等待返回帧且有待发送数据包, 则发送
+	if (!ModBus_para->m_master.m_waitingResponse && ModBus_para->m_master.m_sendFramesN > 0) // 不在等待返回帧且有待发送数据包, 则发送
 	{
-		MODBUS_FRAME_T* pFrame = ModBus_para->m_sendFrames;
+		MODBUS_FRAME_T* pFrame = ModBus_para->m_master.m_sendFrames;
 		if (ModBus_para->m_faston) // 如果是快速模式, 则只执行最新的指令
 		{
-			ModBus_para->m_sendFrames[0] = ModBus_para->m_sendFrames[ModBus_para->m_sendFramesN - 1];
-			ModBus_para->m_sendFramesN = 1;
+			// 被丢弃的指令先移出缓存再以 MODBUS_STATUS_DROPPED 结束; 回调函数中加入的指令排在最新指令之后, 下次再处理
+			size_t droppedN = ModBus_para->m_master.m_sendFramesN - 1;
+			byte latest = ModBus_para->m_master.m_sendFrames[droppedN].index;
+			for (size_t i = 0; i < droppedN && ModBus_para->m_master.m_sendFramesN > 1 && pFrame->index != latest; i++)
+			{
+				MODBUS_FRAME_T dropped = *pFrame;
+				memmove(pFrame, pFrame + 1, (--ModBus_para->m_master.m_sendFramesN) * sizeof(MODBUS_FRAME_T));
+				ModBus_completeFrame(ModBus_para, &dropped, MODBUS_STATUS_DROPPED, 0, 0);
+			}
+		}
+		else
+		{
+#ifdef MODBUS_BREAKER
+			if (ModBus_para->m_master.m_breaker != NULL)
+			{
+				ModBus_rejectUnavailable(ModBus_para, now);
+				if (ModBus_para->m_master.m_sendFramesN == 0 || ModBus_para->m_master.m_waitingResponse) // 全部被结束, 或回调函数中已发送
+				{
+					return;
+				}
+			}
+#endif
+			if (ModBus_para->m_master.m_sendFramesN > 1)
+			{
+				ModBus_selectFrame(ModBus_para, now);
+			}
+		}
+#ifdef MODBUS_BREAKER
+		if (ModBus_para->m_master.m_breaker != NULL)
+		{
+			ModBus_Breaker_send(ModBus_para->m_master.m_breaker, pFrame->unit, pFrame->index, now);
 		}
-		if (ModBus_para->m_SendHandler != NULL)
+#endif
+		MODBUS_LIFECYCLE_HOOK_ARGS(ModBus_para, ModBus_Lifecycle_txStart, pFrame->index);
+		if (ModBus_send(ModBus_para, pFrame->data, pFrame->size))
 		{
-			(*ModBus_para->m_SendHandler)(pFrame->data, pFrame->size);
-			ModBus_para->m_waitingResponse = 1;
-			ModBus_para->m_lastSentTime = millis();
+			MODBUS_LIFECYCLE_HOOK(ModBus_para, ModBus_Lifecycle_txReturn);
+			MODBUS_STATS_COUNT(ModBus_para, ModBus_Stats_countSend, pFrame->unit, now - pFrame->time);
+			ModBus_para->m_master.m_waitingResponse = 1;
+			ModBus_para->m_lastSentTime = ModBus_millis();
+			if (ModBus_para->m_master.m_priorityCredits[pFrame->priority] > 0)
+			{
+				ModBus_para->m_master.m_priorityCredits[pFrame->priority]--;
+			}
 		}
 	}
 }
 
 void ModBus_Master_loop(ModBus_parameter* ModBus_para)
 {
-	u32 now = millis();
+	u32 now = ModBus_millis();
+	volatile byte* pBegin = ModBus_para->m_pBeginReceiveBufferTmp;
+
+	ModBus_captureReceived(ModBus_para);
 
 	if (ModBus_para->m_pBeginReceiveBufferTmp != ModBus_para->m_pEndReceiveBufferTmp)
 	{
 		ModBus_parseReveivedBuff(ModBus_para); // 处理接收到的数据
 	}
-	if (now - ModBus_para->m_lastReceivedTime > ModBus_para->m_receiveTimeout) // 接收超时, 处理数据并重置
+	if (!ModBus_para->m_lengthFraming && now - ModBus_para->m_lastReceivedTime > ModBus_para->m_receiveTimeout) // 接收超时, 处理数据并重置
 	{
 		ModBus_parseReveivedBuff(ModBus_para); // 处理接收到的数据
 		ModBus_para->m_receiveFrameBufferLen = 0;
-		ModBus_para->m_lastReceivedTime = millis();
+		ModBus_para->m_lastReceivedTime = ModBus_millis();
 	}
+	ModBus_countReceived(ModBus_para, pBegin);
 
+	ModBus_drainSubmitQueue(ModBus_para); // 取出其他线程提交的指令
 	sendFrame_loop(ModBus_para);
 }
+
+// 距离主机下一次需要运行loop的毫秒数
+u32 ModBus_Master_nextDeadline(ModBus_parameter* ModBus_para)
+{
+	u32 now = ModBus_millis();
+	u32 wait = ModBus_receiveDeadline(ModBus_para, now);
+	if (ModBus_para->m_master.m_submitQueue != NULL && wait > 1) // 提交队列无法通知, 每毫秒检查一次
+	{
+		wait = 1;
+	}
+	if (ModBus_para->m_master.m_sendFramesN > 0)
+	{
+		u32 elapsed = now - ModBus_para->m_lastSentTime;
+		u32 sendWait;
+		if (!ModBus_para->m_master.m_waitingResponse) // 有待发送指令
+		{
+			return 0;
+		}
+		sendWait = elapsed >= ModBus_para->m_sendTimeout ? 0 : ModBus_para->m_sendTimeout - elapsed;
+		if (sendWait < wait)
+		{
+			wait = sendWait;
+		}
+	}
+	return wait;
+}
 #endif
 
 #ifdef MODBUS_SLAVE
+#include "modbus_image.h"
 
 void ModBus_attachRegisterHandler(ModBus_parameter* ModBus_para, size_t(*GetRegisterHandler)(uint16_t, uint16_t, uint16_t*), size_t(*SetRegisterHandler)(uint16_t, uint16_t, uint16_t*))
 {
-	ModBus_para->m_GetRegisterHandler = GetRegisterHandler;
-	ModBus_para->m_SetRegisterHandler = SetRegisterHandler;
+	ModBus_para->m_slave.m_GetRegisterHandler = GetRegisterHandler;
+	ModBus_para->m_slave.m_SetRegisterHandler = SetRegisterHandler;
+}
+
+void ModBus_attachRegisterImage(ModBus_parameter* ModBus_para, struct __MODBUS_RegisterImage* image)
+{
+	ModBus_para->m_slave.m_registerImage = image;
+}
+
+// 从机读取寄存器, 绑定映像时从映像无锁读取, 否则调用读取寄存器函数, 返回成功读取的个数
+static size_t ModBus_Slave_readRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16_t count, uint16_t* data)
+{
+	if (ModBus_para->m_slave.m_registerImage != NULL)
+	{
+		return ModBus_Image_read(ModBus_para->m_slave.m_registerImage, address, count, data);
+	}
+	if (ModBus_para->m_slave.m_GetRegisterHandler == NULL)
+	{
+		return 0;
+	}
+	return (*(ModBus_para->m_slave.m_GetRegisterHandler))(address, count, data);
+}
+
+// 从机写入寄存器, 绑定映像时先写入映像再通知设置寄存器函数, 返回成功写入的个数
+static size_t ModBus_Slave_writeRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16_t count, uint16_t* data)
+{
+	if (ModBus_para->m_slave.m_registerImage != NULL)
+	{
+		count = (uint16_t)ModBus_Image_write(ModBus_para->m_slave.m_registerImage, address, count, data);
+		if (count > 0 && ModBus_para->m_slave.m_SetRegisterHandler != NULL)
+		{
+			(*(ModBus_para->m_slave.m_SetRegisterHandler))(address, count, data);
+		}
+		return count;
+	}
+	if (ModBus_para->m_slave.m_SetRegisterHandler == NULL)
+	{
+		return 0;
+	}
+	return (*(ModBus_para->m_slave.m_SetRegisterHandler))(address, count, data);
 }
 
 /** 读取寄存器返回帧 **/
@@ -887,45 +1797,44 @@ void ModBus_attachRegisterHandler(ModBus_parameter* ModBus_para, size_t(*GetRegi
 ***/
 static void ModBus_getRegister_Slave(ModBus_parameter* ModBus_para, uint16_t address, uint8_t count)
 {
-	ModBus_para->m_sendFrameBufferLen = 0;
+	ModBus_para->m_slave.m_sendFrameBufferLen = 0;
 	if (ModBus_para->m_modeType == ASCII)
 	{
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = ':';
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = ':';
 	}
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = ModBus_para->m_address; // 设备地址
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = READ_REGISTER; // 功能码, 读寄存器
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = ModBus_para->m_address; // 设备地址
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = READ_REGISTER; // 功能码, 读寄存器
 
-	if (count > ModBus_para->m_registerAcessLimit || ModBus_para->m_sendFrameBufferLen + 2 * count + 3 > MODBUS_BUFFER_SIZE) // 如果超出最大数据量
+	if (count > ModBus_para->m_registerAcessLimit || ModBus_para->m_slave.m_sendFrameBufferLen + 2 * count + 3 > MODBUS_BUFFER_SIZE) // 如果超出最大数据量
 	{
 		count = 0;
 	}
 
-	count = (uint8_t)(*(ModBus_para->m_GetRegisterHandler))(address, count, ModBus_para->m_registerData);
+	count = (uint8_t)ModBus_Slave_readRegisters(ModBus_para, address, count, ModBus_para->m_registerData);
 	ModBus_para->m_registerCount = count;
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = count * 2; // 字节数 = 读寄存器个数 * 2
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = count * 2; // 字节数 = 读寄存器个数 * 2
 	for (uint16_t i = 0; i < count; i++)
 	{
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = (ModBus_para->m_registerData[i] >> 8) & 0x0FF; // 数据高位
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = ModBus_para->m_registerData[i] & 0x0FF; // 数据低位
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = (ModBus_para->m_registerData[i] >> 8) & 0x0FF; // 数据高位
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = ModBus_para->m_registerData[i] & 0x0FF; // 数据低位
 	}
 	switch (ModBus_para->m_modeType)
 	{
 	case ASCII:
-		ModBus_para->m_sendFrameBufferLen = GenLRC(ModBus_para->m_sendFrameBuffer + 1, ModBus_para->m_sendFrameBufferLen - 1) + 1; // 不包括起始字符
-		ModBus_para->m_sendFrameBufferLen = bin2char_s(ModBus_para->m_sendFrameBuffer + 1, ModBus_para->m_sendFrameBufferLen - 1, MODBUS_BUFFER_SIZE) + 1;
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = '\r'; // 结束字符
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = '\n'; // 结束字符
+		ModBus_para->m_slave.m_sendFrameBufferLen = GenLRC(ModBus_para->m_slave.m_sendFrameBuffer + 1, ModBus_para->m_slave.m_sendFrameBufferLen - 1) + 1; // 不包括起始字符
+		ModBus_para->m_slave.m_sendFrameBufferLen = bin2char_s(ModBus_para->m_slave.m_sendFrameBuffer + 1, ModBus_para->m_slave.m_sendFrameBufferLen - 1, MODBUS_BUFFER_SIZE) + 1;
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = '\r'; // 结束字符
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = '\n'; // 结束字符
 		break;
 	case RTU:
-		ModBus_para->m_sendFrameBufferLen = GenCRC16(ModBus_para->m_sendFrameBuffer, ModBus_para->m_sendFrameBufferLen);
+		ModBus_para->m_slave.m_sendFrameBufferLen = GenCRC16(ModBus_para->m_slave.m_sendFrameBuffer, ModBus_para->m_slave.m_sendFrameBufferLen);
 		break;
 	default:
 		break;
 	}
-	if (ModBus_para->m_SendHandler != NULL && ModBus_para->m_sendFrameBufferLen > 0)
+	if (ModBus_para->m_slave.m_sendFrameBufferLen > 0 && ModBus_send(ModBus_para, ModBus_para->m_slave.m_sendFrameBuffer, ModBus_para->m_slave.m_sendFrameBufferLen))
 	{
-		(*ModBus_para->m_SendHandler)(ModBus_para->m_sendFrameBuffer, ModBus_para->m_sendFrameBufferLen);
-		ModBus_para->m_lastSentTime = millis();
+		ModBus_para->m_lastSentTime = ModBus_millis();
 	}
 }
 
@@ -937,41 +1846,40 @@ static void ModBus_getRegister_Slave(ModBus_parameter* ModBus_para, uint16_t add
 ***/
 static void ModBus_setRegister_Slave(ModBus_parameter* ModBus_para, uint16_t address, uint16_t data)
 {
-	ModBus_para->m_sendFrameBufferLen = 0;
+	ModBus_para->m_slave.m_sendFrameBufferLen = 0;
 	if (ModBus_para->m_modeType == ASCII)
 	{
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = ':';
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = ':';
 	}
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = ModBus_para->m_address; // 设备地址
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = WRITE_SINGLE_REGISTER; // 功能码, 读寄存器
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = ModBus_para->m_address; // 设备地址
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = WRITE_SINGLE_REGISTER; // 功能码, 读寄存器
 
-	if ((*(ModBus_para->m_SetRegisterHandler))(address, 1, &data) == 0) // 如果写入错误, 数据取反后返回, 以便主机判断
+	if (ModBus_Slave_writeRegisters(ModBus_para, address, 1, &data) == 0) // 如果写入错误, 数据取反后返回, 以便主机判断
 	{
 		data = ~data;
 	}
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = (address >> 8) & 0x0FF; // 寄存器首地址高位
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = address & 0x0FF; // 寄存器首地址低位
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = (data >> 8) & 0x0FF; // 数据高位
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = data & 0x0FF; // 数据低位
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = (address >> 8) & 0x0FF; // 寄存器首地址高位
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = address & 0x0FF; // 寄存器首地址低位
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = (data >> 8) & 0x0FF; // 数据高位
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = data & 0x0FF; // 数据低位
 
 	switch (ModBus_para->m_modeType)
 	{
 	case ASCII:
-		ModBus_para->m_sendFrameBufferLen = GenLRC(ModBus_para->m_sendFrameBuffer + 1, ModBus_para->m_sendFrameBufferLen - 1) + 1; // 不包括起始字符
-		ModBus_para->m_sendFrameBufferLen = bin2char_s(ModBus_para->m_sendFrameBuffer + 1, ModBus_para->m_sendFrameBufferLen - 1, MODBUS_BUFFER_SIZE) + 1;
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = '\r'; // 结束字符
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = '\n'; // 结束字符
+		ModBus_para->m_slave.m_sendFrameBufferLen = GenLRC(ModBus_para->m_slave.m_sendFrameBuffer + 1, ModBus_para->m_slave.m_sendFrameBufferLen - 1) + 1; // 不包括起始字符
+		ModBus_para->m_slave.m_sendFrameBufferLen = bin2char_s(ModBus_para->m_slave.m_sendFrameBuffer + 1, ModBus_para->m_slave.m_sendFrameBufferLen - 1, MODBUS_BUFFER_SIZE) + 1;
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = '\r'; // 结束字符
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = '\n'; // 结束字符
 		break;
 	case RTU:
-		ModBus_para->m_sendFrameBufferLen = GenCRC16(ModBus_para->m_sendFrameBuffer, ModBus_para->m_sendFrameBufferLen);
+		ModBus_para->m_slave.m_sendFrameBufferLen = GenCRC16(ModBus_para->m_slave.m_sendFrameBuffer, ModBus_para->m_slave.m_sendFrameBufferLen);
 		break;
 	default:
 		break;
 	}
-	if (ModBus_para->m_SendHandler != NULL && ModBus_para->m_sendFrameBufferLen > 0)
+	if (ModBus_para->m_slave.m_sendFrameBufferLen > 0 && ModBus_send(ModBus_para, ModBus_para->m_slave.m_sendFrameBuffer, ModBus_para->m_slave.m_sendFrameBufferLen))
 	{
-		(*ModBus_para->m_SendHandler)(ModBus_para->m_sendFrameBuffer, ModBus_para->m_sendFrameBufferLen);
-		ModBus_para->m_lastSentTime = millis();
+		ModBus_para->m_lastSentTime = ModBus_millis();
 	}
 }
 
@@ -984,38 +1892,37 @@ static void ModBus_setRegister_Slave(ModBus_parameter* ModBus_para, uint16_t add
 ***/
 static void ModBus_setRegisters_Slave(ModBus_parameter* ModBus_para, uint16_t address, uint16_t* data, uint16_t count)
 {
-	ModBus_para->m_sendFrameBufferLen = 0;
+	ModBus_para->m_slave.m_sendFrameBufferLen = 0;
 	if (ModBus_para->m_modeType == ASCII)
 	{
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = ':';
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = ':';
 	}
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = ModBus_para->m_address; // 设备地址
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = WRITE_MULTI_REGISTER; // 功能码, 读寄存器
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = ModBus_para->m_address; // 设备地址
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = WRITE_MULTI_REGISTER; // 功能码, 读寄存器
 
-	count = (uint16_t)(*(ModBus_para->m_SetRegisterHandler))(address, count, data);
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = (address >> 8) & 0x0FF; // 首地址高位
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = address & 0x0FF; // 首地址低位
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = (count >> 8) & 0x0FF; // 个数高位
-	ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = count & 0x0FF; // 个数低位
+	count = (uint16_t)ModBus_Slave_writeRegisters(ModBus_para, address, count, data);
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = (address >> 8) & 0x0FF; // 首地址高位
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = address & 0x0FF; // 首地址低位
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = (count >> 8) & 0x0FF; // 个数高位
+	ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = count & 0x0FF; // 个数低位
 
 	switch (ModBus_para->m_modeType)
 	{
 	case ASCII:
-		ModBus_para->m_sendFrameBufferLen = GenLRC(ModBus_para->m_sendFrameBuffer + 1, ModBus_para->m_sendFrameBufferLen - 1) + 1; // 不包括起始字符
-		ModBus_para->m_sendFrameBufferLen = bin2char_s(ModBus_para->m_sendFrameBuffer + 1, ModBus_para->m_sendFrameBufferLen - 1, MODBUS_BUFFER_SIZE) + 1;
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = '\r'; // 结束字符
-		ModBus_para->m_sendFrameBuffer[ModBus_para->m_sendFrameBufferLen++] = '\n'; // 结束字符
+		ModBus_para->m_slave.m_sendFrameBufferLen = GenLRC(ModBus_para->m_slave.m_sendFrameBuffer + 1, ModBus_para->m_slave.m_sendFrameBufferLen - 1) + 1; // 不包括起始字符
+		ModBus_para->m_slave.m_sendFrameBufferLen = bin2char_s(ModBus_para->m_slave.m_sendFrameBuffer + 1, ModBus_para->m_slave.m_sendFrameBufferLen - 1, MODBUS_BUFFER_SIZE) + 1;
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = '\r'; // 结束字符
+		ModBus_para->m_slave.m_sendFrameBuffer[ModBus_para->m_slave.m_sendFrameBufferLen++] = '\n'; // 结束字符
 		break;
 	case RTU:
-		ModBus_para->m_sendFrameBufferLen = GenCRC16(ModBus_para->m_sendFrameBuffer, ModBus_para->m_sendFrameBufferLen);
+		ModBus_para->m_slave.m_sendFrameBufferLen = GenCRC16(ModBus_para->m_slave.m_sendFrameBuffer, ModBus_para->m_slave.m_sendFrameBufferLen);
 		break;
 	default:
 		break;
 	}
-	if (ModBus_para->m_SendHandler != NULL && ModBus_para->m_sendFrameBufferLen > 0)
+	if (ModBus_para->m_slave.m_sendFrameBufferLen > 0 && ModBus_send(ModBus_para, ModBus_para->m_slave.m_sendFrameBuffer, ModBus_para->m_slave.m_sendFrameBufferLen))
 	{
-		(*ModBus_para->m_SendHandler)(ModBus_para->m_sendFrameBuffer, ModBus_para->m_sendFrameBufferLen);
-		ModBus_para->m_lastSentTime = millis();
+		ModBus_para->m_lastSentTime = ModBus_millis();
 	}
 }
 
@@ -1068,46 +1975,175 @@ static byte ModBus_parseReveivedBuff_Slave(ModBus_parameter* ModBus_para)
 	}
 	default:
 		assert(0);
-		memcpy(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, restSize);
-		ModBus_para->m_receiveFrameBufferLen = restSize;
+		ModBus_keepRestData(ModBus_para, restSize);
 		return 0;
 		break;
 	}
-	memcpy(ModBus_para->m_receiveFrameBuffer, ModBus_para->m_receiveFrameBuffer + ModBus_para->m_receiveFrameBufferLen, restSize);
-	ModBus_para->m_receiveFrameBufferLen = restSize;
+	ModBus_keepRestData(ModBus_para, restSize);
 	return 1;
 }
 
+// 生成异常返回PDU, 返回PDU长度
+static size_t ModBus_exceptionPDU(byte* response, byte function, byte exception)
+{
+	response[0] = function | MODBUS_EXCEPTION_FLAG;
+	response[1] = exception;
+	return 2;
+}
+
+/** 处理一个请求PDU并生成返回PDU **/
+/*** 参数 ***
+** pdu: 请求PDU首地址(功能码+数据)
+** pduLen: 请求PDU长度
+** response: 返回PDU缓冲区, 至少 MODBUS_PDU_SIZE 字节
+** 返回返回PDU长度
+***/
+size_t ModBus_Slave_handlePDU(ModBus_parameter* ModBus_para, const byte* pdu, size_t pduLen, byte* response)
+{
+	uint16_t registerData[MODBUS_REGISTER_LIMIT]; // 使用局部缓冲区, 不占用实例的 m_registerData
+	size_t responseLen = 0;
+	if (pduLen < 1)
+	{
+		return 0;
+	}
+
+	switch (pdu[0])
+	{
+	case READ_REGISTER:
+	{
+		uint16_t address, count;
+		if (pduLen != 5)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		address = ((uint16_t)pdu[1] << 8) + pdu[2];
+		count = ((uint16_t)pdu[3] << 8) + pdu[4];
+		if (count == 0 || count > ModBus_para->m_registerAcessLimit)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		if (ModBus_para->m_slave.m_GetRegisterHandler == NULL && ModBus_para->m_slave.m_registerImage == NULL)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_SLAVE_DEVICE_FAILURE);
+		}
+		if (ModBus_Slave_readRegisters(ModBus_para, address, count, registerData) != count)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_ADDRESS);
+		}
+		response[responseLen++] = READ_REGISTER;
+		response[responseLen++] = (byte)(count * 2); // 字节数
+		for (uint16_t i = 0; i < count; i++)
+		{
+			response[responseLen++] = (registerData[i] >> 8) & 0x0FF; // 数据高位
+			response[responseLen++] = registerData[i] & 0x0FF; // 数据低位
+		}
+		break;
+	}
+	case WRITE_SINGLE_REGISTER:
+	{
+		uint16_t address, data;
+		if (pduLen != 5)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		if (ModBus_para->m_slave.m_SetRegisterHandler == NULL && ModBus_para->m_slave.m_registerImage == NULL)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_SLAVE_DEVICE_FAILURE);
+		}
+		address = ((uint16_t)pdu[1] << 8) + pdu[2];
+		data = ((uint16_t)pdu[3] << 8) + pdu[4];
+		if (ModBus_Slave_writeRegisters(ModBus_para, address, 1, &data) == 0)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_ADDRESS);
+		}
+		memmove(response, pdu, 5); // 返回帧与请求帧相同
+		responseLen = 5;
+		break;
+	}
+	case WRITE_MULTI_REGISTER:
+	{
+		uint16_t address, count;
+		if (pduLen < 6)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		address = ((uint16_t)pdu[1] << 8) + pdu[2];
+		count = ((uint16_t)pdu[3] << 8) + pdu[4];
+		if (count == 0 || count > ModBus_para->m_registerAcessLimit || pdu[5] != count * 2 || pduLen != 6u + pdu[5])
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		if (ModBus_para->m_slave.m_SetRegisterHandler == NULL && ModBus_para->m_slave.m_registerImage == NULL)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_SLAVE_DEVICE_FAILURE);
+		}
+		for (uint16_t i = 0; i < count; i++)
+		{
+			registerData[i] = ((uint16_t)pdu[6 + i * 2] << 8) + pdu[7 + i * 2];
+		}
+		if (ModBus_Slave_writeRegisters(ModBus_para, address, count, registerData) != count)
+		{
+			return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_DATA_ADDRESS);
+		}
+		response[responseLen++] = WRITE_MULTI_REGISTER;
+		response[responseLen++] = (address >> 8) & 0x0FF; // 首地址高位
+		response[responseLen++] = address & 0x0FF; // 首地址低位
+		response[responseLen++] = (count >> 8) & 0x0FF; // 个数高位
+		response[responseLen++] = count & 0x0FF; // 个数低位
+		break;
+	}
+	default:
+		return ModBus_exceptionPDU(response, pdu[0], EXCEPTION_ILLEGAL_FUNCTION);
+	}
+	return responseLen;
+}
+
 void ModBus_Slave_loop(ModBus_parameter* ModBus_para)
 {
-	u32 now = millis();
+	u32 now = ModBus_millis();
+	volatile byte* pBegin = ModBus_para->m_pBeginReceiveBufferTmp;
+
+	ModBus_captureReceived(ModBus_para);
 
 	if (ModBus_para->m_pBeginReceiveBufferTmp != ModBus_para->m_pEndReceiveBufferTmp)
 	{
-		ModBus_parseReveivedBuff_Slave(ModBus_para); // 处理接收到的数据
+		byte parsed = ModBus_parseReveivedBuff_Slave(ModBus_para); // 处理接收到的数据
+		while (parsed && ModBus_para->m_lengthFraming && ModBus_para->m_receiveFrameBufferLen > 0) // 流式传输一次收到多个请求, 继续处理保留的数据
+		{
+			parsed = ModBus_parseReveivedBuff_Slave(ModBus_para);
+		}
 	}
-	if (now - ModBus_para->m_lastReceivedTime > ModBus_para->m_receiveTimeout) // 接收超时, 处理数据并重置
+	if (!ModBus_para->m_lengthFraming && now - ModBus_para->m_lastReceivedTime > ModBus_para->m_receiveTimeout) // 接收超时, 处理数据并重置
 	{
 		ModBus_parseReveivedBuff_Slave(ModBus_para); // 处理接收到的数据
 		ModBus_para->m_receiveFrameBufferLen = 0;
 	}
+	ModBus_countReceived(ModBus_para, pBegin);
+}
+
+// 距离从机下一次需要运行loop的毫秒数
+u32 ModBus_Slave_nextDeadline(ModBus_parameter* ModBus_para)
+{
+	return ModBus_receiveDeadline(ModBus_para, ModBus_millis());
 }
 #endif
 
 #ifdef _UNIT_TEST
-#include <string.h>
-#include <stdio.h>
-#include <windows.h>
-ModBus_parameter modBus_master_test, modBus_slave_test;
-int t = 0;
-static int millis()
+int t = 0; // 虚拟时间, 各模块的单元测试共用
+int millis()
 {
 	return t;
 }
+#endif // _UNIT_TEST
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <string.h>
+#include <stdio.h>
+ModBus_parameter modBus_master_test, modBus_slave_test;
 
 static void OutputData_master(byte* data, size_t len)
 {
-	int t = millis();
+	int t = ModBus_millis();
 	switch (modBus_master_test.m_modeType)
 	{
 	case ASCII:
@@ -1287,6 +2323,788 @@ void unit_test()
 		ModBus_Master_loop(&modBus_master_test);
 	}
 
+	// 实例内存占用, 主从机部分共用内存
+	printf("footprint: instance %u bytes (master part %u, slave part %u, frame %u x %u)\n", (unsigned)sizeof(ModBus_parameter),
+		(unsigned)sizeof(ModBus_MasterPart_T), (unsigned)sizeof(ModBus_SlavePart_T), (unsigned)sizeof(MODBUS_FRAME_T), (unsigned)(MODBUS_WAITFRAME_N + 2));
+}
+
+// 按接收顺序取出循环存取区中未处理的字节
+static size_t receivedBytes(ModBus_parameter* ModBus_para, byte* data)
+{
+	const volatile byte* p = ModBus_para->m_pBeginReceiveBufferTmp;
+	size_t n = 0;
+	while (p != ModBus_para->m_pEndReceiveBufferTmp)
+	{
+		data[n++] = *p;
+		if (++p >= ModBus_para->m_receiveBufferTmp + MODBUS_BUFFER_SIZE)
+		{
+			p = ModBus_para->m_receiveBufferTmp;
+		}
+	}
+	return n;
+}
+
+// 批量接收与逐字节接收后循环存取区中的数据相同, 包括回绕和缓冲区满时丢弃多出的字节
+void receive_unit_test()
+{
+	ModBus_parameter a, b;
+	ModBus_Setting_T modbusSetting = { 0 };
+	byte stream[MODBUS_BUFFER_SIZE * 3], dataA[MODBUS_BUFFER_SIZE], dataB[MODBUS_BUFFER_SIZE];
+	size_t nA, nB;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.frameType = RTU;
+	for (size_t i = 0; i < sizeof(stream); i++)
+		stream[i] = (byte)(i * 31 + 7);
+	for (size_t offset = 0; offset < MODBUS_BUFFER_SIZE; offset += 7)
+	{
+		for (size_t pending = 0; pending < MODBUS_BUFFER_SIZE; pending += 13)
+		{
+			for (size_t len = 0; len < 2 * MODBUS_BUFFER_SIZE; len += 11)
+			{
+				ModBus_setup(&a, modbusSetting);
+				ModBus_setup(&b, modbusSetting);
+				a.m_pBeginReceiveBufferTmp = a.m_pEndReceiveBufferTmp = a.m_receiveBufferTmp + offset;
+				b.m_pBeginReceiveBufferTmp = b.m_pEndReceiveBufferTmp = b.m_receiveBufferTmp + offset;
+				for (size_t i = 0; i < pending; i++) // 尚未处理的数据
+				{
+					ModBus_readByteFromOuter(&a, stream[i]);
+					ModBus_readByteFromOuter(&b, stream[i]);
+				}
+				for (size_t i = 0; i < len; i++)
+					ModBus_readByteFromOuter(&a, stream[pending + i]);
+				ModBus_readBytesFromOuter(&b, stream + pending, len);
+				nA = receivedBytes(&a, dataA);
+				nB = receivedBytes(&b, dataB);
+				assert(nA == nB && memcmp(dataA, dataB, nA) == 0);
+				assert(nA == (pending + len < MODBUS_BUFFER_SIZE ? pending + len : MODBUS_BUFFER_SIZE - 1));
+			}
+		}
+	}
+	printf("receive_unit_test: ok\n");
+}
+
+static byte g_resyncSent[MODBUS_BUFFER_SIZE * 2];
+static size_t g_resyncSentLen, g_resyncSentN;
+static uint16_t g_resyncResult[2];
+static uint16_t g_resyncResultN;
+
+static void resyncCapture(byte* data, size_t len)
+{
+	memcpy(g_resyncSent, data, len);
+	g_resyncSentLen = len;
+	g_resyncSentN++;
+}
+
+static void resyncResult(uint16_t* data, uint16_t count)
+{
+	g_resyncResultN = count;
+	memcpy(g_resyncResult, data, count * sizeof(uint16_t));
+}
+
+// RTU帧: 地址 功能码 数据(4) 校验码
+static size_t resyncFrame(byte* frame, uint8_t unit, uint8_t type, uint16_t address, uint16_t data)
+{
+	frame[0] = unit;
+	frame[1] = type;
+	frame[2] = address >> 8;
+	frame[3] = address & 0xFF;
+	frame[4] = data >> 8;
+	frame[5] = data & 0xFF;
+	return GenCRC16(frame, 6);
+}
+
+// RTU噪声后的帧起始重新同步: 误把数据当作地址时滑动查找帧起始, 不丢弃之后的正常帧, 不等待接收超时
+void resync_unit_test()
+{
+	ModBus_parameter master, slave;
+	ModBus_Setting_T modbusSetting = { 0 };
+	byte stream[MODBUS_BUFFER_SIZE * 2];
+	size_t len;
+	u32 slaveSent = 0;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = 5;
+	modbusSetting.sendHandler = resyncCapture;
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_setTimeout(&slave, 5, 5);
+	ModBus_attachRegisterHandler(&slave, getReg, setReg);
+	g_registerData[0] = 0x1234;
+	g_registerData[1] = 0x5678;
+
+	// 从机: 与地址相同的噪声字节紧接请求帧, 功能码不合理, 不等待接收超时即找到请求帧
+	stream[0] = 0x01;
+	stream[1] = 0x55;
+	len = 2 + resyncFrame(stream + 2, 0x01, READ_REGISTER, 0, 2);
+	ModBus_readBytesFromOuter(&slave, stream, len);
+	ModBus_Slave_loop(&slave);
+	assert(g_resyncSentN == ++slaveSent);
+	assert(g_resyncSentLen == 9 && g_resyncSent[1] == READ_REGISTER && g_resyncSent[3] == 0x12 && g_resyncSent[6] == 0x78);
+
+	// 从机: 噪声字节与请求帧的功能码组成合理的起始, 接收超时后滑动查找到请求帧
+	stream[0] = 0x01;
+	stream[1] = READ_REGISTER;
+	len = 2 + resyncFrame(stream + 2, 0x01, READ_REGISTER, 1, 1);
+	ModBus_readBytesFromOuter(&slave, stream, len);
+	ModBus_Slave_loop(&slave);
+	assert(g_resyncSentN == slaveSent);
+	t += 10;
+	ModBus_Slave_loop(&slave);
+	assert(g_resyncSentN == ++slaveSent);
+	assert(g_resyncSentLen == 7 && g_resyncSent[3] == 0x56 && g_resyncSent[4] == 0x78);
+
+	// 从机(地址2): 其他设备的帧中含有本机地址, 不应答, 之后的请求正常应答
+	slave.m_address = 0x02;
+	len = resyncFrame(stream, 0x01, WRITE_SINGLE_REGISTER, 0x0002, 0x0203);
+	len += resyncFrame(stream + len, 0x02, READ_REGISTER, 0, 1);
+	ModBus_readBytesFromOuter(&slave, stream, len);
+	ModBus_Slave_loop(&slave);
+	t += 10;
+	ModBus_Slave_loop(&slave);
+	assert(g_resyncSentN == ++slaveSent);
+	assert(g_resyncSent[0] == 0x02 && g_resyncSentLen == 7);
+	slave.m_address = 0x01;
+
+	// 按长度分帧的从机: 功能码不合理的起始立即跳过; 一次收到的多个请求都应答
+	ModBus_lengthFraming(&slave, 1);
+	stream[0] = 0x01;
+	stream[1] = 0x55;
+	len = 2 + resyncFrame(stream + 2, 0x01, READ_REGISTER, 0, 2);
+	ModBus_readBytesFromOuter(&slave, stream, len);
+	ModBus_Slave_loop(&slave);
+	assert(g_resyncSentN == ++slaveSent && g_resyncSentLen == 9);
+	len = resyncFrame(stream, 0x01, WRITE_SINGLE_REGISTER, 0x0003, 0x0042);
+	len += resyncFrame(stream + len, 0x01, READ_REGISTER, 3, 1);
+	ModBus_readBytesFromOuter(&slave, stream, len);
+	ModBus_Slave_loop(&slave);
+	assert(g_resyncSentN == (slaveSent += 2));
+	assert(g_resyncSentLen == 7 && g_resyncSent[3] == 0x00 && g_resyncSent[4] == 0x42);
+
+	// 主机: 返回帧前有与地址相同的噪声字节, 以及被截断的返回帧, 收到完整返回帧即完成, 不等待接收超时
+	modbusSetting.sendHandler = resyncCapture;
+	ModBus_setup(&master, modbusSetting);
+	ModBus_setTimeout(&master, 5, 100);
+	for (int round = 0; round < 2; round++)
+	{
+		byte* response = stream;
+		g_resyncResultN = 0;
+		ModBus_getRegister(&master, 0, 2, resyncResult);
+		ModBus_Master_loop(&master);
+		if (round == 0)
+		{
+			*response++ = 0x01;
+		}
+		else
+		{
+			*response++ = 0x01;
+			*response++ = READ_REGISTER;
+			*response++ = 0x04;
+			*response++ = 0xAB;
+		}
+		response[0] = 0x01;
+		response[1] = READ_REGISTER;
+		response[2] = 0x04;
+		response[3] = 0x12;
+		response[4] = 0x34;
+		response[5] = 0x56;
+		response[6] = 0x78 + round;
+		len = (size_t)(response - stream) + GenCRC16(response, 7);
+		ModBus_readBytesFromOuter(&master, stream, len);
+		ModBus_Master_loop(&master);
+		assert(g_resyncResultN == 2 && g_resyncResult[0] == 0x1234 && g_resyncResult[1] == 0x5678 + round);
+		t += 10;
+		ModBus_Master_loop(&master);
+	}
+
+	// 主机: 返回帧前有多个CRC错误的候选帧, 每次loop只检查 MODBUS_RTU_RESYNC_CHECK_N 个, 其余数据保留到接收超时后继续查找
+	g_resyncResultN = 0;
+	ModBus_getRegister(&master, 0, 1, resyncResult);
+	ModBus_Master_loop(&master);
+	len = 0;
+	for (int i = 0; i <= MODBUS_RTU_RESYNC_CHECK_N; i++, len += 7)
+	{
+		memcpy(stream + len, "\x01\x03\x02\x00\x00\x00\x00", 7);
+	}
+	stream[len] = 0x01;
+	stream[len + 1] = READ_REGISTER;
+	stream[len + 2] = 0x02;
+	stream[len + 3] = 0x43;
+	stream[len + 4] = 0x21;
+	len += GenCRC16(stream + len, 5);
+	ModBus_readBytesFromOuter(&master, stream, len);
+	ModBus_Master_loop(&master);
+	assert(g_resyncResultN == 0 && master.m_receiveFrameBufferLen == 7);
+	t += 10;
+	ModBus_Master_loop(&master);
+	assert(g_resyncResultN == 1 && g_resyncResult[0] == 0x4321);
+	printf("resync_unit_test: ok\n");
+}
+
+static uint16_t g_prioritySent[16]; // 发送顺序, 记录寄存器地址
+static size_t g_prioritySentN;
+static MODBUS_STATUS_TYPE g_priorityStatus[64]; // 按寄存器地址记录的结束状态
+
+static void priorityCapture(byte* data, size_t len)
+{
+	(void)len;
+	if (g_prioritySentN < 16)
+		g_prioritySent[g_prioritySentN++] = (uint16_t)((data[2] << 8) | data[3]);
+}
+
+static void priorityResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	g_priorityStatus[result->address] = result->status;
+}
+
+static byte priorityRequest(ModBus_parameter* master, MODBUS_PRIORITY_TYPE priority, MODBUS_FUNCTION_TYPE type, uint16_t address)
+{
+	ModBus_Request_T request = { 0 };
+	request.type = type;
+	request.address = address;
+	request.count = 1;
+	request.priority = priority;
+	request.resultHandler = priorityResult;
+	g_priorityStatus[address] = MODBUS_STATUS_INVALID;
+	return ModBus_request(master, &request);
+}
+
+// 运行主机直到缓存为空, 没有从机应答, 每条指令超时后发送下一条
+static void priorityDrain(ModBus_parameter* master)
+{
+	g_prioritySentN = 0;
+	for (int i = 0; i < 100 && master->m_master.m_sendFramesN > 0; i++)
+	{
+		ModBus_Master_loop(master);
+		t += master->m_sendTimeout;
+	}
+	ModBus_Master_loop(master);
+}
+
+// 指令优先级: 严格/加权出队, 按优先级丢弃, 每个优先级的缓存上限, 等待时间提升优先级
+void priority_unit_test()
+{
+	ModBus_parameter master;
+	ModBus_Setting_T modbusSetting = { 0 };
+
+	modbusSetting.address = 0x01;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = 5;
+	modbusSetting.sendHandler = priorityCapture;
+	ModBus_setup(&master, modbusSetting);
+	assert(master.m_master.m_priorityAging == MODBUS_PRIORITY_AGING);
+	ModBus_setPriorityAging(&master, 0);
+
+	// 严格优先级: 紧急写入先于普通和后台读取, 同一优先级按加入顺序
+	priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, 1);
+	priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, 2);
+	priorityRequest(&master, MODBUS_PRIORITY_NORMAL, READ_REGISTER, 10);
+	priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, 20);
+	priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, 21);
+	priorityDrain(&master);
+	assert(g_prioritySentN == 5 && g_prioritySent[0] == 20 && g_prioritySent[1] == 21 && g_prioritySent[2] == 10);
+	assert(g_prioritySent[3] == 1 && g_prioritySent[4] == 2 && g_priorityStatus[2] == MODBUS_STATUS_TIMEOUT);
+
+	// 正在等待返回帧时加入的紧急指令排在已缓存的指令之前
+	priorityRequest(&master, MODBUS_PRIORITY_NORMAL, READ_REGISTER, 10);
+	ModBus_Master_loop(&master); // 发送10, 等待返回
+	priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, 1);
+	priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, 20);
+	priorityDrain(&master);
+	assert(g_prioritySentN == 2 && g_prioritySent[0] == 20 && g_prioritySent[1] == 1);
+
+	// 缓存满: 丢弃最低优先级中最早的未发送指令; 新指令优先级低于缓存中全部指令时丢弃新指令
+	for (uint16_t k = 0; k < MODBUS_WAITFRAME_N; k++)
+		priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, (uint16_t)(1 + k));
+	assert(priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, 20) != 0);
+	assert(g_priorityStatus[1] == MODBUS_STATUS_DROPPED && master.m_master.m_sendFramesN == MODBUS_WAITFRAME_N);
+	priorityDrain(&master);
+	assert(g_prioritySent[0] == 20 && g_prioritySent[1] == 2 && g_prioritySentN == MODBUS_WAITFRAME_N);
+	for (uint16_t k = 0; k < MODBUS_WAITFRAME_N; k++)
+		priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, (uint16_t)(20 + k));
+	assert(priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, 1) == 0 && g_priorityStatus[1] == MODBUS_STATUS_DROPPED);
+	assert(g_priorityStatus[20] == MODBUS_STATUS_INVALID); // 未结束
+	priorityDrain(&master);
+	assert(g_prioritySentN == MODBUS_WAITFRAME_N && g_priorityStatus[20] == MODBUS_STATUS_TIMEOUT);
+
+	// 正在等待返回帧的指令不被丢弃, 缓存满时丢弃其后的指令(MODBUS_WAITFRAME_N为1时丢弃新指令)
+	priorityRequest(&master, MODBUS_PRIORITY_NORMAL, READ_REGISTER, 10);
+	ModBus_Master_loop(&master); // 发送10, 等待返回
+	for (uint16_t k = 0; k < MODBUS_WAITFRAME_N; k++)
+		priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, (uint16_t)(1 + k));
+	assert(g_priorityStatus[10] == MODBUS_STATUS_INVALID && g_priorityStatus[1] == MODBUS_STATUS_DROPPED);
+	assert(master.m_master.m_sendFramesN == MODBUS_WAITFRAME_N && master.m_master.m_sendFrames[0].address == 10);
+	priorityDrain(&master);
+	assert(g_priorityStatus[10] == MODBUS_STATUS_TIMEOUT);
+
+	// 每个优先级的缓存上限: 后台指令最多2条, 不挤掉其他优先级
+	ModBus_setPriority(&master, MODBUS_PRIORITY_BACKGROUND, 2, 0);
+	priorityRequest(&master, MODBUS_PRIORITY_NORMAL, READ_REGISTER, 10);
+	for (uint16_t k = 0; k < 4; k++)
+		priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, (uint16_t)(1 + k));
+	assert(master.m_master.m_sendFramesN == 3 && g_priorityStatus[1] == MODBUS_STATUS_DROPPED && g_priorityStatus[2] == MODBUS_STATUS_DROPPED);
+	priorityDrain(&master);
+	assert(g_prioritySentN == 3 && g_prioritySent[0] == 10 && g_prioritySent[1] == 3 && g_prioritySent[2] == 4);
+	ModBus_setPriority(&master, MODBUS_PRIORITY_BACKGROUND, 0, 0);
+
+	// 等待时间提升优先级: 等待超过两个周期的后台指令先于新的普通指令
+	ModBus_setPriorityAging(&master, 100);
+	priorityRequest(&master, MODBUS_PRIORITY_NORMAL, READ_REGISTER, 10);
+	ModBus_Master_loop(&master); // 发送10, 等待返回
+	priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, 1);
+	t += 250;
+	priorityRequest(&master, MODBUS_PRIORITY_NORMAL, READ_REGISTER, 11);
+	priorityDrain(&master);
+	assert(g_prioritySentN == 2 && g_prioritySent[0] == 1 && g_prioritySent[1] == 11);
+	ModBus_setPriorityAging(&master, 0);
+
+	// 加权出队: 紧急2条, 后台1条轮流
+	ModBus_setPriority(&master, MODBUS_PRIORITY_URGENT, 0, 2);
+	ModBus_setPriority(&master, MODBUS_PRIORITY_BACKGROUND, 0, 1);
+	priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, 1);
+	priorityRequest(&master, MODBUS_PRIORITY_BACKGROUND, READ_REGISTER, 2);
+	priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, 20);
+	priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, 21);
+	priorityRequest(&master, MODBUS_PRIORITY_URGENT, WRITE_SINGLE_REGISTER, 22);
+	priorityDrain(&master);
+	assert(g_prioritySentN == 5 && g_prioritySent[0] == 20 && g_prioritySent[1] == 21 && g_prioritySent[2] == 1);
+	assert(g_prioritySent[3] == 22 && g_prioritySent[4] == 2);
+	printf("priority_unit_test: ok\n");
+}
+
+static uint16_t g_mergeSent[64][2]; // 发送顺序, 记录寄存器地址和写入的第一个值(读取为0xFFFF)
+static size_t g_mergeSentN;
+static MODBUS_STATUS_TYPE g_mergeStatus[256]; // 按指令序号记录的结束状态
+static uint16_t g_mergeLegacy[2]; // 原有回调函数的参数
+
+static void mergeCapture(byte* data, size_t len)
+{
+	(void)len;
+	if (g_mergeSentN < 64)
+	{
+		g_mergeSent[g_mergeSentN][0] = (uint16_t)((data[2] << 8) | data[3]);
+		g_mergeSent[g_mergeSentN][1] = data[1] == READ_REGISTER ? 0xFFFF : data[1] == WRITE_SINGLE_REGISTER ? (uint16_t)((data[4] << 8) | data[5]) : (uint16_t)((data[7] << 8) | data[8]);
+		g_mergeSentN++;
+	}
+}
+
+static void mergeResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	g_mergeStatus[result->index] = result->status;
+}
+
+static void mergeLegacyHandler(uint16_t address, uint16_t count)
+{
+	g_mergeLegacy[0] = address;
+	g_mergeLegacy[1] = count;
+}
+
+static byte mergeRequest(ModBus_parameter* master, MODBUS_FUNCTION_TYPE type, uint16_t address, uint16_t count, uint16_t value)
+{
+	ModBus_Request_T request = { 0 };
+	byte index;
+	request.type = type;
+	request.address = address;
+	request.count = count;
+	request.data[0] = value;
+	request.data[1] = value;
+	request.resultHandler = mergeResult;
+	index = ModBus_request(master, &request);
+	g_mergeStatus[index] = MODBUS_STATUS_INVALID;
+	return index;
+}
+
+static byte g_mergeResubmit; // 被丢弃的指令的回调函数中加入的指令序号
+static u8 g_mergeCompleteN[256]; // 按指令序号记录的结束次数
+
+static byte mergeFastRequest(ModBus_parameter* master, uint16_t address, uint16_t value);
+
+// 第一条指令被丢弃时加入一条新写入
+static void mergeResubmit(void* context, const ModBus_Result_T* result)
+{
+	g_mergeStatus[result->index] = result->status;
+	g_mergeCompleteN[result->index]++;
+	if (result->status == MODBUS_STATUS_DROPPED && g_mergeResubmit == 0)
+	{
+		g_mergeResubmit = mergeFastRequest((ModBus_parameter*)context, 61, 9);
+	}
+}
+
+static byte mergeFastRequest(ModBus_parameter* master, uint16_t address, uint16_t value)
+{
+	ModBus_Request_T request = { 0 };
+	byte index;
+	request.type = WRITE_SINGLE_REGISTER;
+	request.address = address;
+	request.count = 1;
+	request.data[0] = value;
+	request.resultHandler = mergeResubmit;
+	request.context = master;
+	index = ModBus_request(master, &request);
+	g_mergeCompleteN[index] = 0;
+	return index;
+}
+
+// 运行主机直到缓存为空, 没有从机应答, 每条指令超时后发送下一条
+static void mergeDrain(ModBus_parameter* master)
+{
+	g_mergeSentN = 0;
+	for (int i = 0; i < 100 && master->m_master.m_sendFramesN > 0; i++)
+	{
+		ModBus_Master_loop(master);
+		t += master->m_sendTimeout;
+	}
+	ModBus_Master_loop(master);
+}
+
+// 合并写入: 同一寄存器的未发送写入只发送最新值, 其他指令保留, 读取重叠寄存器和部分重叠写入时保持顺序
+void merge_unit_test()
+{
+	ModBus_parameter master;
+	ModBus_Setting_T modbusSetting = { 0 };
+	byte first, second, third;
+	size_t updateN = 0, writeN = 0;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = 5;
+	modbusSetting.sendHandler = mergeCapture;
+	ModBus_setup(&master, modbusSetting);
+	ModBus_setPriorityAging(&master, 0);
+
+	// 默认不合并
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 1);
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 2);
+	mergeDrain(&master);
+	assert(g_mergeSentN == 2 && g_mergeSent[0][1] == 1 && g_mergeSent[1][1] == 2);
+
+	// 新值代替未发送的写入, 位置不变; 已发送的指令和其他寄存器的指令都保留
+	ModBus_mergeWrites(&master, 1);
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 1);
+	ModBus_Master_loop(&master); // 发送30=1, 等待返回
+	first = mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 2);
+	mergeRequest(&master, READ_REGISTER, 11, 1, 0);
+	second = mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 3);
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 31, 1, 7);
+	third = mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 4);
+	assert(first != 0 && second != 0 && third != 0 && master.m_master.m_sendFramesN == 4);
+	assert(g_mergeStatus[first] == MODBUS_STATUS_SUPERSEDED && g_mergeStatus[second] == MODBUS_STATUS_SUPERSEDED);
+	mergeDrain(&master);
+	assert(g_mergeSentN == 3 && g_mergeSent[0][0] == 30 && g_mergeSent[0][1] == 4 && g_mergeSent[1][0] == 11 && g_mergeSent[2][0] == 31);
+	assert(g_mergeStatus[third] == MODBUS_STATUS_TIMEOUT);
+
+	// 中间有读取重叠寄存器的指令时不合并
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 1);
+	mergeRequest(&master, READ_REGISTER, 29, 2, 0);
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 2);
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, 3);
+	mergeDrain(&master);
+	assert(g_mergeSentN == 3 && g_mergeSent[0][1] == 1 && g_mergeSent[1][1] == 0xFFFF && g_mergeSent[2][1] == 3);
+
+	// 部分重叠的写入不合并, 范围相同的多寄存器写入合并
+	mergeRequest(&master, WRITE_MULTI_REGISTER, 30, 2, 1);
+	mergeRequest(&master, WRITE_SINGLE_REGISTER, 31, 1, 2);
+	mergeRequest(&master, WRITE_MULTI_REGISTER, 40, 2, 3);
+	mergeRequest(&master, WRITE_MULTI_REGISTER, 40, 2, 4);
+	mergeDrain(&master);
+	assert(g_mergeSentN == 3 && g_mergeSent[0][1] == 1 && g_mergeSent[1][1] == 2 && g_mergeSent[2][0] == 40 && g_mergeSent[2][1] == 4);
+
+	// 原有回调函数: 被代替的写入传入(address, 0)
+	ModBus_setRegister(&master, 50, 1, mergeLegacyHandler);
+	ModBus_setRegister(&master, 50, 2, mergeLegacyHandler);
+	assert(g_mergeLegacy[0] == 50 && g_mergeLegacy[1] == 0 && master.m_master.m_sendFramesN == 1);
+	mergeDrain(&master);
+	assert(g_mergeSentN == 1 && g_mergeSent[0][1] == 2);
+
+	// 滑块: 周期读取的同时每10毫秒写入一次设定值, 读取全部保留, 写入只发送总线空闲时的最新值
+	g_mergeSentN = 0;
+	for (int k = 0; k < 200; k++)
+	{
+		if (k % 16 == 0)
+			mergeRequest(&master, READ_REGISTER, 10, 1, 0);
+		mergeRequest(&master, WRITE_SINGLE_REGISTER, 30, 1, (uint16_t)k);
+		updateN++;
+		ModBus_Master_loop(&master);
+		t += 10;
+	}
+	for (int i = 0; i < 100 && master.m_master.m_sendFramesN > 0; i++)
+	{
+		ModBus_Master_loop(&master);
+		t += master.m_sendTimeout;
+	}
+	for (size_t i = 0; i < g_mergeSentN; i++)
+		writeN += g_mergeSent[i][0] == 30;
+	assert(g_mergeSentN - writeN == 13 && g_mergeSent[g_mergeSentN - 1][0] == 30 && g_mergeSent[g_mergeSentN - 1][1] == 199);
+	ModBus_mergeWrites(&master, 0);
+
+	// 快速模式: 被丢弃的指令的回调函数中加入新写入, 最新指令照常发送, 新写入之后发送, 每条指令都只结束一次
+	ModBus_fastMode(&master, 1);
+	g_mergeResubmit = 0;
+	first = mergeFastRequest(&master, 60, 1);
+	second = mergeFastRequest(&master, 62, 2);
+	third = mergeFastRequest(&master, 63, 3);
+	mergeDrain(&master);
+	assert(g_mergeResubmit != 0 && g_mergeSentN == 2 && g_mergeSent[0][0] == 63 && g_mergeSent[1][0] == 61 && g_mergeSent[1][1] == 9);
+	assert(g_mergeStatus[first] == MODBUS_STATUS_DROPPED && g_mergeStatus[second] == MODBUS_STATUS_DROPPED);
+	assert(g_mergeStatus[third] == MODBUS_STATUS_TIMEOUT && g_mergeStatus[g_mergeResubmit] == MODBUS_STATUS_TIMEOUT);
+	assert(g_mergeCompleteN[first] == 1 && g_mergeCompleteN[second] == 1 && g_mergeCompleteN[third] == 1 && g_mergeCompleteN[g_mergeResubmit] == 1);
+	ModBus_fastMode(&master, 0);
+	printf("merge_unit_test: %u setpoint updates sent as %u writes, 13 reads kept\n", (unsigned)updateN, (unsigned)writeN);
 }
 
 #endif // _UNIT_TEST
+
+#if defined(_BENCHMARK)
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define MODBUS_BENCH_CODEC_N 2000000 // 编解码每项的运行次数
+#define MODBUS_BENCH_DETECT_N 1000000 // 帧检测每项的帧数
+#define MODBUS_BENCH_LOOPBACK_N 20000 // 回环测试每种情况的指令数
+
+static volatile size_t g_benchSink; // 保存计算结果, 防止被优化掉
+
+static double benchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// 输出一行机器可读的结果(CSV: 前缀,测试项,指标,数值,单位), 便于不同版本之间比较
+static void benchReport(const char* name, const char* metric, double value, const char* unit)
+{
+	printf("modbus_benchmark,%s,%s,%.3f,%s\n", name, metric, value, unit);
+}
+
+// 帧检测: 每次放入一帧(前面可带干扰字节)到循环存取区, 检测到完整帧后清空接收数据缓冲区
+static void benchDetect(const char* name, MODBUS_MODE_TYPE mode, const byte* noise, size_t noiseLen)
+{
+	static ModBus_parameter modbus;
+	ModBus_Setting_T modbusSetting = { 0 };
+	byte stream[MODBUS_BUFFER_SIZE];
+	size_t len = noiseLen, restSize;
+	u32 detected = 0;
+	double begin;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = mode;
+	ModBus_setup(&modbus, modbusSetting);
+	ModBus_lengthFraming(&modbus, 1); // RTU按功能码计算请求帧长度, 不等待接收超时
+	memcpy(stream, noise, noiseLen);
+	stream[len++] = 0x01;
+	stream[len++] = READ_REGISTER;
+	stream[len++] = 0x00;
+	stream[len++] = 0x10;
+	stream[len++] = 0x00;
+	stream[len++] = MODBUS_REGISTER_LIMIT;
+	if (mode == ASCII)
+	{
+		size_t binLen = GenLRC(stream + noiseLen, len - noiseLen);
+		len = noiseLen + 1 + bin2char_s(stream + noiseLen, binLen, sizeof(stream) - noiseLen - 3);
+		memmove(stream + noiseLen + 1, stream + noiseLen, len - noiseLen - 1);
+		stream[noiseLen] = ':';
+		stream[len++] = '\r';
+		stream[len++] = '\n';
+	}
+	else
+	{
+		len = noiseLen + GenCRC16(stream + noiseLen, len - noiseLen);
+	}
+	assert(len <= MODBUS_BUFFER_SIZE - 1);
+
+	begin = benchNow();
+	for (u32 i = 0; i < MODBUS_BENCH_DETECT_N; i++)
+	{
+		ModBus_readBytesFromOuter(&modbus, stream, len);
+		detected += ModBus_detectFrame(&modbus, &restSize);
+		modbus.m_receiveFrameBufferLen = 0;
+	}
+	assert(detected == MODBUS_BENCH_DETECT_N);
+	benchReport(name, "ns_per_frame", (benchNow() - begin) * 1e9 / MODBUS_BENCH_DETECT_N, "ns");
+}
+
+// 校验码, ASCII/二进制转换和帧检测的单项耗时
+void codec_benchmark()
+{
+	static const byte noise[3] = { 0x00, 0xFF, 0x55 };
+	static const byte asciiNoise[3] = { 'x', '\n', '5' };
+	static const byte falseStart[4] = { 0x01, 0x55, 0x01, 0x03 }; // 噪声中含有地址字节, 需滑动查找帧起始
+	byte frame[MODBUS_BUFFER_SIZE * 2 + 4];
+	byte input[MODBUS_BUFFER_SIZE * 2 + 4];
+	const size_t sizes[2] = { 6, MODBUS_BUFFER_SIZE - 2 }; // 读指令, 最长帧
+	char name[64];
+	double begin;
+
+	for (size_t i = 0; i < sizeof(input); i++)
+		input[i] = (byte)(i * 37 + 11);
+	printf("modbus_benchmark,name,metric,value,unit\n");
+	for (int s = 0; s < 2; s++)
+	{
+		size_t len = sizes[s];
+		memcpy(frame, input, len);
+		begin = benchNow();
+		for (u32 i = 0; i < MODBUS_BENCH_CODEC_N; i++)
+		{
+			frame[0] = (byte)i;
+			g_benchSink += GenCRC16(frame, len);
+		}
+		sprintf(name, "crc16_%uB", (unsigned)len);
+		benchReport(name, "ns_per_op", (benchNow() - begin) * 1e9 / MODBUS_BENCH_CODEC_N, "ns");
+
+		begin = benchNow();
+		for (u32 i = 0; i < MODBUS_BENCH_CODEC_N; i++)
+		{
+			frame[0] = (byte)i;
+			g_benchSink += GenLRC(frame, len);
+		}
+		sprintf(name, "lrc_%uB", (unsigned)len);
+		benchReport(name, "ns_per_op", (benchNow() - begin) * 1e9 / MODBUS_BENCH_CODEC_N, "ns");
+
+		// 原地转换会改变输入, 每次先复制输入(含在结果中)
+		begin = benchNow();
+		for (u32 i = 0; i < MODBUS_BENCH_CODEC_N; i++)
+		{
+			memcpy(frame, input, len);
+			g_benchSink += bin2char_s(frame, len, sizeof(frame));
+		}
+		sprintf(name, "bin2char_s_%uB", (unsigned)len);
+		benchReport(name, "ns_per_op", (benchNow() - begin) * 1e9 / MODBUS_BENCH_CODEC_N, "ns");
+
+		memcpy(input + MODBUS_BUFFER_SIZE, frame, len * 2); // 转换结果作为char2bin的输入
+		begin = benchNow();
+		for (u32 i = 0; i < MODBUS_BENCH_CODEC_N; i++)
+		{
+			memcpy(frame, input + MODBUS_BUFFER_SIZE, len * 2);
+			g_benchSink += char2bin(frame, len * 2);
+		}
+		sprintf(name, "char2bin_%uB", (unsigned)len * 2);
+		benchReport(name, "ns_per_op", (benchNow() - begin) * 1e9 / MODBUS_BENCH_CODEC_N, "ns");
+		assert(memcmp(frame, input, len) == 0);
+	}
+
+	// 帧检测时间包含放入循环存取区(ModBus_readBytesFromOuter)
+	benchDetect("detect_rtu_clean", RTU, noise, 0);
+	benchDetect("detect_rtu_noisy", RTU, noise, sizeof(noise));
+	benchDetect("detect_rtu_false_start", RTU, falseStart, sizeof(falseStart));
+	benchDetect("detect_ascii_clean", ASCII, asciiNoise, 0);
+	benchDetect("detect_ascii_noisy", ASCII, asciiNoise, sizeof(asciiNoise));
+}
+
+#if defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+static ModBus_parameter g_benchMaster, g_benchSlave;
+static uint16_t g_benchRegisters[MODBUS_REGISTER_LIMIT];
+static byte g_benchDone;
+
+static size_t benchGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	(void)address;
+	memcpy(data, g_benchRegisters, n * sizeof(uint16_t));
+	return n;
+}
+
+static size_t benchSetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	(void)address;
+	memcpy(g_benchRegisters, data, n * sizeof(uint16_t));
+	return n;
+}
+
+// 发送函数: 直接放入对端实例的循环存取区
+static void benchSend(void* context, byte* data, size_t len)
+{
+	ModBus_readBytesFromOuter((ModBus_parameter*)context, data, len);
+}
+
+static void benchResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	assert(result->status == MODBUS_STATUS_OK);
+	g_benchDone = 1;
+}
+
+static int benchCompare(const void* a, const void* b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+// 内存中的主从机回环: 每种模式, 读/写和寄存器个数下逐条执行指令, 统计每秒帧数和单条指令延时的百分位
+void loopback_benchmark()
+{
+	static double latency[MODBUS_BENCH_LOOPBACK_N];
+	const MODBUS_MODE_TYPE modes[2] = { RTU, ASCII };
+	const char* modeNames[2] = { "rtu", "ascii" };
+	const MODBUS_FUNCTION_TYPE types[2] = { READ_REGISTER, WRITE_MULTI_REGISTER };
+	const char* typeNames[2] = { "read", "write" };
+	const uint16_t counts[3] = { 1, (MODBUS_REGISTER_LIMIT + 1) / 2, MODBUS_REGISTER_LIMIT };
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+
+	for (int m = 0; m < 2; m++)
+	{
+		modbusSetting.address = 0x01;
+		modbusSetting.frameType = modes[m];
+		modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+		ModBus_setup(&g_benchMaster, modbusSetting);
+		ModBus_setup(&g_benchSlave, modbusSetting);
+		ModBus_lengthFraming(&g_benchSlave, 1); // 不等待接收超时
+		ModBus_attachRegisterHandler(&g_benchSlave, benchGetReg, benchSetReg);
+		ModBus_attachSendHandler(&g_benchMaster, benchSend, &g_benchSlave);
+		ModBus_attachSendHandler(&g_benchSlave, benchSend, &g_benchMaster);
+		for (int f = 0; f < 2; f++)
+		{
+			for (int c = 0; c < 3; c++)
+			{
+				char name[64];
+				double begin, total;
+				byte index;
+				request.type = types[f];
+				request.address = 0;
+				request.count = counts[c];
+				request.resultHandler = benchResult;
+				begin = benchNow();
+				for (u32 i = 0; i < MODBUS_BENCH_LOOPBACK_N; i++)
+				{
+					double start = benchNow();
+					request.data[0] = (uint16_t)i;
+					g_benchDone = 0;
+					index = ModBus_request(&g_benchMaster, &request);
+					assert(index != 0); // 定义NDEBUG时不能把指令放在assert中, 否则不发送, 下面一直等待
+					(void)index;
+					while (!g_benchDone)
+					{
+						ModBus_Master_loop(&g_benchMaster);
+						ModBus_Slave_loop(&g_benchSlave);
+					}
+					latency[i] = benchNow() - start;
+				}
+				total = benchNow() - begin;
+				qsort(latency, MODBUS_BENCH_LOOPBACK_N, sizeof(double), benchCompare);
+				sprintf(name, "loopback_%s_%s_%u", modeNames[m], typeNames[f], (unsigned)counts[c]);
+				benchReport(name, "frames_per_s", MODBUS_BENCH_LOOPBACK_N * 2 / total, "frames/s"); // 请求和返回各一帧
+				benchReport(name, "latency_p50", latency[MODBUS_BENCH_LOOPBACK_N / 2] * 1e6, "us");
+				benchReport(name, "latency_p99", latency[MODBUS_BENCH_LOOPBACK_N * 99 / 100] * 1e6, "us");
+				benchReport(name, "latency_max", latency[MODBUS_BENCH_LOOPBACK_N - 1] * 1e6, "us");
+			}
+		}
+	}
+}
+#endif
+
+// 本文件的全部性能测试, 测试程序提供millis()后调用(需关闭_UNIT_TEST, 否则与单元测试的millis()重复定义); 其他模块的性能测试在各自文件中, 按编译的模块调用
+void benchmark()
+{
+	codec_benchmark();
+#if defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+	loopback_benchmark();
+#endif
+}
+#endif // _BENCHMARK
@@ -23,42 +23,37 @@
 #define MODBUS_MASTER
 //#define MODBUS_SLAVE
 
-#define _UNIT_TEST
-//#define DEBUG
-//#define _DELAY_DEBUG
-
-#ifdef _UNIT_TEST
-
-#ifndef MODBUS_MASTER
-#define MODBUS_MASTER
-#endif // !MODBUS_MASTER
-
-#ifndef MODBUS_SLAVE
-#define MODBUS_SLAVE
-#endif // !MODBUS_SLAVE
-
-#endif // _UNIT_TEST
-
-#ifdef DEBUG
-#define MODBUS_DEBUG(x) print_controlled x
-#else
-#define MODBUS_DEBUG(x)  
-#endif // DEBUG
-
-#ifdef _DELAY_DEBUG
-#define MODBUS_DELAY_DEBUG(x) print_controlled x
-#else
-#define MODBUS_DELAY_DEBUG(x)  
-#endif // DEBUG
-
+#define _UNIT_TEST // 单元测试不改变主机/从机配置, 只编译所需角色都已开启的测试
+//#define _BENCHMARK // 编译各模块的性能测试函数, 由测试程序提供millis(), 需关闭_UNIT_TEST
+#define MODBUS_TRACE // 收发事件写入二进制跟踪缓冲区(见 modbus_trace.h), 代替打印调试信息; 实例未绑定跟踪缓冲区时只多一次判断
+#define MODBUS_STATS // 实例计数和延时直方图(见 modbus_stats.h); 实例未绑定统计时只多一次判断
+#define MODBUS_CAPTURE // 收发字节写入二进制捕获记录(见 modbus_capture.h), 可在虚拟时间下重放; 实例未绑定捕获时只多一次判断
+#define MODBUS_LIFECYCLE // 主机指令各阶段的时刻和耗时直方图(见 modbus_lifecycle.h); 实例未绑定时只多一次判断
+#define MODBUS_BREAKER // 主机按设备断路: 连续超时的设备指令立即结束, 按指数退避发送探测指令(见 modbus_breaker.h); 实例未绑定时只多一次判断
+
+// 以下大小决定每个实例占用的内存, 可在编译选项中重新定义(如 -DMODBUS_WAITFRAME_N=2)
+#ifndef MODBUS_REGISTER_LIMIT
 #define MODBUS_REGISTER_LIMIT 6 // 一次最多读写寄存器个数
+#endif
 #define MODBUS_BUFFER_SIZE ((MODBUS_REGISTER_LIMIT)*4+20) // 数据包最大长度(写多个寄存器的数据包长度)
+#ifndef MODBUS_WAITFRAME_N
 #define MODBUS_WAITFRAME_N 5  // 指令缓存最大个数
+#endif
+#ifndef MODBUS_PRIORITY_AGING
+#define MODBUS_PRIORITY_AGING 1000 // 默认: 指令缓存中等待每超过此毫秒数提升一个优先级
+#endif
+#ifndef MODBUS_DEFAULT_BAUD
 #define MODBUS_DEFAULT_BAUD 9600 // 默认数据收发速率, 9600bps
+#endif
 
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef unsigned char byte;
 typedef unsigned char u8;
 typedef unsigned int u32;
@@ -66,6 +61,10 @@ typedef unsigned int u32;
 // TODO: 获取毫秒系统时间的函数, 根据具体系统进行定义
 int millis();
 
+// 协议内部使用的毫秒时间, 默认为millis(); 可用ModBus_setClock替换为其他时间源, 如仿真总线的虚拟时钟(见 modbus_sim.h)
+u32 ModBus_millis(void);
+void ModBus_setClock(u32(*clock)(void)); // 替换时间源, 传入NULL恢复为millis()
+
 typedef enum {
 	ASCII,
 	RTU
@@ -77,6 +76,20 @@ typedef enum {
 	WRITE_MULTI_REGISTER = 0x10,
 } MODBUS_FUNCTION_TYPE;
 
+typedef enum { // 异常码, 异常返回帧功能码最高位置1
+	EXCEPTION_ILLEGAL_FUNCTION = 0x01, // 不支持的功能码
+	EXCEPTION_ILLEGAL_DATA_ADDRESS = 0x02, // 寄存器地址无效
+	EXCEPTION_ILLEGAL_DATA_VALUE = 0x03, // 数据值/个数无效
+	EXCEPTION_SLAVE_DEVICE_FAILURE = 0x04, // 从机执行失败
+	EXCEPTION_SLAVE_DEVICE_BUSY = 0x06, // 从机忙
+	EXCEPTION_GATEWAY_PATH_UNAVAILABLE = 0x0A, // 网关无可用路径
+	EXCEPTION_GATEWAY_TARGET_FAILED = 0x0B, // 网关目标设备无响应
+} MODBUS_EXCEPTION_TYPE;
+
+#define MODBUS_EXCEPTION_FLAG 0x80 // 异常返回帧功能码标志位
+#define MODBUS_PDU_SIZE 253 // PDU(功能码+数据)最大长度
+#define MODBUS_DEADLINE_NONE 0xFFFFFFFFu // 没有需要等待的超时, 有数据或指令时才需要运行loop
+
 typedef struct _MODBUS_SETTING_T { // ModBus实例配置信息类型
 	uint8_t address; // 目标设备地址
 	MODBUS_MODE_TYPE frameType; // 工作模式, 包括 ASCII和RTU
@@ -85,67 +98,183 @@ typedef struct _MODBUS_SETTING_T { // ModBus实例配置信息类型
 	void(*sendHandler)(byte*, size_t); // 用于发送数据的函数, 函数参数(byte* data, size_t size)数据首地址和数据字节数
 } ModBus_Setting_T;
 
-typedef struct _MODBUS_FRAME_T {
+typedef enum { // 指令执行结果
+	MODBUS_STATUS_OK = 0, // 成功
+	MODBUS_STATUS_TIMEOUT, // 等待返回帧超时
+	MODBUS_STATUS_EXCEPTION, // 从机返回异常码
+	MODBUS_STATUS_INVALID, // 参数无效, 未发送
+	MODBUS_STATUS_DROPPED, // 指令缓存已满或快速模式下被丢弃, 未发送
+	MODBUS_STATUS_UNAVAILABLE, // 目标设备断路中(连续超时, 见 modbus_breaker.h), 未发送
+	MODBUS_STATUS_SUPERSEDED, // 合并写入模式下被同一设备同一寄存器的新写入指令代替, 未发送
+} MODBUS_STATUS_TYPE;
+
+typedef enum { // 指令优先级, 指令缓存中优先级高的先发送, 同一优先级按加入顺序
+	MODBUS_PRIORITY_NORMAL = 0, // 普通指令, 默认
+	MODBUS_PRIORITY_URGENT, // 紧急指令, 如急停, 设定值写入
+	MODBUS_PRIORITY_BACKGROUND, // 后台指令, 如周期读取
+	MODBUS_PRIORITY_N
+} MODBUS_PRIORITY_TYPE;
+
+typedef struct _MODBUS_RESULT_T { // 指令执行结果
 	u8 index; // 指令序号
-	byte data[MODBUS_BUFFER_SIZE + 2]; // 数据, 多分配两字节保证安全
-	u8 size; // 数据长度
+	MODBUS_STATUS_TYPE status; // 执行结果
 	MODBUS_FUNCTION_TYPE type; // 指令类型
-	u32 time; // 指令开始时间
-	void* responseHandler; // 指令执行结束回调函数指针
-	u8 responseSize; // 返回帧长度
-	uint16_t address; // 访问寄存器的地址
-	u8 count; // 访问寄存器的个数
-} MODBUS_FRAME_T;
+	uint16_t address; // 寄存器首地址
+	uint16_t count; // 成功读/写的寄存器个数, 失败为0
+	uint16_t* data; // 读取的寄存器值, 只在回调函数中有效; 写指令为NULL
+	u8 exception; // 从机返回的异常码, 无异常为0
+} ModBus_Result_T;
 
 typedef void(*GetReponseHandler_T)(uint16_t*, uint16_t); // 读取寄存器回调函数指针类型, 回到函数参数(寄存器值缓冲区首地址, 寄存器个数)
 typedef void(*SetReponseHandler_T)(uint16_t, uint16_t); // 写入寄存器回调函数指针类型, 回调函数参数(寄存器地址, 写入个数)
+typedef void(*ModBus_ResultHandler_T)(void*, const ModBus_Result_T*); // 带上下文的回调函数指针类型, 回调函数参数(上下文, 执行结果)
 
-typedef struct __MODBUS_Parameter {
-	uint8_t m_address; // 从机设备地址
-	MODBUS_MODE_TYPE m_modeType; // 协议模式: ASCII / RTU
-	byte m_receiveFrameBuffer[MODBUS_BUFFER_SIZE + 2]; // 接收数据包, 多分配两字节保证安全
-	size_t m_receiveFrameBufferLen;  // 接收到的数据字节数
+struct __MODBUS_Queue; // 无锁队列, 见 modbus_queue.h
 
-	volatile byte m_receiveBufferTmp[MODBUS_BUFFER_SIZE + 2]; // 临时储存的接收数据, 由于中断函数会修改此变量, 因而采用循环存取, 避免中断函数外部修改此变量
-	volatile byte* m_pBeginReceiveBufferTmp; // 循环存取区开始位置
-	volatile byte* m_pEndReceiveBufferTmp; // 循环存取区结束位置的下一个位置
-	byte m_hasDetectedBufferStart;
-
-	uint16_t m_registerData[MODBUS_REGISTER_LIMIT + 2]; // 缓存读寄存器数据
-	uint16_t m_registerCount;
-	u8 m_registerAcessLimit;
-
-	volatile u32 m_lastReceivedTime; // 最近一次接受到字节数据的时刻
-	u32 m_lastSentTime; // 最近一次发送数据的时刻
-	u32 m_receiveTimeout; // 设定的接收等待下一字符超时时间
-	u32 m_sendTimeout; // 设定等待返回帧超时时间
-
-	byte m_faston; // 是否开启快速模式
+typedef struct _MODBUS_REQUEST_T { // 通用指令描述
+	uint8_t unit; // 目标设备地址, 0 使用实例配置的地址
+	MODBUS_FUNCTION_TYPE type; // 指令类型
+	uint16_t address; // 寄存器首地址
+	uint16_t count; // 寄存器个数
+	uint16_t data[MODBUS_REGISTER_LIMIT]; // 待写入数据, 写单寄存器只用data[0]
+	ModBus_ResultHandler_T resultHandler; // 执行结束回调函数, 在主机loop线程中调用, 可以为NULL
+	void* context; // 传给回调函数的上下文
+	struct __MODBUS_Queue* completionQueue; // 不为NULL时执行结果放入此完成队列(ModBus_Completion_T), 不调用回调函数
+	MODBUS_PRIORITY_TYPE priority; // 优先级, 0 为 MODBUS_PRIORITY_NORMAL
+	u8 retries; // 超时后重发的次数, 0 不重发; 目标设备断路后不再重发
+} ModBus_Request_T;
+
+typedef struct _MODBUS_FRAME_T { // 字段按对齐大小排列, 减少填充
+	void* responseHandler; // 指令执行结束回调函数指针
+	ModBus_ResultHandler_T resultHandler; // 带上下文的回调函数
+	void* context; // 回调函数上下文
+	struct __MODBUS_Queue* completionQueue; // 完成队列
+	u32 time; // 指令开始时间
+	MODBUS_FUNCTION_TYPE type; // 指令类型
+	uint16_t address; // 访问寄存器的地址
+	u8 index; // 指令序号
+	uint8_t unit; // 目标设备地址, 返回帧地址需与之相同
+	u8 size; // 数据长度
+	u8 responseSize; // 返回帧长度
+	u8 count; // 访问寄存器的个数
+	u8 priority; // 优先级(MODBUS_PRIORITY_TYPE)
+	u8 retries; // 剩余的重发次数
+	byte data[MODBUS_BUFFER_SIZE + 2]; // 数据, 多分配两字节保证安全
+} MODBUS_FRAME_T;
 
-	void(*m_SendHandler)(byte*, size_t); // 发送数据函数, 用于向外部设备传递数据
+struct __MODBUS_RegisterImage; // 从机寄存器映像, 见 modbus_image.h
+struct __MODBUS_Trace; // 跟踪缓冲区, 见 modbus_trace.h
+struct __MODBUS_Stats; // 实例统计, 见 modbus_stats.h
+struct __MODBUS_Breaker; // 按设备断路, 见 modbus_breaker.h
 
-#ifdef MODBUS_MASTER // 主机
+#ifdef MODBUS_MASTER
+typedef struct _MODBUS_MASTER_PART_T { // 实例的主机部分
 	MODBUS_FRAME_T m_sendFrames[MODBUS_WAITFRAME_N + 2]; // 发送数据包队列
 	size_t m_sendFramesN; // 发送数据包队列长度
+	struct __MODBUS_Queue* m_submitQueue; // 其他线程提交指令的队列, 在主机loop中取出
+#ifdef MODBUS_BREAKER
+	struct __MODBUS_Breaker* m_breaker; // 按设备断路, NULL表示不断路
+#endif
+	u32 m_priorityAging; // 等待每超过此毫秒数提升一个优先级, 0 不提升
 	u8 m_nextFrameIndex; // 下一数据包序号
 	byte m_waitingResponse; // 正在等待返回帧
+	byte m_mergeWrites; // 是否开启合并写入模式
+	u8 m_priorityLimits[MODBUS_PRIORITY_N]; // 每个优先级最多缓存的未发送指令数
+	u8 m_priorityWeights[MODBUS_PRIORITY_N]; // 加权出队时每轮发送的指令数, 全部为0时严格按优先级
+	u8 m_priorityCredits[MODBUS_PRIORITY_N]; // 加权出队时本轮剩余的发送数
+} ModBus_MasterPart_T;
 #endif // MODBUS_MASTER
 
-#ifdef MODBUS_SLAVE // 从机
-	byte m_sendFrameBuffer[MODBUS_BUFFER_SIZE];
-	u8 m_sendFrameBufferLen;
-
+#ifdef MODBUS_SLAVE
+typedef struct _MODBUS_SLAVE_PART_T { // 实例的从机部分
 	size_t(*m_GetRegisterHandler)(uint16_t, uint16_t, uint16_t*); // 读取寄存器函数, 函数参数(寄存器首地址, 寄存器个数, 读出的数据), 返回成功读取的个数
 	size_t(*m_SetRegisterHandler)(uint16_t, uint16_t, uint16_t*); // 设置寄存器函数, 函数参数(寄存器地址, 写入个数, 写入数据), 返回成功设置的个数
+	struct __MODBUS_RegisterImage* m_registerImage; // 寄存器映像, 绑定后代替读寄存器函数
+	u8 m_sendFrameBufferLen;
+	byte m_sendFrameBuffer[MODBUS_BUFFER_SIZE];
+} ModBus_SlavePart_T;
 #endif // MODBUS_SLAVE
 
+typedef struct __MODBUS_Parameter { // 主从机共用部分在前, 字段按对齐大小排列
+	void(*m_SendHandler)(byte*, size_t); // 发送数据函数, 用于向外部设备传递数据
+	void(*m_SendHandlerEx)(void*, byte*, size_t); // 带上下文的发送数据函数, 设置后代替m_SendHandler
+	void* m_sendContext; // 传给m_SendHandlerEx的上下文, 比如串口/连接对象
+#ifdef MODBUS_TRACE
+	struct __MODBUS_Trace* m_trace; // 跟踪缓冲区, NULL表示不记录
+#endif
+#ifdef MODBUS_STATS
+	struct __MODBUS_Stats* m_stats; // 统计, NULL表示不统计; 只在loop线程中更新
+#endif
+#ifdef MODBUS_CAPTURE
+	struct __MODBUS_Capture* m_capture; // 总线捕获, NULL表示不记录; 只在loop线程中写入
+#endif
+#ifdef MODBUS_LIFECYCLE
+	struct __MODBUS_Lifecycle* m_lifecycle; // 主机指令生命周期, NULL表示不记录
+#endif
+	size_t m_receiveFrameBufferLen;  // 接收到的数据字节数
+	volatile byte* m_pBeginReceiveBufferTmp; // 循环存取区开始位置
+	volatile byte* m_pEndReceiveBufferTmp; // 循环存取区结束位置的下一个位置
 
+	MODBUS_MODE_TYPE m_modeType; // 协议模式: ASCII / RTU
+	volatile u32 m_lastReceivedTime; // 最近一次接受到字节数据的时刻
+	u32 m_lastSentTime; // 最近一次发送数据的时刻
+	u32 m_receiveTimeout; // 设定的接收等待下一字符超时时间
+	u32 m_sendTimeout; // 设定等待返回帧超时时间
+
+	uint16_t m_registerData[MODBUS_REGISTER_LIMIT + 2]; // 缓存读寄存器数据
+	uint16_t m_registerCount;
+
+	uint8_t m_address; // 从机设备地址
+	u8 m_registerAcessLimit;
+	byte m_hasDetectedBufferStart;
+	byte m_faston; // 是否开启快速模式
+	byte m_lengthFraming; // 按长度判断帧边界, 不因接收超时丢弃未接收完的帧(TCP等流式传输)
+#ifdef MODBUS_TRACE
+	u8 m_traceId; // 记录在跟踪事件中的实例编号
+#endif
+	byte m_receiveFrameBuffer[MODBUS_BUFFER_SIZE + 2]; // 接收数据包, 多分配两字节保证安全
+	volatile byte m_receiveBufferTmp[MODBUS_BUFFER_SIZE + 2]; // 临时储存的接收数据, 由于中断函数会修改此变量, 因而采用循环存取, 避免中断函数外部修改此变量
+
+	// 角色部分: 同时编译主机和从机时两部分共用内存, 一个实例只能作为主机或从机之一使用
+#if defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+	union {
+#endif
+#ifdef MODBUS_MASTER
+		ModBus_MasterPart_T m_master;
+#endif
+#ifdef MODBUS_SLAVE
+		ModBus_SlavePart_T m_slave;
+#endif
+#if defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+	};
+#endif
 } ModBus_parameter;
 
+/** 实例内存占用 **/
+// 可在编译选项中定义 MODBUS_INSTANCE_SIZE_MAX(字节), 实例超出时编译失败, 用于确认单片机RAM可以容纳的总线数
+#define MODBUS_STATIC_ASSERT(cond, name) typedef char modbus_static_assert_##name[(cond) ? 1 : -1]
+#ifdef MODBUS_INSTANCE_SIZE_MAX
+MODBUS_STATIC_ASSERT(sizeof(ModBus_parameter) <= (MODBUS_INSTANCE_SIZE_MAX), instance_size);
+#endif
+
 /************ 对外接口 BEGIN ***********/
 void ModBus_setup(ModBus_parameter* ModBus_para, ModBus_Setting_T setting); // 配置ModBus实例
 void ModBus_readByteFromOuter(ModBus_parameter* ModBus_para, byte receivedByte); // 传递字节数据到ModBus协议
+void ModBus_readBytesFromOuter(ModBus_parameter* ModBus_para, const byte* data, size_t len); // 一次传递多个字节数据到ModBus协议, 用于批量读取串口的场合
 void ModBus_fastMode(ModBus_parameter* ModBus_para, byte faston); // 是否开启快速指令模式, 快速模式不缓存指令, 关闭快速模式可保证指令被执行但可能有延迟
+void ModBus_lengthFraming(ModBus_parameter* ModBus_para, byte on); // 是否按长度判断RTU帧边界, 通过TCP等流式连接收发RTU帧时开启, 数据分段到达不会被接收超时截断
+
+/** RTU帧工具函数, 供不经过实例收发RTU帧的传输方式使用(如RTU over TCP) **/
+size_t ModBus_RTU_appendCRC(byte* frame, size_t len); // 在帧尾部添加CRC校验码, 返回添加后的长度
+byte ModBus_RTU_checkCRC(const byte* frame, size_t len); // 检查帧(含尾部校验码)的CRC, 正确返回1
+size_t ModBus_RTU_requestSize(const byte* frame, size_t len); // 根据功能码计算请求帧长度(含校验码), 已接收的数据不足以判断或功能码未知返回0
+
+/** 绑定带上下文的发送数据函数 **/
+/*** 参数 ***
+** sendHandler: 发送数据函数, 传入参数(void* context, byte* data, size_t size), 设置后代替配置时的sendHandler, 传入NULL恢复
+** context: 上下文, 比如串口或连接对象, 同一发送函数可服务多个实例
+***/
+void ModBus_attachSendHandler(ModBus_parameter* ModBus_para, void(*sendHandler)(void*, byte*, size_t), void* context);
 
 /** 设置数据收发速率 **/
 /*** 参数 ***
@@ -167,6 +296,9 @@ void ModBus_setTimeout(ModBus_parameter* ModBus_para, u32 receiveTimeout, u32 se
 // 主机loop函数
 void ModBus_Master_loop(ModBus_parameter* ModBus_para);
 
+// 距离主机下一次需要运行loop的毫秒数(接收超时/返回帧超时/待发送指令), 0 立即运行, MODBUS_DEADLINE_NONE 空闲; 供调度器使用(见 modbus_scheduler.h)
+u32 ModBus_Master_nextDeadline(ModBus_parameter* ModBus_para);
+
 /** 读取寄存器 **/
 /*** 参数 ***
 ** address: 寄存器首地址
@@ -195,6 +327,52 @@ byte ModBus_setRegister(ModBus_parameter* ModBus_para, uint16_t address, uint16_
 ***/
 byte ModBus_setRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16_t* data, uint16_t count, void(*SetReponseHandler)(uint16_t, uint16_t));
 
+/** 发送通用指令 **/
+/*** 参数 ***
+** request: 指令描述, 函数返回后可释放
+** 返回指令序号(大于0), 参数无效则以 MODBUS_STATUS_INVALID 结束指令并返回0
+** 注: 与ModBus_getRegister等相同, 只能在主机loop所在线程调用; 其他线程使用ModBus_submit(见 modbus_queue.h)
+***/
+byte ModBus_request(ModBus_parameter* ModBus_para, const ModBus_Request_T* request);
+
+// 解除缓存中指令的回调函数和上下文(上下文即将释放时调用, 如协程被销毁), 指令照常发送, 结束时不再通知; 找到指令返回1
+byte ModBus_detachRequest(ModBus_parameter* ModBus_para, byte index);
+
+/** 配置指令优先级 **/
+/*** 参数 ***
+** priority: 优先级, ModBus_getRegister等接口的指令为 MODBUS_PRIORITY_NORMAL
+** limit: 该优先级最多缓存的未发送指令数, 超出时丢弃该优先级最早的未发送指令; 0 为不限制(只受 MODBUS_WAITFRAME_N 限制)
+** weight: 加权出队时该优先级每轮最多发送的指令数; 全部优先级为0时严格按优先级出队(默认)
+** 注: 指令缓存满时丢弃优先级最低的最早未发送指令, 新指令优先级低于缓存中全部指令时丢弃新指令
+***/
+void ModBus_setPriority(ModBus_parameter* ModBus_para, MODBUS_PRIORITY_TYPE priority, u8 limit, u8 weight);
+
+// 指令等待每超过agingMs毫秒提升一个优先级(最高到 MODBUS_PRIORITY_URGENT), 低优先级指令不会一直等待; 0 为不提升, 默认 MODBUS_PRIORITY_AGING
+void ModBus_setPriorityAging(ModBus_parameter* ModBus_para, u32 agingMs);
+
+/** 是否开启合并写入模式 **/
+/*** 参数 ***
+** on: 开启后新的写入指令代替缓存中同一设备, 同一首地址和个数的未发送写入指令(最新值有效), 位置不变, 其他指令都保留
+** 注: 两条写入之间有读取重叠寄存器的指令, 或部分重叠的写入时不合并, 保证读到的值与发送顺序一致
+** 被代替的指令以 MODBUS_STATUS_SUPERSEDED 结束, 原有回调函数传入参数(address, 0); 与快速模式(ModBus_fastMode)不同, 不丢弃其他寄存器的指令
+***/
+void ModBus_mergeWrites(ModBus_parameter* ModBus_para, byte on);
+
+/** 生成指令的请求PDU, 供UDP等自行管理指令的传输方式使用 **/
+/*** 参数 ***
+** pdu: PDU缓冲区, 至少 MODBUS_PDU_SIZE 字节
+** 返回PDU长度, 参数无效返回0
+***/
+size_t ModBus_Master_buildPDU(const ModBus_Request_T* request, byte* pdu);
+
+/** 解析指令的返回PDU **/
+/*** 参数 ***
+** pdu: 返回PDU, pduLen: 长度
+** result: 解析结果, 读取的寄存器值写入data(至少 MODBUS_REGISTER_LIMIT 个), result->data指向data
+** 返回 MODBUS_STATUS_OK 或 MODBUS_STATUS_EXCEPTION; 与指令不对应返回 MODBUS_STATUS_INVALID
+***/
+MODBUS_STATUS_TYPE ModBus_Master_parsePDU(const ModBus_Request_T* request, const byte* pdu, size_t pduLen, ModBus_Result_T* result, uint16_t* data);
+
 #endif
 
 
@@ -202,10 +380,34 @@ byte ModBus_setRegisters(ModBus_parameter* ModBus_para, uint16_t address, uint16
 // 从loop函数
 void ModBus_Slave_loop(ModBus_parameter* ModBus_para);
 
+// 距离从机下一次需要运行loop的毫秒数(接收超时), 0 立即运行, MODBUS_DEADLINE_NONE 空闲
+u32 ModBus_Slave_nextDeadline(ModBus_parameter* ModBus_para);
+
 // 从机设置读写寄存器函数
 void ModBus_attachRegisterHandler(ModBus_parameter* ModBus_para, size_t(*GetRegisterHandler)(uint16_t, uint16_t, uint16_t*), size_t(*SetRegisterHandler)(uint16_t, uint16_t, uint16_t*));
 
+/** 从机绑定寄存器映像 **/
+/*** 参数 ***
+** image: 寄存器映像(见 modbus_image.h), 传入NULL解除绑定
+** 注: 绑定后读寄存器从映像无锁读取, 保证多寄存器值一致; 主机写入的值先写入映像, 再调用设置寄存器函数(若已绑定)通知应用
+***/
+void ModBus_attachRegisterImage(ModBus_parameter* ModBus_para, struct __MODBUS_RegisterImage* image);
+
+/** 处理一个请求PDU并生成返回PDU, 供TCP等不经过串口字节流的传输方式使用 **/
+/*** 参数 ***
+** pdu: 请求PDU首地址(功能码+数据), 不含地址和校验码
+** pduLen: 请求PDU长度
+** response: 返回PDU缓冲区, 至少 MODBUS_PDU_SIZE 字节, 可以与pdu为同一缓冲区(原地生成)
+** 返回返回PDU长度, 请求异常时生成异常返回PDU(功能码|0x80, 异常码), 不应答返回0
+** 注: 不修改实例的接收/发送缓冲区, 可与串口从机共用同一实例
+***/
+size_t ModBus_Slave_handlePDU(ModBus_parameter* ModBus_para, const byte* pdu, size_t pduLen, byte* response);
+
 #endif
 /**************** 对外接口 END ***************/
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif
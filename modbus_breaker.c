@@ -0,0 +1,352 @@
+#include "modbus_breaker.h"
+
+// 设备状态, create为1时为新设备分配, 缓冲区满返回NULL
+static ModBus_Breaker_Unit_T* ModBus_Breaker_find(ModBus_Breaker_T* breaker, uint8_t unit, byte create)
+{
+	ModBus_Breaker_Unit_T* pUnit;
+	if (breaker->m_unitIndex[unit] != 0)
+	{
+		return breaker->m_units + (breaker->m_unitIndex[unit] - 1);
+	}
+	if (!create || breaker->m_unitN >= breaker->m_capacity)
+	{
+		return NULL;
+	}
+	pUnit = breaker->m_units + breaker->m_unitN;
+	memset(pUnit, 0, sizeof(*pUnit));
+	pUnit->unit = unit;
+	breaker->m_unitIndex[unit] = (u8)(++breaker->m_unitN);
+	return pUnit;
+}
+
+// 设备状态变化
+static void ModBus_Breaker_setState(ModBus_Breaker_T* breaker, ModBus_Breaker_Unit_T* pUnit, MODBUS_BREAKER_STATE_TYPE state)
+{
+	pUnit->state = (u8)state;
+	if (state != MODBUS_BREAKER_PROBING)
+	{
+		pUnit->probeIndex = 0;
+	}
+	if (breaker->m_handler != NULL)
+	{
+		(*breaker->m_handler)(breaker->m_context, pUnit);
+	}
+}
+
+// 断路, 退避时间为最短退避时间左移backoffShift位, 不超过上限
+static void ModBus_Breaker_open(ModBus_Breaker_T* breaker, ModBus_Breaker_Unit_T* pUnit, u32 now)
+{
+	u32 backoff = breaker->m_backoffMin;
+	for (u8 i = 0; i < pUnit->backoffShift && backoff < breaker->m_backoffMax; i++)
+	{
+		backoff = backoff <= 0x7FFFFFFFu ? backoff << 1 : 0xFFFFFFFFu;
+	}
+	pUnit->backoff = backoff < breaker->m_backoffMax ? backoff : breaker->m_backoffMax;
+	if (pUnit->backoff < breaker->m_backoffMax && pUnit->backoffShift < 31)
+	{
+		pUnit->backoffShift++; // 下一次探测失败时加倍
+	}
+	pUnit->openTime = now;
+	pUnit->trips++;
+	ModBus_Breaker_setState(breaker, pUnit, MODBUS_BREAKER_OPEN);
+}
+
+/** 配置断路 **/
+/*** 参数 ***
+** units: 设备状态缓冲区, 最多255个
+** threshold: 连续超时次数阈值
+** backoffMin: 第一次断路的退避毫秒数
+** backoffMax: 退避毫秒数上限
+***/
+void ModBus_Breaker_setup(ModBus_Breaker_T* breaker, ModBus_Breaker_Unit_T* units, size_t capacity, u32 threshold, u32 backoffMin, u32 backoffMax)
+{
+	memset(breaker, 0, sizeof(ModBus_Breaker_T));
+	breaker->m_units = units;
+	breaker->m_capacity = capacity < 255 ? capacity : 255;
+	breaker->m_threshold = threshold > 0 ? threshold : 1;
+	breaker->m_backoffMin = backoffMin;
+	breaker->m_backoffMax = backoffMax > backoffMin ? backoffMax : backoffMin;
+}
+
+// 绑定到主机实例
+void ModBus_attachBreaker(ModBus_parameter* ModBus_para, ModBus_Breaker_T* breaker)
+{
+#if defined(MODBUS_BREAKER) && defined(MODBUS_MASTER)
+	ModBus_para->m_master.m_breaker = breaker;
+#endif
+}
+
+// 设置设备状态变化时调用的函数
+void ModBus_Breaker_setHandler(ModBus_Breaker_T* breaker, void(*handler)(void*, const ModBus_Breaker_Unit_T*), void* context)
+{
+	breaker->m_handler = handler;
+	breaker->m_context = context;
+}
+
+// 设备状态
+const ModBus_Breaker_Unit_T* ModBus_Breaker_unit(const ModBus_Breaker_T* breaker, uint8_t unit)
+{
+	return breaker->m_unitIndex[unit] != 0 ? breaker->m_units + (breaker->m_unitIndex[unit] - 1) : NULL;
+}
+
+// 手动恢复设备
+void ModBus_Breaker_reset(ModBus_Breaker_T* breaker, uint8_t unit)
+{
+	ModBus_Breaker_Unit_T* pUnit = ModBus_Breaker_find(breaker, unit, 0);
+	if (pUnit == NULL)
+	{
+		return;
+	}
+	pUnit->consecutiveTimeouts = 0;
+	pUnit->backoffShift = 0;
+	if (pUnit->state != MODBUS_BREAKER_CLOSED)
+	{
+		ModBus_Breaker_setState(breaker, pUnit, MODBUS_BREAKER_CLOSED);
+	}
+}
+
+// 设备断路且退避时间未到, 或探测指令未结束
+byte ModBus_Breaker_isOpen(const ModBus_Breaker_T* breaker, uint8_t unit, u32 now)
+{
+	const ModBus_Breaker_Unit_T* pUnit = ModBus_Breaker_unit(breaker, unit);
+	if (pUnit == NULL || pUnit->state == MODBUS_BREAKER_CLOSED)
+	{
+		return 0;
+	}
+	return pUnit->state == MODBUS_BREAKER_PROBING || now - pUnit->openTime < pUnit->backoff;
+}
+
+// 发送指令前: 退避时间已到的设备以此指令探测
+void ModBus_Breaker_send(ModBus_Breaker_T* breaker, uint8_t unit, u8 index, u32 now)
+{
+	ModBus_Breaker_Unit_T* pUnit = ModBus_Breaker_find(breaker, unit, 0);
+	if (pUnit != NULL && pUnit->state == MODBUS_BREAKER_OPEN && now - pUnit->openTime >= pUnit->backoff)
+	{
+		pUnit->probeIndex = index;
+		ModBus_Breaker_setState(breaker, pUnit, MODBUS_BREAKER_PROBING);
+	}
+}
+
+// 一次发送超时: 连续超时达到阈值或探测失败时断路
+byte ModBus_Breaker_timeout(ModBus_Breaker_T* breaker, uint8_t unit, u8 index, u32 now)
+{
+	ModBus_Breaker_Unit_T* pUnit = ModBus_Breaker_find(breaker, unit, 1);
+	if (pUnit == NULL) // 缓冲区已满, 不断路
+	{
+		return 1;
+	}
+	pUnit->consecutiveTimeouts++;
+	if (pUnit->state == MODBUS_BREAKER_PROBING && pUnit->probeIndex == index)
+	{
+		ModBus_Breaker_open(breaker, pUnit, now);
+	}
+	else if (pUnit->state == MODBUS_BREAKER_CLOSED && pUnit->consecutiveTimeouts >= breaker->m_threshold)
+	{
+		pUnit->backoffShift = 0;
+		ModBus_Breaker_open(breaker, pUnit, now);
+	}
+	return pUnit->state == MODBUS_BREAKER_CLOSED;
+}
+
+// 指令结束: 有应答则恢复; 探测指令未发送就结束(被丢弃等)时, 下一条指令继续探测
+void ModBus_Breaker_finish(ModBus_Breaker_T* breaker, uint8_t unit, u8 index, MODBUS_STATUS_TYPE status)
+{
+	ModBus_Breaker_Unit_T* pUnit = ModBus_Breaker_find(breaker, unit, 0);
+	if (pUnit == NULL)
+	{
+		return;
+	}
+	switch (status)
+	{
+	case MODBUS_STATUS_OK:
+	case MODBUS_STATUS_EXCEPTION:
+		pUnit->consecutiveTimeouts = 0;
+		pUnit->backoffShift = 0;
+		if (pUnit->state != MODBUS_BREAKER_CLOSED)
+		{
+			ModBus_Breaker_setState(breaker, pUnit, MODBUS_BREAKER_CLOSED);
+		}
+		break;
+	case MODBUS_STATUS_UNAVAILABLE:
+		pUnit->rejected++;
+		break;
+	case MODBUS_STATUS_TIMEOUT:
+		break;
+	default:
+		if (pUnit->state == MODBUS_BREAKER_PROBING && pUnit->probeIndex == index)
+		{
+			pUnit->state = MODBUS_BREAKER_OPEN; // 退避时间已到, 不调用状态变化函数
+			pUnit->probeIndex = 0;
+		}
+		break;
+	}
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_BREAKER) && defined(MODBUS_MASTER)
+#include <stdio.h>
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint8_t g_breakerSent[32]; // 发送的指令的设备地址
+static size_t g_breakerSentN;
+static MODBUS_STATUS_TYPE g_breakerStatus[8]; // 按设备地址记录的结束状态
+static u8 g_breakerStates[16]; // 设备状态变化
+static size_t g_breakerStateN;
+
+static void breakerCapture(byte* data, size_t len)
+{
+	(void)len;
+	if (g_breakerSentN < sizeof(g_breakerSent))
+		g_breakerSent[g_breakerSentN++] = data[0];
+}
+
+static void breakerResult(void* context, const ModBus_Result_T* result)
+{
+	g_breakerStatus[*(uint8_t*)context] = result->status;
+}
+
+static void breakerState(void* context, const ModBus_Breaker_Unit_T* unit)
+{
+	(void)context;
+	if (g_breakerStateN < sizeof(g_breakerStates))
+		g_breakerStates[g_breakerStateN++] = unit->state;
+}
+
+static void breakerRead(ModBus_parameter* master, uint8_t unit, u8 retries)
+{
+	static uint8_t units[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	ModBus_Request_T request = { 0 };
+	request.unit = unit;
+	request.type = READ_REGISTER;
+	request.count = 1;
+	request.retries = retries;
+	request.resultHandler = breakerResult;
+	request.context = units + unit;
+	g_breakerStatus[unit] = MODBUS_STATUS_INVALID;
+	ModBus_request(master, &request);
+}
+
+// 运行主机直到缓存为空; respond不为0时对该设备的指令返回寄存器值
+static void breakerDrain(ModBus_parameter* master, uint8_t respond)
+{
+	g_breakerSentN = 0;
+	for (int i = 0; i < 100 && master->m_master.m_sendFramesN > 0; i++)
+	{
+		size_t sent = g_breakerSentN;
+		ModBus_Master_loop(master);
+		if (g_breakerSentN > sent && g_breakerSent[sent] == respond && respond != 0)
+		{
+			byte frame[8] = { respond, READ_REGISTER, 2, 0x12, 0x34 };
+			ModBus_readBytesFromOuter(master, frame, ModBus_RTU_appendCRC(frame, 5));
+			ModBus_Master_loop(master);
+			t += 1;
+			continue;
+		}
+		t += master->m_sendTimeout;
+	}
+	ModBus_Master_loop(master);
+}
+
+// 超时重发; 连续超时断路后指令立即结束, 退避时间后探测, 探测失败退避时间加倍, 有应答恢复
+void breaker_unit_test()
+{
+	ModBus_parameter master;
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Breaker_T breaker;
+	ModBus_Breaker_Unit_T units[2];
+	const ModBus_Breaker_Unit_T* unit5;
+	u32 deadUs, breakerUs;
+	int start;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = 5;
+	modbusSetting.sendHandler = breakerCapture;
+	ModBus_setup(&master, modbusSetting);
+
+	// 未绑定断路: 超时后按指令的次数重发, 只结束一次
+	breakerRead(&master, 5, 2);
+	breakerDrain(&master, 0);
+	assert(g_breakerSentN == 3 && g_breakerStatus[5] == MODBUS_STATUS_TIMEOUT);
+
+	// 连续两次超时断路, 不再重发
+	ModBus_Breaker_setup(&breaker, units, 1, 2, 1000, 4000);
+	ModBus_Breaker_setHandler(&breaker, breakerState, NULL);
+	ModBus_attachBreaker(&master, &breaker);
+	breakerRead(&master, 5, 3);
+	breakerDrain(&master, 0);
+	unit5 = ModBus_Breaker_unit(&breaker, 5);
+	assert(g_breakerSentN == 2 && g_breakerStatus[5] == MODBUS_STATUS_TIMEOUT);
+	assert(unit5 != NULL && unit5->state == MODBUS_BREAKER_OPEN && unit5->backoff == 1000 && unit5->trips == 1);
+
+	// 断路中: 设备5的指令立即结束, 不占用总线; 缓冲区满后设备6不断路
+	breakerRead(&master, 5, 0);
+	breakerRead(&master, 6, 0);
+	breakerRead(&master, 5, 0);
+	breakerDrain(&master, 6);
+	assert(g_breakerSentN == 1 && g_breakerSent[0] == 6 && g_breakerStatus[6] == MODBUS_STATUS_OK);
+	assert(g_breakerStatus[5] == MODBUS_STATUS_UNAVAILABLE && unit5->rejected == 2 && ModBus_Breaker_unit(&breaker, 6) == NULL);
+
+	// 参数无效的指令按目标设备结束, 不改变设备状态
+	{
+		ModBus_Request_T request = { 0 };
+		request.unit = 5;
+		request.type = READ_REGISTER;
+		assert(ModBus_request(&master, &request) == 0);
+		assert(unit5->state == MODBUS_BREAKER_OPEN && unit5->rejected == 2 && ModBus_Breaker_unit(&breaker, 6) == NULL);
+	}
+
+	// 退避时间后第一条指令探测, 其余仍立即结束; 探测超时后退避时间加倍, 上限4000
+	for (u32 k = 0; k < 4; k++)
+	{
+		t += (int)unit5->backoff;
+		breakerRead(&master, 5, 3);
+		breakerRead(&master, 5, 0);
+		breakerDrain(&master, 0);
+		assert(g_breakerSentN == 1 && unit5->state == MODBUS_BREAKER_OPEN && unit5->trips == 2 + k);
+		assert(unit5->backoff == (k < 2 ? 2000u << k : 4000u));
+	}
+
+	// 探测有应答: 恢复, 退避时间重新开始
+	t += (int)unit5->backoff;
+	breakerRead(&master, 5, 0);
+	breakerDrain(&master, 5);
+	assert(g_breakerStatus[5] == MODBUS_STATUS_OK && unit5->state == MODBUS_BREAKER_CLOSED && unit5->consecutiveTimeouts == 0);
+	assert(g_breakerStateN == 11 && g_breakerStates[0] == MODBUS_BREAKER_OPEN && g_breakerStates[1] == MODBUS_BREAKER_PROBING && g_breakerStates[10] == MODBUS_BREAKER_CLOSED);
+
+	// 手动恢复
+	breakerRead(&master, 5, 1);
+	breakerDrain(&master, 0);
+	assert(unit5->state == MODBUS_BREAKER_OPEN && unit5->backoff == 1000);
+	ModBus_Breaker_reset(&breaker, 5);
+	breakerRead(&master, 5, 0);
+	breakerDrain(&master, 5);
+	assert(g_breakerSentN == 1 && g_breakerStatus[5] == MODBUS_STATUS_OK);
+
+	// 离线设备对其他设备的影响: 交替读取离线设备5和在线设备6各20轮的总线时间
+	ModBus_attachBreaker(&master, NULL);
+	start = t;
+	for (int k = 0; k < 20; k++)
+	{
+		breakerRead(&master, 5, 0);
+		breakerRead(&master, 6, 0);
+		breakerDrain(&master, 6);
+	}
+	deadUs = (u32)(t - start);
+	ModBus_Breaker_setup(&breaker, units, 2, 2, 1000, 4000);
+	ModBus_attachBreaker(&master, &breaker);
+	start = t;
+	for (int k = 0; k < 20; k++)
+	{
+		breakerRead(&master, 5, 0);
+		breakerRead(&master, 6, 0);
+		breakerDrain(&master, 6);
+	}
+	breakerUs = (u32)(t - start);
+	assert(breakerUs * 4 < deadUs);
+	ModBus_attachBreaker(&master, NULL);
+	printf("breaker_unit_test: 20 polls of a dead and a live unit take %u ms, %u ms with the breaker (%u trips)\n",
+		deadUs, breakerUs, ModBus_Breaker_unit(&breaker, 5)->trips);
+}
+#endif // _UNIT_TEST
@@ -0,0 +1,79 @@
+#ifndef MOTECMODBUS_BREAKER_H_
+#define MOTECMODBUS_BREAKER_H_
+/**** ModBus 主机按设备断路 ****
+** 离线设备的每条指令都要等待整个返回帧超时(m_sendTimeout), 周期读取又立即重新发送, 同一总线上的其他设备都被拖慢
+** 每个设备记录连续超时次数, 达到阈值后断路: 此设备的指令在发送前立即以 MODBUS_STATUS_UNAVAILABLE 结束, 不占用总线
+** 断路经过退避时间后, 此设备的下一条指令作为探测指令发送: 有应答(包括异常返回)则恢复, 仍然超时则退避时间加倍(不超过上限)再次断路
+** 指令的超时重发次数由 ModBus_Request_T.retries 指定, 设备断路后不再重发
+** 使用方法:
+****** 在 modbus.h 中开启 MODBUS_BREAKER(默认开启); 实例未绑定时只多一次判断
+****** 调用ModBus_Breaker_setup配置, 传入设备状态缓冲区, 连续超时阈值和退避时间
+****** 调用ModBus_attachBreaker将主机实例绑定
+****** 调用ModBus_Breaker_unit查询设备状态, 或ModBus_Breaker_setHandler设置状态变化时调用的函数
+** 注: 设备状态缓冲区满后新出现的设备不断路; 在主机loop线程中更新和查询
+*/
+
+#include "modbus.h"
+
+typedef enum {
+	MODBUS_BREAKER_CLOSED, // 正常发送
+	MODBUS_BREAKER_OPEN, // 断路: 指令立即结束, 退避时间后发送探测指令
+	MODBUS_BREAKER_PROBING, // 探测指令已发送, 等待结果
+} MODBUS_BREAKER_STATE_TYPE;
+
+typedef struct _MODBUS_BREAKER_UNIT_T { // 设备状态
+	uint8_t unit; // 设备地址
+	u8 state; // MODBUS_BREAKER_STATE_TYPE
+	u8 probeIndex; // 探测指令序号
+	u8 backoffShift; // 退避时间为最短退避时间左移此位数
+	u32 consecutiveTimeouts; // 连续超时次数(每次发送计一次)
+	u32 openTime; // 最近一次断路的时刻
+	u32 backoff; // 本次断路的退避毫秒数
+	u32 trips; // 断路次数
+	u32 rejected; // 断路期间立即结束的指令数
+} ModBus_Breaker_Unit_T;
+
+typedef struct __MODBUS_Breaker {
+	ModBus_Breaker_Unit_T* m_units; // 设备状态缓冲区, 由调用者提供
+	size_t m_capacity; // 设备状态缓冲区个数
+	size_t m_unitN; // 已记录的设备数
+	u8 m_unitIndex[256]; // 设备地址到状态序号+1的映射, 0表示未记录
+	u32 m_threshold; // 连续超时次数达到此值时断路
+	u32 m_backoffMin; // 第一次断路的退避毫秒数
+	u32 m_backoffMax; // 退避毫秒数上限
+	void(*m_handler)(void*, const ModBus_Breaker_Unit_T*); // 设备状态变化时调用, 可以为NULL
+	void* m_context; // 传给m_handler的上下文
+} ModBus_Breaker_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置断路 **/
+/*** 参数 ***
+** units: 设备状态缓冲区, capacity: 个数
+** threshold: 连续超时次数达到此值时断路, 0按1处理
+** backoffMin: 第一次断路的退避毫秒数, 探测失败后加倍
+** backoffMax: 退避毫秒数上限
+***/
+void ModBus_Breaker_setup(ModBus_Breaker_T* breaker, ModBus_Breaker_Unit_T* units, size_t capacity, u32 threshold, u32 backoffMin, u32 backoffMax);
+
+// 绑定到主机实例, 传入NULL解除
+void ModBus_attachBreaker(ModBus_parameter* ModBus_para, ModBus_Breaker_T* breaker);
+
+// 设置设备状态变化(断路, 探测, 恢复)时调用的函数
+void ModBus_Breaker_setHandler(ModBus_Breaker_T* breaker, void(*handler)(void*, const ModBus_Breaker_Unit_T*), void* context);
+
+// 设备状态, 没有记录的设备返回NULL(视为正常)
+const ModBus_Breaker_Unit_T* ModBus_Breaker_unit(const ModBus_Breaker_T* breaker, uint8_t unit);
+
+// 手动恢复设备(比如维护后重新上线), 下一条指令立即发送
+void ModBus_Breaker_reset(ModBus_Breaker_T* breaker, uint8_t unit);
+
+// 以下由协议内部调用, 在loop线程中
+byte ModBus_Breaker_isOpen(const ModBus_Breaker_T* breaker, uint8_t unit, u32 now); // 设备断路且退避时间未到, 或探测指令未结束, 返回1
+void ModBus_Breaker_send(ModBus_Breaker_T* breaker, uint8_t unit, u8 index, u32 now); // 发送指令前: 退避时间已到的设备以此指令探测
+byte ModBus_Breaker_timeout(ModBus_Breaker_T* breaker, uint8_t unit, u8 index, u32 now); // 一次发送超时, 设备未断路(可以重发)返回1
+void ModBus_Breaker_finish(ModBus_Breaker_T* breaker, uint8_t unit, u8 index, MODBUS_STATUS_TYPE status); // 指令结束, 超时已由ModBus_Breaker_timeout计入
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,662 @@
+#include "modbus_capture.h"
+
+static const byte g_captureMagic[4] = { 'M', 'B', 'C', 'P' };
+
+// 小端写入32位数
+static void ModBus_Capture_put32(byte* p, u32 value)
+{
+	p[0] = (byte)value;
+	p[1] = (byte)(value >> 8);
+	p[2] = (byte)(value >> 16);
+	p[3] = (byte)(value >> 24);
+}
+
+// 小端读取32位数
+static u32 ModBus_Capture_get32(const byte* p)
+{
+	return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+// 缓冲区剩余空间不足len字节时先输出已有的记录, 仍不足返回0
+static byte ModBus_Capture_reserve(ModBus_Capture_T* capture, size_t len)
+{
+	if (capture->m_len + len > capture->m_size)
+	{
+		ModBus_Capture_flush(capture);
+	}
+	return capture->m_len + len <= capture->m_size;
+}
+
+/** 配置捕获 **/
+/*** 参数 ***
+** buffer: 记录缓冲区
+** size: 缓冲区字节数
+** flushHandler: 输出函数, 可以为NULL
+** context: 传给输出函数的上下文
+***/
+byte ModBus_Capture_setup(ModBus_Capture_T* capture, byte* buffer, size_t size, void(*flushHandler)(void*, const byte*, size_t), void* context)
+{
+	if (buffer == NULL || size < MODBUS_CAPTURE_HEADER_SIZE + MODBUS_CAPTURE_RECORD_HEADER_SIZE + MODBUS_CAPTURE_RECORD_DATA_MAX)
+	{
+		return 0;
+	}
+	capture->m_buffer = buffer;
+	capture->m_size = size;
+	capture->m_len = 0;
+	capture->m_flushHandler = flushHandler;
+	capture->m_flushContext = context;
+	capture->m_rxPosition = 0;
+	capture->m_recordN = 0;
+	capture->m_dropN = 0;
+	capture->m_flushedBytes = 0;
+	return 1;
+}
+
+// 实例绑定捕获, 第一次绑定时写入文件头
+void ModBus_attachCapture(ModBus_parameter* ModBus_para, ModBus_Capture_T* capture)
+{
+#ifdef MODBUS_CAPTURE
+	ModBus_para->m_capture = capture;
+	if (capture == NULL)
+	{
+		return;
+	}
+	capture->m_rxPosition = (size_t)(ModBus_para->m_pEndReceiveBufferTmp - ModBus_para->m_receiveBufferTmp);
+	if (capture->m_len == 0 && capture->m_flushedBytes == 0)
+	{
+		byte* p = capture->m_buffer;
+		memcpy(p, g_captureMagic, sizeof(g_captureMagic));
+		p[4] = MODBUS_CAPTURE_VERSION;
+		p[5] = (byte)ModBus_para->m_modeType;
+		p[6] = ModBus_para->m_address;
+		p[7] = 0;
+		ModBus_Capture_put32(p + 8, MODBUS_CAPTURE_CLOCK_HZ);
+		capture->m_len = MODBUS_CAPTURE_HEADER_SIZE;
+	}
+#endif
+}
+
+// 输出缓冲区中的记录
+size_t ModBus_Capture_flush(ModBus_Capture_T* capture)
+{
+	size_t len = capture->m_len;
+	if (capture->m_flushHandler == NULL || len == 0)
+	{
+		return 0;
+	}
+	(*capture->m_flushHandler)(capture->m_flushContext, capture->m_buffer, len);
+	capture->m_flushedBytes += len;
+	capture->m_len = 0;
+	return len;
+}
+
+// 写入记录, 超过 MODBUS_CAPTURE_RECORD_DATA_MAX 字节时分为多条相同时刻的记录
+void ModBus_Capture_record(ModBus_Capture_T* capture, MODBUS_CAPTURE_RECORD_TYPE type, const byte* data, size_t len)
+{
+	u32 time = MODBUS_CAPTURE_CLOCK();
+	do
+	{
+		size_t n = len < MODBUS_CAPTURE_RECORD_DATA_MAX ? len : MODBUS_CAPTURE_RECORD_DATA_MAX;
+		byte* p;
+		if (!ModBus_Capture_reserve(capture, MODBUS_CAPTURE_RECORD_HEADER_SIZE + n))
+		{
+			capture->m_dropN++;
+			return;
+		}
+		p = capture->m_buffer + capture->m_len;
+		p[0] = (byte)type;
+		p[1] = (byte)n;
+		ModBus_Capture_put32(p + 2, time);
+		memcpy(p + MODBUS_CAPTURE_RECORD_HEADER_SIZE, data, n);
+		capture->m_len += MODBUS_CAPTURE_RECORD_HEADER_SIZE + n;
+		capture->m_recordN++;
+		data += n;
+		len -= n;
+	} while (len > 0);
+}
+
+// 记录循环存取区中上次记录位置到结束位置之间的字节
+void ModBus_Capture_received(ModBus_Capture_T* capture, const ModBus_parameter* modbus)
+{
+	const volatile byte* ring = modbus->m_receiveBufferTmp;
+	size_t end = (size_t)(modbus->m_pEndReceiveBufferTmp - ring);
+	size_t position = capture->m_rxPosition;
+	byte bytes[MODBUS_BUFFER_SIZE];
+	size_t n = 0;
+	while (position != end && n < sizeof(bytes))
+	{
+		bytes[n++] = ring[position];
+		position = position + 1 >= MODBUS_BUFFER_SIZE ? 0 : position + 1;
+	}
+	capture->m_rxPosition = position;
+	if (n > 0)
+	{
+		ModBus_Capture_record(capture, MODBUS_CAPTURE_RX, bytes, n);
+	}
+}
+
+// 开始读取捕获数据
+byte ModBus_Capture_open(ModBus_Capture_Reader_T* reader, const byte* data, size_t len, ModBus_Capture_Header_T* header)
+{
+	reader->m_data = data;
+	reader->m_len = len;
+	reader->m_position = len;
+	if (data == NULL || len < MODBUS_CAPTURE_HEADER_SIZE || memcmp(data, g_captureMagic, sizeof(g_captureMagic)) != 0 || data[4] != MODBUS_CAPTURE_VERSION)
+	{
+		return 0;
+	}
+	if (header != NULL)
+	{
+		header->version = data[4];
+		header->mode = (MODBUS_MODE_TYPE)data[5];
+		header->address = data[6];
+		header->clockHz = ModBus_Capture_get32(data + 8);
+	}
+	reader->m_position = MODBUS_CAPTURE_HEADER_SIZE;
+	return 1;
+}
+
+// 读取下一条记录
+byte ModBus_Capture_next(ModBus_Capture_Reader_T* reader, ModBus_Capture_Record_T* record)
+{
+	const byte* p = reader->m_data + reader->m_position;
+	if (reader->m_position + MODBUS_CAPTURE_RECORD_HEADER_SIZE > reader->m_len
+		|| reader->m_position + MODBUS_CAPTURE_RECORD_HEADER_SIZE + p[1] > reader->m_len)
+	{
+		return 0;
+	}
+	record->type = (MODBUS_CAPTURE_RECORD_TYPE)p[0];
+	record->len = p[1];
+	record->time = ModBus_Capture_get32(p + 2);
+	record->data = p + MODBUS_CAPTURE_RECORD_HEADER_SIZE;
+	reader->m_position += MODBUS_CAPTURE_RECORD_HEADER_SIZE + record->len;
+	return 1;
+}
+
+typedef struct _MODBUS_REPLAY_T { // 重放状态
+	ModBus_Replay_Result_T* m_result;
+	const byte* m_pending[MODBUS_REPLAY_PENDING_N]; // 等待比较的发送帧(指向捕获数据)
+	u8 m_pendingLen[MODBUS_REPLAY_PENDING_N];
+	size_t m_pendingHead; // 最早的等待比较的发送帧
+	size_t m_pendingN;
+} ModBus_Replay_T;
+
+static u32 g_replayNow; // 重放的虚拟时间(毫秒)
+
+// 时间源: 重放的虚拟时间
+static u32 ModBus_Replay_clock(void)
+{
+	return g_replayNow;
+}
+
+// 实例的发送函数: 与记录中最早的未比较的发送帧比较
+static void ModBus_Replay_send(void* context, byte* data, size_t len)
+{
+	ModBus_Replay_T* replay = (ModBus_Replay_T*)context;
+	size_t head = replay->m_pendingHead;
+	if (replay->m_pendingN == 0)
+	{
+		replay->m_result->txMismatched++;
+		return;
+	}
+	if (len == replay->m_pendingLen[head] && memcmp(data, replay->m_pending[head], len) == 0)
+	{
+		replay->m_result->txMatched++;
+	}
+	else
+	{
+		replay->m_result->txMismatched++;
+	}
+	replay->m_pendingHead = (head + 1) % MODBUS_REPLAY_PENDING_N;
+	replay->m_pendingN--;
+}
+
+// 记录中的发送帧加入等待比较; 已满时最早的帧计为未发送
+static void ModBus_Replay_expect(ModBus_Replay_T* replay, const ModBus_Capture_Record_T* record)
+{
+	size_t tail;
+	if (replay->m_pendingN == MODBUS_REPLAY_PENDING_N)
+	{
+		replay->m_result->txMissing++;
+		replay->m_pendingHead = (replay->m_pendingHead + 1) % MODBUS_REPLAY_PENDING_N;
+		replay->m_pendingN--;
+	}
+	tail = (replay->m_pendingHead + replay->m_pendingN) % MODBUS_REPLAY_PENDING_N;
+	replay->m_pending[tail] = record->data;
+	replay->m_pendingLen[tail] = record->len;
+	replay->m_pendingN++;
+}
+
+// 运行实例的loop
+static void ModBus_Replay_loop(ModBus_parameter* modbus, MODBUS_REPLAY_ROLE_TYPE role)
+{
+#ifdef MODBUS_MASTER
+	if (role == MODBUS_REPLAY_MASTER)
+	{
+		ModBus_Master_loop(modbus);
+	}
+#endif
+#ifdef MODBUS_SLAVE
+	if (role == MODBUS_REPLAY_SLAVE)
+	{
+		ModBus_Slave_loop(modbus);
+	}
+#endif
+}
+
+#ifdef MODBUS_MASTER
+// 主机重放的指令结束: 按结果计数
+static void ModBus_Replay_result(void* context, const ModBus_Result_T* result)
+{
+	ModBus_Replay_Result_T* replayResult = ((ModBus_Replay_T*)context)->m_result;
+	switch (result->status)
+	{
+	case MODBUS_STATUS_OK:
+		replayResult->ok++;
+		break;
+	case MODBUS_STATUS_TIMEOUT:
+		replayResult->timeouts++;
+		break;
+	case MODBUS_STATUS_EXCEPTION:
+		replayResult->exceptions++;
+		break;
+	default:
+		break;
+	}
+}
+
+// 十六进制字符的值, 不是十六进制字符返回-1
+static int ModBus_Replay_hex(byte c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+// 记录中主机发送的帧转换为指令, 帧无法识别返回0
+static byte ModBus_Replay_decodeRequest(MODBUS_MODE_TYPE mode, const byte* frame, size_t len, ModBus_Request_T* request)
+{
+	byte bin[MODBUS_BUFFER_SIZE];
+	size_t n = 0;
+	if (mode == ASCII) // ':' 十六进制字符 LRC "\r\n"
+	{
+		if (len < 3 || frame[0] != ':')
+		{
+			return 0;
+		}
+		for (size_t i = 1; i + 1 < len && frame[i] != '\r' && n < sizeof(bin); i += 2)
+		{
+			int hi = ModBus_Replay_hex(frame[i]), lo = ModBus_Replay_hex(frame[i + 1]);
+			if (hi < 0 || lo < 0)
+			{
+				return 0;
+			}
+			bin[n++] = (byte)((hi << 4) | lo);
+		}
+	}
+	else
+	{
+		if (len > sizeof(bin))
+		{
+			return 0;
+		}
+		memcpy(bin, frame, len);
+		n = len;
+	}
+	if (n < 6)
+	{
+		return 0;
+	}
+	memset(request, 0, sizeof(*request));
+	request->unit = bin[0];
+	request->type = (MODBUS_FUNCTION_TYPE)bin[1];
+	request->address = (uint16_t)((bin[2] << 8) | bin[3]);
+	switch (bin[1])
+	{
+	case READ_REGISTER:
+		request->count = (uint16_t)((bin[4] << 8) | bin[5]);
+		break;
+	case WRITE_SINGLE_REGISTER:
+		request->count = 1;
+		request->data[0] = (uint16_t)((bin[4] << 8) | bin[5]);
+		break;
+	case WRITE_MULTI_REGISTER:
+		request->count = (uint16_t)((bin[4] << 8) | bin[5]);
+		if (request->count > MODBUS_REGISTER_LIMIT || n < 7u + request->count * 2u)
+		{
+			return 0;
+		}
+		for (uint16_t i = 0; i < request->count; i++)
+		{
+			request->data[i] = (uint16_t)((bin[7 + i * 2] << 8) | bin[8 + i * 2]);
+		}
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+/** 重放捕获 **/
+/*** 参数 ***
+** data: 捕获数据, len: 字节数
+** modbus: 新配置的实例
+** role: 主机/从机
+** result: 重放结果
+***/
+byte ModBus_Replay_run(const byte* data, size_t len, ModBus_parameter* modbus, MODBUS_REPLAY_ROLE_TYPE role, ModBus_Replay_Result_T* result)
+{
+	ModBus_Capture_Reader_T reader;
+	ModBus_Capture_Header_T header;
+	ModBus_Capture_Record_T record;
+	ModBus_Replay_T replay;
+	void(*sendHandler)(byte*, size_t) = modbus->m_SendHandler;
+	void(*sendHandlerEx)(void*, byte*, size_t) = modbus->m_SendHandlerEx;
+	void* sendContext = modbus->m_sendContext;
+	u32 startTime = 0, tail;
+	byte first = 1;
+
+	memset(result, 0, sizeof(*result));
+	if (!ModBus_Capture_open(&reader, data, len, &header) || header.mode != modbus->m_modeType || header.clockHz == 0)
+	{
+		return 0;
+	}
+	memset(&replay, 0, sizeof(replay));
+	replay.m_result = result;
+	ModBus_attachSendHandler(modbus, ModBus_Replay_send, &replay);
+	g_replayNow = 0;
+	ModBus_setClock(ModBus_Replay_clock);
+	modbus->m_lastReceivedTime = modbus->m_lastSentTime = 0;
+
+	while (ModBus_Capture_next(&reader, &record))
+	{
+		u32 ms;
+		if (first)
+		{
+			startTime = record.time;
+			first = 0;
+		}
+		ms = (u32)((unsigned long long)(u32)(record.time - startTime) * 1000u / header.clockHz);
+		while (g_replayNow < ms) // 运行记录时刻之前的loop
+		{
+			ModBus_Replay_loop(modbus, role);
+			g_replayNow++;
+		}
+		result->records++;
+		switch (record.type)
+		{
+		case MODBUS_CAPTURE_RX:
+			ModBus_readBytesFromOuter(modbus, record.data, record.len);
+			result->rxBytes += record.len;
+			break;
+		case MODBUS_CAPTURE_TX:
+			result->txExpected++;
+			ModBus_Replay_expect(&replay, &record);
+#ifdef MODBUS_MASTER
+			if (role == MODBUS_REPLAY_MASTER)
+			{
+				ModBus_Request_T request;
+				if (ModBus_Replay_decodeRequest(header.mode, record.data, record.len, &request))
+				{
+					request.resultHandler = ModBus_Replay_result;
+					request.context = &replay;
+					ModBus_request(modbus, &request);
+				}
+			}
+#endif
+			break;
+		case MODBUS_CAPTURE_FRAME:
+			result->framesCaptured++;
+			break;
+		case MODBUS_CAPTURE_CHECK_FAIL:
+			result->checkFailsCaptured++;
+			break;
+		default:
+			break;
+		}
+	}
+	tail = g_replayNow + modbus->m_sendTimeout + modbus->m_receiveTimeout + 1; // 最后的指令超时或处理完接收的数据
+	while (g_replayNow <= tail)
+	{
+		ModBus_Replay_loop(modbus, role);
+		g_replayNow++;
+	}
+	result->txMissing += (u32)replay.m_pendingN;
+	result->durationMs = g_replayNow;
+
+	modbus->m_SendHandler = sendHandler;
+	modbus->m_SendHandlerEx = sendHandlerEx;
+	modbus->m_sendContext = sendContext;
+	ModBus_setClock(NULL);
+	return 1;
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE) && defined(MODBUS_CAPTURE)
+#include "modbus_sim.h"
+#include <stdio.h>
+
+#define MODBUS_CAPTURE_TEST_REQUEST_N 60 // 指令数
+#define MODBUS_CAPTURE_TEST_FILE_SIZE 32768 // 模拟文件的大小
+
+typedef struct {
+	byte data[MODBUS_CAPTURE_TEST_FILE_SIZE];
+	size_t len;
+	u32 flushN;
+} CaptureTestFile_T;
+
+static CaptureTestFile_T g_captureMasterFile, g_captureSlaveFile, g_captureReplayFile;
+static uint16_t g_captureRegisters[8] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 };
+static byte g_captureDone;
+static MODBUS_STATUS_TYPE g_captureStatus;
+
+static void captureFlush(void* context, const byte* data, size_t len)
+{
+	CaptureTestFile_T* file = (CaptureTestFile_T*)context;
+	assert(file->len + len <= sizeof(file->data));
+	memcpy(file->data + file->len, data, len);
+	file->len += len;
+	file->flushN++;
+}
+
+static size_t captureGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 8)
+		return 0;
+	memcpy(data, g_captureRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static size_t captureSetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 8)
+		return 0;
+	memcpy(g_captureRegisters + address, data, n * sizeof(uint16_t));
+	return n;
+}
+
+// 从机2不修改寄存器, 从机1的重放只依赖它自己收到的写指令
+static size_t captureIgnoreReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	(void)address;
+	(void)data;
+	return n;
+}
+
+static void captureResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	g_captureDone = 1;
+	g_captureStatus = result->status;
+}
+
+// 统计捕获中各类记录的个数, 返回记录数
+static u32 captureCount(const CaptureTestFile_T* file, u32* counts)
+{
+	ModBus_Capture_Reader_T reader;
+	ModBus_Capture_Header_T header;
+	ModBus_Capture_Record_T record;
+	u32 n = 0, lastTime = 0;
+	assert(ModBus_Capture_open(&reader, file->data, file->len, &header));
+	assert(header.clockHz == MODBUS_CAPTURE_CLOCK_HZ && header.mode == RTU);
+	memset(counts, 0, sizeof(u32) * 5);
+	while (ModBus_Capture_next(&reader, &record))
+	{
+		assert(record.type >= MODBUS_CAPTURE_RX && record.type <= MODBUS_CAPTURE_CHECK_FAIL);
+		assert(record.time >= lastTime); // 按时间顺序
+		lastTime = record.time;
+		counts[record.type]++;
+		n++;
+	}
+	assert(reader.m_position == file->len);
+	return n;
+}
+
+// 比较两个捕获中接收到的完整帧(设备地址, 功能码, 长度)
+static byte captureSameFrames(const CaptureTestFile_T* a, const CaptureTestFile_T* b)
+{
+	ModBus_Capture_Reader_T readerA, readerB;
+	ModBus_Capture_Record_T recordA, recordB;
+	byte hasA, hasB;
+	ModBus_Capture_open(&readerA, a->data, a->len, NULL);
+	ModBus_Capture_open(&readerB, b->data, b->len, NULL);
+	for (;;)
+	{
+		while ((hasA = ModBus_Capture_next(&readerA, &recordA)) && recordA.type != MODBUS_CAPTURE_FRAME);
+		while ((hasB = ModBus_Capture_next(&readerB, &recordB)) && recordB.type != MODBUS_CAPTURE_FRAME);
+		if (!hasA || !hasB)
+			return hasA == hasB;
+		if (recordA.len != recordB.len || memcmp(recordA.data, recordB.data, recordA.len) != 0)
+			return 0;
+	}
+}
+
+// 虚拟总线上有误码和丢字节时捕获主机和从机1, 重放到新实例, 发送的帧与记录完全相同
+void capture_unit_test()
+{
+	static ModBus_Sim_T bus;
+	static ModBus_Sim_Node_T nodes[3];
+	static ModBus_parameter master, slaves[2], replayMaster, replaySlave;
+	static ModBus_Capture_T masterCapture, slaveCapture, replayCapture, smallCapture;
+	static byte masterBuffer[512], slaveBuffer[512], replayBuffer[512], smallBuffer[MODBUS_CAPTURE_HEADER_SIZE + MODBUS_CAPTURE_RECORD_HEADER_SIZE + MODBUS_CAPTURE_RECORD_DATA_MAX];
+	ModBus_Sim_Setting_T setting = { 0 };
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+	ModBus_Replay_Result_T masterReplay, slaveReplay;
+	u32 ok = 0, fail = 0, masterCounts[5], slaveCounts[5];
+	uint16_t initialRegisters[8];
+
+	assert(!ModBus_Capture_setup(&smallCapture, smallBuffer, sizeof(smallBuffer) - 1, NULL, NULL));
+	assert(ModBus_Capture_setup(&masterCapture, masterBuffer, sizeof(masterBuffer), captureFlush, &g_captureMasterFile));
+	assert(ModBus_Capture_setup(&slaveCapture, slaveBuffer, sizeof(slaveBuffer), captureFlush, &g_captureSlaveFile));
+	assert(ModBus_Capture_setup(&smallCapture, smallBuffer, sizeof(smallBuffer), NULL, NULL));
+
+	setting.baudRate = 9600;
+	setting.parity = MODBUS_SIM_PARITY_EVEN;
+	setting.bitErrorPpm = 4000;
+	setting.dropPpm = 2000;
+	setting.seed = 2024;
+	ModBus_Sim_setup(&bus, setting, nodes, 3);
+	modbusSetting.frameType = RTU;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	modbusSetting.address = 0x01;
+	ModBus_setup(&master, modbusSetting);
+	ModBus_Sim_attach(&bus, &master, MODBUS_SIM_MASTER, 8000);
+	for (int s = 0; s < 2; s++)
+	{
+		modbusSetting.address = (uint8_t)(s + 1);
+		ModBus_setup(slaves + s, modbusSetting);
+		ModBus_attachRegisterHandler(slaves + s, captureGetReg, s == 0 ? captureSetReg : captureIgnoreReg);
+		ModBus_Sim_attach(&bus, slaves + s, MODBUS_SIM_SLAVE, 2000);
+	}
+	ModBus_attachCapture(&master, &masterCapture);
+	ModBus_attachCapture(slaves, &slaveCapture);
+	ModBus_attachCapture(slaves + 1, &smallCapture); // 没有输出函数, 写满后丢弃
+
+	memcpy(initialRegisters, g_captureRegisters, sizeof(initialRegisters));
+	request.resultHandler = captureResult;
+	for (int i = 0; i < MODBUS_CAPTURE_TEST_REQUEST_N; i++)
+	{
+		request.unit = (uint8_t)(i % 2 + 1);
+		request.address = (uint16_t)(i % 4);
+		switch (i % 3)
+		{
+		case 0:
+			request.type = READ_REGISTER;
+			request.count = 3;
+			break;
+		case 1:
+			request.type = WRITE_SINGLE_REGISTER;
+			request.count = 1;
+			request.data[0] = (uint16_t)(0x100 + i);
+			break;
+		default:
+			request.type = WRITE_MULTI_REGISTER;
+			request.count = 2;
+			request.data[0] = (uint16_t)i;
+			request.data[1] = (uint16_t)(i * 3);
+			break;
+		}
+		g_captureDone = 0;
+		assert(ModBus_request(&master, &request));
+		while (!g_captureDone)
+		{
+			ModBus_Sim_run(&bus, 100);
+		}
+		if (g_captureStatus == MODBUS_STATUS_OK)
+			ok++;
+		else
+			fail++;
+	}
+	ModBus_Sim_run(&bus, 20000); // 最后的返回帧发送完
+	ModBus_Sim_close(&bus);
+	ModBus_Capture_flush(&masterCapture);
+	ModBus_Capture_flush(&slaveCapture);
+	assert(masterCapture.m_dropN == 0 && slaveCapture.m_dropN == 0);
+	assert(g_captureMasterFile.flushN > 1); // 缓冲区写满时输出
+	assert(smallCapture.m_dropN > 0 && smallCapture.m_len <= sizeof(smallBuffer));
+	assert(ok > 0 && fail > 0);
+
+	// 记录个数与收发一致
+	assert(captureCount(&g_captureMasterFile, masterCounts) == masterCapture.m_recordN);
+	assert(masterCounts[MODBUS_CAPTURE_TX] == nodes[0].m_txFrames);
+	assert(masterCounts[MODBUS_CAPTURE_FRAME] >= ok);
+	assert(captureCount(&g_captureSlaveFile, slaveCounts) == slaveCapture.m_recordN);
+	assert(slaveCounts[MODBUS_CAPTURE_TX] == nodes[1].m_txFrames && slaveCounts[MODBUS_CAPTURE_CHECK_FAIL] > 0);
+
+	// 从机重放: 寄存器从相同的初值开始, 应答与记录相同, 帧检测结果相同
+	memcpy(g_captureRegisters, initialRegisters, sizeof(initialRegisters));
+	modbusSetting.address = 0x01;
+	ModBus_setup(&replaySlave, modbusSetting);
+	ModBus_attachRegisterHandler(&replaySlave, captureGetReg, captureSetReg);
+	assert(ModBus_Capture_setup(&replayCapture, replayBuffer, sizeof(replayBuffer), captureFlush, &g_captureReplayFile));
+	ModBus_attachCapture(&replaySlave, &replayCapture);
+	assert(ModBus_Replay_run(g_captureSlaveFile.data, g_captureSlaveFile.len, &replaySlave, MODBUS_REPLAY_SLAVE, &slaveReplay));
+	ModBus_Capture_flush(&replayCapture);
+	assert(slaveReplay.txExpected == slaveCounts[MODBUS_CAPTURE_TX] && slaveReplay.txMatched == slaveReplay.txExpected);
+	assert(slaveReplay.txMismatched == 0 && slaveReplay.txMissing == 0);
+	assert(slaveReplay.framesCaptured == slaveCounts[MODBUS_CAPTURE_FRAME] && slaveReplay.checkFailsCaptured == slaveCounts[MODBUS_CAPTURE_CHECK_FAIL]);
+	assert(captureSameFrames(&g_captureSlaveFile, &g_captureReplayFile));
+
+	// 主机重放: 记录中的指令重新发出, 发送的帧和指令结果与原来相同
+	ModBus_setup(&replayMaster, modbusSetting);
+	assert(ModBus_Replay_run(g_captureMasterFile.data, g_captureMasterFile.len, &replayMaster, MODBUS_REPLAY_MASTER, &masterReplay));
+	assert(masterReplay.txMatched == masterReplay.txExpected && masterReplay.txMismatched == 0 && masterReplay.txMissing == 0);
+	assert(masterReplay.ok == ok && masterReplay.timeouts == fail);
+
+	// 文件头无效, 协议模式不同
+	assert(!ModBus_Replay_run(g_captureMasterFile.data + 1, g_captureMasterFile.len - 1, &replayMaster, MODBUS_REPLAY_MASTER, &masterReplay));
+	modbusSetting.frameType = ASCII;
+	ModBus_setup(&replayMaster, modbusSetting);
+	assert(!ModBus_Replay_run(g_captureMasterFile.data, g_captureMasterFile.len, &replayMaster, MODBUS_REPLAY_MASTER, &masterReplay));
+
+	printf("capture_unit_test: %u requests (ok %u, fail %u), master capture %u bytes %u records, slave replay %u/%u frames matched in %u ms\n",
+		(unsigned)MODBUS_CAPTURE_TEST_REQUEST_N, ok, fail, (unsigned)g_captureMasterFile.len, masterCapture.m_recordN,
+		slaveReplay.txMatched, slaveReplay.txExpected, slaveReplay.durationMs);
+}
+#endif // _UNIT_TEST
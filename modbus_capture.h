@@ -0,0 +1,137 @@
+#ifndef MOTECMODBUS_CAPTURE_H_
+#define MOTECMODBUS_CAPTURE_H_
+/**** ModBus 总线捕获与重放 ****
+** 代替在ModBus_readByteFromOuter和发送函数中打印: 实例的收发字节按时间顺序写入紧凑的二进制记录
+** 记录: 接收的字节(loop开始时取出), 发送的帧, 接收到的完整帧(设备地址, 功能码, 长度), 校验失败
+** 记录先写入调用者提供的缓冲区, 写满或调用ModBus_Capture_flush时才交给输出函数(写文件等), 不影响收发
+** 缓冲区也可以是内存映射的文件, 不设置输出函数时写满后丢弃新记录并计数
+** 重放(ModBus_Replay_run)在虚拟时间下把接收的字节按记录时刻送入实例并运行loop, 比较实例发送的帧与记录
+** 现场问题的捕获可作为可重复的回归测试和性能对比用例
+** 使用方法:
+****** 在 modbus.h 中开启 MODBUS_CAPTURE(默认开启); 实例未绑定捕获时只多一次判断
+****** 调用ModBus_Capture_setup配置, 传入记录缓冲区和输出函数(可以为NULL)
+****** 调用ModBus_attachCapture将实例绑定到捕获, 写入文件头(模式, 地址, 时钟频率)
+****** 结束时调用ModBus_Capture_flush输出剩余的记录
+****** 调用ModBus_Capture_open和ModBus_Capture_next逐条读取记录
+****** 调用ModBus_Replay_run把记录重放到新配置的实例
+** 注: 一个捕获只绑定一个实例, 只在实例的loop线程中写入
+*/
+
+#include "modbus.h"
+
+#ifndef MODBUS_CAPTURE_CLOCK
+#define MODBUS_CAPTURE_CLOCK() (ModBus_millis()) // 记录时刻的计时函数, 可重新定义为微秒计数(同时定义 MODBUS_CAPTURE_CLOCK_HZ)
+#endif
+#ifndef MODBUS_CAPTURE_CLOCK_HZ
+#define MODBUS_CAPTURE_CLOCK_HZ 1000u // 计时函数每秒的计数
+#endif
+#define MODBUS_CAPTURE_VERSION 1
+#define MODBUS_CAPTURE_HEADER_SIZE 12 // 文件头: "MBCP" 版本 模式 地址 保留 时钟频率(4, 小端)
+#define MODBUS_CAPTURE_RECORD_HEADER_SIZE 6 // 记录头: 类型 长度 时刻(4, 小端), 之后为长度个字节
+#define MODBUS_CAPTURE_RECORD_DATA_MAX 255 // 一条记录最多的字节数, 更长的数据分为多条记录
+#define MODBUS_REPLAY_PENDING_N 8 // 重放时等待比较的发送帧个数
+
+typedef enum {
+	MODBUS_CAPTURE_RX = 1, // 接收的字节, 在loop开始时记录
+	MODBUS_CAPTURE_TX, // 发送的帧
+	MODBUS_CAPTURE_FRAME, // 接收到完整的帧: 设备地址 功能码 帧长度(不含校验码)
+	MODBUS_CAPTURE_CHECK_FAIL, // 校验失败: 帧长度
+} MODBUS_CAPTURE_RECORD_TYPE;
+
+typedef enum {
+	MODBUS_REPLAY_MASTER, // 记录中的发送帧作为指令重新发出, 运行ModBus_Master_loop
+	MODBUS_REPLAY_SLAVE, // 运行ModBus_Slave_loop, 应答与记录中的发送帧比较
+} MODBUS_REPLAY_ROLE_TYPE;
+
+typedef struct __MODBUS_Capture {
+	byte* m_buffer; // 记录缓冲区, 由调用者提供
+	size_t m_size; // 缓冲区字节数
+	size_t m_len; // 缓冲区中未输出的字节数
+	void(*m_flushHandler)(void*, const byte*, size_t); // 输出函数, 函数参数(上下文, 数据, 字节数); NULL表示只保存在缓冲区
+	void* m_flushContext; // 传给输出函数的上下文, 比如文件
+	size_t m_rxPosition; // 循环存取区中下一个待记录的位置
+	u32 m_recordN; // 写入的记录数
+	u32 m_dropN; // 缓冲区已满丢弃的记录数
+	unsigned long long m_flushedBytes; // 已输出的字节数
+} ModBus_Capture_T;
+
+typedef struct _MODBUS_CAPTURE_HEADER_T { // 文件头
+	u8 version; // 格式版本
+	MODBUS_MODE_TYPE mode; // 实例的协议模式
+	uint8_t address; // 实例配置的设备地址
+	u32 clockHz; // 记录时刻每秒的计数
+} ModBus_Capture_Header_T;
+
+typedef struct _MODBUS_CAPTURE_RECORD_T { // 读出的记录
+	MODBUS_CAPTURE_RECORD_TYPE type; // 记录类型
+	u32 time; // 记录时刻
+	u8 len; // 字节数
+	const byte* data; // 指向捕获数据中的字节
+} ModBus_Capture_Record_T;
+
+typedef struct _MODBUS_CAPTURE_READER_T { // 读取位置
+	const byte* m_data;
+	size_t m_len;
+	size_t m_position;
+} ModBus_Capture_Reader_T;
+
+typedef struct _MODBUS_REPLAY_RESULT_T { // 重放结果
+	u32 records; // 读取的记录数
+	u32 rxBytes; // 送入实例的接收字节数
+	u32 framesCaptured; // 记录中接收到的完整帧数
+	u32 checkFailsCaptured; // 记录中的校验失败数
+	u32 txExpected; // 记录中的发送帧数
+	u32 txMatched; // 实例发送的帧与记录相同的个数
+	u32 txMismatched; // 实例发送的帧与记录不同, 或记录中没有对应的帧
+	u32 txMissing; // 记录中有但实例没有发送的帧数
+	u32 ok; // 主机: 成功的指令数
+	u32 timeouts; // 主机: 超时的指令数
+	u32 exceptions; // 主机: 异常返回的指令数
+	u32 durationMs; // 重放的虚拟时间(毫秒)
+} ModBus_Replay_Result_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置捕获 **/
+/*** 参数 ***
+** buffer: 记录缓冲区, 至少能容纳文件头和一条最长的记录(MODBUS_CAPTURE_HEADER_SIZE + MODBUS_CAPTURE_RECORD_HEADER_SIZE + MODBUS_CAPTURE_RECORD_DATA_MAX)
+** flushHandler: 缓冲区写满时输出已有的记录, 可以为NULL(写满后丢弃新记录)
+** 成功返回1, 缓冲区太小返回0
+***/
+byte ModBus_Capture_setup(ModBus_Capture_T* capture, byte* buffer, size_t size, void(*flushHandler)(void*, const byte*, size_t), void* context);
+
+// 实例绑定捕获并写入文件头, 传入NULL解除绑定; 绑定前已接收的字节不记录
+void ModBus_attachCapture(ModBus_parameter* ModBus_para, ModBus_Capture_T* capture);
+
+// 输出缓冲区中的记录, 返回输出的字节数; 没有输出函数时不输出, 返回0
+size_t ModBus_Capture_flush(ModBus_Capture_T* capture);
+
+/** 开始读取捕获数据 **/
+/*** 参数 ***
+** data: 捕获数据(输出的全部字节, 或没有输出函数时的缓冲区), len: 字节数
+** header: 读出的文件头, 可以为NULL
+** 文件头有效返回1, 否则返回0
+***/
+byte ModBus_Capture_open(ModBus_Capture_Reader_T* reader, const byte* data, size_t len, ModBus_Capture_Header_T* header);
+
+// 读取下一条记录, 成功返回1, 结束或记录不完整返回0
+byte ModBus_Capture_next(ModBus_Capture_Reader_T* reader, ModBus_Capture_Record_T* record);
+
+/** 重放捕获 **/
+/*** 参数 ***
+** modbus: 新配置的实例, 协议模式须与记录相同; 重放期间发送函数和时间源被替换, 结束后恢复
+** role: 主机/从机, 主机把记录中的发送帧作为指令重新发出
+** result: 重放结果
+** 按记录时刻(毫秒)运行loop; 接收的字节在记录的时刻送入实例, 同一毫秒的记录都送入后再运行loop
+** 需要比较帧检测结果时, 可在重放前把实例绑定到另一个捕获, 与原记录的 MODBUS_CAPTURE_FRAME 逐条比较
+** 成功返回1, 文件头无效或协议模式不同返回0
+***/
+byte ModBus_Replay_run(const byte* data, size_t len, ModBus_parameter* modbus, MODBUS_REPLAY_ROLE_TYPE role, ModBus_Replay_Result_T* result);
+
+// 以下由协议内部在loop线程中调用
+void ModBus_Capture_record(ModBus_Capture_T* capture, MODBUS_CAPTURE_RECORD_TYPE type, const byte* data, size_t len); // 写入记录
+void ModBus_Capture_received(ModBus_Capture_T* capture, const ModBus_parameter* modbus); // 记录循环存取区中新接收的字节
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,764 @@
+#ifndef MOTECMODBUS_CORO_HPP_
+#define MOTECMODBUS_CORO_HPP_
+/**** ModBus 主机 C++20 协程接口 ****
+** 读写指令可以co_await, 指令结束(成功/超时/异常码)后协程继续执行, 不需要手写状态机和全局变量
+** 协程帧从固定大小的内存池分配(FramePool), 每个指令不分配堆内存; 指令状态保存在协程帧中
+** when_all 同时发送多个指令(可以是不同总线的主机), 全部结束后继续
+** 使用方法:
+****** 配置主机实例(ModBus_setup), 用motecmodbus::Master包装
+****** 编写返回motecmodbus::Task<T>的协程, 其中 co_await master.read(...) / master.write(...)
+****** 调用task.start()启动, 循环调用master.loop()(代替ModBus_Master_loop)
+** 注: 协程在master.loop()中继续执行(不在指令回调中), 可以直接发送新指令
+** 注: 协程, 内存池和主机实例只能在同一线程中使用; 编译需要 -std=c++20
+** 注: 可以销毁挂起中的Task(如界面关闭时), 正在等待的指令照常发送, 结束时不再通知已释放的协程帧
+*/
+
+#include "modbus.h"
+
+#include <array>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <tuple>
+#include <utility>
+
+#ifdef MODBUS_MASTER
+
+#ifndef MODBUS_CORO_FRAME_SIZE
+#define MODBUS_CORO_FRAME_SIZE 1024 // 内存池每块字节数, 协程帧(局部变量和co_await的操作)大于此值时分配失败
+#endif
+#ifndef MODBUS_CORO_FRAME_N
+#define MODBUS_CORO_FRAME_N 32 // 内存池块数, 即同时存在的协程数上限
+#endif
+
+namespace motecmodbus {
+
+// 协程帧内存池: 固定大小的块, 空闲链表, 分配和释放O(1)
+class FramePool {
+public:
+	static void* allocate(std::size_t size) noexcept
+	{
+		State& s = state();
+		Block* block = s.head;
+		if (size > MODBUS_CORO_FRAME_SIZE || block == nullptr)
+		{
+			return nullptr; // 由 get_return_object_on_allocation_failure 返回无效的Task
+		}
+		s.head = block->next;
+		s.available--;
+		return block;
+	}
+
+	static void release(void* p) noexcept
+	{
+		State& s = state();
+		Block* block = static_cast<Block*>(p);
+		block->next = s.head;
+		s.head = block;
+		s.available++;
+	}
+
+	// 空闲块数
+	static std::size_t available() noexcept { return state().available; }
+
+private:
+	union Block {
+		Block* next;
+		alignas(std::max_align_t) unsigned char data[MODBUS_CORO_FRAME_SIZE];
+	};
+
+	struct State {
+		Block* head;
+		std::size_t available;
+		Block blocks[MODBUS_CORO_FRAME_N];
+
+		State() noexcept : head(blocks), available(MODBUS_CORO_FRAME_N)
+		{
+			for (std::size_t i = 0; i + 1 < MODBUS_CORO_FRAME_N; i++)
+			{
+				blocks[i].next = blocks + i + 1;
+			}
+			blocks[MODBUS_CORO_FRAME_N - 1].next = nullptr;
+		}
+	};
+
+	static State& state() noexcept
+	{
+		static State s;
+		return s;
+	}
+};
+
+// 指令结果, 读取的寄存器值复制到data
+struct Result {
+	MODBUS_STATUS_TYPE status = MODBUS_STATUS_INVALID;
+	MODBUS_FUNCTION_TYPE type = READ_REGISTER;
+	uint16_t address = 0;
+	uint16_t count = 0;
+	uint8_t exception = 0;
+	uint16_t data[MODBUS_REGISTER_LIMIT] = {};
+
+	bool ok() const noexcept { return status == MODBUS_STATUS_OK; }
+};
+
+class Master;
+
+// 等待继续执行的协程, 嵌入在指令或when_all中, 由Master的就绪链表串联
+struct Waiter {
+	std::coroutine_handle<> handle;
+	Waiter* next = nullptr;
+};
+
+class Master {
+public:
+	explicit Master(ModBus_parameter* modbus) noexcept : m_modbus(modbus) {}
+
+	class Operation;
+
+	// 读寄存器, unit为0使用实例配置的地址
+	Operation read(uint16_t address, uint16_t count, uint8_t unit = 0) noexcept;
+
+	// 写单寄存器
+	Operation write(uint16_t address, uint16_t value, uint8_t unit = 0) noexcept;
+
+	// 写多寄存器
+	Operation write(uint16_t address, const uint16_t* values, uint16_t count, uint8_t unit = 0) noexcept;
+
+	// 主机loop, 然后继续执行指令已结束的协程
+	void loop() noexcept
+	{
+		ModBus_Master_loop(m_modbus);
+		resumeReady();
+	}
+
+	// 继续执行指令已结束的协程, 不运行主机loop
+	void resumeReady() noexcept
+	{
+		while (m_readyHead != nullptr)
+		{
+			Waiter* waiter = m_readyHead;
+			m_readyHead = waiter->next;
+			if (m_readyHead == nullptr)
+			{
+				m_readyTail = nullptr;
+			}
+			waiter->handle.resume();
+		}
+	}
+
+	ModBus_parameter* instance() const noexcept { return m_modbus; }
+
+private:
+	friend class Operation;
+	template<typename... Ops>
+	friend class WhenAll;
+
+	void schedule(Waiter* waiter) noexcept
+	{
+		waiter->next = nullptr;
+		if (m_readyTail != nullptr)
+		{
+			m_readyTail->next = waiter;
+		}
+		else
+		{
+			m_readyHead = waiter;
+		}
+		m_readyTail = waiter;
+	}
+
+	// 从就绪链表中移除(等待的协程在继续执行前被销毁)
+	void unschedule(Waiter* waiter) noexcept
+	{
+		Waiter* prev = nullptr;
+		for (Waiter* w = m_readyHead; w != nullptr; prev = w, w = w->next)
+		{
+			if (w == waiter)
+			{
+				(prev != nullptr ? prev->next : m_readyHead) = w->next;
+				if (m_readyTail == w)
+				{
+					m_readyTail = prev;
+				}
+				return;
+			}
+		}
+	}
+
+	ModBus_parameter* m_modbus;
+	Waiter* m_readyHead = nullptr;
+	Waiter* m_readyTail = nullptr;
+};
+
+struct WhenAllState { // when_all的等待状态
+	Waiter waiter;
+	Master* scheduledBy = nullptr; // 最后结束的指令所在的主机, waiter在其就绪链表中
+	std::size_t remaining = 0;
+	bool suspended = false;
+};
+
+// 一条指令, co_await 发送并等待结束, 结果为Result
+class Master::Operation {
+public:
+	Operation(Master* master, const ModBus_Request_T& request) noexcept : m_master(master), m_request(request) {}
+	Operation(const Operation&) = delete;
+	Operation(Operation&& other) noexcept : m_master(other.m_master), m_request(other.m_request) {} // 只能在发送前移动
+	Operation& operator=(const Operation&) = delete;
+
+	// 协程帧在指令结束前被销毁: 解除缓存中指令的回调; 已结束但协程未继续: 移出就绪链表
+	~Operation()
+	{
+		if (m_index != 0 && !m_done)
+		{
+			ModBus_detachRequest(m_master->m_modbus, m_index);
+		}
+		else if (m_suspended && m_group == nullptr)
+		{
+			m_master->unschedule(&m_waiter);
+		}
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle) noexcept
+	{
+		m_waiter.handle = handle;
+		submit(nullptr);
+		if (m_done) // 参数无效等在发送时已结束, 不挂起
+		{
+			return false;
+		}
+		m_suspended = true;
+		return true;
+	}
+
+	Result await_resume() const noexcept { return m_result; }
+
+	// 发送指令, 结束时通知group(when_all)或继续等待的协程
+	void submit(WhenAllState* group) noexcept
+	{
+		m_group = group;
+		m_request.resultHandler = &Operation::onResult;
+		m_request.context = this;
+		m_index = ModBus_request(m_master->m_modbus, &m_request);
+	}
+
+	const Result& result() const noexcept { return m_result; }
+	bool done() const noexcept { return m_done; }
+
+private:
+	static void onResult(void* context, const ModBus_Result_T* result) noexcept
+	{
+		Operation* op = static_cast<Operation*>(context);
+		op->m_result.status = result->status;
+		op->m_result.type = result->type;
+		op->m_result.address = result->address;
+		op->m_result.count = result->count;
+		op->m_result.exception = result->exception;
+		if (result->data != nullptr)
+		{
+			memcpy(op->m_result.data, result->data, result->count * sizeof(uint16_t)); // data只在回调中有效
+		}
+		op->m_done = true;
+		if (op->m_group != nullptr)
+		{
+			if (--op->m_group->remaining == 0 && op->m_group->suspended)
+			{
+				op->m_group->scheduledBy = op->m_master;
+				op->m_master->schedule(&op->m_group->waiter);
+			}
+		}
+		else if (op->m_suspended)
+		{
+			op->m_master->schedule(&op->m_waiter); // 在loop()中继续, 不在主机loop的回调中
+		}
+	}
+
+	Master* m_master;
+	ModBus_Request_T m_request;
+	Result m_result;
+	Waiter m_waiter;
+	WhenAllState* m_group = nullptr;
+	byte m_index = 0; // 指令序号, 0表示未加入缓存
+	bool m_done = false;
+	bool m_suspended = false;
+};
+
+inline Master::Operation Master::read(uint16_t address, uint16_t count, uint8_t unit) noexcept
+{
+	ModBus_Request_T request = {};
+	request.unit = unit;
+	request.type = READ_REGISTER;
+	request.address = address;
+	request.count = count;
+	return Operation(this, request);
+}
+
+inline Master::Operation Master::write(uint16_t address, uint16_t value, uint8_t unit) noexcept
+{
+	ModBus_Request_T request = {};
+	request.unit = unit;
+	request.type = WRITE_SINGLE_REGISTER;
+	request.address = address;
+	request.count = 1;
+	request.data[0] = value;
+	return Operation(this, request);
+}
+
+inline Master::Operation Master::write(uint16_t address, const uint16_t* values, uint16_t count, uint8_t unit) noexcept
+{
+	ModBus_Request_T request = {};
+	request.unit = unit;
+	request.type = WRITE_MULTI_REGISTER;
+	request.address = address;
+	request.count = count <= MODBUS_REGISTER_LIMIT ? count : 0; // 超出时以 MODBUS_STATUS_INVALID 结束
+	memcpy(request.data, values, request.count * sizeof(uint16_t));
+	return Operation(this, request);
+}
+
+// 同时发送多条指令, 全部结束后继续, 结果为 std::array<Result, N>(与参数顺序相同)
+// 注: 同一主机实例的指令在其指令缓存中排队, 个数不要超过 MODBUS_WAITFRAME_N
+template<typename... Ops>
+class WhenAll {
+public:
+	explicit WhenAll(Ops&&... ops) noexcept : m_ops(std::forward<Ops>(ops)...) {}
+	WhenAll(const WhenAll&) = delete;
+
+	// 未结束的指令在各自析构时解除回调
+	~WhenAll()
+	{
+		if (m_state.scheduledBy != nullptr)
+		{
+			m_state.scheduledBy->unschedule(&m_state.waiter);
+		}
+	}
+
+	bool await_ready() const noexcept { return sizeof...(Ops) == 0; }
+
+	bool await_suspend(std::coroutine_handle<> handle) noexcept
+	{
+		m_state.waiter.handle = handle;
+		m_state.remaining = sizeof...(Ops);
+		std::apply([this](auto&... op) { (op.submit(&m_state), ...); }, m_ops);
+		if (m_state.remaining == 0) // 全部在发送时已结束
+		{
+			return false;
+		}
+		m_state.suspended = true;
+		return true;
+	}
+
+	std::array<Result, sizeof...(Ops)> await_resume() const noexcept
+	{
+		return std::apply([](const auto&... op) { return std::array<Result, sizeof...(Ops)>{ op.result()... }; }, m_ops);
+	}
+
+private:
+	std::tuple<Ops...> m_ops;
+	WhenAllState m_state;
+};
+
+template<typename... Ops>
+WhenAll<Ops...> when_all(Ops&&... ops) noexcept
+{
+	return WhenAll<Ops...>(std::forward<Ops>(ops)...);
+}
+
+// 协程返回类型; 创建后挂起, 调用start()或被co_await时开始执行
+template<typename T = void>
+class Task;
+
+namespace detail {
+struct PromiseBase {
+	std::coroutine_handle<> continuation; // co_await此协程的协程
+
+	static void* operator new(std::size_t size) noexcept { return FramePool::allocate(size); }
+	static void operator delete(void* p) noexcept { FramePool::release(p); }
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct FinalAwaiter {
+		bool await_ready() const noexcept { return false; }
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			std::coroutine_handle<> next = handle.promise().continuation;
+			return next ? next : std::noop_coroutine(); // 对称转移, 不增加栈深度
+		}
+		void await_resume() const noexcept {}
+	};
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template<typename T>
+struct Promise : PromiseBase {
+	T value{};
+	Task<T> get_return_object() noexcept;
+	static Task<T> get_return_object_on_allocation_failure() noexcept;
+	void return_value(T v) noexcept { value = std::move(v); }
+};
+
+template<>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object() noexcept;
+	static Task<void> get_return_object_on_allocation_failure() noexcept;
+	void return_void() noexcept {}
+};
+} // namespace detail
+
+template<typename T>
+class Task {
+public:
+	using promise_type = detail::Promise<T>;
+
+	Task() noexcept = default;
+	explicit Task(std::coroutine_handle<promise_type> handle) noexcept : m_handle(handle) {}
+	Task(Task&& other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+	Task& operator=(Task&& other) noexcept
+	{
+		if (this != &other)
+		{
+			destroy();
+			m_handle = std::exchange(other.m_handle, nullptr);
+		}
+		return *this;
+	}
+	Task(const Task&) = delete;
+	~Task() { destroy(); }
+
+	// 内存池不足或协程帧过大时无效
+	bool valid() const noexcept { return static_cast<bool>(m_handle); }
+	bool done() const noexcept { return !m_handle || m_handle.done(); }
+
+	// 启动顶层协程, 执行到第一个co_await挂起
+	void start() noexcept
+	{
+		if (m_handle && !m_handle.done())
+		{
+			m_handle.resume();
+		}
+	}
+
+	// 协程结束后的返回值
+	template<typename U = T>
+	const U& result() const noexcept { return m_handle.promise().value; }
+
+	auto operator co_await() noexcept
+	{
+		struct Awaiter {
+			std::coroutine_handle<promise_type> handle;
+			bool await_ready() const noexcept { return !handle || handle.done(); }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+			{
+				handle.promise().continuation = caller;
+				return handle;
+			}
+			T await_resume() const noexcept
+			{
+				if constexpr (!std::is_void_v<T>)
+				{
+					return handle ? handle.promise().value : T{};
+				}
+			}
+		};
+		return Awaiter{ m_handle };
+	}
+
+private:
+	void destroy() noexcept
+	{
+		if (m_handle)
+		{
+			m_handle.destroy();
+			m_handle = nullptr;
+		}
+	}
+
+	std::coroutine_handle<promise_type> m_handle;
+};
+
+namespace detail {
+template<typename T>
+Task<T> Promise<T>::get_return_object() noexcept { return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this)); }
+template<typename T>
+Task<T> Promise<T>::get_return_object_on_allocation_failure() noexcept { return Task<T>(); }
+inline Task<void> Promise<void>::get_return_object() noexcept { return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this)); }
+inline Task<void> Promise<void>::get_return_object_on_allocation_failure() noexcept { return Task<void>(); }
+} // namespace detail
+
+#if defined(_UNIT_TEST) || defined(_BENCHMARK)
+namespace test {
+struct Link { // 测试用的线路: 发送的数据直接传给对端实例, 对端为NULL表示无响应
+	ModBus_parameter* peer;
+};
+
+inline void linkSend(void* context, byte* data, size_t len)
+{
+	Link* link = static_cast<Link*>(context);
+	if (link->peer != nullptr)
+	{
+		ModBus_readBytesFromOuter(link->peer, data, len);
+	}
+}
+
+inline uint16_t g_registers[16];
+
+inline size_t getReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(data, g_registers + address, n * sizeof(uint16_t));
+	return n;
+}
+
+inline size_t setReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(g_registers + address, data, n * sizeof(uint16_t));
+	return n;
+}
+} // namespace test
+#endif
+
+#if defined(_UNIT_TEST) && defined(MODBUS_SLAVE)
+} // namespace motecmodbus
+#include <cstdio>
+extern "C" int t; // 单元测试的虚拟时间, 见 modbus.c
+namespace motecmodbus {
+namespace test {
+inline Task<uint16_t> readOne(Master& master, uint16_t address)
+{
+	Result r = co_await master.read(address, 1);
+	co_return r.ok() ? r.data[0] : 0xFFFF;
+}
+
+// 顺序读写, 嵌套协程, 参数无效不挂起
+inline Task<int> sequence(Master& master)
+{
+	int okN = 0;
+	uint16_t values[] = { 0x1111, 0x2222, 0x3333 };
+	Result r = co_await master.read(2, 3);
+	assert(r.ok() && r.count == 3 && r.data[0] == 2 && r.data[2] == 4);
+	okN += r.ok();
+	r = co_await master.write(5, 0xABCD);
+	assert(r.ok() && g_registers[5] == 0xABCD);
+	okN += r.ok();
+	r = co_await master.write(8, values, 3);
+	assert(r.ok() && r.count == 3 && g_registers[10] == 0x3333);
+	okN += r.ok();
+	r = co_await master.read(0, 0);
+	assert(r.status == MODBUS_STATUS_INVALID);
+	uint16_t v = co_await readOne(master, 9);
+	assert(v == 0x2222);
+	co_return okN + (v == 0x2222);
+}
+
+// 三个主机同时读, 其中一个无响应
+inline Task<int> fanOut(Master& a, Master& b, Master& dead)
+{
+	auto [ra, rb, rd] = co_await when_all(a.read(0, 2), b.read(12, 2), dead.read(0, 1));
+	assert(ra.ok() && ra.data[1] == 1 && rb.ok() && rb.data[0] == 12);
+	assert(rd.status == MODBUS_STATUS_TIMEOUT);
+	co_return 1;
+}
+
+// 运行主从机直到协程结束
+template<typename T>
+inline void run(Task<T>& task, Master* masters, size_t masterN, ModBus_parameter* slaves, size_t slaveN)
+{
+	task.start();
+	for (int i = 0; i < 2000 && !task.done(); i++)
+	{
+		for (size_t m = 0; m < masterN; m++)
+			masters[m].loop();
+		for (size_t s = 0; s < slaveN; s++)
+			ModBus_Slave_loop(slaves + s);
+		t += 1;
+	}
+	assert(task.done());
+}
+} // namespace test
+
+inline void coro_unit_test()
+{
+	static ModBus_parameter masterInstances[3], slaves[2];
+	static test::Link masterLinks[3], slaveLinks[2];
+	ModBus_Setting_T setting = {};
+	std::size_t freeBlocks = FramePool::available();
+
+	for (uint16_t i = 0; i < 16; i++)
+		test::g_registers[i] = i;
+	setting.address = 0x11;
+	setting.frameType = RTU;
+	setting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	for (int i = 0; i < 3; i++)
+	{
+		ModBus_setup(masterInstances + i, setting);
+		ModBus_setTimeout(masterInstances + i, 5, 50);
+		masterLinks[i].peer = i < 2 ? slaves + i : nullptr;
+		ModBus_attachSendHandler(masterInstances + i, test::linkSend, masterLinks + i);
+	}
+	for (int i = 0; i < 2; i++)
+	{
+		ModBus_setup(slaves + i, setting);
+		ModBus_setTimeout(slaves + i, 5, 50);
+		ModBus_attachRegisterHandler(slaves + i, test::getReg, test::setReg);
+		slaveLinks[i].peer = masterInstances + i;
+		ModBus_attachSendHandler(slaves + i, test::linkSend, slaveLinks + i);
+	}
+	Master masters[3] = { Master(masterInstances), Master(masterInstances + 1), Master(masterInstances + 2) };
+
+	{
+		Task<int> task = test::sequence(masters[0]);
+		assert(task.valid() && FramePool::available() == freeBlocks - 1);
+		test::run(task, masters, 1, slaves, 1);
+		assert(task.result() == 4);
+	}
+	{
+		Task<int> task = test::fanOut(masters[0], masters[1], masters[2]);
+		test::run(task, masters, 3, slaves, 2);
+		assert(task.result() == 1);
+	}
+	assert(FramePool::available() == freeBlocks); // 协程帧全部归还内存池
+
+	// 销毁等待中的协程: 指令照常结束, 不再访问已释放的协程帧
+	{
+		Task<uint16_t> task = test::readOne(masters[2], 0); // 无响应的主机
+		task.start();
+		assert(masterInstances[2].m_master.m_sendFramesN == 1 && masterInstances[2].m_master.m_sendFrames[0].context != nullptr);
+		task = Task<uint16_t>();
+		assert(masterInstances[2].m_master.m_sendFrames[0].context == nullptr && FramePool::available() == freeBlocks);
+		for (int i = 0; i < 100 && masterInstances[2].m_master.m_sendFramesN > 0; i++, t++)
+			masters[2].loop();
+		assert(masterInstances[2].m_master.m_sendFramesN == 0);
+	}
+	{
+		Task<uint16_t> task = test::readOne(masters[0], 3);
+		Task<int> group = test::fanOut(masters[0], masters[1], masters[2]);
+		task.start();
+		group.start();
+		for (int i = 0; i < 100 && (masterInstances[0].m_master.m_sendFramesN > 0 || masterInstances[2].m_master.m_sendFramesN > 0); i++, t++)
+		{
+			for (int m = 0; m < 3; m++)
+				ModBus_Master_loop(masterInstances + m); // 指令结束, 协程在就绪链表中, 不继续执行
+			ModBus_Slave_loop(slaves);
+			ModBus_Slave_loop(slaves + 1);
+		}
+		assert(!task.done() && !group.done());
+		task = Task<uint16_t>();
+		group = Task<int>();
+		for (int m = 0; m < 3; m++)
+			masters[m].resumeReady(); // 已移出就绪链表
+		assert(FramePool::available() == freeBlocks);
+	}
+
+	// 内存池用完时返回无效的Task, 不分配堆内存
+	{
+		static Task<uint16_t> tasks[MODBUS_CORO_FRAME_N + 1];
+		for (std::size_t i = 0; i < MODBUS_CORO_FRAME_N + 1; i++)
+			tasks[i] = test::readOne(masters[0], 0);
+		assert(tasks[MODBUS_CORO_FRAME_N - 1].valid() && !tasks[MODBUS_CORO_FRAME_N].valid());
+		for (std::size_t i = 0; i < MODBUS_CORO_FRAME_N + 1; i++)
+			tasks[i] = Task<uint16_t>();
+		assert(FramePool::available() == freeBlocks);
+	}
+	printf("coro_unit_test: frame pool %u x %u bytes\n", (unsigned)MODBUS_CORO_FRAME_N, (unsigned)MODBUS_CORO_FRAME_SIZE);
+}
+#endif // _UNIT_TEST
+
+#if defined(_BENCHMARK) && defined(MODBUS_SLAVE)
+} // namespace motecmodbus
+#include <cstdio>
+#include <time.h>
+namespace motecmodbus {
+namespace test {
+inline double benchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+inline int g_benchDone;
+
+inline void benchReadDone(uint16_t* data, uint16_t count)
+{
+	(void)data;
+	g_benchDone = count;
+}
+
+inline Task<int> benchSequence(Master& master, int n)
+{
+	int okN = 0;
+	for (int i = 0; i < n; i++)
+	{
+		Result r = co_await master.read(0, MODBUS_REGISTER_LIMIT);
+		okN += r.ok();
+	}
+	co_return okN;
+}
+} // namespace test
+
+// 顺序读: 原有回调接口与协程接口对比, 主从机在内存中直连, 按长度分帧不依赖时间
+inline void coro_benchmark()
+{
+	const int n = 200000;
+	static ModBus_parameter master, slave;
+	static test::Link masterLink, slaveLink;
+	ModBus_Setting_T setting = {};
+	Master coMaster(&master);
+	double begin, callbackTime, coroTime;
+	int okN = 0;
+
+	setting.address = 0x11;
+	setting.frameType = RTU;
+	setting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(&master, setting);
+	ModBus_setup(&slave, setting);
+	ModBus_lengthFraming(&master, 1);
+	ModBus_lengthFraming(&slave, 1);
+	ModBus_attachRegisterHandler(&slave, test::getReg, test::setReg);
+	masterLink.peer = &slave;
+	slaveLink.peer = &master;
+	ModBus_attachSendHandler(&master, test::linkSend, &masterLink);
+	ModBus_attachSendHandler(&slave, test::linkSend, &slaveLink);
+
+	begin = test::benchNow();
+	for (int i = 0; i < n; i++)
+	{
+		test::g_benchDone = -1;
+		ModBus_getRegister(&master, 0, MODBUS_REGISTER_LIMIT, test::benchReadDone);
+		while (test::g_benchDone < 0)
+		{
+			ModBus_Master_loop(&master);
+			ModBus_Slave_loop(&slave);
+		}
+		okN += test::g_benchDone == MODBUS_REGISTER_LIMIT;
+	}
+	callbackTime = test::benchNow() - begin;
+
+	begin = test::benchNow();
+	{
+		Task<int> task = test::benchSequence(coMaster, n);
+		task.start();
+		while (!task.done())
+		{
+			coMaster.loop();
+			ModBus_Slave_loop(&slave);
+		}
+		okN += task.result();
+	}
+	coroTime = test::benchNow() - begin;
+
+	printf("coro_benchmark: %d reads, callback %.0f ns/req, coroutine %.0f ns/req (ok %d)\n", n, callbackTime * 1e9 / n, coroTime * 1e9 / n, okN);
+}
+#endif // _BENCHMARK
+
+} // namespace motecmodbus
+
+#endif // MODBUS_MASTER
+
+#endif
@@ -0,0 +1,343 @@
+#include "modbus_deadband.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// 配置读取块
+void ModBus_Deadband_setup(ModBus_Deadband_T* deadband, uint16_t address, uint16_t count, uint16_t* last, const uint16_t* deadbands, ModBus_ChangeHandler_T handler, void* context)
+{
+	memset(deadband, 0, sizeof(ModBus_Deadband_T));
+	deadband->m_last = last;
+	deadband->m_deadbands = deadbands;
+	deadband->m_address = address;
+	deadband->m_count = count;
+	deadband->m_handler = handler;
+	deadband->m_context = context;
+}
+
+// 按有符号数计算差值
+void ModBus_Deadband_setSigned(ModBus_Deadband_T* deadband, byte isSigned)
+{
+	deadband->m_signed = isSigned;
+}
+
+// 下一次返回送出全部寄存器
+void ModBus_Deadband_reset(ModBus_Deadband_T* deadband)
+{
+	deadband->m_valid = 0;
+}
+
+// 第k个寄存器的值与上次送出的不同: 超过死区则加入变化列表, 返回加入的个数
+static size_t ModBus_Deadband_check(ModBus_Deadband_T* deadband, size_t k, uint16_t value, ModBus_Change_T* change)
+{
+	uint16_t previous = deadband->m_last[k];
+	if (deadband->m_deadbands != NULL && deadband->m_deadbands[k] != 0)
+	{
+		int32_t diff = deadband->m_signed ? (int32_t)(int16_t)value - (int16_t)previous : (int32_t)value - previous;
+		if (diff < 0)
+		{
+			diff = -diff;
+		}
+		if (diff <= deadband->m_deadbands[k])
+		{
+			return 0;
+		}
+	}
+	change->address = (uint16_t)(deadband->m_address + k);
+	change->value = value;
+	change->previous = previous;
+	deadband->m_last[k] = value;
+	return 1;
+}
+
+// 比较整块的新值
+size_t ModBus_Deadband_compare(ModBus_Deadband_T* deadband, const uint16_t* data, ModBus_Change_T* changes)
+{
+	uint16_t* last = deadband->m_last;
+	size_t count = deadband->m_count, n = 0, k = 0;
+	deadband->m_responseN++;
+	if (!deadband->m_valid) // 第一次送出全部
+	{
+		for (k = 0; k < count; k++)
+		{
+			changes[k].address = (uint16_t)(deadband->m_address + k);
+			changes[k].value = changes[k].previous = last[k] = data[k];
+		}
+		deadband->m_valid = 1;
+		deadband->m_changeN += (u32)count;
+		return count;
+	}
+#if defined(__SSE2__)
+	for (; k + 8 <= count; k += 8) // 每次比较8个寄存器, 相同的位置在掩码中为1(每个寄存器2位)
+	{
+		__m128i now = _mm_loadu_si128((const __m128i*)(data + k));
+		__m128i before = _mm_loadu_si128((const __m128i*)(last + k));
+		u32 diff = ~(u32)_mm_movemask_epi8(_mm_cmpeq_epi16(now, before)) & 0xFFFFu;
+		while (diff != 0)
+		{
+			u32 lane = 0;
+			while (!(diff >> (2 * lane) & 1u))
+			{
+				lane++;
+			}
+			n += ModBus_Deadband_check(deadband, k + lane, data[k + lane], changes + n);
+			diff &= ~(3u << (2 * lane));
+		}
+	}
+#else
+	for (; k + 4 <= count; k += 4) // 每次按64位整数比较4个寄存器
+	{
+		uint64_t now, before;
+		memcpy(&now, data + k, sizeof(now));
+		memcpy(&before, last + k, sizeof(before));
+		if (now != before)
+		{
+			for (size_t lane = 0; lane < 4; lane++)
+			{
+				if (data[k + lane] != last[k + lane])
+				{
+					n += ModBus_Deadband_check(deadband, k + lane, data[k + lane], changes + n);
+				}
+			}
+		}
+	}
+#endif
+	for (; k < count; k++)
+	{
+		if (data[k] != last[k])
+		{
+			n += ModBus_Deadband_check(deadband, k, data[k], changes + n);
+		}
+	}
+	deadband->m_changeN += (u32)n;
+	return n;
+}
+
+// 读指令的回调函数
+void ModBus_Deadband_resultHandler(void* context, const ModBus_Result_T* result)
+{
+	ModBus_Deadband_T* deadband = (ModBus_Deadband_T*)context;
+	ModBus_Change_T changes[MODBUS_REGISTER_LIMIT];
+	size_t n;
+	if (result->status != MODBUS_STATUS_OK)
+	{
+		(*deadband->m_handler)(deadband->m_context, result->status, NULL, 0);
+		return;
+	}
+	if (result->type != READ_REGISTER || result->address != deadband->m_address || result->count != deadband->m_count || deadband->m_count > MODBUS_REGISTER_LIMIT)
+	{
+		(*deadband->m_handler)(deadband->m_context, MODBUS_STATUS_INVALID, NULL, 0);
+		return;
+	}
+	n = ModBus_Deadband_compare(deadband, result->data, changes);
+	if (n > 0)
+	{
+		(*deadband->m_handler)(deadband->m_context, MODBUS_STATUS_OK, changes, n);
+	}
+}
+
+#if defined(_UNIT_TEST) || defined(_BENCHMARK)
+#include <stdio.h>
+
+#define MODBUS_DEADBAND_TEST_COUNT 125 // 一次读取最多的寄存器个数
+
+// 逐个比较的参考实现
+static size_t deadbandReference(ModBus_Deadband_T* deadband, const uint16_t* data, ModBus_Change_T* changes)
+{
+	size_t n = 0;
+	for (size_t k = 0; k < deadband->m_count; k++)
+	{
+		if (data[k] != deadband->m_last[k])
+		{
+			n += ModBus_Deadband_check(deadband, k, data[k], changes + n);
+		}
+	}
+	return n;
+}
+
+static u32 g_deadbandRandom = 2024;
+
+static u32 deadbandRandom(void)
+{
+	g_deadbandRandom ^= g_deadbandRandom << 13;
+	g_deadbandRandom ^= g_deadbandRandom >> 17;
+	g_deadbandRandom ^= g_deadbandRandom << 5;
+	return g_deadbandRandom;
+}
+
+// 随机修改一部分寄存器: 约 permille/1000 的寄存器变化, 变化量在 ±range 之内
+static void deadbandMutate(uint16_t* data, size_t count, u32 permille, u32 range)
+{
+	for (size_t k = 0; k < count; k++)
+	{
+		if (deadbandRandom() % 1000 < permille)
+		{
+			data[k] = (uint16_t)(data[k] + deadbandRandom() % (2 * range + 1) - range);
+		}
+	}
+}
+#endif
+
+#if defined(_UNIT_TEST)
+typedef struct {
+	u32 calls;
+	MODBUS_STATUS_TYPE status;
+	size_t n;
+	ModBus_Change_T changes[MODBUS_REGISTER_LIMIT];
+} DeadbandTestSink_T;
+
+static void deadbandSink(void* context, MODBUS_STATUS_TYPE status, const ModBus_Change_T* changes, size_t n)
+{
+	DeadbandTestSink_T* sink = (DeadbandTestSink_T*)context;
+	sink->calls++;
+	sink->status = status;
+	sink->n = n;
+	if (n > 0) // 读取失败时changes为NULL
+	{
+		memcpy(sink->changes, changes, n * sizeof(ModBus_Change_T));
+	}
+}
+
+// 分组比较与逐个比较的结果相同; 回调函数只收到变化的寄存器和读取失败
+void deadband_unit_test()
+{
+	static uint16_t lastA[MODBUS_DEADBAND_TEST_COUNT], lastB[MODBUS_DEADBAND_TEST_COUNT], bands[MODBUS_DEADBAND_TEST_COUNT], data[MODBUS_DEADBAND_TEST_COUNT];
+	static ModBus_Change_T changesA[MODBUS_DEADBAND_TEST_COUNT], changesB[MODBUS_DEADBAND_TEST_COUNT];
+	ModBus_Deadband_T a, b;
+	DeadbandTestSink_T sink = { 0 };
+	ModBus_Result_T result = { 0 };
+	uint16_t registers[MODBUS_REGISTER_LIMIT] = { 0 };
+	uint16_t last[MODBUS_REGISTER_LIMIT], smallBands[MODBUS_REGISTER_LIMIT] = { 0 };
+	u32 total = 0, delivered = 0;
+
+	for (int round = 0; round < 200; round++)
+	{
+		uint16_t count = (uint16_t)(1 + deadbandRandom() % MODBUS_DEADBAND_TEST_COUNT);
+		byte isSigned = round % 2;
+		for (size_t k = 0; k < count; k++)
+		{
+			data[k] = (uint16_t)deadbandRandom();
+			bands[k] = (uint16_t)(round % 3 == 0 ? 0 : deadbandRandom() % 8);
+		}
+		ModBus_Deadband_setup(&a, 100, count, lastA, round % 5 == 0 ? NULL : bands, NULL, NULL);
+		ModBus_Deadband_setup(&b, 100, count, lastB, round % 5 == 0 ? NULL : bands, NULL, NULL);
+		ModBus_Deadband_setSigned(&a, isSigned);
+		ModBus_Deadband_setSigned(&b, isSigned);
+		assert(ModBus_Deadband_compare(&a, data, changesA) == count && changesA[count - 1].address == 100 + count - 1);
+		ModBus_Deadband_compare(&b, data, changesB);
+		b.m_responseN = b.m_changeN = 0;
+		for (int poll = 0; poll < 20; poll++)
+		{
+			size_t n;
+			deadbandMutate(data, count, 100, 10);
+			n = ModBus_Deadband_compare(&a, data, changesA);
+			b.m_responseN++;
+			assert(n == deadbandReference(&b, data, changesB));
+			assert(memcmp(changesA, changesB, n * sizeof(ModBus_Change_T)) == 0 && memcmp(lastA, lastB, count * sizeof(uint16_t)) == 0);
+			total += count;
+			delivered += (u32)n;
+		}
+	}
+
+	// 有符号差值: 0xFFFE(-2) -> 2 差4, 不超过死区5; 按无符号数差65532
+	ModBus_Deadband_setup(&a, 0, 1, lastA, smallBands, NULL, NULL);
+	smallBands[0] = 5;
+	data[0] = 0xFFFE;
+	ModBus_Deadband_compare(&a, data, changesA);
+	data[0] = 2;
+	assert(ModBus_Deadband_compare(&a, data, changesA) == 1 && changesA[0].previous == 0xFFFE);
+	ModBus_Deadband_setSigned(&a, 1);
+	data[0] = 0xFFFE;
+	assert(ModBus_Deadband_compare(&a, data, changesA) == 0 && lastA[0] == 2); // 不送出, 上次值不变
+	data[0] = 8;
+	assert(ModBus_Deadband_compare(&a, data, changesA) == 1 && changesA[0].value == 8);
+
+	// 作为读指令的回调函数
+	smallBands[0] = 0;
+	ModBus_Deadband_setup(&a, 10, MODBUS_REGISTER_LIMIT, last, smallBands, deadbandSink, &sink);
+	result.status = MODBUS_STATUS_OK;
+	result.type = READ_REGISTER;
+	result.address = 10;
+	result.count = MODBUS_REGISTER_LIMIT;
+	result.data = registers;
+	ModBus_Deadband_resultHandler(&a, &result);
+	assert(sink.calls == 1 && sink.n == MODBUS_REGISTER_LIMIT); // 第一次送出全部
+	ModBus_Deadband_resultHandler(&a, &result);
+	assert(sink.calls == 1); // 没有变化, 不调用
+	registers[2] = 7;
+	ModBus_Deadband_resultHandler(&a, &result);
+	assert(sink.calls == 2 && sink.n == 1 && sink.changes[0].address == 12 && sink.changes[0].value == 7 && sink.changes[0].previous == 0);
+	result.status = MODBUS_STATUS_TIMEOUT;
+	ModBus_Deadband_resultHandler(&a, &result);
+	assert(sink.calls == 3 && sink.status == MODBUS_STATUS_TIMEOUT && sink.n == 0);
+	result.status = MODBUS_STATUS_OK;
+	result.count = 2;
+	ModBus_Deadband_resultHandler(&a, &result);
+	assert(sink.calls == 4 && sink.status == MODBUS_STATUS_INVALID);
+	ModBus_Deadband_reset(&a);
+	result.count = MODBUS_REGISTER_LIMIT;
+	ModBus_Deadband_resultHandler(&a, &result);
+	assert(sink.calls == 5 && sink.n == MODBUS_REGISTER_LIMIT);
+
+	printf("deadband_unit_test: delivered %u of %u registers\n", delivered, total);
+}
+#endif // _UNIT_TEST
+
+#if defined(_BENCHMARK)
+#include <time.h>
+
+#define MODBUS_DEADBAND_BENCH_POLL_N 2000000 // 比较次数
+
+static double deadbandBenchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// 125个寄存器的读取块, 约1%的寄存器变化: 分组比较与逐个比较每块的耗时, 送出的寄存器比例
+void deadband_benchmark()
+{
+	static uint16_t last[2][MODBUS_DEADBAND_TEST_COUNT], bands[MODBUS_DEADBAND_TEST_COUNT], data[64][MODBUS_DEADBAND_TEST_COUNT];
+	static ModBus_Change_T changes[MODBUS_DEADBAND_TEST_COUNT];
+	ModBus_Deadband_T deadband[2];
+	double seconds[2];
+	volatile size_t sink = 0;
+
+	for (size_t k = 0; k < MODBUS_DEADBAND_TEST_COUNT; k++)
+	{
+		data[0][k] = (uint16_t)deadbandRandom();
+		bands[k] = 2;
+	}
+	for (int i = 1; i < 64; i++) // 预先生成的返回值序列
+	{
+		memcpy(data[i], data[i - 1], sizeof(data[0]));
+		deadbandMutate(data[i], MODBUS_DEADBAND_TEST_COUNT, 10, 20);
+	}
+	for (int mode = 0; mode < 2; mode++)
+	{
+		double start;
+		ModBus_Deadband_setup(deadband + mode, 0, MODBUS_DEADBAND_TEST_COUNT, last[mode], bands, NULL, NULL);
+		ModBus_Deadband_compare(deadband + mode, data[0], changes);
+		deadband[mode].m_responseN = deadband[mode].m_changeN = 0;
+		start = deadbandBenchNow();
+		for (u32 i = 0; i < MODBUS_DEADBAND_BENCH_POLL_N; i++)
+		{
+			const uint16_t* now = data[i & 63];
+			if (mode == 0)
+			{
+				sink += ModBus_Deadband_compare(deadband, now, changes);
+			}
+			else
+			{
+				deadband[1].m_responseN++;
+				sink += deadbandReference(deadband + 1, now, changes);
+			}
+		}
+		seconds[mode] = deadbandBenchNow() - start;
+	}
+	printf("deadband_benchmark: %d registers, compare %.1f ns/block, per-register %.1f ns/block, delivered %.2f%%\n", MODBUS_DEADBAND_TEST_COUNT,
+		seconds[0] * 1e9 / MODBUS_DEADBAND_BENCH_POLL_N, seconds[1] * 1e9 / MODBUS_DEADBAND_BENCH_POLL_N,
+		100.0 * (double)sink / 2 / ((double)MODBUS_DEADBAND_BENCH_POLL_N * MODBUS_DEADBAND_TEST_COUNT));
+}
+#endif // _BENCHMARK
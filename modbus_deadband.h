@@ -0,0 +1,68 @@
+#ifndef MOTECMODBUS_DEADBAND_H_
+#define MOTECMODBUS_DEADBAND_H_
+/**** ModBus 读寄存器变化检测(死区) ****
+** 周期读取的寄存器大多不变, 每次把整块数据交给上层(历史库, 界面)会重复处理
+** 每个读取块保存上次送出的值, 新的返回值与之比较, 只送出变化的寄存器(或变化超过该寄存器死区的), 形式为紧凑的变化列表
+** 比较时先按多个寄存器一组整体比较(SSE2 每次8个, 其他平台 64位整数每次4个), 只有不同的组再逐个判断死区
+** 第一次返回(或ModBus_Deadband_reset之后)送出全部寄存器
+** 使用方法:
+****** 调用ModBus_Deadband_setup配置读取块: 起始地址, 寄存器个数, 上次值缓冲区, 死区(可以为NULL), 变化回调函数
+****** 读指令的 resultHandler 设为ModBus_Deadband_resultHandler, context 设为读取块(见 ModBus_request)
+****** 读取失败时回调函数的变化个数为0, status为失败原因, 上层可据此标记数据质量
+** 注: 死区与上次送出的值比较, 缓慢漂移累计超过死区时也会送出
+*/
+
+#include "modbus.h"
+
+typedef struct _MODBUS_CHANGE_T { // 变化的寄存器
+	uint16_t address; // 寄存器地址
+	uint16_t value; // 新的值
+	uint16_t previous; // 上次送出的值, 第一次送出时与value相同
+} ModBus_Change_T;
+
+typedef void(*ModBus_ChangeHandler_T)(void*, MODBUS_STATUS_TYPE, const ModBus_Change_T*, size_t); // 变化回调函数指针类型, 函数参数(上下文, 读取结果, 变化列表, 变化个数)
+
+typedef struct __MODBUS_Deadband {
+	uint16_t* m_last; // 上次送出的值, 由调用者提供
+	const uint16_t* m_deadbands; // 每个寄存器的死区, 差值超过死区才送出; NULL表示任何变化都送出
+	uint16_t m_address; // 起始寄存器地址
+	uint16_t m_count; // 寄存器个数
+	byte m_valid; // 已有上次送出的值
+	byte m_signed; // 按有符号数(int16_t)计算差值
+	ModBus_ChangeHandler_T m_handler; // 变化回调函数
+	void* m_context; // 传给回调函数的上下文
+	u32 m_responseN; // 比较的返回次数
+	u32 m_changeN; // 送出的寄存器个数, 与 m_responseN * m_count 之比为送出比例
+} ModBus_Deadband_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置读取块 **/
+/*** 参数 ***
+** address: 起始寄存器地址, count: 寄存器个数
+** last: 上次送出的值, count个
+** deadbands: 每个寄存器的死区, count个, 可以为NULL
+** handler: 有变化或读取失败时调用
+***/
+void ModBus_Deadband_setup(ModBus_Deadband_T* deadband, uint16_t address, uint16_t count, uint16_t* last, const uint16_t* deadbands, ModBus_ChangeHandler_T handler, void* context);
+
+// 按有符号数(int16_t)计算差值, 默认按无符号数
+void ModBus_Deadband_setSigned(ModBus_Deadband_T* deadband, byte isSigned);
+
+// 下一次返回送出全部寄存器(比如上层重新连接后)
+void ModBus_Deadband_reset(ModBus_Deadband_T* deadband);
+
+/** 比较整块的新值 **/
+/*** 参数 ***
+** data: 新的值, m_count个
+** changes: 变化列表, 至少m_count个
+** 返回变化个数, 送出的寄存器更新为上次送出的值
+***/
+size_t ModBus_Deadband_compare(ModBus_Deadband_T* deadband, const uint16_t* data, ModBus_Change_T* changes);
+
+// 读指令的回调函数, context为读取块; 返回的地址和个数须与读取块相同(个数不超过MODBUS_REGISTER_LIMIT)
+void ModBus_Deadband_resultHandler(void* context, const ModBus_Result_T* result);
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,674 @@
+#include "modbus_gateway.h"
+
+#ifdef MODBUS_MASTER
+
+typedef enum {
+	MODBUS_GATEWAY_FREE, // 空闲
+	MODBUS_GATEWAY_QUEUED, // 在客户端队列中等待发送, 或已合并到其他请求
+	MODBUS_GATEWAY_IN_FLIGHT, // 正在总线上执行
+} MODBUS_GATEWAY_STATE_TYPE;
+
+// 从内存池取出一个请求, 没有空闲请求返回-1
+static int ModBus_Gateway_alloc(ModBus_Gateway_T* gateway)
+{
+	ModBus_Gateway_Request_T* request = (ModBus_Gateway_Request_T*)ModBus_Pool_acquire(&gateway->m_requestPool);
+	if (request == NULL)
+	{
+		return -1;
+	}
+	request->m_next = -1;
+	request->m_nextRead = -1;
+	request->m_nextFollower = -1;
+	request->m_leader = -1;
+	return (int)(request - gateway->m_requests);
+}
+
+// 放回内存池
+static void ModBus_Gateway_free(ModBus_Gateway_T* gateway, int i)
+{
+	gateway->m_requests[i].m_state = MODBUS_GATEWAY_FREE;
+	ModBus_Pool_release(&gateway->m_requestPool, gateway->m_requests + i);
+}
+
+// 读请求在散列表中的位置
+static size_t ModBus_Gateway_readBucket(const ModBus_Request_T* read)
+{
+	u32 key = ((u32)read->unit << 24) ^ ((u32)read->address << 8) ^ read->count;
+	key *= 0x9E3779B1u; // 乘法散列, 取高位
+	return (key >> 16) % MODBUS_GATEWAY_READ_BUCKET_N;
+}
+
+// 加入可合并读请求散列表
+static void ModBus_Gateway_addRead(ModBus_Gateway_T* gateway, int i)
+{
+	int* bucket = gateway->m_readBuckets + ModBus_Gateway_readBucket(&gateway->m_requests[i].m_request);
+	gateway->m_requests[i].m_nextRead = *bucket;
+	*bucket = i;
+}
+
+// 从可合并读请求散列表中移除
+static void ModBus_Gateway_removeRead(ModBus_Gateway_T* gateway, int i)
+{
+	int* link = gateway->m_readBuckets + ModBus_Gateway_readBucket(&gateway->m_requests[i].m_request);
+	while (*link >= 0)
+	{
+		if (*link == i)
+		{
+			*link = gateway->m_requests[i].m_nextRead;
+			return;
+		}
+		link = &gateway->m_requests[*link].m_nextRead;
+	}
+}
+
+// 请求所在的连接是否还存在
+static byte ModBus_Gateway_isAlive(ModBus_Gateway_T* gateway, const ModBus_Gateway_Request_T* request)
+{
+	const ModBus_TCP_Connection_T* conn = gateway->m_server->m_connections + request->m_client;
+	return conn->m_fd >= 0 && conn->m_generation == request->m_generation;
+}
+
+// 根据请求的MBAP报文头和返回PDU生成返回帧, 返回帧长度
+static size_t ModBus_Gateway_response(byte* response, const byte* header, const byte* pdu, size_t pduLen)
+{
+	memcpy(response, header, 4); // 事务号和协议号与请求相同
+	response[4] = ((pduLen + 1) >> 8) & 0x0FF; // 长度高位
+	response[5] = (pduLen + 1) & 0x0FF; // 长度低位
+	response[6] = header[6]; // 单元号
+	memcpy(response + MODBUS_MBAP_SIZE, pdu, pduLen);
+	return MODBUS_MBAP_SIZE + pduLen;
+}
+
+// 生成异常返回帧
+static size_t ModBus_Gateway_exception(byte* response, const byte* header, byte function, byte exception)
+{
+	byte pdu[2];
+	pdu[0] = function | MODBUS_EXCEPTION_FLAG;
+	pdu[1] = exception;
+	return ModBus_Gateway_response(response, header, pdu, 2);
+}
+
+// 请求结束, 释放客户端的排队名额, 客户端因排队已满被暂停时继续处理
+static void ModBus_Gateway_release(ModBus_Gateway_T* gateway, int i)
+{
+	ModBus_Gateway_Request_T* request = gateway->m_requests + i;
+	ModBus_Gateway_Client_T* client = gateway->m_clients + request->m_client;
+	int clientIndex = request->m_client;
+	u32 generation = request->m_generation;
+	if (request->m_leader < 0 && request->m_request.type == READ_REGISTER) // 之后的读请求不再合并到此请求
+	{
+		ModBus_Gateway_removeRead(gateway, i);
+	}
+	ModBus_Gateway_free(gateway, i);
+	if (client->m_generation == generation && client->m_pending > 0)
+	{
+		client->m_pending--;
+		ModBus_TCP_resume(gateway->m_server, gateway->m_server->m_connections + clientIndex, generation);
+	}
+}
+
+// 查找可合并的读请求: 设备/地址/个数相同且尚未返回
+static int ModBus_Gateway_findRead(ModBus_Gateway_T* gateway, const ModBus_Request_T* read)
+{
+	for (int i = gateway->m_readBuckets[ModBus_Gateway_readBucket(read)]; i >= 0; i = gateway->m_requests[i].m_nextRead)
+	{
+		const ModBus_Request_T* request = &gateway->m_requests[i].m_request;
+		if (request->unit == read->unit && request->address == read->address && request->count == read->count)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+// TCP服务器的请求处理函数: 检查请求, 放入客户端队列或合并到相同的读请求
+static int ModBus_Gateway_handle(void* context, ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn, const byte* adu, size_t aduLen, byte* response)
+{
+	ModBus_Gateway_T* gateway = (ModBus_Gateway_T*)context;
+	int clientIndex = (int)(conn - server->m_connections);
+	ModBus_Gateway_Client_T* client = gateway->m_clients + clientIndex;
+	const byte* pdu = adu + MODBUS_MBAP_SIZE;
+	size_t pduLen = aduLen - MODBUS_MBAP_SIZE;
+	ModBus_Request_T request = { 0 };
+	ModBus_Gateway_Request_T* pRequest;
+	int i, leader = -1;
+
+	if (client->m_generation != conn->m_generation) // 新连接, 之前连接的请求返回时不再计数
+	{
+		client->m_generation = conn->m_generation;
+		client->m_pending = 0;
+	}
+	if (client->m_pending >= MODBUS_GATEWAY_CLIENT_PENDING_N) // 排队已满, 暂停接收此客户端的请求
+	{
+		return -1;
+	}
+
+	request.unit = gateway->m_unitMap[adu[6]];
+	if (request.unit == MODBUS_GATEWAY_UNIT_NONE)
+	{
+		return (int)ModBus_Gateway_exception(response, adu, pdu[0], EXCEPTION_GATEWAY_PATH_UNAVAILABLE);
+	}
+	if (pdu[0] != READ_REGISTER && pdu[0] != WRITE_SINGLE_REGISTER && pdu[0] != WRITE_MULTI_REGISTER)
+	{
+		return (int)ModBus_Gateway_exception(response, adu, pdu[0], EXCEPTION_ILLEGAL_FUNCTION);
+	}
+	if (pduLen < 5) // 先检查长度再读取地址和个数
+	{
+		return (int)ModBus_Gateway_exception(response, adu, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+	}
+	request.type = (MODBUS_FUNCTION_TYPE)pdu[0];
+	request.priority = MODBUS_PRIORITY_NORMAL;
+	request.retries = 0; // 不重发, 超时后立即返回0x0B, 由TCP客户端决定是否重发
+	request.address = ((uint16_t)pdu[1] << 8) + pdu[2];
+	request.count = ((uint16_t)pdu[3] << 8) + pdu[4];
+	switch (pdu[0])
+	{
+	case READ_REGISTER:
+		if (pduLen != 5 || request.count == 0 || request.count > gateway->m_master->m_registerAcessLimit)
+		{
+			return (int)ModBus_Gateway_exception(response, adu, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		leader = ModBus_Gateway_findRead(gateway, &request);
+		break;
+	case WRITE_SINGLE_REGISTER:
+		if (pduLen != 5)
+		{
+			return (int)ModBus_Gateway_exception(response, adu, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		request.data[0] = request.count;
+		request.count = 1;
+		break;
+	case WRITE_MULTI_REGISTER:
+		if (pduLen < 6 || request.count == 0 || request.count > gateway->m_master->m_registerAcessLimit
+			|| pdu[5] != request.count * 2 || pduLen != 6u + pdu[5])
+		{
+			return (int)ModBus_Gateway_exception(response, adu, pdu[0], EXCEPTION_ILLEGAL_DATA_VALUE);
+		}
+		for (uint16_t k = 0; k < request.count; k++)
+		{
+			request.data[k] = ((uint16_t)pdu[6 + 2 * k] << 8) + pdu[7 + 2 * k];
+		}
+		break;
+	}
+
+	i = ModBus_Gateway_alloc(gateway);
+	if (i < 0) // 所有客户端的排队请求已占满缓冲区
+	{
+		gateway->m_busyCount++;
+		return (int)ModBus_Gateway_exception(response, adu, pdu[0], EXCEPTION_SLAVE_DEVICE_BUSY);
+	}
+	pRequest = gateway->m_requests + i;
+	pRequest->m_client = clientIndex;
+	pRequest->m_generation = conn->m_generation;
+	pRequest->m_state = MODBUS_GATEWAY_QUEUED;
+	memcpy(pRequest->m_header, adu, MODBUS_MBAP_SIZE);
+	pRequest->m_request = request;
+	client->m_pending++;
+
+	if (leader >= 0) // 合并到相同的读请求, 不再发送
+	{
+		pRequest->m_leader = leader;
+		pRequest->m_nextFollower = gateway->m_requests[leader].m_nextFollower;
+		gateway->m_requests[leader].m_nextFollower = i;
+		gateway->m_mergedCount++;
+		return 0;
+	}
+	if (request.type == READ_REGISTER)
+	{
+		ModBus_Gateway_addRead(gateway, i);
+	}
+	if (client->m_head < 0)
+	{
+		client->m_head = i;
+	}
+	else
+	{
+		gateway->m_requests[client->m_tail].m_next = i;
+	}
+	client->m_tail = i;
+	return 0;
+}
+
+// 总线指令结束, 向发送指令的请求和合并到它的请求返回结果
+static void ModBus_Gateway_complete(void* context, const ModBus_Result_T* result)
+{
+	ModBus_Gateway_T* gateway = (ModBus_Gateway_T*)context;
+	int i = gateway->m_inFlight;
+	ModBus_Gateway_Request_T* request = gateway->m_requests + i;
+	byte pdu[MODBUS_PDU_SIZE];
+	byte response[MODBUS_TCP_ADU_SIZE];
+	size_t pduLen = 0;
+
+	gateway->m_inFlight = -1;
+	pdu[pduLen++] = request->m_request.type;
+	if (result->status == MODBUS_STATUS_OK)
+	{
+		switch (request->m_request.type)
+		{
+		case READ_REGISTER:
+			pdu[pduLen++] = (byte)(result->count * 2); // 数据字节数
+			for (uint16_t k = 0; k < result->count; k++)
+			{
+				pdu[pduLen++] = (result->data[k] >> 8) & 0x0FF;
+				pdu[pduLen++] = result->data[k] & 0x0FF;
+			}
+			break;
+		case WRITE_SINGLE_REGISTER:
+			pdu[pduLen++] = (request->m_request.address >> 8) & 0x0FF;
+			pdu[pduLen++] = request->m_request.address & 0x0FF;
+			pdu[pduLen++] = (request->m_request.data[0] >> 8) & 0x0FF;
+			pdu[pduLen++] = request->m_request.data[0] & 0x0FF;
+			break;
+		default:
+			pdu[pduLen++] = (request->m_request.address >> 8) & 0x0FF;
+			pdu[pduLen++] = request->m_request.address & 0x0FF;
+			pdu[pduLen++] = (result->count >> 8) & 0x0FF;
+			pdu[pduLen++] = result->count & 0x0FF;
+			break;
+		}
+	}
+	else
+	{
+		pdu[0] |= MODBUS_EXCEPTION_FLAG;
+		if (result->status == MODBUS_STATUS_EXCEPTION) // 从机返回的异常码原样转发
+		{
+			pdu[pduLen++] = result->exception;
+		}
+		else if (result->status == MODBUS_STATUS_TIMEOUT)
+		{
+			pdu[pduLen++] = EXCEPTION_GATEWAY_TARGET_FAILED;
+			gateway->m_timeoutCount++;
+		}
+		else
+		{
+			pdu[pduLen++] = EXCEPTION_GATEWAY_PATH_UNAVAILABLE;
+		}
+	}
+
+	while (i >= 0)
+	{
+		int next = gateway->m_requests[i].m_nextFollower;
+		request = gateway->m_requests + i;
+		if (ModBus_Gateway_isAlive(gateway, request))
+		{
+			size_t responseLen = ModBus_Gateway_response(response, request->m_header, pdu, pduLen);
+			ModBus_TCP_reply(gateway->m_server, gateway->m_server->m_connections + request->m_client, request->m_generation, response, responseLen);
+		}
+		ModBus_Gateway_release(gateway, i);
+		i = next;
+	}
+}
+
+// 按客户端轮流取出排队的请求发送到总线, 请求的连接都已关闭时直接丢弃; 发送返回1
+static byte ModBus_Gateway_dispatch(ModBus_Gateway_T* gateway)
+{
+	size_t clientCount = gateway->m_server->m_connectionCapacity;
+	for (size_t k = 0; k < clientCount; k++)
+	{
+		size_t c = (gateway->m_nextClient + k) % clientCount;
+		ModBus_Gateway_Client_T* client = gateway->m_clients + c;
+		while (client->m_head >= 0)
+		{
+			int i = client->m_head;
+			int follower;
+			ModBus_Gateway_Request_T* request = gateway->m_requests + i;
+			byte alive = ModBus_Gateway_isAlive(gateway, request);
+			client->m_head = request->m_next;
+			request->m_next = -1;
+			for (follower = request->m_nextFollower; !alive && follower >= 0; follower = gateway->m_requests[follower].m_nextFollower)
+			{
+				alive = ModBus_Gateway_isAlive(gateway, gateway->m_requests + follower);
+			}
+			if (!alive) // 没有客户端等待结果
+			{
+				for (follower = request->m_nextFollower; follower >= 0; )
+				{
+					int next = gateway->m_requests[follower].m_nextFollower;
+					ModBus_Gateway_release(gateway, follower);
+					follower = next;
+				}
+				ModBus_Gateway_release(gateway, i);
+				continue;
+			}
+
+			gateway->m_nextClient = c + 1; // 下一次从下一个客户端开始
+			request->m_state = MODBUS_GATEWAY_IN_FLIGHT;
+			request->m_request.resultHandler = ModBus_Gateway_complete;
+			request->m_request.context = gateway;
+			request->m_request.completionQueue = NULL;
+			gateway->m_inFlight = i;
+			gateway->m_forwardCount++;
+			ModBus_request(gateway->m_master, &request->m_request);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** 配置网关 **/
+/*** 参数 ***
+** server: 已配置的TCP服务器
+** master: 串口主机实例
+** requests: 请求缓冲区
+** clients: 客户端队列, 个数与服务器的连接缓冲区个数相同
+***/
+void ModBus_Gateway_setup(ModBus_Gateway_T* gateway, ModBus_TCP_Server_T* server, ModBus_parameter* master, ModBus_Gateway_Request_T* requests, size_t requestCapacity, ModBus_Gateway_Client_T* clients)
+{
+	gateway->m_server = server;
+	gateway->m_master = master;
+	gateway->m_requests = requests;
+	gateway->m_requestCapacity = requestCapacity;
+	assert(MODBUS_POOL_BLOCK_SIZE(sizeof(ModBus_Gateway_Request_T)) == sizeof(ModBus_Gateway_Request_T)); // 内存池按数组下标访问请求
+	ModBus_Pool_setup(&gateway->m_requestPool, requests, sizeof(ModBus_Gateway_Request_T), requestCapacity);
+	for (size_t i = 0; i < requestCapacity; i++)
+	{
+		requests[i].m_state = MODBUS_GATEWAY_FREE;
+	}
+	for (size_t i = 0; i < MODBUS_GATEWAY_READ_BUCKET_N; i++)
+	{
+		gateway->m_readBuckets[i] = -1;
+	}
+	gateway->m_clients = clients;
+	for (size_t i = 0; i < server->m_connectionCapacity; i++)
+	{
+		clients[i].m_head = -1;
+		clients[i].m_tail = -1;
+		clients[i].m_generation = server->m_connections[i].m_generation;
+		clients[i].m_pending = 0;
+	}
+	gateway->m_nextClient = 0;
+	gateway->m_inFlight = -1;
+
+	for (int unitId = 0; unitId < 256; unitId++)
+	{
+		gateway->m_unitMap[unitId] = (unitId >= 1 && unitId <= 247) ? (uint8_t)unitId : MODBUS_GATEWAY_UNIT_NONE;
+	}
+	gateway->m_unitMap[0] = gateway->m_unitMap[255] = master->m_address;
+
+	gateway->m_forwardCount = 0;
+	gateway->m_mergedCount = 0;
+	gateway->m_timeoutCount = 0;
+	gateway->m_busyCount = 0;
+
+	ModBus_fastMode(master, 0); // 快速模式会丢弃排队的指令
+	ModBus_TCP_attachRequestHandler(server, ModBus_Gateway_handle, gateway);
+}
+
+// 设置单元号映射
+void ModBus_Gateway_mapUnit(ModBus_Gateway_T* gateway, uint8_t unitId, uint8_t address)
+{
+	gateway->m_unitMap[unitId] = address;
+}
+
+// 网关loop函数
+void ModBus_Gateway_loop(ModBus_Gateway_T* gateway)
+{
+	ModBus_Master_loop(gateway->m_master); // 处理返回帧或超时
+	if (gateway->m_inFlight < 0 && ModBus_Gateway_dispatch(gateway)) // 总线空闲时发送下一个请求
+	{
+		ModBus_Master_loop(gateway->m_master); // 立即发送, 不等下一轮loop
+	}
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+#include <pty.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "modbus_serial.h"
+
+#define MODBUS_GATEWAY_TEST_PORT 15021 // 测试端口
+#define MODBUS_GATEWAY_TEST_CLIENTS 3 // 回环客户端个数
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_gatewayRegisters[16];
+static uint16_t g_gatewayReadOrder[16]; // 从机收到读请求的首地址顺序
+static size_t g_gatewayReadN = 0;
+
+static size_t gatewayGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	if (g_gatewayReadN < 16)
+		g_gatewayReadOrder[g_gatewayReadN++] = address;
+	memcpy(data, g_gatewayRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static size_t gatewaySetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(g_gatewayRegisters + address, data, n * sizeof(uint16_t));
+	return n;
+}
+
+// 发送MBAP请求, pdu为功能码+数据
+static void gatewaySend(int fd, uint16_t transaction, uint8_t unitId, const byte* pdu, size_t pduLen)
+{
+	byte adu[MODBUS_TCP_ADU_SIZE];
+	adu[0] = (transaction >> 8) & 0x0FF;
+	adu[1] = transaction & 0x0FF;
+	adu[2] = adu[3] = 0;
+	adu[4] = ((pduLen + 1) >> 8) & 0x0FF;
+	adu[5] = (pduLen + 1) & 0x0FF;
+	adu[6] = unitId;
+	memcpy(adu + MODBUS_MBAP_SIZE, pdu, pduLen);
+	assert(send(fd, adu, MODBUS_MBAP_SIZE + pduLen, MSG_NOSIGNAL) == (ssize_t)(MODBUS_MBAP_SIZE + pduLen));
+}
+
+// 运行网关/总线/从机直到客户端收到一个返回帧, 返回帧长度; slave为NULL时不运行从机
+static size_t gatewayReceive(int fd, ModBus_TCP_Server_T* server, ModBus_Gateway_T* gateway, ModBus_Serial_T* masterPort,
+	ModBus_Serial_T* slavePort, ModBus_parameter* slave, byte* adu)
+{
+	for (int i = 0; i < 2000; i++)
+	{
+		ssize_t n = recv(fd, adu, MODBUS_MBAP_SIZE, MSG_PEEK);
+		if (n == MODBUS_MBAP_SIZE)
+		{
+			size_t len = MODBUS_MBAP_SIZE - 1 + (((size_t)adu[4] << 8) + adu[5]);
+			if (recv(fd, adu, len, MSG_PEEK) == (ssize_t)len)
+			{
+				recv(fd, adu, len, 0);
+				return len;
+			}
+		}
+		ModBus_TCP_Server_loop(server, 0);
+		ModBus_Gateway_loop(gateway);
+		if (slave != NULL)
+		{
+			ModBus_Serial_poll(slavePort, 1);
+			ModBus_Slave_loop(slave);
+		}
+		ModBus_Serial_poll(masterPort, 1);
+		t += 1;
+	}
+	return 0;
+}
+
+// 本机回环TCP客户端 -> 网关 -> 伪终端 -> 从机
+void gateway_unit_test()
+{
+	static ModBus_TCP_Connection_T connections[MODBUS_GATEWAY_TEST_CLIENTS];
+	static ModBus_Gateway_Request_T requests[16];
+	static ModBus_Gateway_Client_T clients[MODBUS_GATEWAY_TEST_CLIENTS];
+	static ModBus_TCP_Server_T server;
+	static ModBus_Gateway_T gateway;
+	ModBus_parameter master, slave;
+	ModBus_Serial_T masterPort, slavePort;
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_TCP_Setting_T tcpSetting = { 0 };
+	struct sockaddr_in addr;
+	int fds[MODBUS_GATEWAY_TEST_CLIENTS];
+	int ptyMaster, ptySlave;
+	byte adu[MODBUS_TCP_ADU_SIZE];
+	size_t len;
+	int ret;
+
+	for (uint16_t i = 0; i < 16; i++)
+		g_gatewayRegisters[i] = 0x100 + i;
+
+	ret = openpty(&ptyMaster, &ptySlave, NULL, NULL, NULL);
+	assert(ret == 0);
+	modbusSetting.address = 0x11;
+	modbusSetting.baudRate = 115200;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(&master, modbusSetting);
+	ModBus_setTimeout(&master, 5, 50);
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_setTimeout(&slave, 5, 50);
+	ModBus_attachRegisterHandler(&slave, gatewayGetReg, gatewaySetReg);
+	assert(ModBus_Serial_attachFd(&masterPort, ptyMaster, &master, 1) == 0);
+	assert(ModBus_Serial_attachFd(&slavePort, ptySlave, &slave, 1) == 0);
+
+	tcpSetting.port = MODBUS_GATEWAY_TEST_PORT;
+	tcpSetting.bindAddress = INADDR_LOOPBACK;
+	ret = ModBus_TCP_setup(&server, tcpSetting, NULL, connections, MODBUS_GATEWAY_TEST_CLIENTS);
+	assert(ret == 0);
+	ModBus_Gateway_setup(&gateway, &server, &master, requests, 16, clients);
+	ModBus_Gateway_mapUnit(&gateway, 1, 0x11); // 单元号1映射到串口地址0x11
+	ModBus_Gateway_mapUnit(&gateway, 9, MODBUS_GATEWAY_UNIT_NONE);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(MODBUS_GATEWAY_TEST_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (int i = 0; i < MODBUS_GATEWAY_TEST_CLIENTS; i++)
+	{
+		fds[i] = socket(AF_INET, SOCK_STREAM, 0);
+		assert(connect(fds[i], (struct sockaddr*)&addr, sizeof(addr)) == 0);
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		ModBus_TCP_Server_loop(&server, 0);
+	}
+
+	// 单元号映射后读寄存器
+	{
+		byte pdu[] = { READ_REGISTER, 0, 2, 0, 3 };
+		gatewaySend(fds[0], 0x0101, 1, pdu, sizeof(pdu));
+		len = gatewayReceive(fds[0], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 2 + 6 && adu[0] == 0x01 && adu[1] == 0x01 && adu[6] == 1);
+		assert(adu[7] == READ_REGISTER && adu[8] == 6 && adu[9] == 0x01 && adu[10] == 0x02 && adu[14] == 0x04);
+	}
+
+	// 写多寄存器和单寄存器
+	{
+		byte pdu[] = { WRITE_MULTI_REGISTER, 0, 5, 0, 2, 4, 0xAA, 0x01, 0xAA, 0x02 };
+		byte pduSingle[] = { WRITE_SINGLE_REGISTER, 0, 9, 0xBE, 0xEF };
+		gatewaySend(fds[1], 0x0202, 0x11, pdu, sizeof(pdu));
+		len = gatewayReceive(fds[1], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 5 && adu[7] == WRITE_MULTI_REGISTER && adu[11] == 2);
+		assert(g_gatewayRegisters[5] == 0xAA01 && g_gatewayRegisters[6] == 0xAA02);
+		gatewaySend(fds[1], 0x0203, 0x11, pduSingle, sizeof(pduSingle));
+		len = gatewayReceive(fds[1], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 5 && memcmp(adu + 7, pduSingle, 5) == 0 && g_gatewayRegisters[9] == 0xBEEF);
+	}
+
+	// 从机异常码原样转发, 由测试代替从机返回异常帧
+	{
+		byte pdu[] = { READ_REGISTER, 0, 14, 0, 4 };
+		byte exceptionFrame[] = { 0x11, READ_REGISTER | MODBUS_EXCEPTION_FLAG, EXCEPTION_ILLEGAL_DATA_ADDRESS, 0xC1, 0x34 };
+		byte frame[MODBUS_BUFFER_SIZE];
+		gatewaySend(fds[0], 0x0102, 1, pdu, sizeof(pdu));
+		for (int i = 0; i < 10; i++)
+		{
+			ModBus_TCP_Server_loop(&server, 1);
+			ModBus_Gateway_loop(&gateway);
+		}
+		assert(read(ptySlave, frame, sizeof(frame)) == 8 && frame[0] == 0x11 && frame[3] == 14);
+		assert(write(ptySlave, exceptionFrame, sizeof(exceptionFrame)) == sizeof(exceptionFrame));
+		len = gatewayReceive(fds[0], &server, &gateway, &masterPort, &slavePort, NULL, adu);
+		assert(len == MODBUS_MBAP_SIZE + 2 && adu[7] == (READ_REGISTER | MODBUS_EXCEPTION_FLAG) && adu[8] == EXCEPTION_ILLEGAL_DATA_ADDRESS);
+		assert(gateway.m_timeoutCount == 0);
+	}
+
+	// 未映射的单元号返回0x0A, 从机无响应返回0x0B
+	{
+		byte pdu[] = { READ_REGISTER, 0, 0, 0, 1 };
+		gatewaySend(fds[2], 0x0301, 9, pdu, sizeof(pdu));
+		len = gatewayReceive(fds[2], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 2 && adu[8] == EXCEPTION_GATEWAY_PATH_UNAVAILABLE);
+		gatewaySend(fds[2], 0x0302, 0x22, pdu, sizeof(pdu));
+		len = gatewayReceive(fds[2], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 2 && adu[0] == 0x03 && adu[1] == 0x02 && adu[6] == 0x22);
+		assert(adu[7] == (READ_REGISTER | MODBUS_EXCEPTION_FLAG) && adu[8] == EXCEPTION_GATEWAY_TARGET_FAILED);
+		assert(gateway.m_timeoutCount == 1);
+	}
+
+	// 不完整的PDU返回0x03, 未知功能码返回0x01, 都不转发
+	{
+		byte pdu[] = { WRITE_SINGLE_REGISTER, 0, 9 };
+		byte pduUnknown[] = { 0x2B };
+		u32 forwardCount = gateway.m_forwardCount;
+		gatewaySend(fds[2], 0x0304, 1, pdu, sizeof(pdu));
+		len = gatewayReceive(fds[2], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 2 && adu[7] == (WRITE_SINGLE_REGISTER | MODBUS_EXCEPTION_FLAG) && adu[8] == EXCEPTION_ILLEGAL_DATA_VALUE);
+		gatewaySend(fds[2], 0x0305, 1, pduUnknown, sizeof(pduUnknown));
+		len = gatewayReceive(fds[2], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 2 && adu[7] == (0x2B | MODBUS_EXCEPTION_FLAG) && adu[8] == EXCEPTION_ILLEGAL_FUNCTION);
+		assert(gateway.m_forwardCount == forwardCount);
+	}
+
+	// 不同客户端相同的读请求合并, 总线上只发送一次
+	{
+		byte pdu[] = { READ_REGISTER, 0, 0, 0, 4 };
+		u32 forwardCount = gateway.m_forwardCount;
+		g_gatewayReadN = 0;
+		gatewaySend(fds[0], 0x0103, 1, pdu, sizeof(pdu));
+		gatewaySend(fds[1], 0x0204, 0x11, pdu, sizeof(pdu));
+		gatewaySend(fds[2], 0x0303, 0x11, pdu, sizeof(pdu));
+		for (int i = 0; i < MODBUS_GATEWAY_TEST_CLIENTS; i++)
+		{
+			len = gatewayReceive(fds[i], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+			assert(len == MODBUS_MBAP_SIZE + 2 + 8 && adu[0] == i + 1 && adu[9] == 0x01 && adu[16] == 0x03);
+		}
+		assert(g_gatewayReadN == 1 && gateway.m_forwardCount == forwardCount + 1 && gateway.m_mergedCount == 2);
+	}
+
+	// 客户端轮流发送: 客户端0连续4个请求时, 客户端1的请求不必等待全部完成
+	{
+		g_gatewayReadN = 0;
+		for (uint16_t k = 0; k < 4; k++)
+		{
+			byte pdu[] = { READ_REGISTER, 0, (byte)k, 0, 1 };
+			gatewaySend(fds[0], 0x0110 + k, 1, pdu, sizeof(pdu));
+		}
+		{
+			byte pdu[] = { READ_REGISTER, 0, 8, 0, 1 };
+			gatewaySend(fds[1], 0x0210, 1, pdu, sizeof(pdu));
+		}
+		len = gatewayReceive(fds[1], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+		assert(len == MODBUS_MBAP_SIZE + 4 && adu[9] == 0x01 && adu[10] == 0x08);
+		for (uint16_t k = 0; k < 4; k++)
+		{
+			len = gatewayReceive(fds[0], &server, &gateway, &masterPort, &slavePort, &slave, adu);
+			assert(len == MODBUS_MBAP_SIZE + 4 && adu[1] == 0x10 + k && adu[10] == k);
+		}
+		assert(g_gatewayReadN == 5 && (g_gatewayReadOrder[0] == 8 || g_gatewayReadOrder[1] == 8)); // 最多等待客户端0的一个请求
+	}
+
+	// 全部请求已返回, 请求缓冲区全部放回
+	{
+		ModBus_Pool_Stats_T stats;
+		ModBus_Pool_getStats(&gateway.m_requestPool, &stats);
+		assert(stats.used == 0 && stats.peak >= MODBUS_GATEWAY_TEST_CLIENTS && stats.failCount == 0);
+		for (size_t i = 0; i < MODBUS_GATEWAY_READ_BUCKET_N; i++)
+			assert(gateway.m_readBuckets[i] < 0);
+		printf("gateway_unit_test: forwarded %u, merged %u, timeout %u, request peak %u/%u\n", gateway.m_forwardCount, gateway.m_mergedCount, gateway.m_timeoutCount,
+			(unsigned)stats.peak, (unsigned)stats.capacity);
+	}
+
+	for (int i = 0; i < MODBUS_GATEWAY_TEST_CLIENTS; i++)
+	{
+		close(fds[i]);
+	}
+	ModBus_TCP_close(&server);
+	ModBus_Serial_close(&masterPort);
+	ModBus_Serial_close(&slavePort);
+}
+#endif // _UNIT_TEST
+
+#endif // MODBUS_MASTER
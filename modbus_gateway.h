@@ -0,0 +1,95 @@
+#ifndef MOTECMODBUS_GATEWAY_H_
+#define MOTECMODBUS_GATEWAY_H_
+/**** ModBus TCP 转 串口 网关 ****
+** 多个TCP客户端的请求通过一个主机实例转发到串口总线(RTU/ASCII)
+** MBAP单元号映射为串口设备地址, 未映射的单元号返回异常码0x0A
+** 每个客户端独立排队, 轮流发送, 一个客户端的大量请求不会挤掉或阻塞其他客户端的请求
+** 不同客户端相同的读请求(设备/地址/个数相同)在等待期间合并, 总线上只发送一次
+** 从机无响应返回异常码0x0B, 从机返回的异常码原样转发
+** 请求缓冲区作为固定大小内存池(见 modbus_pool.h)使用, 取出/放回和查找可合并的读请求均为O(1), 可排队上万个请求
+** 使用方法:
+****** 配置主机实例(ModBus_setup), 绑定串口(ModBus_Serial_open, 见 modbus_serial.h)
+****** 调用ModBus_TCP_setup配置服务器(从机实例传入NULL)
+****** 调用ModBus_Gateway_setup配置网关, 传入请求缓冲区和客户端缓冲区
+****** 循环调用ModBus_TCP_Server_loop, ModBus_Serial_poll, ModBus_Gateway_loop
+****** 请求缓冲区使用情况可通过 ModBus_Pool_getStats(&gateway.m_requestPool, &stats) 查看
+*/
+
+#include "modbus.h"
+#include "modbus_tcp.h"
+#include "modbus_pool.h"
+
+#ifdef MODBUS_MASTER
+
+#ifndef MODBUS_GATEWAY_CLIENT_PENDING_N
+#define MODBUS_GATEWAY_CLIENT_PENDING_N 8 // 每个客户端最多排队的请求数, 超出后暂停接收此客户端的请求
+#endif
+#define MODBUS_GATEWAY_READ_BUCKET_N 64 // 可合并读请求的散列表大小
+#define MODBUS_GATEWAY_UNIT_NONE 0 // 单元号未映射
+
+typedef struct _MODBUS_GATEWAY_REQUEST_T { // 网关请求, 每个TCP请求占用一个
+	int m_next; // 客户端队列中的下一个请求, -1表示无
+	int m_nextRead; // 散列表同一位置的下一个可合并读请求, -1表示无
+	int m_nextFollower; // 合并到同一总线指令的下一个请求, -1表示无
+	int m_leader; // 合并到的请求序号, -1表示自己发送总线指令
+	int m_client; // 客户端(连接)序号
+	u32 m_generation; // 收到请求时连接的序号
+	byte m_state; // 状态, 见 modbus_gateway.c
+	byte m_header[MODBUS_MBAP_SIZE]; // 请求的MBAP报文头, 返回时使用
+	ModBus_Request_T m_request; // 转发到串口的指令
+} ModBus_Gateway_Request_T;
+
+typedef struct _MODBUS_GATEWAY_CLIENT_T { // 每个连接的请求队列
+	int m_head; // 队列头, -1表示空
+	int m_tail; // 队列尾
+	u32 m_generation; // 队列所属连接的序号
+	uint16_t m_pending; // 未返回的请求数
+} ModBus_Gateway_Client_T;
+
+typedef struct __MODBUS_Gateway {
+	ModBus_TCP_Server_T* m_server; // TCP服务器
+	ModBus_parameter* m_master; // 串口主机实例
+
+	ModBus_Gateway_Request_T* m_requests; // 请求缓冲区, 由调用者提供
+	size_t m_requestCapacity; // 请求缓冲区个数
+	ModBus_Pool_T m_requestPool; // 请求缓冲区内存池, 记录使用个数和峰值
+	int m_readBuckets[MODBUS_GATEWAY_READ_BUCKET_N]; // 可合并读请求(自己发送总线指令的读请求)散列表, 按设备/地址/个数散列
+	ModBus_Gateway_Client_T* m_clients; // 客户端队列, 个数与服务器连接缓冲区相同, 由调用者提供
+	size_t m_nextClient; // 下一个轮到发送的客户端
+	int m_inFlight; // 正在总线上执行的请求, -1表示无
+
+	uint8_t m_unitMap[256]; // MBAP单元号到串口设备地址的映射
+
+	u32 m_forwardCount; // 发送到总线的指令数
+	u32 m_mergedCount; // 合并的读请求数
+	u32 m_timeoutCount; // 从机无响应次数
+	u32 m_busyCount; // 请求缓冲区满, 返回从机忙的次数
+} ModBus_Gateway_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置网关 **/
+/*** 参数 ***
+** server: 已配置的TCP服务器, 网关绑定为其请求处理函数
+** master: 已配置并绑定发送函数的串口主机实例, 网关独占使用
+** requests: 请求缓冲区, 个数决定所有客户端合计最多排队的请求数, 占用 requestCapacity * sizeof(ModBus_Gateway_Request_T) 字节
+** clients: 客户端队列, 个数与服务器的连接缓冲区个数(server->m_connectionCapacity)相同
+** 注: 默认单元号1~247映射为相同的设备地址, 0和255映射为主机实例配置的地址
+***/
+void ModBus_Gateway_setup(ModBus_Gateway_T* gateway, ModBus_TCP_Server_T* server, ModBus_parameter* master, ModBus_Gateway_Request_T* requests, size_t requestCapacity, ModBus_Gateway_Client_T* clients);
+
+/** 设置单元号映射 **/
+/*** 参数 ***
+** unitId: MBAP单元号
+** address: 串口设备地址, MODBUS_GATEWAY_UNIT_NONE 表示不转发, 返回异常码0x0A
+***/
+void ModBus_Gateway_mapUnit(ModBus_Gateway_T* gateway, uint8_t unitId, uint8_t address);
+
+// 网关loop函数, 运行主机实例并按客户端轮流发送排队的请求
+void ModBus_Gateway_loop(ModBus_Gateway_T* gateway);
+
+/**************** 对外接口 END ***************/
+
+#endif // MODBUS_MASTER
+
+#endif
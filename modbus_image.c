@@ -0,0 +1,220 @@
+#include "modbus_image.h"
+
+/** 配置寄存器映像 **/
+/*** 参数 ***
+** baseAddress: 映像首个寄存器的地址
+** buffer: 寄存器缓冲区, 至少 2*count 个, 前 count 个为初始值
+** count: 映像寄存器个数
+***/
+void ModBus_Image_setup(ModBus_RegisterImage_T* image, uint16_t baseAddress, uint16_t* buffer, uint16_t count)
+{
+	atomic_init(&image->m_sequence, 0u);
+	atomic_flag_clear(&image->m_writeLock);
+	image->m_baseAddress = baseAddress;
+	image->m_count = count;
+	image->m_copies[0] = buffer;
+	image->m_copies[1] = buffer + count;
+	memcpy(image->m_copies[1], image->m_copies[0], count * sizeof(uint16_t));
+	image->m_dirtyBegin = count;
+	image->m_dirtyEnd = 0;
+}
+
+// 开始一次写入
+void ModBus_Image_beginWrite(ModBus_RegisterImage_T* image)
+{
+	while (atomic_flag_test_and_set_explicit(&image->m_writeLock, memory_order_acquire))
+	{
+		; // 只与其他写者竞争
+	}
+	image->m_dirtyBegin = image->m_count;
+	image->m_dirtyEnd = 0;
+	ModBus_Seq_writeStep(&image->m_sequence); // 版本号变为奇数, 读者改用副本1, 写者修改副本0
+}
+
+// 在写入过程中修改一个寄存器
+byte ModBus_Image_set(ModBus_RegisterImage_T* image, uint16_t address, uint16_t data)
+{
+	uint16_t index = (uint16_t)(address - image->m_baseAddress);
+	if (address < image->m_baseAddress || index >= image->m_count)
+	{
+		return 0;
+	}
+	image->m_copies[0][index] = data;
+	if (index < image->m_dirtyBegin)
+	{
+		image->m_dirtyBegin = index;
+	}
+	if (index + 1 > image->m_dirtyEnd)
+	{
+		image->m_dirtyEnd = index + 1;
+	}
+	return 1;
+}
+
+// 提交写入
+void ModBus_Image_commit(ModBus_RegisterImage_T* image)
+{
+	ModBus_Seq_writeStep(&image->m_sequence); // 版本号变为偶数, 读者改用已更新的副本0
+	if (image->m_dirtyBegin < image->m_dirtyEnd) // 只同步本次修改的范围到副本1
+	{
+		memcpy(image->m_copies[1] + image->m_dirtyBegin, image->m_copies[0] + image->m_dirtyBegin, (image->m_dirtyEnd - image->m_dirtyBegin) * sizeof(uint16_t));
+	}
+	atomic_flag_clear_explicit(&image->m_writeLock, memory_order_release);
+}
+
+/** 写入多个寄存器并提交 **/
+/*** 参数 ***
+** address: 寄存器首地址
+** count: 寄存器个数
+** data: 待写入数据
+** 返回写入的个数, 超出映像范围返回0
+***/
+size_t ModBus_Image_write(ModBus_RegisterImage_T* image, uint16_t address, uint16_t count, const uint16_t* data)
+{
+	if (address < image->m_baseAddress || (u32)(address - image->m_baseAddress) + count > image->m_count)
+	{
+		return 0;
+	}
+	ModBus_Image_beginWrite(image);
+	for (uint16_t i = 0; i < count; i++)
+	{
+		ModBus_Image_set(image, (uint16_t)(address + i), data[i]);
+	}
+	ModBus_Image_commit(image);
+	return count;
+}
+
+/** 无锁读取多个寄存器 **/
+/*** 参数 ***
+** address: 寄存器首地址
+** count: 寄存器个数
+** data: 读出的数据
+** 返回读取的个数, 超出映像范围返回0
+***/
+size_t ModBus_Image_read(ModBus_RegisterImage_T* image, uint16_t address, uint16_t count, uint16_t* data)
+{
+	uint16_t index = (uint16_t)(address - image->m_baseAddress);
+	unsigned sequence;
+	if (address < image->m_baseAddress || (u32)index + count > image->m_count)
+	{
+		return 0;
+	}
+	do
+	{
+		// 读取期间写者只修改另一份副本; 写者再次切换副本时版本号变化, 重新读取
+		sequence = ModBus_Seq_readBegin(&image->m_sequence);
+		memcpy(data, image->m_copies[sequence & 1u] + index, count * sizeof(uint16_t));
+	} while (ModBus_Seq_readRetry(&image->m_sequence, sequence));
+	return count;
+}
+
+#if defined(_UNIT_TEST)
+#include <stdio.h>
+#include <pthread.h>
+
+#define MODBUS_IMAGE_TEST_COUNT 16 // 映像寄存器个数
+#define MODBUS_IMAGE_TEST_WIDE 8192 // 并发读取的映像寄存器个数, 读取耗时较长更容易与提交交错
+#define MODBUS_IMAGE_TEST_WRITE_N 2000 // 并发读取时每个写者的提交次数
+#define MODBUS_IMAGE_TEST_READER_N 2
+
+static ModBus_RegisterImage_T g_image;
+static atomic_uint g_imageRunning;
+static atomic_uint g_imageReadN;
+static atomic_uint g_imageTornN; // 不一致的读取次数, 应为0
+
+// 读取线程: 每次提交写入的寄存器值都相同, 不同即读到了不同提交的值; 交替读取全部和中间一段
+static void* imageReader(void* arg)
+{
+	uint16_t data[MODBUS_IMAGE_TEST_WIDE];
+	(void)arg;
+	while (atomic_load(&g_imageRunning))
+	{
+		u32 n = atomic_fetch_add(&g_imageReadN, 1u);
+		uint16_t address = (n & 1u) ? 100 : 103, count = (n & 1u) ? MODBUS_IMAGE_TEST_WIDE : 7;
+		if (ModBus_Image_read(&g_image, address, count, data) != count)
+		{
+			atomic_fetch_add(&g_imageTornN, 1u);
+			continue;
+		}
+		for (uint16_t k = 1; k < count; k++)
+		{
+			if (data[k] != data[0])
+			{
+				atomic_fetch_add(&g_imageTornN, 1u);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+// 写入线程: 逐个修改后提交, 与另一写者互斥
+static void* imageWriter(void* arg)
+{
+	static atomic_uint value;
+	(void)arg;
+	for (u32 i = 0; i < MODBUS_IMAGE_TEST_WRITE_N; i++)
+	{
+		ModBus_Image_beginWrite(&g_image);
+		uint16_t v = (uint16_t)(atomic_fetch_add(&value, 1u) + 1u);
+		for (uint16_t k = 0; k < MODBUS_IMAGE_TEST_WIDE; k++)
+			ModBus_Image_set(&g_image, (uint16_t)(100 + k), v);
+		ModBus_Image_commit(&g_image);
+	}
+	return NULL;
+}
+
+// 双缓冲写入和读取, 并发写入时多寄存器读取不会读到两次提交混合的值
+void image_unit_test()
+{
+	static uint16_t buffer[2 * MODBUS_IMAGE_TEST_COUNT], wide[2 * MODBUS_IMAGE_TEST_WIDE];
+	uint16_t data[MODBUS_IMAGE_TEST_COUNT], values[3] = { 0x11, 0x22, 0x33 };
+	pthread_t readers[MODBUS_IMAGE_TEST_READER_N], writers[2];
+
+	for (uint16_t k = 0; k < MODBUS_IMAGE_TEST_COUNT; k++)
+		buffer[k] = k;
+	ModBus_Image_setup(&g_image, 100, buffer, MODBUS_IMAGE_TEST_COUNT);
+	assert(ModBus_Image_read(&g_image, 100, MODBUS_IMAGE_TEST_COUNT, data) == MODBUS_IMAGE_TEST_COUNT && data[15] == 15);
+	assert(ModBus_Image_read(&g_image, 99, 1, data) == 0 && ModBus_Image_read(&g_image, 110, 7, data) == 0);
+	assert(ModBus_Image_write(&g_image, 114, 3, values) == 0 && ModBus_Image_write(&g_image, 113, 3, values) == 3);
+	assert(ModBus_Image_read(&g_image, 112, 4, data) == 4 && data[0] == 12 && data[1] == 0x11 && data[3] == 0x33);
+	ModBus_Image_beginWrite(&g_image);
+	assert(ModBus_Image_set(&g_image, 101, 0xAA) && !ModBus_Image_set(&g_image, 116, 0xBB));
+	assert(ModBus_Image_read(&g_image, 101, 1, data) == 1 && data[0] == 1); // 提交前读到上次的值
+	ModBus_Image_commit(&g_image);
+	assert(ModBus_Image_read(&g_image, 101, 1, data) == 1 && data[0] == 0xAA);
+	assert(buffer[MODBUS_IMAGE_TEST_COUNT + 1] == 0xAA && buffer[MODBUS_IMAGE_TEST_COUNT + 14] == 0x22); // 两份副本已同步
+
+#ifdef MODBUS_SLAVE
+	{
+		ModBus_parameter slave;
+		ModBus_Setting_T modbusSetting = { 0 };
+		const byte pdu[] = { READ_REGISTER, 0, 113, 0, 2 };
+		byte response[MODBUS_BUFFER_SIZE];
+		modbusSetting.address = 0x01;
+		modbusSetting.baudRate = 9600;
+		modbusSetting.frameType = RTU;
+		modbusSetting.register_access_limit = 5;
+		ModBus_setup(&slave, modbusSetting);
+		ModBus_attachRegisterImage(&slave, &g_image);
+		assert(ModBus_Slave_handlePDU(&slave, pdu, sizeof(pdu), response) == 6 && response[3] == 0x11 && response[5] == 0x22);
+	}
+#endif
+
+	// 两个写者和两个读者并发
+	ModBus_Image_setup(&g_image, 100, wide, MODBUS_IMAGE_TEST_WIDE);
+	atomic_store(&g_imageRunning, 1u);
+	for (int i = 0; i < MODBUS_IMAGE_TEST_READER_N; i++)
+		pthread_create(readers + i, NULL, imageReader, NULL);
+	for (int i = 0; i < 2; i++)
+		pthread_create(writers + i, NULL, imageWriter, NULL);
+	for (int i = 0; i < 2; i++)
+		pthread_join(writers[i], NULL);
+	atomic_store(&g_imageRunning, 0u);
+	for (int i = 0; i < MODBUS_IMAGE_TEST_READER_N; i++)
+		pthread_join(readers[i], NULL);
+	assert(atomic_load(&g_imageTornN) == 0);
+	assert(ModBus_Image_read(&g_image, 100 + MODBUS_IMAGE_TEST_WIDE - 1, 1, data) == 1 && data[0] == (uint16_t)(2 * MODBUS_IMAGE_TEST_WRITE_N));
+	printf("image_unit_test: %u commits with %u concurrent reads, %u torn\n", 2u * MODBUS_IMAGE_TEST_WRITE_N, atomic_load(&g_imageReadN), atomic_load(&g_imageTornN));
+}
+#endif // _UNIT_TEST
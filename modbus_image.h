@@ -0,0 +1,86 @@
+#ifndef MOTECMODBUS_IMAGE_H_
+#define MOTECMODBUS_IMAGE_H_
+/**** ModBus 从机寄存器映像 ****
+** 双缓冲 + 版本号(seqlock latch)发布, 应用线程更新寄存器时不阻塞从机
+** 写者在一份副本上修改, 提交时切换读者使用的副本, 再同步另一份副本
+** 读者不加锁, 总能读到某一次提交后的一致的多寄存器值
+** 写者被抢占时读者读取另一份稳定副本, 不会等待写者
+** 使用方法:
+****** 调用ModBus_Image_setup配置, 传入 2*count 个寄存器的缓冲区
+****** 调用ModBus_attachRegisterImage绑定到从机实例
+****** 应用线程调用ModBus_Image_write, 或ModBus_Image_beginWrite/ModBus_Image_set/ModBus_Image_commit批量更新
+*/
+
+#include "modbus.h"
+#include <stdatomic.h>
+
+typedef struct __MODBUS_RegisterImage {
+	atomic_uint m_sequence; // 版本号, 最低位选择读者使用的副本
+	atomic_flag m_writeLock; // 多个写者之间互斥, 不影响读者
+	uint16_t m_baseAddress; // 映像首个寄存器的地址
+	uint16_t m_count; // 映像寄存器个数
+	uint16_t* m_copies[2]; // 两份寄存器副本
+	uint16_t m_dirtyBegin; // 本次写入修改的起始序号
+	uint16_t m_dirtyEnd; // 本次写入修改的结束序号的下一个
+} ModBus_RegisterImage_T;
+
+/**** 版本号(seqlock)基本操作, 也可用于其他需要无锁一致读取的数据 ****/
+// 读者开始读取, 返回当前版本号
+static inline unsigned ModBus_Seq_readBegin(atomic_uint* sequence)
+{
+	return atomic_load_explicit(sequence, memory_order_acquire);
+}
+
+// 读者结束读取, 读取期间版本号变化(数据可能不一致)返回1, 需要重新读取
+static inline int ModBus_Seq_readRetry(atomic_uint* sequence, unsigned begin)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(sequence, memory_order_relaxed) != begin;
+}
+
+// 写者递增版本号, 之前的数据写入先于版本号可见, 之后的数据写入不会早于版本号可见
+static inline void ModBus_Seq_writeStep(atomic_uint* sequence)
+{
+	atomic_fetch_add_explicit(sequence, 1u, memory_order_acq_rel);
+}
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置寄存器映像 **/
+/*** 参数 ***
+** baseAddress: 映像首个寄存器的地址
+** buffer: 寄存器缓冲区, 至少 2*count 个, 前 count 个为初始值
+** count: 映像寄存器个数
+***/
+void ModBus_Image_setup(ModBus_RegisterImage_T* image, uint16_t baseAddress, uint16_t* buffer, uint16_t count);
+
+// 开始一次写入, 多个写者之间互斥; 之后调用ModBus_Image_set修改, ModBus_Image_commit提交
+void ModBus_Image_beginWrite(ModBus_RegisterImage_T* image);
+
+// 在写入过程中修改一个寄存器, 地址超出映像范围返回0, 成功返回1
+byte ModBus_Image_set(ModBus_RegisterImage_T* image, uint16_t address, uint16_t data);
+
+// 提交写入, 读者之后读到的是本次写入后的值
+void ModBus_Image_commit(ModBus_RegisterImage_T* image);
+
+/** 写入多个寄存器并提交 **/
+/*** 参数 ***
+** address: 寄存器首地址
+** count: 寄存器个数
+** data: 待写入数据
+** 返回写入的个数, 超出映像范围返回0
+***/
+size_t ModBus_Image_write(ModBus_RegisterImage_T* image, uint16_t address, uint16_t count, const uint16_t* data);
+
+/** 无锁读取多个寄存器 **/
+/*** 参数 ***
+** address: 寄存器首地址
+** count: 寄存器个数
+** data: 读出的数据, 保证为同一次提交后的值
+** 返回读取的个数, 超出映像范围返回0
+***/
+size_t ModBus_Image_read(ModBus_RegisterImage_T* image, uint16_t address, uint16_t count, uint16_t* data);
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,377 @@
+#include "modbus_lifecycle.h"
+#include <stdio.h>
+
+#define MODBUS_LIFECYCLE_WIRE_MASK ((1u << MODBUS_LIFECYCLE_TX_START) | (1u << MODBUS_LIFECYCLE_TX_COMPLETE) | (1u << MODBUS_LIFECYCLE_FIRST_BYTE) | (1u << MODBUS_LIFECYCLE_FRAME_COMPLETE))
+
+static const MODBUS_LIFECYCLE_STAMP_TYPE g_phaseStamps[MODBUS_LIFECYCLE_PHASE_N][2] = { // 各阶段的起止时刻
+	{ MODBUS_LIFECYCLE_ENQUEUE, MODBUS_LIFECYCLE_HEAD },
+	{ MODBUS_LIFECYCLE_HEAD, MODBUS_LIFECYCLE_TX_START },
+	{ MODBUS_LIFECYCLE_TX_START, MODBUS_LIFECYCLE_TX_COMPLETE },
+	{ MODBUS_LIFECYCLE_TX_COMPLETE, MODBUS_LIFECYCLE_FIRST_BYTE },
+	{ MODBUS_LIFECYCLE_FIRST_BYTE, MODBUS_LIFECYCLE_FRAME_COMPLETE },
+	{ MODBUS_LIFECYCLE_FRAME_COMPLETE, MODBUS_LIFECYCLE_CALLBACK_RETURN },
+	{ MODBUS_LIFECYCLE_ENQUEUE, MODBUS_LIFECYCLE_CALLBACK_RETURN },
+};
+
+static const char* const g_phaseNames[MODBUS_LIFECYCLE_PHASE_N] = { "queueing", "dispatch", "wire", "turnaround", "receive", "callback", "total" };
+
+// 默认计时函数: 协议的时间源(毫秒)
+static u32 ModBus_Lifecycle_millis(void)
+{
+	return ModBus_millis();
+}
+
+// 记录时刻
+static void ModBus_Lifecycle_stamp(ModBus_Lifecycle_Record_T* record, MODBUS_LIFECYCLE_STAMP_TYPE stamp, u32 time)
+{
+	record->stamps[stamp] = time;
+	record->stamped |= (u8)(1u << stamp);
+}
+
+// 配置生命周期记录
+void ModBus_Lifecycle_setup(ModBus_Lifecycle_T* lifecycle, ModBus_Lifecycle_Record_T* records, size_t capacity, u32(*clock)(void), u32 clockHz)
+{
+	memset(lifecycle, 0, sizeof(ModBus_Lifecycle_T));
+	lifecycle->m_clock = clock != NULL ? clock : ModBus_Lifecycle_millis;
+	lifecycle->m_clockHz = clock != NULL && clockHz > 0 ? clockHz : 1000u;
+	lifecycle->m_records = records;
+	lifecycle->m_capacity = records != NULL ? capacity : 0;
+}
+
+// 主机实例绑定生命周期记录
+void ModBus_attachLifecycle(ModBus_parameter* ModBus_para, ModBus_Lifecycle_T* lifecycle)
+{
+#ifdef MODBUS_LIFECYCLE
+	ModBus_para->m_lifecycle = lifecycle;
+#endif
+}
+
+// 设置指令结束时的回调函数
+void ModBus_Lifecycle_setHandler(ModBus_Lifecycle_T* lifecycle, void(*handler)(void*, const ModBus_Lifecycle_Record_T*), void* context)
+{
+	lifecycle->m_handler = handler;
+	lifecycle->m_handlerContext = context;
+}
+
+// 串口发送完成, 可在中断中调用
+void ModBus_Lifecycle_txComplete(ModBus_parameter* ModBus_para)
+{
+#ifdef MODBUS_LIFECYCLE
+	ModBus_Lifecycle_T* lifecycle = ModBus_para->m_lifecycle;
+	if (lifecycle != NULL && lifecycle->m_armed && !lifecycle->m_firstByteSeen)
+	{
+		lifecycle->m_txCompleteTime = (*lifecycle->m_clock)();
+		lifecycle->m_txCompleteSeen = 1;
+	}
+#endif
+}
+
+// 两个时刻之差(微秒)
+u32 ModBus_Lifecycle_elapsedUs(const ModBus_Lifecycle_T* lifecycle, const ModBus_Lifecycle_Record_T* record, MODBUS_LIFECYCLE_STAMP_TYPE from, MODBUS_LIFECYCLE_STAMP_TYPE to)
+{
+	u32 ticks;
+	unsigned long long us;
+	if (!(record->stamped & (1u << from)) || !(record->stamped & (1u << to)))
+	{
+		return 0;
+	}
+	ticks = record->stamps[to] - record->stamps[from];
+	if (lifecycle->m_clockHz == 1000000u)
+	{
+		return ticks;
+	}
+	us = (unsigned long long)ticks * 1000000u / lifecycle->m_clockHz;
+	return us > 0xFFFFFFFFu ? 0xFFFFFFFFu : (u32)us;
+}
+
+// 阶段累计
+const ModBus_Lifecycle_Phase_T* ModBus_Lifecycle_phase(const ModBus_Lifecycle_T* lifecycle, MODBUS_LIFECYCLE_PHASE_TYPE phase)
+{
+	return lifecycle->m_phases + phase;
+}
+
+// 按阶段逐行输出
+size_t ModBus_Lifecycle_dump(const ModBus_Lifecycle_T* lifecycle, void(*writeLine)(void*, const char*), void* context)
+{
+	char line[96];
+	snprintf(line, sizeof(line), "%-10s %8s %10s %10s %10s %10s", "phase", "count", "avg_us", "p50_us", "p99_us", "max_us");
+	(*writeLine)(context, line);
+	for (int k = 0; k < MODBUS_LIFECYCLE_PHASE_N; k++)
+	{
+		const ModBus_Lifecycle_Phase_T* phase = lifecycle->m_phases + k;
+		u32 count = phase->histogram.count;
+		snprintf(line, sizeof(line), "%-10s %8u %10llu %10u %10u %10u", g_phaseNames[k], count, count > 0 ? phase->sumUs / count : 0ull,
+			ModBus_Histogram_percentile(&phase->histogram, 50), ModBus_Histogram_percentile(&phase->histogram, 99), phase->histogram.max);
+		(*writeLine)(context, line);
+	}
+	return MODBUS_LIFECYCLE_PHASE_N + 1;
+}
+
+// 指令入队
+void ModBus_Lifecycle_enqueue(ModBus_Lifecycle_T* lifecycle, u8 index)
+{
+	lifecycle->m_enqueueTime[index] = (*lifecycle->m_clock)();
+}
+
+// 调用发送函数前: 队首指令开始记录, 同一指令再次发送时重新记录发送之后的时刻
+void ModBus_Lifecycle_txStart(ModBus_Lifecycle_T* lifecycle, u8 index)
+{
+	ModBus_Lifecycle_Record_T* record = &lifecycle->m_current;
+	u32 now = (*lifecycle->m_clock)();
+	lifecycle->m_armed = 0;
+	lifecycle->m_firstByteSeen = 0;
+	lifecycle->m_txCompleteSeen = 0;
+	if (record->index != index)
+	{
+		u32 enqueueTime = lifecycle->m_enqueueTime[index];
+		memset(record, 0, sizeof(ModBus_Lifecycle_Record_T));
+		record->index = index;
+		ModBus_Lifecycle_stamp(record, MODBUS_LIFECYCLE_ENQUEUE, enqueueTime);
+		// 入队时队列中有其他指令, 则上一条指令结束时成为队首
+		ModBus_Lifecycle_stamp(record, MODBUS_LIFECYCLE_HEAD, (int32_t)(lifecycle->m_lastEndTime - enqueueTime) > 0 ? lifecycle->m_lastEndTime : enqueueTime);
+	}
+	record->stamped &= (u8)~MODBUS_LIFECYCLE_WIRE_MASK;
+	record->attempts++;
+	ModBus_Lifecycle_stamp(record, MODBUS_LIFECYCLE_TX_START, now);
+	lifecycle->m_armed = 1;
+}
+
+// 发送函数返回后: 没有发送完成中断时以此为发送完成
+void ModBus_Lifecycle_txReturn(ModBus_Lifecycle_T* lifecycle)
+{
+	u32 now = (*lifecycle->m_clock)();
+	if (lifecycle->m_armed && !lifecycle->m_txCompleteSeen)
+	{
+		lifecycle->m_txCompleteTime = now;
+		lifecycle->m_txCompleteSeen = 1;
+	}
+}
+
+// 接收到字节, 在接收中断中调用; 只记录发送后的第一个字节
+void ModBus_Lifecycle_firstByte(ModBus_Lifecycle_T* lifecycle)
+{
+	if (lifecycle->m_armed && !lifecycle->m_firstByteSeen)
+	{
+		lifecycle->m_firstByteTime = (*lifecycle->m_clock)();
+		lifecycle->m_firstByteSeen = 1;
+	}
+}
+
+// 检测到完整的返回帧, 返回帧与指令不对应时由之后的帧覆盖
+void ModBus_Lifecycle_frameComplete(ModBus_Lifecycle_T* lifecycle, u8 index)
+{
+	if (lifecycle->m_current.index == index && index != 0)
+	{
+		ModBus_Lifecycle_stamp(&lifecycle->m_current, MODBUS_LIFECYCLE_FRAME_COMPLETE, (*lifecycle->m_clock)());
+	}
+}
+
+// 回调返回, 指令结束: 写入记录并累计各阶段
+void ModBus_Lifecycle_finish(ModBus_Lifecycle_T* lifecycle, u8 index, uint8_t unit, u8 type, MODBUS_STATUS_TYPE status)
+{
+	ModBus_Lifecycle_Record_T record;
+	u32 now = (*lifecycle->m_clock)();
+	if (lifecycle->m_current.index == index && index != 0) // 已发送的指令
+	{
+		record = lifecycle->m_current;
+		lifecycle->m_armed = 0;
+		if (lifecycle->m_txCompleteSeen)
+		{
+			ModBus_Lifecycle_stamp(&record, MODBUS_LIFECYCLE_TX_COMPLETE, lifecycle->m_txCompleteTime);
+		}
+		if (lifecycle->m_firstByteSeen)
+		{
+			ModBus_Lifecycle_stamp(&record, MODBUS_LIFECYCLE_FIRST_BYTE, lifecycle->m_firstByteTime);
+		}
+		lifecycle->m_current.index = 0;
+		lifecycle->m_lastEndTime = now;
+	}
+	else // 未发送就结束的指令(丢弃, 参数无效)
+	{
+		memset(&record, 0, sizeof(record));
+		record.index = index;
+		if (index != 0)
+		{
+			ModBus_Lifecycle_stamp(&record, MODBUS_LIFECYCLE_ENQUEUE, lifecycle->m_enqueueTime[index]);
+		}
+	}
+	record.unit = unit;
+	record.type = type;
+	record.status = status;
+	ModBus_Lifecycle_stamp(&record, MODBUS_LIFECYCLE_CALLBACK_RETURN, now);
+
+	for (int k = 0; k < MODBUS_LIFECYCLE_PHASE_N; k++)
+	{
+		if ((record.stamped & (1u << g_phaseStamps[k][0])) && (record.stamped & (1u << g_phaseStamps[k][1])))
+		{
+			u32 us = ModBus_Lifecycle_elapsedUs(lifecycle, &record, g_phaseStamps[k][0], g_phaseStamps[k][1]);
+			lifecycle->m_phases[k].sumUs += us;
+			ModBus_Histogram_add(&lifecycle->m_phases[k].histogram, us);
+		}
+	}
+	if (lifecycle->m_capacity > 0)
+	{
+		lifecycle->m_records[lifecycle->m_recordN % lifecycle->m_capacity] = record;
+	}
+	lifecycle->m_recordN++;
+	if (lifecycle->m_handler != NULL)
+	{
+		(*lifecycle->m_handler)(lifecycle->m_handlerContext, &record);
+	}
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE) && defined(MODBUS_LIFECYCLE)
+#include "modbus_sim.h"
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_lifecycleRegisters[4] = { 1, 2, 3, 4 };
+static u32 g_lifecycleDone, g_lifecycleHandled;
+
+static size_t lifecycleGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 4)
+		return 0;
+	memcpy(data, g_lifecycleRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static void lifecycleResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	(void)result;
+	g_lifecycleDone++;
+}
+
+// 结束的记录: 已记录的时刻不减小
+static void lifecycleHandler(void* context, const ModBus_Lifecycle_Record_T* record)
+{
+	u32 last = 0;
+	(void)context;
+	g_lifecycleHandled++;
+	for (int k = 0; k < MODBUS_LIFECYCLE_STAMP_N; k++)
+	{
+		if (record->stamped & (1u << k))
+		{
+			assert(record->stamps[k] >= last);
+			last = record->stamps[k];
+		}
+	}
+}
+
+static void lifecycleNoSend(void* context, byte* data, size_t len)
+{
+	(void)context;
+	(void)data;
+	(void)len;
+}
+
+static void lifecycleWriteLine(void* context, const char* line)
+{
+	(void)context;
+	printf("lifecycle: %s\n", line);
+}
+
+// 虚拟总线(9600 8E1)上同时提交三条读指令和一条无应答设备的指令, 各阶段耗时与总线时序一致
+void lifecycle_unit_test()
+{
+	static ModBus_Sim_T bus;
+	static ModBus_Sim_Node_T nodes[2];
+	static ModBus_parameter master, slave;
+	static ModBus_Lifecycle_T lifecycle;
+	static ModBus_Lifecycle_Record_T records[8];
+	ModBus_Sim_Setting_T setting = { 0 };
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+	u32 byteUs, slaveUs, queueing[3], phaseUs[3] = { 0 };
+
+	setting.baudRate = 9600;
+	setting.parity = MODBUS_SIM_PARITY_EVEN;
+	ModBus_Sim_setup(&bus, setting, nodes, 2);
+	byteUs = bus.m_byteTimeUs;
+	modbusSetting.frameType = RTU;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	modbusSetting.address = 0x01;
+	ModBus_setup(&master, modbusSetting);
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_attachRegisterHandler(&slave, lifecycleGetReg, NULL);
+	slaveUs = slave.m_receiveTimeout * 1000u + 2000u + byteUs;
+	ModBus_Sim_attach(&bus, &master, MODBUS_SIM_MASTER, 0);
+	ModBus_Sim_attach(&bus, &slave, MODBUS_SIM_SLAVE, 2000);
+	ModBus_Lifecycle_setup(&lifecycle, records, 8, ModBus_Sim_micros, 1000000u);
+	ModBus_Lifecycle_setHandler(&lifecycle, lifecycleHandler, NULL);
+	ModBus_attachLifecycle(&master, &lifecycle);
+
+	request.resultHandler = lifecycleResult;
+	request.type = READ_REGISTER;
+	request.count = 2;
+	for (int i = 0; i < 4; i++)
+	{
+		request.unit = i < 3 ? 0x01 : 0x05; // 最后一条发给不存在的设备
+		request.address = (uint16_t)(i % 3);
+		assert(ModBus_request(&master, &request) != 0);
+	}
+	for (int i = 0; i < 2000 && g_lifecycleDone < 4; i++)
+	{
+		ModBus_Sim_run(&bus, 1000);
+	}
+	assert(g_lifecycleDone == 4 && g_lifecycleHandled == 4 && lifecycle.m_recordN == 4);
+
+	for (int i = 0; i < 3; i++)
+	{
+		const ModBus_Lifecycle_Record_T* record = records + i;
+		u32 wire = ModBus_Lifecycle_elapsedUs(&lifecycle, record, MODBUS_LIFECYCLE_TX_START, MODBUS_LIFECYCLE_TX_COMPLETE);
+		u32 turnaround = ModBus_Lifecycle_elapsedUs(&lifecycle, record, MODBUS_LIFECYCLE_TX_COMPLETE, MODBUS_LIFECYCLE_FIRST_BYTE);
+		u32 receive = ModBus_Lifecycle_elapsedUs(&lifecycle, record, MODBUS_LIFECYCLE_FIRST_BYTE, MODBUS_LIFECYCLE_FRAME_COMPLETE);
+		assert(record->status == MODBUS_STATUS_OK && record->unit == 0x01 && record->type == READ_REGISTER && record->attempts == 1);
+		assert(record->stamped == (1u << MODBUS_LIFECYCLE_STAMP_N) - 1u); // 七个时刻都已记录
+		assert(wire >= 8 * byteUs && wire < 8 * byteUs + 1000); // 请求帧8字节
+		assert(turnaround >= slaveUs && turnaround < slaveUs + 2000); // 从机接收超时后处理请求, 再经过应答延时和第一个字节
+		assert(receive >= 8 * byteUs && receive < 8 * byteUs + 1000); // 返回帧9字节, 第一个字节之后的8字节
+		phaseUs[0] += wire;
+		phaseUs[1] += turnaround;
+		phaseUs[2] += receive;
+		queueing[i] = ModBus_Lifecycle_elapsedUs(&lifecycle, record, MODBUS_LIFECYCLE_ENQUEUE, MODBUS_LIFECYCLE_HEAD);
+		if (i > 0) // 前一条指令结束时成为队首
+		{
+			assert(record->stamps[MODBUS_LIFECYCLE_HEAD] == records[i - 1].stamps[MODBUS_LIFECYCLE_CALLBACK_RETURN]);
+			assert(queueing[i] > queueing[i - 1]);
+		}
+	}
+	assert(queueing[0] == 0);
+
+	// 无应答: 没有返回字节和返回帧, 各阶段只累计已记录的时刻
+	assert(records[3].status == MODBUS_STATUS_TIMEOUT && records[3].unit == 0x05);
+	assert(!(records[3].stamped & (1u << MODBUS_LIFECYCLE_FIRST_BYTE)) && !(records[3].stamped & (1u << MODBUS_LIFECYCLE_FRAME_COMPLETE)));
+	assert(ModBus_Lifecycle_elapsedUs(&lifecycle, records + 3, MODBUS_LIFECYCLE_TX_START, MODBUS_LIFECYCLE_CALLBACK_RETURN) >= master.m_sendTimeout * 1000u);
+	assert(ModBus_Lifecycle_phase(&lifecycle, MODBUS_LIFECYCLE_WIRE)->histogram.count == 4);
+	assert(ModBus_Lifecycle_phase(&lifecycle, MODBUS_LIFECYCLE_TURNAROUND)->histogram.count == 3);
+	assert(ModBus_Lifecycle_phase(&lifecycle, MODBUS_LIFECYCLE_TOTAL)->histogram.count == 4);
+	assert(ModBus_Lifecycle_dump(&lifecycle, lifecycleWriteLine, NULL) == MODBUS_LIFECYCLE_PHASE_N + 1);
+	ModBus_Sim_close(&bus);
+
+	// 默认计时函数(毫秒), 没有发送完成中断时以发送函数返回为发送完成; 被丢弃的指令只有入队和结束时刻
+	ModBus_setup(&master, modbusSetting);
+	ModBus_attachSendHandler(&master, lifecycleNoSend, NULL);
+	ModBus_Lifecycle_setup(&lifecycle, records, 2, NULL, 0);
+	ModBus_attachLifecycle(&master, &lifecycle);
+	ModBus_fastMode(&master, 1);
+	request.unit = 0x01;
+	ModBus_request(&master, &request);
+	t += 5;
+	ModBus_request(&master, &request);
+	ModBus_Master_loop(&master);
+	assert(lifecycle.m_recordN == 1 && records[0].status == MODBUS_STATUS_DROPPED);
+	assert(records[0].stamped == ((1u << MODBUS_LIFECYCLE_ENQUEUE) | (1u << MODBUS_LIFECYCLE_CALLBACK_RETURN)));
+	assert(ModBus_Lifecycle_elapsedUs(&lifecycle, records, MODBUS_LIFECYCLE_ENQUEUE, MODBUS_LIFECYCLE_CALLBACK_RETURN) == 5000);
+	t += master.m_sendTimeout;
+	ModBus_Master_loop(&master);
+	assert(lifecycle.m_recordN == 2 && records[1].status == MODBUS_STATUS_TIMEOUT);
+	assert(records[1].stamps[MODBUS_LIFECYCLE_TX_COMPLETE] == records[1].stamps[MODBUS_LIFECYCLE_TX_START]);
+	ModBus_fastMode(&master, 0);
+
+	printf("lifecycle_unit_test: wire %u us, turnaround %u us, receive %u us, queueing %u/%u/%u us\n",
+		phaseUs[0] / 3, phaseUs[1] / 3, phaseUs[2] / 3, queueing[0], queueing[1], queueing[2]);
+}
+#endif // _UNIT_TEST
@@ -0,0 +1,121 @@
+#ifndef MOTECMODBUS_LIFECYCLE_H_
+#define MOTECMODBUS_LIFECYCLE_H_
+/**** ModBus 主机指令生命周期 ****
+** MODBUS_FRAME_T::time 只记录入队时刻, 无法知道慢的指令把时间花在哪里
+** 每条指令记录七个时刻: 入队, 成为队首, 开始发送, 发送完成, 收到第一个返回字节, 返回帧完整, 回调返回
+** 相邻时刻之差为各阶段: 排队, 等待发送, 发送(线上), 设备应答延时, 接收, 回调; 按阶段累计微秒直方图
+** 时刻来自可替换的高精度计时函数, 比如:
+******   Cortex-M: DWT->CYCCNT, 频率 SystemCoreClock
+******   Linux: clock_gettime(CLOCK_MONOTONIC) 换算的微秒, 频率 1000000
+******   虚拟总线: ModBus_Sim_micros, 频率 1000000
+** 结束的指令写入调用者提供的环形记录缓冲区, 也可设置回调函数逐条取得记录
+** 使用方法:
+****** 在 modbus.h 中开启 MODBUS_LIFECYCLE(默认开启); 实例未绑定时只多一次判断
+****** 调用ModBus_Lifecycle_setup配置, 传入记录缓冲区和计时函数
+****** 调用ModBus_attachLifecycle将主机实例绑定
+****** 串口有发送完成中断(TC)时, 在中断中调用ModBus_Lifecycle_txComplete, 否则以发送函数返回的时刻为发送完成
+****** 调用ModBus_Lifecycle_dump按阶段输出次数, 平均值和百分位(微秒)
+** 注: 一个生命周期记录只绑定一个主机实例; 首字节和发送完成时刻可在中断中记录, 其余在loop线程中记录
+** 注: 成为队首的时刻取入队时刻与上一条指令结束时刻中较晚的一个
+*/
+
+#include "modbus.h"
+#include "modbus_stats.h"
+
+typedef enum {
+	MODBUS_LIFECYCLE_ENQUEUE, // 入队(addFrame)
+	MODBUS_LIFECYCLE_HEAD, // 成为队首
+	MODBUS_LIFECYCLE_TX_START, // 调用发送函数
+	MODBUS_LIFECYCLE_TX_COMPLETE, // 发送完成(发送函数返回, 或ModBus_Lifecycle_txComplete)
+	MODBUS_LIFECYCLE_FIRST_BYTE, // 收到第一个返回字节(ModBus_readByteFromOuter)
+	MODBUS_LIFECYCLE_FRAME_COMPLETE, // 检测到完整的返回帧
+	MODBUS_LIFECYCLE_CALLBACK_RETURN, // 回调函数返回, 指令结束
+	MODBUS_LIFECYCLE_STAMP_N,
+} MODBUS_LIFECYCLE_STAMP_TYPE;
+
+typedef enum {
+	MODBUS_LIFECYCLE_QUEUEING, // 入队 -> 成为队首
+	MODBUS_LIFECYCLE_DISPATCH, // 成为队首 -> 开始发送
+	MODBUS_LIFECYCLE_WIRE, // 开始发送 -> 发送完成
+	MODBUS_LIFECYCLE_TURNAROUND, // 发送完成 -> 第一个返回字节, 设备应答延时
+	MODBUS_LIFECYCLE_RECEIVE, // 第一个返回字节 -> 返回帧完整
+	MODBUS_LIFECYCLE_CALLBACK, // 返回帧完整 -> 回调返回
+	MODBUS_LIFECYCLE_TOTAL, // 入队 -> 回调返回
+	MODBUS_LIFECYCLE_PHASE_N,
+} MODBUS_LIFECYCLE_PHASE_TYPE;
+
+typedef struct _MODBUS_LIFECYCLE_RECORD_T { // 一条指令的记录
+	u8 index; // 指令序号
+	uint8_t unit; // 设备地址
+	u8 type; // 功能码
+	u8 stamped; // 已记录的时刻, 第k位对应 MODBUS_LIFECYCLE_STAMP_TYPE 的k
+	u8 attempts; // 发送次数
+	MODBUS_STATUS_TYPE status; // 结束状态
+	u32 stamps[MODBUS_LIFECYCLE_STAMP_N]; // 各时刻(计时函数单位)
+} ModBus_Lifecycle_Record_T;
+
+typedef struct _MODBUS_LIFECYCLE_PHASE_T { // 阶段累计
+	unsigned long long sumUs; // 耗时之和(微秒)
+	ModBus_Histogram_T histogram; // 耗时直方图(微秒)
+} ModBus_Lifecycle_Phase_T;
+
+typedef struct __MODBUS_Lifecycle {
+	u32(*m_clock)(void); // 计时函数
+	u32 m_clockHz; // 计时函数每秒的计数
+	u32 m_enqueueTime[256]; // 按指令序号记录的入队时刻
+	u32 m_lastEndTime; // 上一条指令结束的时刻
+	ModBus_Lifecycle_Record_T m_current; // 已发送的队首指令, index为0表示没有
+	volatile byte m_armed; // 已发送, 等待中断记录首字节和发送完成
+	volatile byte m_firstByteSeen; // 已收到第一个返回字节
+	volatile byte m_txCompleteSeen; // 已记录发送完成
+	volatile u32 m_firstByteTime; // 第一个返回字节的时刻, 在接收中断中记录
+	volatile u32 m_txCompleteTime; // 发送完成的时刻, 可在发送完成中断中记录
+
+	ModBus_Lifecycle_Record_T* m_records; // 环形记录缓冲区, 由调用者提供
+	size_t m_capacity; // 记录缓冲区个数
+	u32 m_recordN; // 结束的指令数, 最近的记录为 m_records[(m_recordN - 1) % m_capacity]
+	void(*m_handler)(void*, const ModBus_Lifecycle_Record_T*); // 指令结束时调用, 可以为NULL
+	void* m_handlerContext; // 传给m_handler的上下文
+	ModBus_Lifecycle_Phase_T m_phases[MODBUS_LIFECYCLE_PHASE_N]; // 阶段累计
+} ModBus_Lifecycle_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置生命周期记录 **/
+/*** 参数 ***
+** records: 环形记录缓冲区, 可以为NULL(只累计阶段)
+** capacity: 记录个数
+** clock: 计时函数, NULL使用ModBus_millis(毫秒)
+** clockHz: 计时函数每秒的计数, clock为NULL时忽略
+***/
+void ModBus_Lifecycle_setup(ModBus_Lifecycle_T* lifecycle, ModBus_Lifecycle_Record_T* records, size_t capacity, u32(*clock)(void), u32 clockHz);
+
+// 主机实例绑定生命周期记录, 传入NULL解除绑定
+void ModBus_attachLifecycle(ModBus_parameter* ModBus_para, ModBus_Lifecycle_T* lifecycle);
+
+// 设置指令结束时的回调函数, 在loop线程中调用
+void ModBus_Lifecycle_setHandler(ModBus_Lifecycle_T* lifecycle, void(*handler)(void*, const ModBus_Lifecycle_Record_T*), void* context);
+
+// 串口发送完成时调用(可在发送完成中断中), 代替发送函数返回的时刻
+void ModBus_Lifecycle_txComplete(ModBus_parameter* ModBus_para);
+
+// 记录两个时刻之差(微秒), 任一时刻未记录返回0
+u32 ModBus_Lifecycle_elapsedUs(const ModBus_Lifecycle_T* lifecycle, const ModBus_Lifecycle_Record_T* record, MODBUS_LIFECYCLE_STAMP_TYPE from, MODBUS_LIFECYCLE_STAMP_TYPE to);
+
+// 阶段累计: 次数为 histogram.count, 平均值为 sumUs / count, 百分位用ModBus_Histogram_percentile
+const ModBus_Lifecycle_Phase_T* ModBus_Lifecycle_phase(const ModBus_Lifecycle_T* lifecycle, MODBUS_LIFECYCLE_PHASE_TYPE phase);
+
+// 按阶段逐行输出: 名称 次数 平均 p50 p99 最大(微秒), 返回输出的行数
+size_t ModBus_Lifecycle_dump(const ModBus_Lifecycle_T* lifecycle, void(*writeLine)(void*, const char*), void* context);
+
+// 以下由协议内部调用, 除ModBus_Lifecycle_firstByte外都在loop线程中
+void ModBus_Lifecycle_enqueue(ModBus_Lifecycle_T* lifecycle, u8 index); // 指令入队
+void ModBus_Lifecycle_txStart(ModBus_Lifecycle_T* lifecycle, u8 index); // 调用发送函数前
+void ModBus_Lifecycle_txReturn(ModBus_Lifecycle_T* lifecycle); // 发送函数返回后
+void ModBus_Lifecycle_firstByte(ModBus_Lifecycle_T* lifecycle); // 接收到字节(接收中断)
+void ModBus_Lifecycle_frameComplete(ModBus_Lifecycle_T* lifecycle, u8 index); // 检测到完整的返回帧
+void ModBus_Lifecycle_finish(ModBus_Lifecycle_T* lifecycle, u8 index, uint8_t unit, u8 type, MODBUS_STATUS_TYPE status); // 回调返回, 指令结束
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,390 @@
+#include "modbus_mirror.h"
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// 块表之后的寄存器区起始(字节)
+static size_t ModBus_Mirror_dataStart(size_t blockN)
+{
+	return sizeof(ModBus_Mirror_Header_T) + blockN * sizeof(ModBus_Mirror_Block_T);
+}
+
+// 开始更新: 序号变为奇数
+static void ModBus_Mirror_beginWrite(ModBus_Mirror_Block_T* block)
+{
+	atomic_store_explicit(&block->m_sequence, atomic_load_explicit(&block->m_sequence, memory_order_relaxed) + 1u, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+// 结束更新: 序号变为偶数
+static void ModBus_Mirror_endWrite(ModBus_Mirror_Block_T* block)
+{
+	atomic_store_explicit(&block->m_sequence, atomic_load_explicit(&block->m_sequence, memory_order_relaxed) + 1u, memory_order_release);
+}
+
+// 所需内存字节数
+size_t ModBus_Mirror_size(size_t blockN, size_t registerN)
+{
+	return ModBus_Mirror_dataStart(blockN) + ((registerN + 1u) & ~(size_t)1u) * sizeof(uint16_t); // 总长保持4字节对齐
+}
+
+// 写入布局
+byte ModBus_Mirror_create(ModBus_Mirror_T* mirror, void* memory, size_t size, const ModBus_Mirror_Layout_T* layouts, size_t blockN)
+{
+	ModBus_Mirror_Header_T* header = (ModBus_Mirror_Header_T*)memory;
+	size_t registerN = 0, offset = ModBus_Mirror_dataStart(blockN);
+	memset(mirror, 0, sizeof(ModBus_Mirror_T));
+	if (memory == NULL || ((uintptr_t)memory & 3u) != 0)
+	{
+		return 0;
+	}
+	for (size_t k = 0; k < blockN; k++)
+	{
+		if (layouts[k].count == 0 || layouts[k].count > MODBUS_REGISTER_LIMIT)
+		{
+			return 0;
+		}
+		registerN += layouts[k].count;
+	}
+	if (size < ModBus_Mirror_size(blockN, registerN) || size > 0xFFFFFFFFu)
+	{
+		return 0;
+	}
+	memset(memory, 0, size);
+	header->version = MODBUS_MIRROR_VERSION;
+	header->size = (uint32_t)size;
+	header->blockN = (uint32_t)blockN;
+	header->registerN = (uint32_t)registerN;
+	mirror->m_header = header;
+	mirror->m_blocks = (ModBus_Mirror_Block_T*)(header + 1);
+	mirror->m_blockN = blockN;
+	for (size_t k = 0; k < blockN; k++)
+	{
+		ModBus_Mirror_Block_T* block = mirror->m_blocks + k;
+		atomic_init(&block->m_sequence, 0u);
+		block->m_dataOffset = (int32_t)(offset - ((byte*)block - (byte*)memory));
+		block->unit = layouts[k].unit;
+		block->address = layouts[k].address;
+		block->count = layouts[k].count;
+		block->status = MODBUS_STATUS_INVALID;
+		offset += layouts[k].count * sizeof(uint16_t);
+	}
+	atomic_thread_fence(memory_order_release); // 布局先于标识可见
+	header->magic = MODBUS_MIRROR_MAGIC;
+	return 1;
+}
+
+// 映射已写入布局的内存
+byte ModBus_Mirror_attach(ModBus_Mirror_T* mirror, void* memory, size_t size)
+{
+	ModBus_Mirror_Header_T* header = (ModBus_Mirror_Header_T*)memory;
+	memset(mirror, 0, sizeof(ModBus_Mirror_T));
+	if (memory == NULL || ((uintptr_t)memory & 3u) != 0 || size < sizeof(ModBus_Mirror_Header_T))
+	{
+		return 0;
+	}
+	if (header->magic != MODBUS_MIRROR_MAGIC)
+	{
+		return 0;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	if (header->version != MODBUS_MIRROR_VERSION || header->size > size || ModBus_Mirror_size(header->blockN, header->registerN) > header->size)
+	{
+		return 0;
+	}
+	mirror->m_header = header;
+	mirror->m_blocks = (ModBus_Mirror_Block_T*)(header + 1);
+	mirror->m_blockN = header->blockN;
+	return 1;
+}
+
+// 第index个块
+ModBus_Mirror_Block_T* ModBus_Mirror_block(const ModBus_Mirror_T* mirror, size_t index)
+{
+	return index < mirror->m_blockN ? mirror->m_blocks + index : NULL;
+}
+
+// 按设备地址和起始寄存器地址查找块
+ModBus_Mirror_Block_T* ModBus_Mirror_find(const ModBus_Mirror_T* mirror, uint8_t unit, uint16_t address)
+{
+	for (size_t k = 0; k < mirror->m_blockN; k++)
+	{
+		if (mirror->m_blocks[k].unit == unit && mirror->m_blocks[k].address == address)
+		{
+			return mirror->m_blocks + k;
+		}
+	}
+	return NULL;
+}
+
+// 块的寄存器
+const uint16_t* ModBus_Mirror_data(const ModBus_Mirror_Block_T* block)
+{
+	return (const uint16_t*)((const byte*)block + block->m_dataOffset);
+}
+
+// 写入一次读取结果
+void ModBus_Mirror_publish(ModBus_Mirror_Block_T* block, MODBUS_STATUS_TYPE status, const uint16_t* data, uint8_t exception)
+{
+	u32 now = ModBus_millis();
+	ModBus_Mirror_beginWrite(block);
+	if (status == MODBUS_STATUS_OK)
+	{
+		memcpy((byte*)block + block->m_dataOffset, data, block->count * sizeof(uint16_t));
+		block->valid = 1;
+		block->time = now;
+		block->updateN++;
+	}
+	else
+	{
+		block->failN++; // 保留上次的值, 读取者由status和time判断质量
+	}
+	block->status = (uint8_t)status;
+	block->exception = exception;
+	block->checkTime = now;
+	ModBus_Mirror_endWrite(block);
+}
+
+// 读指令的回调函数
+void ModBus_Mirror_resultHandler(void* context, const ModBus_Result_T* result)
+{
+	ModBus_Mirror_Block_T* block = (ModBus_Mirror_Block_T*)context;
+	if (result->status == MODBUS_STATUS_OK && (result->type != READ_REGISTER || result->address != block->address || result->count != block->count))
+	{
+		ModBus_Mirror_publish(block, MODBUS_STATUS_INVALID, NULL, 0);
+		return;
+	}
+	ModBus_Mirror_publish(block, result->status, result->data, result->exception);
+}
+
+// 开始不复制读取
+u32 ModBus_Mirror_beginRead(const ModBus_Mirror_Block_T* block)
+{
+	atomic_uint* sequence = (atomic_uint*)&block->m_sequence;
+	u32 begin;
+	while ((begin = atomic_load_explicit(sequence, memory_order_acquire)) & 1u) // 正在更新
+		;
+	return begin;
+}
+
+// 结束不复制读取
+byte ModBus_Mirror_endRead(const ModBus_Mirror_Block_T* block, u32 sequence)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit((atomic_uint*)&block->m_sequence, memory_order_relaxed) == sequence;
+}
+
+/** 复制读取 **/
+/*** 参数 ***
+** data: 寄存器值, 可以为NULL
+** info: 块状态, 可以为NULL
+***/
+u32 ModBus_Mirror_read(const ModBus_Mirror_Block_T* block, uint16_t* data, ModBus_Mirror_Info_T* info)
+{
+	for (;;)
+	{
+		u32 begin = ModBus_Mirror_beginRead(block);
+		if (data != NULL)
+		{
+			memcpy(data, ModBus_Mirror_data(block), block->count * sizeof(uint16_t));
+		}
+		if (info != NULL)
+		{
+			info->status = block->status;
+			info->exception = block->exception;
+			info->valid = block->valid;
+			info->time = block->time;
+			info->checkTime = block->checkTime;
+			info->updateN = block->updateN;
+			info->failN = block->failN;
+		}
+		if (ModBus_Mirror_endRead(block, begin)) // 复制期间没有更新
+		{
+			return begin >> 1;
+		}
+	}
+}
+
+#if defined(__linux__)
+// 映射POSIX共享内存
+void* ModBus_Mirror_mapShared(const char* name, size_t size, byte create)
+{
+	void* memory;
+	int fd = shm_open(name, create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	if (create && ftruncate(fd, (off_t)size) != 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // 映射保持有效
+	return memory == MAP_FAILED ? NULL : memory;
+}
+
+// 解除映射
+void ModBus_Mirror_unmap(void* memory, size_t size)
+{
+	if (memory != NULL)
+	{
+		munmap(memory, size);
+	}
+}
+#endif
+
+#if defined(_UNIT_TEST) && defined(__linux__)
+#include <stdio.h>
+#include <pthread.h>
+
+#define MODBUS_MIRROR_TEST_NAME "/motecmodbus_mirror_test"
+#define MODBUS_MIRROR_TEST_WRITE_N 200000 // 并发读取时的写入次数
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static ModBus_Mirror_T g_mirrorReader; // 第二个映射上的视图, 地址与写入者不同
+static atomic_uint g_mirrorRunning;
+static atomic_uint g_mirrorReadN;
+static atomic_uint g_mirrorTornN; // 不一致的读取次数, 应为0
+
+// 读取线程: 复制读取和不复制读取交替, 块内的寄存器每次写入都相同, 不同即读到了写入一半的数据
+static void* mirrorReader(void* arg)
+{
+	const ModBus_Mirror_Block_T* block = ModBus_Mirror_find(&g_mirrorReader, 2, 100);
+	uint16_t data[MODBUS_REGISTER_LIMIT];
+	ModBus_Mirror_Info_T info;
+	u32 last = 0;
+	(void)arg;
+	while (atomic_load(&g_mirrorRunning))
+	{
+		u32 n = atomic_load(&g_mirrorReadN);
+		u32 update;
+		if (n & 1u)
+		{
+			update = ModBus_Mirror_read(block, data, &info);
+			for (uint16_t k = 1; k < block->count; k++)
+			{
+				if (data[k] != data[0])
+					atomic_fetch_add(&g_mirrorTornN, 1u);
+			}
+			if ((uint16_t)info.updateN != (uint16_t)(data[0] + 1u) && info.valid) // 值为写入序号
+				atomic_fetch_add(&g_mirrorTornN, 1u);
+		}
+		else
+		{
+			const uint16_t* shared = ModBus_Mirror_data(block);
+			uint16_t first, k;
+			u32 begin;
+			do
+			{
+				begin = ModBus_Mirror_beginRead(block);
+				first = shared[0];
+				for (k = 1; k < block->count && shared[k] == first; k++)
+					;
+			} while (!ModBus_Mirror_endRead(block, begin));
+			if (k != block->count)
+				atomic_fetch_add(&g_mirrorTornN, 1u);
+			update = begin >> 1;
+		}
+		if (update < last) // 发布次数不减少
+			atomic_fetch_add(&g_mirrorTornN, 1u);
+		last = update;
+		atomic_fetch_add(&g_mirrorReadN, 1u);
+	}
+	return NULL;
+}
+
+void mirror_unit_test()
+{
+	static const ModBus_Mirror_Layout_T layouts[] = { { 1, 0, 4 }, { 2, 100, MODBUS_REGISTER_LIMIT }, { 1, 40, 3 } };
+	const size_t blockN = sizeof(layouts) / sizeof(layouts[0]);
+	const size_t size = ModBus_Mirror_size(blockN, 4 + MODBUS_REGISTER_LIMIT + 3);
+	ModBus_Mirror_T mirror, view;
+	ModBus_Mirror_Block_T* block;
+	ModBus_Mirror_Info_T info;
+	ModBus_Result_T result = { 0 };
+	uint16_t registers[MODBUS_REGISTER_LIMIT], data[MODBUS_REGISTER_LIMIT];
+	ModBus_Mirror_Layout_T bad = { 1, 0, 0 };
+	byte* writerMemory, * readerMemory;
+	pthread_t thread;
+
+	assert(sizeof(ModBus_Mirror_Header_T) == 32 && sizeof(ModBus_Mirror_Block_T) == 32); // 不同进程(32/64位)布局相同
+	shm_unlink(MODBUS_MIRROR_TEST_NAME);
+	writerMemory = (byte*)ModBus_Mirror_mapShared(MODBUS_MIRROR_TEST_NAME, size, 1);
+	readerMemory = (byte*)ModBus_Mirror_mapShared(MODBUS_MIRROR_TEST_NAME, size, 0);
+	assert(writerMemory != NULL && readerMemory != NULL && writerMemory != readerMemory);
+
+	// 布局: 内存不足, 块个数为0, 布局写入前不能映射
+	assert(!ModBus_Mirror_attach(&view, readerMemory, size));
+	assert(!ModBus_Mirror_create(&mirror, writerMemory, size - 2, layouts, blockN));
+	assert(!ModBus_Mirror_create(&mirror, writerMemory, size, &bad, 1));
+	assert(ModBus_Mirror_create(&mirror, writerMemory, size, layouts, blockN));
+	assert(ModBus_Mirror_attach(&view, readerMemory, size) && view.m_blockN == blockN);
+	assert(!ModBus_Mirror_attach(&g_mirrorReader, readerMemory, size - 4));
+	assert(ModBus_Mirror_find(&view, 1, 40) == ModBus_Mirror_block(&view, 2) && ModBus_Mirror_find(&view, 2, 40) == NULL);
+	assert(ModBus_Mirror_block(&view, blockN) == NULL);
+	assert(ModBus_Mirror_data(ModBus_Mirror_block(&view, 1)) == (const uint16_t*)(readerMemory + 32 + 3 * 32 + 4 * 2));
+
+	// 未读取过: 无效
+	block = ModBus_Mirror_find(&view, 1, 0);
+	assert(ModBus_Mirror_read(block, NULL, &info) == 0 && info.status == MODBUS_STATUS_INVALID && !info.valid);
+
+	// 写入者的回调函数写入, 读取者在另一个映射上看到
+	for (uint16_t k = 0; k < 4; k++)
+		registers[k] = (uint16_t)(0x100 + k);
+	result.status = MODBUS_STATUS_OK;
+	result.type = READ_REGISTER;
+	result.address = 0;
+	result.count = 4;
+	result.data = registers;
+	t = 1234;
+	ModBus_Mirror_resultHandler(ModBus_Mirror_block(&mirror, 0), &result);
+	assert(ModBus_Mirror_read(block, data, &info) == 1 && memcmp(data, registers, 4 * sizeof(uint16_t)) == 0);
+	assert(info.status == MODBUS_STATUS_OK && info.valid && info.time == 1234 && info.checkTime == 1234 && info.updateN == 1 && info.failN == 0);
+	assert(ModBus_Mirror_data(block)[3] == 0x103); // 不复制读取
+
+	// 读取失败: 保留上次的值, 更新质量
+	t = 2000;
+	result.status = MODBUS_STATUS_EXCEPTION;
+	result.exception = 2;
+	ModBus_Mirror_resultHandler(ModBus_Mirror_block(&mirror, 0), &result);
+	assert(ModBus_Mirror_read(block, data, &info) == 2 && data[0] == 0x100 && info.status == MODBUS_STATUS_EXCEPTION && info.exception == 2);
+	assert(info.valid && info.time == 1234 && info.checkTime == 2000 && info.failN == 1);
+
+	// 返回与块不符: 记为无效
+	result.status = MODBUS_STATUS_OK;
+	result.count = 3;
+	ModBus_Mirror_resultHandler(ModBus_Mirror_block(&mirror, 0), &result);
+	ModBus_Mirror_read(block, data, &info);
+	assert(info.status == MODBUS_STATUS_INVALID && info.failN == 2 && data[3] == 0x103);
+
+	// 写入线程与读取线程并发: 读取者不会看到写入一半的块
+	assert(ModBus_Mirror_attach(&g_mirrorReader, readerMemory, size));
+	block = ModBus_Mirror_block(&mirror, 1);
+	atomic_store(&g_mirrorRunning, 1);
+	pthread_create(&thread, NULL, mirrorReader, NULL);
+	while (atomic_load(&g_mirrorReadN) == 0) // 等待读取线程开始
+		;
+	for (u32 n = 0; n < MODBUS_MIRROR_TEST_WRITE_N; n++)
+	{
+		for (int k = 0; k < MODBUS_REGISTER_LIMIT; k++)
+			registers[k] = (uint16_t)n;
+		ModBus_Mirror_publish(block, MODBUS_STATUS_OK, registers, 0);
+	}
+	atomic_store(&g_mirrorRunning, 0);
+	pthread_join(thread, NULL);
+	assert(atomic_load(&g_mirrorTornN) == 0);
+	assert(ModBus_Mirror_read(ModBus_Mirror_find(&g_mirrorReader, 2, 100), data, &info) == MODBUS_MIRROR_TEST_WRITE_N);
+	assert(data[0] == (uint16_t)(MODBUS_MIRROR_TEST_WRITE_N - 1) && info.updateN == MODBUS_MIRROR_TEST_WRITE_N);
+	printf("mirror_unit_test: %u blocks, %u bytes shared, %u writes with %u concurrent reads, 0 torn\n",
+		(u32)blockN, (u32)size, MODBUS_MIRROR_TEST_WRITE_N, atomic_load(&g_mirrorReadN));
+
+	ModBus_Mirror_unmap(readerMemory, size);
+	ModBus_Mirror_unmap(writerMemory, size);
+	shm_unlink(MODBUS_MIRROR_TEST_NAME);
+}
+#endif // _UNIT_TEST
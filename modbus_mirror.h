@@ -0,0 +1,130 @@
+#ifndef MOTECMODBUS_MIRROR_H_
+#define MOTECMODBUS_MIRROR_H_
+/**** ModBus 共享内存寄存器镜像 ****
+** 网关上多个进程(界面, 历史库, 报警, OPC UA)都需要最新的读取值, 各自建立客户端会增加总线流量, 经进程间通信复制又要序列化
+** 主机把读取块的返回值直接写入一块共享内存, 其他进程映射同一块内存后无锁读取, 不经过主机进程, 也不产生总线请求
+** 内存布局: 头部(标识, 版本, 块数, 寄存器数) + 块表 + 寄存器区, 只含固定宽度的整数, 块内用相对偏移定位寄存器, 各进程映射地址可以不同
+** 每个块有独立的序号(顺序锁): 写入时为奇数, 读取者在读取前后比较序号判断数据是否一致, 不一致则重新读取; 写入者从不等待读取者
+** 每个块记录最近一次成功读取的时间, 最近一次读取的结果(质量)和次数, 读取失败时保留上次的值
+** 使用方法:
+****** 写入进程: ModBus_Mirror_size计算所需内存, 映射共享内存(Linux可用ModBus_Mirror_mapShared)后调用ModBus_Mirror_create按块配置写入布局
+****** 读指令的 resultHandler 设为ModBus_Mirror_resultHandler, context 设为ModBus_Mirror_block返回的块(见 ModBus_request)
+****** 读取进程: 映射同一块内存后调用ModBus_Mirror_attach, ModBus_Mirror_find按设备和地址查找块
+****** 复制读取: ModBus_Mirror_read; 不复制读取: ModBus_Mirror_beginRead, 直接读ModBus_Mirror_data返回的寄存器, 再调用ModBus_Mirror_endRead确认(返回0则重新读取)
+** 注: 一个镜像只能有一个写入者; 时间为写入进程的ModBus_millis, 读取者与写入块的time比较前应使用同一时钟源
+*/
+
+#include "modbus.h"
+#include <stdatomic.h>
+
+#define MODBUS_MIRROR_MAGIC 0x524D424Du // "MBMR"
+#define MODBUS_MIRROR_VERSION 1u
+
+typedef struct _MODBUS_MIRROR_LAYOUT_T { // 块配置
+	uint8_t unit; // 设备地址
+	uint16_t address; // 起始寄存器地址
+	uint16_t count; // 寄存器个数
+} ModBus_Mirror_Layout_T;
+
+typedef struct _MODBUS_MIRROR_HEADER_T { // 共享内存头部, 32字节
+	uint32_t magic; // MODBUS_MIRROR_MAGIC, 布局写完后最后写入
+	uint32_t version; // MODBUS_MIRROR_VERSION
+	uint32_t size; // 总字节数
+	uint32_t blockN; // 块数
+	uint32_t registerN; // 寄存器总数
+	uint32_t reserved[3];
+} ModBus_Mirror_Header_T;
+
+typedef struct _MODBUS_MIRROR_BLOCK_T { // 共享内存中的块, 32字节
+	atomic_uint m_sequence; // 更新时为奇数
+	int32_t m_dataOffset; // 寄存器相对本块的字节偏移
+	uint16_t address; // 起始寄存器地址
+	uint16_t count; // 寄存器个数
+	uint8_t unit; // 设备地址
+	uint8_t status; // 最近一次读取的结果(MODBUS_STATUS_TYPE), 未读取过为MODBUS_STATUS_INVALID
+	uint8_t exception; // 最近一次读取的异常码
+	uint8_t valid; // 寄存器已有成功读取的值
+	uint32_t time; // 最近一次成功读取的时间(毫秒)
+	uint32_t checkTime; // 最近一次读取结束的时间(毫秒)
+	uint32_t updateN; // 成功读取次数
+	uint32_t failN; // 失败次数
+} ModBus_Mirror_Block_T;
+
+typedef struct _MODBUS_MIRROR_INFO_T { // 块状态, 与寄存器一起一致读取
+	uint8_t status;
+	uint8_t exception;
+	uint8_t valid;
+	uint32_t time;
+	uint32_t checkTime;
+	uint32_t updateN;
+	uint32_t failN;
+} ModBus_Mirror_Info_T;
+
+typedef struct __MODBUS_Mirror { // 本进程的视图, 不在共享内存中
+	ModBus_Mirror_Header_T* m_header; // 共享内存起始
+	ModBus_Mirror_Block_T* m_blocks; // 块表
+	size_t m_blockN; // 块数
+} ModBus_Mirror_T;
+
+/************ 对外接口 BEGIN ***********/
+
+// 所需内存字节数
+size_t ModBus_Mirror_size(size_t blockN, size_t registerN);
+
+/** 写入布局(写入进程) **/
+/*** 参数 ***
+** memory: 共享内存, 至少ModBus_Mirror_size字节, 4字节对齐
+** size: 内存字节数
+** layouts: 块配置, blockN: 块数
+** 内存不足或参数错误返回0
+***/
+byte ModBus_Mirror_create(ModBus_Mirror_T* mirror, void* memory, size_t size, const ModBus_Mirror_Layout_T* layouts, size_t blockN);
+
+// 映射已写入布局的内存(读取进程), 标识, 版本或大小不符返回0
+byte ModBus_Mirror_attach(ModBus_Mirror_T* mirror, void* memory, size_t size);
+
+// 第index个块, 超出范围返回NULL
+ModBus_Mirror_Block_T* ModBus_Mirror_block(const ModBus_Mirror_T* mirror, size_t index);
+
+// 按设备地址和起始寄存器地址查找块, 没有返回NULL
+ModBus_Mirror_Block_T* ModBus_Mirror_find(const ModBus_Mirror_T* mirror, uint8_t unit, uint16_t address);
+
+// 块的寄存器(共享内存中), 不复制读取时在beginRead和endRead之间使用
+const uint16_t* ModBus_Mirror_data(const ModBus_Mirror_Block_T* block);
+
+/** 写入一次读取结果(写入进程) **/
+/*** 参数 ***
+** status: 读取结果, 成功时写入data
+** data: 寄存器值, block->count个
+** exception: 异常码
+***/
+void ModBus_Mirror_publish(ModBus_Mirror_Block_T* block, MODBUS_STATUS_TYPE status, const uint16_t* data, uint8_t exception);
+
+// 读指令的回调函数, context为块; 返回的地址和个数与块不同时记为MODBUS_STATUS_INVALID
+void ModBus_Mirror_resultHandler(void* context, const ModBus_Result_T* result);
+
+// 开始不复制读取, 等待写入结束后返回序号
+u32 ModBus_Mirror_beginRead(const ModBus_Mirror_Block_T* block);
+
+// 结束不复制读取, 期间没有写入返回1, 否则读到的数据可能不一致, 应重新读取
+byte ModBus_Mirror_endRead(const ModBus_Mirror_Block_T* block, u32 sequence);
+
+/** 复制读取 **/
+/*** 参数 ***
+** data: 寄存器值, 至少block->count个, 可以为NULL
+** info: 块状态, 可以为NULL
+** 返回发布次数(序号的一半), 读取失败的结果也计入, 可用于判断是否有新结果; 成功读取次数见info->updateN
+***/
+u32 ModBus_Mirror_read(const ModBus_Mirror_Block_T* block, uint16_t* data, ModBus_Mirror_Info_T* info);
+
+#if defined(__linux__)
+// 映射POSIX共享内存(name如"/modbus_mirror"), create为1时创建并设置大小; 失败返回NULL
+void* ModBus_Mirror_mapShared(const char* name, size_t size, byte create);
+
+// 解除映射
+void ModBus_Mirror_unmap(void* memory, size_t size);
+#endif
+
+/**************** 对外接口 END ***************/
+
+#endif
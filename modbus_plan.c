@@ -0,0 +1,390 @@
+#include "modbus_plan.h"
+#include <stdlib.h>
+
+// 标签排序: 设备地址, 寄存器地址
+static int ModBus_Plan_compare(const void* a, const void* b)
+{
+	const ModBus_Tag_T* tagA = (const ModBus_Tag_T*)a;
+	const ModBus_Tag_T* tagB = (const ModBus_Tag_T*)b;
+	if (tagA->unit != tagB->unit)
+	{
+		return tagA->unit < tagB->unit ? -1 : 1;
+	}
+	return tagA->address < tagB->address ? -1 : tagA->address > tagB->address ? 1 : 0;
+}
+
+// 配置分组计划
+void ModBus_Plan_setup(ModBus_Plan_T* plan, ModBus_parameter* modbus, ModBus_Tag_T* tags, size_t tagN, ModBus_Plan_Block_T* blocks, size_t capacity)
+{
+	memset(plan, 0, sizeof(ModBus_Plan_T));
+	plan->m_modbus = modbus;
+	plan->m_tags = tags;
+	plan->m_tagN = tagN;
+	plan->m_blocks = blocks;
+	plan->m_capacity = capacity;
+	plan->m_limit = modbus->m_registerAcessLimit > 0 ? modbus->m_registerAcessLimit : 1;
+	plan->m_maxGap = 0xFFFF;
+}
+
+// 由总线参数计算读取开销
+ModBus_Plan_Cost_T ModBus_Plan_busCost(MODBUS_MODE_TYPE mode, u32 baudRate, u32 turnaroundUs)
+{
+	ModBus_Plan_Cost_T cost;
+	u32 bits = mode == ASCII ? 10u : 11u; // 每字符位数
+	u32 frameChars, registerChars;
+	if (baudRate == 0)
+	{
+		baudRate = MODBUS_DEFAULT_BAUD;
+	}
+	if (mode == ASCII) // 请求帧17字符, 返回帧11字符 + 每寄存器4字符
+	{
+		frameChars = 17u + 11u;
+		registerChars = 4u;
+	}
+	else // 请求帧8字节, 返回帧5字节 + 每寄存器2字节, 两个帧间隔各3.5字符
+	{
+		frameChars = 8u + 5u + 7u;
+		registerChars = 2u;
+	}
+	cost.frameUs = (u32)(((unsigned long long)frameChars * bits * 1000000u + baudRate - 1) / baudRate) + turnaroundUs;
+	cost.registerUs = (u32)(((unsigned long long)registerChars * bits * 1000000u + baudRate - 1) / baudRate);
+	return cost;
+}
+
+// 分组: 按设备地址和寄存器地址排序后, 第i个标签的最短时间为
+// min(第j-1个标签的最短时间 + 每帧开销 + (地址i - 地址j + 1) * 每寄存器开销), j为与i同组的第一个标签
+// 同组的条件: 同一设备, 寄存器个数不超过上限, 相邻标签的间隔不超过maxGap; j只需向前查找到不满足条件为止
+size_t ModBus_Plan_build(ModBus_Plan_T* plan, ModBus_Plan_Cost_T cost, uint16_t maxGap)
+{
+	ModBus_Tag_T* tags = plan->m_tags;
+	size_t n = plan->m_tagN, blockN = 0, i;
+	plan->m_cost = cost;
+	plan->m_maxGap = maxGap;
+	plan->m_blockN = 0;
+	plan->m_totalUs = 0;
+	if (n == 0)
+	{
+		return 0;
+	}
+	qsort(tags, n, sizeof(ModBus_Tag_T), ModBus_Plan_compare);
+
+	for (i = 0; i < n; i++)
+	{
+		size_t j = i;
+		tags[i].m_cost = 0xFFFFFFFFu;
+		for (;;)
+		{
+			u32 span = (u32)tags[i].address - tags[j].address + 1u;
+			u32 prev = (j == 0 || tags[j - 1].unit != tags[i].unit) ? 0 : tags[j - 1].m_cost;
+			u32 total = prev + cost.frameUs + span * cost.registerUs;
+			if (total < tags[i].m_cost)
+			{
+				tags[i].m_cost = total;
+				tags[i].m_start = j;
+			}
+			if (j == 0 || tags[j - 1].unit != tags[i].unit || (u32)tags[i].address - tags[j - 1].address + 1u > plan->m_limit
+				|| (u32)tags[j].address - tags[j - 1].address - (tags[j].address != tags[j - 1].address) > maxGap)
+			{
+				break;
+			}
+			j--;
+		}
+	}
+
+	// 各设备最后一个标签的最短时间之和为一轮的时间; 从最后一个标签向前得到各组
+	for (i = 0; i < n; i++)
+	{
+		if (i == n - 1 || tags[i + 1].unit != tags[i].unit)
+		{
+			plan->m_totalUs += tags[i].m_cost;
+		}
+	}
+	for (i = n; i > 0; i = tags[i - 1].m_start)
+	{
+		blockN++;
+	}
+	plan->m_blockN = blockN;
+	if (blockN > plan->m_capacity)
+	{
+		return 0;
+	}
+	for (i = n; i > 0; i = tags[i - 1].m_start)
+	{
+		ModBus_Plan_Block_T* block = plan->m_blocks + (--blockN);
+		size_t first = tags[i - 1].m_start;
+		block->m_plan = plan;
+		block->m_firstTag = first;
+		block->m_tagN = i - first;
+		block->m_unit = tags[first].unit;
+		block->m_address = tags[first].address;
+		block->m_count = (u8)(tags[i - 1].address - tags[first].address + 1u);
+	}
+	return plan->m_blockN;
+}
+
+// 一轮读取的估计时间
+u32 ModBus_Plan_totalUs(const ModBus_Plan_T* plan)
+{
+	return plan->m_totalUs;
+}
+
+// 设置一轮结束时调用的函数
+void ModBus_Plan_setCycleHandler(ModBus_Plan_T* plan, void(*handler)(void*, ModBus_Plan_T*), void* context)
+{
+	plan->m_cycleHandler = handler;
+	plan->m_cycleContext = context;
+}
+
+#ifdef MODBUS_MASTER
+static void ModBus_Plan_sendNext(ModBus_Plan_T* plan);
+
+// 分组读取结束: 值写回各标签, 发送下一组
+static void ModBus_Plan_result(void* context, const ModBus_Result_T* result)
+{
+	ModBus_Plan_Block_T* block = (ModBus_Plan_Block_T*)context;
+	ModBus_Plan_T* plan = block->m_plan;
+	ModBus_Tag_T* tag = plan->m_tags + block->m_firstTag;
+	byte ok = result->status == MODBUS_STATUS_OK && result->count == block->m_count;
+	for (size_t i = 0; i < block->m_tagN; i++, tag++)
+	{
+		tag->status = ok ? MODBUS_STATUS_OK : result->status != MODBUS_STATUS_OK ? result->status : MODBUS_STATUS_INVALID;
+		if (ok && tag->value != NULL)
+		{
+			*tag->value = result->data[tag->address - block->m_address];
+		}
+	}
+	if (!ok)
+	{
+		plan->m_failCount++;
+	}
+	plan->m_completed = 1;
+	if (!plan->m_sending) // 返回帧结束的分组, 在回调中发送下一组
+	{
+		ModBus_Plan_sendNext(plan);
+	}
+}
+
+// 发送下一组; 立即结束(参数无效, 被丢弃)的分组继续发送下一组, 全部结束时调用一轮结束函数
+static void ModBus_Plan_sendNext(ModBus_Plan_T* plan)
+{
+	ModBus_Request_T request;
+	memset(&request, 0, sizeof(request));
+	request.type = READ_REGISTER;
+	request.priority = MODBUS_PRIORITY_BACKGROUND; // 周期读取让位于控制指令
+	request.resultHandler = ModBus_Plan_result;
+	while (plan->m_nextBlock < plan->m_blockN)
+	{
+		ModBus_Plan_Block_T* block = plan->m_blocks + plan->m_nextBlock++;
+		request.unit = block->m_unit;
+		request.address = block->m_address;
+		request.count = block->m_count;
+		request.context = block;
+		plan->m_completed = 0;
+		plan->m_sending = 1;
+		ModBus_request(plan->m_modbus, &request);
+		plan->m_sending = 0;
+		if (!plan->m_completed)
+		{
+			return;
+		}
+	}
+	plan->m_polling = 0;
+	plan->m_cycleCount++;
+	if (plan->m_cycleHandler != NULL)
+	{
+		(*plan->m_cycleHandler)(plan->m_cycleContext, plan);
+	}
+}
+
+// 开始一轮读取
+byte ModBus_Plan_poll(ModBus_Plan_T* plan)
+{
+	if (plan->m_polling || plan->m_blockN == 0 || plan->m_blockN > plan->m_capacity)
+	{
+		return 0;
+	}
+	plan->m_polling = 1;
+	plan->m_nextBlock = 0;
+	ModBus_Plan_sendNext(plan);
+	return 1;
+}
+#endif // MODBUS_MASTER
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include "modbus_sim.h"
+#include <stdio.h>
+
+#define MODBUS_PLAN_TEST_RANDOM_N 200 // 与穷举比较的随机标签表个数
+
+static u32 g_planRandom = 12345;
+static u32 g_planCycles;
+
+static u32 planRandom(void)
+{
+	g_planRandom ^= g_planRandom << 13;
+	g_planRandom ^= g_planRandom >> 17;
+	g_planRandom ^= g_planRandom << 5;
+	return g_planRandom;
+}
+
+// 穷举排序后标签之间的所有分割, 返回满足条件的最短时间
+static u32 planExhaustive(const ModBus_Tag_T* tags, size_t n, u8 limit, uint16_t maxGap, ModBus_Plan_Cost_T cost)
+{
+	u32 best = 0xFFFFFFFFu;
+	for (u32 mask = 0; mask < (1u << (n - 1)); mask++) // 第k位为1: 第k和k+1个标签之间分割
+	{
+		u32 total = 0;
+		size_t first = 0;
+		byte valid = 1;
+		for (size_t k = 0; k < n && valid; k++)
+		{
+			byte split = k == n - 1 || (mask >> k & 1u);
+			if (k + 1 < n && !split && (tags[k + 1].unit != tags[k].unit || (u32)tags[k + 1].address - tags[k].address - (tags[k + 1].address != tags[k].address) > maxGap))
+				valid = 0;
+			if (split)
+			{
+				if ((u32)tags[k].address - tags[first].address + 1u > limit)
+					valid = 0;
+				total += cost.frameUs + ((u32)tags[k].address - tags[first].address + 1u) * cost.registerUs;
+				first = k + 1;
+			}
+		}
+		if (valid && total < best)
+			best = total;
+	}
+	return best;
+}
+
+static size_t planGetReg1(uint16_t address, uint16_t n, uint16_t* data)
+{
+	for (uint16_t i = 0; i < n; i++)
+		data[i] = (uint16_t)(1000 + address + i);
+	return n;
+}
+
+static size_t planGetReg2(uint16_t address, uint16_t n, uint16_t* data)
+{
+	for (uint16_t i = 0; i < n; i++)
+		data[i] = (uint16_t)(2000 + address + i);
+	return n;
+}
+
+static void planCycle(void* context, ModBus_Plan_T* plan)
+{
+	(void)context;
+	(void)plan;
+	g_planCycles++;
+}
+
+// 分组与穷举结果相同; 虚拟总线上一轮读取把值写回标签, 分组比逐个读取快
+void plan_unit_test()
+{
+	static ModBus_Sim_T bus;
+	static ModBus_Sim_Node_T nodes[3];
+	static ModBus_parameter master, slaves[2];
+	static ModBus_Plan_T plan;
+	static ModBus_Plan_Block_T blocks[16];
+	static ModBus_Tag_T tags[16];
+	static const uint8_t units[] = { 1, 2, 1, 1, 3, 1, 2, 1, 1, 2, 1 };
+	static const uint16_t addresses[] = { 21, 4, 0, 9, 7, 2, 40, 1, 20, 3, 5 };
+	static uint16_t values[sizeof(addresses) / sizeof(addresses[0])];
+	const size_t tagN = sizeof(addresses) / sizeof(addresses[0]);
+	ModBus_Sim_Setting_T setting = { 0 };
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Plan_Cost_T cost = ModBus_Plan_busCost(RTU, 9600, 0), cheapFrame = { 1000, 2292 };
+	u32 startUs, elapsedUs, singleUs;
+
+	// 9600 8E1: 每字符1146微秒, 每帧20字符, 每寄存器2字符
+	assert(cost.frameUs == 22917 && cost.registerUs == 2292);
+	assert(ModBus_Plan_busCost(ASCII, 9600, 100).frameUs == 29167 + 100 && ModBus_Plan_busCost(ASCII, 9600, 0).registerUs == 4167);
+
+	modbusSetting.frameType = RTU;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	modbusSetting.address = 0x01;
+	ModBus_setup(&master, modbusSetting);
+
+	// 间隔2个寄存器: 帧开销大时合并, 帧开销小时分开; 超出单帧个数时分开
+	memset(tags, 0, sizeof(tags));
+	tags[0].unit = 1, tags[0].address = 3;
+	tags[1].unit = 1, tags[1].address = 0;
+	ModBus_Plan_setup(&plan, &master, tags, 2, blocks, 16);
+	assert(ModBus_Plan_build(&plan, cost, 0xFFFF) == 1 && blocks[0].m_address == 0 && blocks[0].m_count == 4 && blocks[0].m_tagN == 2);
+	assert(ModBus_Plan_totalUs(&plan) == cost.frameUs + 4 * cost.registerUs);
+	assert(ModBus_Plan_build(&plan, cheapFrame, 0xFFFF) == 2 && blocks[1].m_address == 3 && blocks[1].m_count == 1);
+	assert(ModBus_Plan_build(&plan, cost, 1) == 2); // 间隔超过maxGap
+	tags[1].address = MODBUS_REGISTER_LIMIT; // 已按地址排序, 0~6 超出单帧个数
+	assert(ModBus_Plan_build(&plan, cost, 0xFFFF) == 2);
+	ModBus_Plan_setup(&plan, &master, tags, 2, blocks, 1);
+	assert(ModBus_Plan_build(&plan, cost, 0xFFFF) == 0 && plan.m_blockN == 2); // 分组缓冲区不足
+
+	// 随机标签表: 动态规划与穷举的最短时间相同
+	for (int r = 0; r < MODBUS_PLAN_TEST_RANDOM_N; r++)
+	{
+		size_t n = 1 + planRandom() % 10;
+		ModBus_Plan_Cost_T randomCost;
+		uint16_t maxGap = r % 3 == 0 ? (uint16_t)(planRandom() % 4) : 0xFFFF;
+		randomCost.frameUs = 500 + planRandom() % 20000;
+		randomCost.registerUs = 100 + planRandom() % 3000;
+		for (size_t k = 0; k < n; k++)
+		{
+			tags[k].unit = (uint8_t)(1 + planRandom() % 2);
+			tags[k].address = (uint16_t)(planRandom() % 16);
+		}
+		ModBus_Plan_setup(&plan, &master, tags, n, blocks, 16);
+		assert(ModBus_Plan_build(&plan, randomCost, maxGap) > 0);
+		assert(ModBus_Plan_totalUs(&plan) == planExhaustive(tags, n, master.m_registerAcessLimit, maxGap, randomCost));
+		for (size_t b = 0; b < plan.m_blockN; b++)
+			assert(blocks[b].m_count <= master.m_registerAcessLimit && tags[blocks[b].m_firstTag].unit == tags[blocks[b].m_firstTag + blocks[b].m_tagN - 1].unit);
+	}
+
+	// 虚拟总线: 两个从机, 设备3不存在
+	setting.baudRate = 9600;
+	setting.parity = MODBUS_SIM_PARITY_EVEN;
+	ModBus_Sim_setup(&bus, setting, nodes, 3);
+	ModBus_setup(&master, modbusSetting);
+	ModBus_Sim_attach(&bus, &master, MODBUS_SIM_MASTER, 0);
+	for (int s = 0; s < 2; s++)
+	{
+		modbusSetting.address = (uint8_t)(s + 1);
+		ModBus_setup(slaves + s, modbusSetting);
+		ModBus_attachRegisterHandler(slaves + s, s == 0 ? planGetReg1 : planGetReg2, NULL);
+		ModBus_Sim_attach(&bus, slaves + s, MODBUS_SIM_SLAVE, 2000);
+	}
+	memset(tags, 0, sizeof(tags));
+	for (size_t k = 0; k < tagN; k++)
+	{
+		tags[k].unit = units[k];
+		tags[k].address = addresses[k];
+		tags[k].value = values + k;
+		tags[k].status = MODBUS_STATUS_INVALID;
+	}
+	cost = ModBus_Plan_busCost(RTU, 9600, slaves[0].m_receiveTimeout * 1000u + 2000u);
+	ModBus_Plan_setup(&plan, &master, tags, tagN, blocks, 16);
+	ModBus_Plan_setCycleHandler(&plan, planCycle, NULL);
+	// 设备1: 0~5(含无用的3, 4), 9, 20~21; 设备2: 3~4, 40; 设备3: 7
+	assert(ModBus_Plan_build(&plan, cost, 0xFFFF) == 6);
+	assert(blocks[0].m_unit == 1 && blocks[0].m_address == 0 && blocks[0].m_count == 6 && blocks[0].m_tagN == 4);
+	assert(blocks[1].m_address == 9 && blocks[1].m_count == 1 && blocks[2].m_address == 20 && blocks[2].m_count == 2);
+	assert(blocks[3].m_unit == 2 && blocks[3].m_count == 2 && blocks[4].m_address == 40 && blocks[5].m_unit == 3);
+	assert(ModBus_Plan_poll(&plan) && !ModBus_Plan_poll(&plan)); // 上一轮未结束
+	startUs = (u32)ModBus_Sim_now(&bus);
+	for (int i = 0; i < 2000 && g_planCycles == 0; i++)
+		ModBus_Sim_run(&bus, 1000);
+	elapsedUs = (u32)ModBus_Sim_now(&bus) - startUs;
+	assert(g_planCycles == 1 && plan.m_cycleCount == 1 && plan.m_failCount == 1 && nodes[0].m_txFrames == plan.m_blockN);
+	for (size_t k = 0; k < tagN; k++)
+	{
+		if (tags[k].unit == 3)
+		{
+			assert(tags[k].status == MODBUS_STATUS_TIMEOUT);
+			continue;
+		}
+		assert(tags[k].status == MODBUS_STATUS_OK && *tags[k].value == tags[k].unit * 1000 + tags[k].address);
+	}
+	singleUs = (u32)tagN * (cost.frameUs + cost.registerUs);
+	ModBus_Sim_close(&bus);
+	printf("plan_unit_test: %u tags in %u blocks, estimated %u us (one per tag %u us), simulated %u us with one timeout\n",
+		(u32)tagN, (u32)plan.m_blockN, ModBus_Plan_totalUs(&plan), singleUs, elapsedUs);
+}
+#endif // _UNIT_TEST
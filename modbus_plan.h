@@ -0,0 +1,105 @@
+#ifndef MOTECMODBUS_PLAN_H_
+#define MOTECMODBUS_PLAN_H_
+/**** ModBus 读寄存器分组 ****
+** 点表中的寄存器地址通常不连续: 每个地址单独读取帧开销大, 合并读取则要多读中间无用的寄存器
+** 按每帧开销和每个寄存器的传输时间(由波特率和协议模式计算)选择分组, 使一轮读取的总线时间最短
+** 同一设备按地址排序后动态规划: 每组不超过实例的单帧寄存器个数, 可限制组内相邻地址的最大间隔(避开未定义的寄存器)
+** 每组对应一条读寄存器指令, 返回后把值写回各标签的存储位置
+** 使用方法:
+****** 填写标签数组(设备地址, 寄存器地址, 值的存储位置), 调用ModBus_Plan_setup传入标签和分组缓冲区
+****** 调用ModBus_Plan_busCost由波特率计算开销, 再调用ModBus_Plan_build分组
+****** 周期调用ModBus_Plan_poll(比如由 ModBus_Scheduler_addPoll 调度)开始一轮读取, 各组依次发送
+****** 一轮结束时调用ModBus_Plan_setCycleHandler设置的函数
+** 注: ModBus_Plan_build按设备地址和寄存器地址对标签数组重新排序; 分组和轮询与实例在同一线程中使用
+** 注: 分组的读指令为后台优先级(MODBUS_PRIORITY_BACKGROUND), 缓存中的控制指令先发送
+*/
+
+#include "modbus.h"
+
+typedef struct _MODBUS_TAG_T { // 标签, 由调用者分配
+	uint16_t* value; // 读到的值写入的位置, 可以为NULL
+	uint16_t address; // 寄存器地址
+	uint8_t unit; // 设备地址
+	MODBUS_STATUS_TYPE status; // 最近一次读取的结果, 失败时value不变
+	u32 m_cost; // 分组时使用: 到此标签为止的最短时间
+	size_t m_start; // 分组时使用: 最短时间下此标签所在组的第一个标签
+} ModBus_Tag_T;
+
+typedef struct _MODBUS_PLAN_COST_T { // 读取开销(微秒)
+	u32 frameUs; // 每条指令的固定开销: 请求帧, 返回帧头尾, 帧间隔和设备应答时间
+	u32 registerUs; // 每多读一个寄存器增加的返回帧传输时间
+} ModBus_Plan_Cost_T;
+
+struct __MODBUS_Plan;
+
+typedef struct _MODBUS_PLAN_BLOCK_T { // 分组, 对应一条读寄存器指令
+	struct __MODBUS_Plan* m_plan; // 所属分组计划
+	size_t m_firstTag; // 第一个标签序号
+	size_t m_tagN; // 标签个数
+	uint16_t m_address; // 起始寄存器地址
+	uint8_t m_unit; // 设备地址
+	u8 m_count; // 寄存器个数
+} ModBus_Plan_Block_T;
+
+typedef struct __MODBUS_Plan {
+	ModBus_parameter* m_modbus; // 主机实例
+	ModBus_Tag_T* m_tags; // 标签数组, 由调用者提供
+	size_t m_tagN; // 标签个数
+	ModBus_Plan_Block_T* m_blocks; // 分组缓冲区, 由调用者提供
+	size_t m_capacity; // 分组缓冲区个数
+	size_t m_blockN; // 分组个数
+	u8 m_limit; // 每组最多寄存器个数
+	uint16_t m_maxGap; // 组内相邻标签地址的最大间隔(之间无用寄存器的个数)
+	ModBus_Plan_Cost_T m_cost; // 读取开销
+	u32 m_totalUs; // 一轮读取的估计时间(微秒)
+
+	size_t m_nextBlock; // 本轮下一个发送的分组
+	byte m_polling; // 正在进行一轮读取
+	byte m_sending; // 正在调用ModBus_request, 期间结束的分组不再发送下一组
+	byte m_completed; // 最近发送的分组已结束
+	u32 m_cycleCount; // 已完成的轮数
+	u32 m_failCount; // 读取失败的分组数
+	void(*m_cycleHandler)(void*, struct __MODBUS_Plan*); // 一轮结束时调用, 可以为NULL
+	void* m_cycleContext; // 传给m_cycleHandler的上下文
+} ModBus_Plan_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置分组计划 **/
+/*** 参数 ***
+** modbus: 主机实例, 每组寄存器个数不超过实例的单帧寄存器个数
+** tags: 标签数组, tagN: 标签个数
+** blocks: 分组缓冲区, capacity: 个数(最坏情况每个标签一组)
+***/
+void ModBus_Plan_setup(ModBus_Plan_T* plan, ModBus_parameter* modbus, ModBus_Tag_T* tags, size_t tagN, ModBus_Plan_Block_T* blocks, size_t capacity);
+
+/** 由总线参数计算读取开销 **/
+/*** 参数 ***
+** mode: 协议模式, RTU每字符11位(8E1/8N2), ASCII每字符10位(7E1)
+** baudRate: 波特率, 0为MODBUS_DEFAULT_BAUD
+** turnaroundUs: 设备收到请求到开始返回的时间(微秒), 包括从机的接收超时
+***/
+ModBus_Plan_Cost_T ModBus_Plan_busCost(MODBUS_MODE_TYPE mode, u32 baudRate, u32 turnaroundUs);
+
+/** 分组 **/
+/*** 参数 ***
+** cost: 读取开销
+** maxGap: 组内相邻标签地址之间最多的无用寄存器个数, 0xFFFF不限制
+** 返回分组个数, 分组缓冲区不足返回0(m_blockN为所需个数)
+***/
+size_t ModBus_Plan_build(ModBus_Plan_T* plan, ModBus_Plan_Cost_T cost, uint16_t maxGap);
+
+// 一轮读取的估计时间(微秒)
+u32 ModBus_Plan_totalUs(const ModBus_Plan_T* plan);
+
+// 设置一轮结束时调用的函数
+void ModBus_Plan_setCycleHandler(ModBus_Plan_T* plan, void(*handler)(void*, ModBus_Plan_T*), void* context);
+
+#ifdef MODBUS_MASTER
+// 开始一轮读取, 各组在上一组结束后发送; 上一轮未结束或没有分组返回0
+byte ModBus_Plan_poll(ModBus_Plan_T* plan);
+#endif
+
+/**************** 对外接口 END ***************/
+
+#endif
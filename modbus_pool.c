@@ -0,0 +1,255 @@
+#include "modbus_pool.h"
+
+/** 配置内存池 **/
+/*** 参数 ***
+** buffer: 块区域
+** blockSize: 每块字节数
+** capacity: 块个数
+***/
+void ModBus_Pool_setup(ModBus_Pool_T* pool, void* buffer, size_t blockSize, size_t capacity)
+{
+	pool->m_blocks = (byte*)buffer;
+	pool->m_blockSize = MODBUS_POOL_BLOCK_SIZE(blockSize);
+	pool->m_capacity = capacity;
+	pool->m_freeHead = NULL;
+	for (size_t i = capacity; i > 0; i--) // 按地址顺序取出
+	{
+		void* block = pool->m_blocks + (i - 1) * pool->m_blockSize;
+		*(void**)block = pool->m_freeHead;
+		pool->m_freeHead = block;
+	}
+	pool->m_used = 0;
+	pool->m_peak = 0;
+	pool->m_acquireCount = 0;
+	pool->m_failCount = 0;
+}
+
+// 取出一块
+void* ModBus_Pool_acquire(ModBus_Pool_T* pool)
+{
+	void* block = pool->m_freeHead;
+	if (block == NULL)
+	{
+		pool->m_failCount++;
+		return NULL;
+	}
+	pool->m_freeHead = *(void**)block;
+	pool->m_used++;
+	if (pool->m_used > pool->m_peak)
+	{
+		pool->m_peak = pool->m_used;
+	}
+	pool->m_acquireCount++;
+	return block;
+}
+
+// 放回一块
+void ModBus_Pool_release(ModBus_Pool_T* pool, void* block)
+{
+	assert((byte*)block >= pool->m_blocks && (byte*)block < pool->m_blocks + pool->m_capacity * pool->m_blockSize);
+	*(void**)block = pool->m_freeHead;
+	pool->m_freeHead = block;
+	pool->m_used--;
+}
+
+// 块的序号
+size_t ModBus_Pool_index(const ModBus_Pool_T* pool, const void* block)
+{
+	return (size_t)((const byte*)block - pool->m_blocks) / pool->m_blockSize;
+}
+
+// 序号对应的块
+void* ModBus_Pool_at(const ModBus_Pool_T* pool, size_t index)
+{
+	return pool->m_blocks + index * pool->m_blockSize;
+}
+
+// 获取使用情况
+void ModBus_Pool_getStats(const ModBus_Pool_T* pool, ModBus_Pool_Stats_T* stats)
+{
+	stats->capacity = pool->m_capacity;
+	stats->blockSize = pool->m_blockSize;
+	stats->used = pool->m_used;
+	stats->peak = pool->m_peak;
+	stats->acquireCount = pool->m_acquireCount;
+	stats->failCount = pool->m_failCount;
+}
+
+// 取出并配置实例
+ModBus_parameter* ModBus_Pool_newInstance(ModBus_Pool_T* pool, ModBus_Setting_T setting)
+{
+	ModBus_parameter* modbus;
+	assert(pool->m_blockSize >= sizeof(ModBus_parameter));
+	modbus = (ModBus_parameter*)ModBus_Pool_acquire(pool);
+	if (modbus != NULL)
+	{
+		ModBus_setup(modbus, setting);
+	}
+	return modbus;
+}
+
+// 放回实例
+void ModBus_Pool_deleteInstance(ModBus_Pool_T* pool, ModBus_parameter* modbus)
+{
+	ModBus_attachSendHandler(modbus, NULL, NULL);
+	ModBus_Pool_release(pool, modbus);
+}
+
+// 取出清零的指令描述
+ModBus_Request_T* ModBus_Pool_newRequest(ModBus_Pool_T* pool)
+{
+	ModBus_Request_T* request;
+	assert(pool->m_blockSize >= sizeof(ModBus_Request_T));
+	request = (ModBus_Request_T*)ModBus_Pool_acquire(pool);
+	if (request != NULL)
+	{
+		memset(request, 0, sizeof(*request));
+	}
+	return request;
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+#include "modbus_gateway.h"
+
+#define MODBUS_POOL_TEST_INSTANCE_N 8 // 实例池大小, 即4对主从机
+#define MODBUS_POOL_TEST_REQUEST_N 10000 // 网关请求缓冲区个数
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_poolRegisters[8];
+static ModBus_Result_T g_poolResult;
+static int g_poolResultN;
+
+static size_t poolGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 8)
+		return 0;
+	memcpy(data, g_poolRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+// 发送函数: 直接传给对端实例
+static void poolSend(void* context, byte* data, size_t len)
+{
+	ModBus_readBytesFromOuter((ModBus_parameter*)context, data, len);
+}
+
+static void poolResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	g_poolResult = *result;
+	g_poolResultN++;
+}
+
+void pool_unit_test()
+{
+	static ModBus_parameter instanceBuffer[MODBUS_POOL_TEST_INSTANCE_N];
+	static ModBus_Request_T requestBuffer[4];
+	static ModBus_Gateway_Request_T gatewayRequests[MODBUS_POOL_TEST_REQUEST_N];
+	static void* payloadBuffer[MODBUS_POOL_BUFFER_SIZE(MODBUS_BUFFER_SIZE, 3) / sizeof(void*)]; // 指针数组保证对齐
+	static ModBus_Pool_T instancePool, requestPool, payloadPool, gatewayPool;
+	ModBus_parameter* instances[MODBUS_POOL_TEST_INSTANCE_N];
+	ModBus_Request_T* requests[4];
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Pool_Stats_T stats;
+	void* blocks[3];
+
+	for (uint16_t i = 0; i < 8; i++)
+		g_poolRegisters[i] = 0x500 + i;
+
+	// 数据缓冲区池: 块大小按指针对齐, 用完返回NULL, 放回后O(1)重用最后放回的块
+	ModBus_Pool_setup(&payloadPool, payloadBuffer, MODBUS_BUFFER_SIZE, 3);
+	assert(payloadPool.m_blockSize % sizeof(void*) == 0 && payloadPool.m_blockSize >= MODBUS_BUFFER_SIZE);
+	for (int i = 0; i < 3; i++)
+	{
+		blocks[i] = ModBus_Pool_acquire(&payloadPool);
+		assert(blocks[i] != NULL && ModBus_Pool_index(&payloadPool, blocks[i]) == (size_t)i && ModBus_Pool_at(&payloadPool, i) == blocks[i]);
+		memset(blocks[i], 0xA5, MODBUS_BUFFER_SIZE); // 整块可写
+	}
+	assert(ModBus_Pool_acquire(&payloadPool) == NULL);
+	ModBus_Pool_release(&payloadPool, blocks[1]);
+	assert(ModBus_Pool_acquire(&payloadPool) == blocks[1]);
+	ModBus_Pool_getStats(&payloadPool, &stats);
+	assert(stats.capacity == 3 && stats.used == 3 && stats.peak == 3 && stats.acquireCount == 4 && stats.failCount == 1);
+	for (int i = 0; i < 3; i++)
+		ModBus_Pool_release(&payloadPool, blocks[i]);
+	ModBus_Pool_getStats(&payloadPool, &stats);
+	assert(stats.used == 0 && stats.peak == 3);
+
+	// 指令描述池: 取出的描述已清零
+	ModBus_Pool_setup(&requestPool, requestBuffer, sizeof(ModBus_Request_T), 4);
+	for (int i = 0; i < 4; i++)
+	{
+		requests[i] = ModBus_Pool_newRequest(&requestPool);
+		assert(requests[i] != NULL && requests[i]->resultHandler == NULL && requests[i]->count == 0);
+		requests[i]->count = 9;
+	}
+	assert(ModBus_Pool_newRequest(&requestPool) == NULL);
+	ModBus_Pool_release(&requestPool, requests[2]);
+	requests[2] = ModBus_Pool_newRequest(&requestPool);
+	assert(requests[2] != NULL && requests[2]->count == 0);
+
+	// 实例池: 取出的实例已配置, 主从机成对通信; 放回后重新取出的实例可正常使用
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_Pool_setup(&instancePool, instanceBuffer, sizeof(ModBus_parameter), MODBUS_POOL_TEST_INSTANCE_N);
+	for (int i = 0; i < MODBUS_POOL_TEST_INSTANCE_N; i++)
+	{
+		instances[i] = ModBus_Pool_newInstance(&instancePool, modbusSetting);
+		assert(instances[i] != NULL);
+		ModBus_setTimeout(instances[i], 5, 50);
+	}
+	assert(ModBus_Pool_newInstance(&instancePool, modbusSetting) == NULL);
+	ModBus_Pool_deleteInstance(&instancePool, instances[4]);
+	ModBus_Pool_deleteInstance(&instancePool, instances[5]);
+	instances[5] = ModBus_Pool_newInstance(&instancePool, modbusSetting);
+	instances[4] = ModBus_Pool_newInstance(&instancePool, modbusSetting);
+	assert(instances[4] != NULL && instances[5] != NULL);
+	for (int p = 0; p < MODBUS_POOL_TEST_INSTANCE_N; p += 2)
+	{
+		ModBus_parameter* master = instances[p];
+		ModBus_parameter* slave = instances[p + 1];
+		ModBus_Request_T* request = requests[p / 2];
+		ModBus_setTimeout(master, 5, 50);
+		ModBus_setTimeout(slave, 5, 50);
+		ModBus_attachRegisterHandler(slave, poolGetReg, NULL);
+		ModBus_attachSendHandler(master, poolSend, slave);
+		ModBus_attachSendHandler(slave, poolSend, master);
+		memset(request, 0, sizeof(*request));
+		request->type = READ_REGISTER;
+		request->address = (uint16_t)p;
+		request->count = 2;
+		request->resultHandler = poolResult;
+		g_poolResultN = 0;
+		ModBus_request(master, request);
+		for (int i = 0; i < 100 && g_poolResultN == 0; i++)
+		{
+			ModBus_Master_loop(master);
+			ModBus_Slave_loop(slave);
+			t += 1;
+		}
+		assert(g_poolResultN == 1 && g_poolResult.status == MODBUS_STATUS_OK && g_poolResult.data[1] == 0x501 + p);
+	}
+	for (int i = 0; i < 4; i++)
+		ModBus_Pool_release(&requestPool, requests[i]);
+	for (int i = 0; i < MODBUS_POOL_TEST_INSTANCE_N; i++)
+		ModBus_Pool_deleteInstance(&instancePool, instances[i]);
+	ModBus_Pool_getStats(&instancePool, &stats);
+	assert(stats.used == 0 && stats.peak == MODBUS_POOL_TEST_INSTANCE_N && stats.failCount == 1);
+
+	// 上万个请求: 全部取出再全部放回, 内存固定为缓冲区大小
+	ModBus_Pool_setup(&gatewayPool, gatewayRequests, sizeof(ModBus_Gateway_Request_T), MODBUS_POOL_TEST_REQUEST_N);
+	for (int i = 0; i < MODBUS_POOL_TEST_REQUEST_N; i++)
+		assert(ModBus_Pool_acquire(&gatewayPool) == gatewayRequests + i);
+	assert(ModBus_Pool_acquire(&gatewayPool) == NULL);
+	for (int i = MODBUS_POOL_TEST_REQUEST_N; i > 0; i--)
+		ModBus_Pool_release(&gatewayPool, gatewayRequests + i - 1);
+	ModBus_Pool_getStats(&gatewayPool, &stats);
+	assert(stats.used == 0 && stats.peak == MODBUS_POOL_TEST_REQUEST_N);
+
+	printf("pool_unit_test: instance %u bytes, request %u bytes, %d gateway requests %u bytes\n", (unsigned)instancePool.m_blockSize,
+		(unsigned)requestPool.m_blockSize, MODBUS_POOL_TEST_REQUEST_N, (unsigned)(MODBUS_POOL_TEST_REQUEST_N * gatewayPool.m_blockSize));
+}
+#endif // _UNIT_TEST
@@ -0,0 +1,83 @@
+#ifndef MOTECMODBUS_POOL_H_
+#define MOTECMODBUS_POOL_H_
+/**** ModBus 固定大小内存池 ****
+** 内存区域由调用者在初始化时提供(静态数组), 运行中不调用malloc
+** 块大小固定, 空闲块组成链表(链表指针保存在空闲块内), 取出/放回均为O(1), 不额外占用内存
+** 统计使用个数, 峰值和取出失败次数, 用于确认池的大小是否合适
+** 典型用法: 实例池(ModBus_parameter), 指令描述池(ModBus_Request_T), 数据缓冲区池(如网关请求, 见 modbus_gateway.h)
+** 使用方法:
+****** 定义缓冲区: static byte buffer[MODBUS_POOL_BUFFER_SIZE(sizeof(T), N)] (需按指针大小对齐, 可用类型T的数组)
+****** 调用ModBus_Pool_setup配置
+****** 调用ModBus_Pool_acquire/ModBus_Pool_release取出/放回; 实例和指令描述可用 ModBus_Pool_newInstance/ModBus_Pool_newRequest
+****** 调用ModBus_Pool_getStats查看使用情况
+** 注: 池本身不加锁, 只能在同一线程中使用
+*/
+
+#include "modbus.h"
+
+#define MODBUS_POOL_ALIGN sizeof(void*) // 块按指针大小对齐, 空闲块保存链表指针
+#define MODBUS_POOL_BLOCK_SIZE(size) ((((size) < MODBUS_POOL_ALIGN ? MODBUS_POOL_ALIGN : (size)) + MODBUS_POOL_ALIGN - 1) / MODBUS_POOL_ALIGN * MODBUS_POOL_ALIGN) // 实际块大小
+#define MODBUS_POOL_BUFFER_SIZE(size, n) (MODBUS_POOL_BLOCK_SIZE(size) * (n)) // n个块需要的缓冲区字节数
+
+typedef struct __MODBUS_Pool {
+	byte* m_blocks; // 块区域, 由调用者提供
+	size_t m_blockSize; // 块大小(已对齐)
+	size_t m_capacity; // 块个数
+	void* m_freeHead; // 空闲链表头, NULL表示已用完
+
+	size_t m_used; // 正在使用的块数
+	size_t m_peak; // 使用块数的峰值
+	u32 m_acquireCount; // 取出次数
+	u32 m_failCount; // 用完时取出失败的次数
+} ModBus_Pool_T;
+
+typedef struct _MODBUS_POOL_STATS_T { // 内存池使用情况
+	size_t capacity; // 块个数
+	size_t blockSize; // 块大小
+	size_t used; // 正在使用的块数
+	size_t peak; // 峰值
+	u32 acquireCount; // 取出次数
+	u32 failCount; // 取出失败次数
+} ModBus_Pool_Stats_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置内存池 **/
+/*** 参数 ***
+** buffer: 块区域, 至少 MODBUS_POOL_BUFFER_SIZE(blockSize, capacity) 字节, 按指针大小对齐
+** blockSize: 每块字节数(如 sizeof(ModBus_parameter))
+** capacity: 块个数
+***/
+void ModBus_Pool_setup(ModBus_Pool_T* pool, void* buffer, size_t blockSize, size_t capacity);
+
+// 取出一块, 内容未初始化; 用完返回NULL
+void* ModBus_Pool_acquire(ModBus_Pool_T* pool);
+
+// 放回一块, block必须由同一内存池取出
+void ModBus_Pool_release(ModBus_Pool_T* pool, void* block);
+
+// 块的序号(0 ~ capacity-1), 用于以序号链接的结构
+size_t ModBus_Pool_index(const ModBus_Pool_T* pool, const void* block);
+
+// 序号对应的块
+void* ModBus_Pool_at(const ModBus_Pool_T* pool, size_t index);
+
+// 获取使用情况
+void ModBus_Pool_getStats(const ModBus_Pool_T* pool, ModBus_Pool_Stats_T* stats);
+
+/** 实例池: 取出并配置实例, 用完返回NULL **/
+/*** 参数 ***
+** pool: 块大小为 sizeof(ModBus_parameter) 的内存池
+** setting: 实例配置, 同 ModBus_setup
+***/
+ModBus_parameter* ModBus_Pool_newInstance(ModBus_Pool_T* pool, ModBus_Setting_T setting);
+
+// 放回实例, 放回前需解除串口/调度器等对实例的引用
+void ModBus_Pool_deleteInstance(ModBus_Pool_T* pool, ModBus_parameter* modbus);
+
+// 指令描述池: 取出清零的指令描述(块大小为 sizeof(ModBus_Request_T)), 用完返回NULL; 用ModBus_Pool_release放回
+ModBus_Request_T* ModBus_Pool_newRequest(ModBus_Pool_T* pool);
+
+/**************** 对外接口 END ***************/
+
+#endif
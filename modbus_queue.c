@@ -0,0 +1,256 @@
+#include "modbus_queue.h"
+
+// position位置元素的序号
+static atomic_size_t* ModBus_Queue_sequence(ModBus_Queue_T* queue, size_t position)
+{
+	return (atomic_size_t*)(queue->m_cells + (position & queue->m_mask) * queue->m_cellSize);
+}
+
+/** 配置队列 **/
+/*** 参数 ***
+** buffer: 缓冲区, 至少 MODBUS_QUEUE_BUFFER_SIZE(capacity, elementSize) 字节
+** capacity: 队列容量, 必须是2的整数次幂
+** elementSize: 元素字节数
+***/
+byte ModBus_Queue_setup(ModBus_Queue_T* queue, void* buffer, size_t capacity, size_t elementSize)
+{
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+	{
+		return 0;
+	}
+	queue->m_cells = (byte*)buffer;
+	queue->m_mask = capacity - 1;
+	queue->m_cellSize = MODBUS_QUEUE_CELL_SIZE(elementSize);
+	queue->m_elementSize = elementSize;
+	queue->m_tail = 0;
+	atomic_init(&queue->m_head, 0);
+	atomic_init(&queue->m_dropCount, 0u);
+	for (size_t i = 0; i < capacity; i++) // 序号等于位置表示可写入, 等于位置+1表示可读取
+	{
+		atomic_init(ModBus_Queue_sequence(queue, i), i);
+	}
+	return 1;
+}
+
+// 放入元素, 任意线程可调用
+byte ModBus_Queue_push(ModBus_Queue_T* queue, const void* element)
+{
+	size_t position = atomic_load_explicit(&queue->m_head, memory_order_relaxed);
+	atomic_size_t* sequence;
+	for (;;)
+	{
+		size_t seq;
+		sequence = ModBus_Queue_sequence(queue, position);
+		seq = atomic_load_explicit(sequence, memory_order_acquire);
+		if (seq == position) // 位置可写入, 竞争占用
+		{
+			if (atomic_compare_exchange_weak_explicit(&queue->m_head, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if ((intptr_t)(seq - position) < 0) // 消费者尚未取出, 队列满
+		{
+			atomic_fetch_add_explicit(&queue->m_dropCount, 1u, memory_order_relaxed);
+			return 0;
+		}
+		else // 被其他生产者占用, 重新读取位置
+		{
+			position = atomic_load_explicit(&queue->m_head, memory_order_relaxed);
+		}
+	}
+	memcpy((byte*)sequence + MODBUS_QUEUE_ALIGN(sizeof(atomic_size_t)), element, queue->m_elementSize);
+	atomic_store_explicit(sequence, position + 1, memory_order_release); // 发布给消费者
+	return 1;
+}
+
+// 取出元素, 只能由一个线程调用
+byte ModBus_Queue_pop(ModBus_Queue_T* queue, void* element)
+{
+	size_t position = queue->m_tail;
+	atomic_size_t* sequence = ModBus_Queue_sequence(queue, position);
+	if (atomic_load_explicit(sequence, memory_order_acquire) != position + 1) // 队列空, 或生产者尚未写完
+	{
+		return 0;
+	}
+	memcpy(element, (byte*)sequence + MODBUS_QUEUE_ALIGN(sizeof(atomic_size_t)), queue->m_elementSize);
+	atomic_store_explicit(sequence, position + queue->m_mask + 1, memory_order_release); // 位置留给下一轮生产者
+	queue->m_tail = position + 1;
+	return 1;
+}
+
+#ifdef MODBUS_MASTER
+
+// 主机绑定指令提交队列
+void ModBus_attachSubmitQueue(ModBus_parameter* ModBus_para, ModBus_Queue_T* queue)
+{
+	ModBus_para->m_master.m_submitQueue = queue;
+}
+
+// 提交指令, 任意线程可调用
+byte ModBus_submit(ModBus_Queue_T* queue, const ModBus_Request_T* request)
+{
+	return ModBus_Queue_push(queue, request);
+}
+
+// 主机loop中取出提交的指令放入指令缓存
+void ModBus_drainSubmitQueue(ModBus_parameter* ModBus_para)
+{
+	ModBus_Request_T request;
+	if (ModBus_para->m_master.m_submitQueue == NULL)
+	{
+		return;
+	}
+	// 指令缓存满时留在提交队列中, 由提交队列的容量提供背压, 不挤掉已缓存的指令
+	while (ModBus_para->m_master.m_sendFramesN < MODBUS_WAITFRAME_N && ModBus_Queue_pop(ModBus_para->m_master.m_submitQueue, &request))
+	{
+		ModBus_request(ModBus_para, &request);
+	}
+}
+
+// 指令执行结束, 结果放入完成队列, 或调用带上下文的回调函数; 完成队列满返回0
+byte ModBus_deliverResult(ModBus_ResultHandler_T resultHandler, void* context, ModBus_Queue_T* completionQueue, const ModBus_Result_T* result)
+{
+	if (completionQueue)
+	{
+		ModBus_Completion_T completion;
+		completion.context = context;
+		completion.result = *result;
+		if (result->data)
+		{
+			memcpy(completion.data, result->data, result->count * sizeof(uint16_t));
+		}
+		return ModBus_Queue_push(completionQueue, &completion); // 队列满时已计入m_dropCount
+	}
+	else if (resultHandler)
+	{
+		(*resultHandler)(context, result);
+	}
+	return 1;
+}
+
+// 从完成队列取出一个执行结果
+byte ModBus_pollCompletion(ModBus_Queue_T* queue, ModBus_Completion_T* completion)
+{
+	if (!ModBus_Queue_pop(queue, completion))
+	{
+		return 0;
+	}
+	completion->result.data = (completion->result.type == READ_REGISTER && completion->result.count > 0) ? completion->data : NULL;
+	return 1;
+}
+
+#endif // MODBUS_MASTER
+
+#if defined(_UNIT_TEST)
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define MODBUS_QUEUE_TEST_PRODUCER_N 4 // 并发生产者个数
+#define MODBUS_QUEUE_TEST_PUSH_N 50000 // 每个生产者放入的元素个数
+#define MODBUS_QUEUE_TEST_CAPACITY 64 // 容量远小于元素总数, 生产者经常遇到队列满
+
+typedef struct {
+	u32 producer; // 生产者序号
+	u32 sequence; // 该生产者放入的顺序
+} QueueTestElement_T;
+
+static ModBus_Queue_T g_queueTest;
+
+// 生产者线程: 按顺序放入元素, 队列满时让出CPU后重试
+static void* queueProducer(void* arg)
+{
+	QueueTestElement_T element;
+	element.producer = (u32)(uintptr_t)arg;
+	for (element.sequence = 0; element.sequence < MODBUS_QUEUE_TEST_PUSH_N; element.sequence++)
+	{
+		while (!ModBus_Queue_push(&g_queueTest, &element))
+			sched_yield();
+	}
+	return NULL;
+}
+
+// 多个生产者线程并发放入, 一个消费者取出: 每个元素只取出一次, 同一生产者的元素保持放入顺序
+static void queueConcurrentTest()
+{
+	static byte buffer[MODBUS_QUEUE_BUFFER_SIZE(MODBUS_QUEUE_TEST_CAPACITY, sizeof(QueueTestElement_T))];
+	pthread_t producers[MODBUS_QUEUE_TEST_PRODUCER_N];
+	u32 next[MODBUS_QUEUE_TEST_PRODUCER_N] = { 0 };
+	QueueTestElement_T element;
+	size_t popN = 0, idleN = 0;
+
+	assert(ModBus_Queue_setup(&g_queueTest, buffer, MODBUS_QUEUE_TEST_CAPACITY, sizeof(QueueTestElement_T)));
+	for (uintptr_t i = 0; i < MODBUS_QUEUE_TEST_PRODUCER_N; i++)
+		pthread_create(producers + i, NULL, queueProducer, (void*)i);
+	while (popN < (size_t)MODBUS_QUEUE_TEST_PRODUCER_N * MODBUS_QUEUE_TEST_PUSH_N)
+	{
+		if (!ModBus_Queue_pop(&g_queueTest, &element))
+		{
+			assert(++idleN < 10000000); // 元素丢失时不会再取到, 不一直等待
+			sched_yield();
+			continue;
+		}
+		idleN = 0;
+		assert(element.producer < MODBUS_QUEUE_TEST_PRODUCER_N && element.sequence == next[element.producer]);
+		next[element.producer]++;
+		popN++;
+	}
+	for (int i = 0; i < MODBUS_QUEUE_TEST_PRODUCER_N; i++)
+	{
+		pthread_join(producers[i], NULL);
+		assert(next[i] == MODBUS_QUEUE_TEST_PUSH_N);
+	}
+	assert(!ModBus_Queue_pop(&g_queueTest, &element));
+	printf("queue_unit_test: %u producers, %u elements, %u full retries\n", (unsigned)MODBUS_QUEUE_TEST_PRODUCER_N, (unsigned)popN, atomic_load(&g_queueTest.m_dropCount));
+}
+
+#ifdef MODBUS_MASTER
+// 完成队列满: 执行结果丢失时计入m_dropCount, 取出后可继续放入
+static void queueCompletionTest()
+{
+	static byte buffer[MODBUS_QUEUE_BUFFER_SIZE(2, sizeof(ModBus_Completion_T))];
+	ModBus_Queue_T completions;
+	ModBus_parameter master;
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+	ModBus_Completion_T completion;
+	ModBus_Result_T result = { 0 };
+
+	assert(!ModBus_Queue_setup(&completions, buffer, 3, sizeof(ModBus_Completion_T)));
+	assert(ModBus_Queue_setup(&completions, buffer, 2, sizeof(ModBus_Completion_T)));
+	modbusSetting.address = 0x01;
+	modbusSetting.baudRate = 9600;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = 5;
+	ModBus_setup(&master, modbusSetting);
+
+	// 参数无效的指令立即结束, 第三个结果放不下
+	request.type = READ_REGISTER;
+	request.completionQueue = &completions;
+	for (intptr_t i = 0; i < 3; i++)
+	{
+		request.context = (void*)i;
+		assert(ModBus_request(&master, &request) == 0);
+	}
+	assert(atomic_load(&completions.m_dropCount) == 1);
+	result.status = MODBUS_STATUS_OK;
+	assert(ModBus_deliverResult(NULL, NULL, &completions, &result) == 0 && atomic_load(&completions.m_dropCount) == 2);
+	assert(ModBus_pollCompletion(&completions, &completion) && completion.context == (void*)0 && completion.result.status == MODBUS_STATUS_INVALID);
+	assert(ModBus_deliverResult(NULL, (void*)7, &completions, &result) == 1);
+	assert(ModBus_pollCompletion(&completions, &completion) && completion.context == (void*)1);
+	assert(ModBus_pollCompletion(&completions, &completion) && completion.context == (void*)7 && completion.result.status == MODBUS_STATUS_OK);
+	assert(!ModBus_pollCompletion(&completions, &completion));
+	assert(ModBus_deliverResult(NULL, NULL, NULL, &result) == 1); // 没有完成队列和回调函数
+}
+#endif // MODBUS_MASTER
+
+void queue_unit_test()
+{
+	queueConcurrentTest();
+#ifdef MODBUS_MASTER
+	queueCompletionTest();
+#endif
+	printf("queue_unit_test: ok\n");
+}
+#endif // _UNIT_TEST
@@ -0,0 +1,76 @@
+#ifndef MOTECMODBUS_QUEUE_H_
+#define MOTECMODBUS_QUEUE_H_
+/**** 无锁多生产者/单消费者有界队列 ****
+** 任意线程可以放入元素, 只有一个线程取出; 不加锁, 不分配内存, 缓冲区由调用者提供
+** 主机指令提交:
+****** 调用ModBus_Queue_setup配置提交队列(元素为ModBus_Request_T)
+****** 调用ModBus_attachSubmitQueue绑定到主机实例
+****** 任意线程调用ModBus_submit提交指令, 主机loop所在线程在ModBus_Master_loop中取出并发送
+****** 执行结果在主机loop线程中调用回调函数, 或放入指令指定的完成队列(元素为ModBus_Completion_T)
+****** 应用线程调用ModBus_pollCompletion取出执行结果
+*/
+
+#include "modbus.h"
+#include <stdatomic.h>
+
+#define MODBUS_QUEUE_ALIGN(size) (((size) + 7u) & ~(size_t)7u) // 按8字节对齐
+#define MODBUS_QUEUE_CELL_SIZE(elementSize) (MODBUS_QUEUE_ALIGN(sizeof(atomic_size_t)) + MODBUS_QUEUE_ALIGN(elementSize)) // 每个元素占用的字节数
+#define MODBUS_QUEUE_BUFFER_SIZE(capacity, elementSize) ((capacity) * MODBUS_QUEUE_CELL_SIZE(elementSize)) // 队列缓冲区字节数
+#define MODBUS_QUEUE_CACHE_LINE 64 // 生产者和消费者位置分别放在不同缓存行, 避免伪共享
+
+typedef struct __MODBUS_Queue {
+	atomic_size_t m_head; // 生产者下一个写入位置
+	byte m_padHead[MODBUS_QUEUE_CACHE_LINE - sizeof(atomic_size_t)];
+	size_t m_tail; // 消费者下一个读取位置, 只由消费者修改
+	byte m_padTail[MODBUS_QUEUE_CACHE_LINE - sizeof(size_t)];
+	byte* m_cells; // 元素缓冲区, 每个元素前有一个序号
+	size_t m_mask; // 容量-1
+	size_t m_cellSize; // 每个元素占用的字节数
+	size_t m_elementSize; // 元素字节数
+	atomic_uint m_dropCount; // 因队列满未能放入的次数, 完成队列中即丢失的执行结果数
+} ModBus_Queue_T;
+
+typedef struct _MODBUS_COMPLETION_T { // 完成队列元素
+	void* context; // 指令的上下文
+	ModBus_Result_T result; // 执行结果, 取出后result.data指向本结构的data
+	uint16_t data[MODBUS_REGISTER_LIMIT]; // 读取的寄存器值
+} ModBus_Completion_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置队列 **/
+/*** 参数 ***
+** buffer: 缓冲区, 至少 MODBUS_QUEUE_BUFFER_SIZE(capacity, elementSize) 字节, 8字节对齐
+** capacity: 队列容量, 必须是2的整数次幂
+** elementSize: 元素字节数
+** 成功返回1, 容量不是2的整数次幂返回0
+***/
+byte ModBus_Queue_setup(ModBus_Queue_T* queue, void* buffer, size_t capacity, size_t elementSize);
+
+// 放入元素, 任意线程可调用; 成功返回1, 队列满返回0
+byte ModBus_Queue_push(ModBus_Queue_T* queue, const void* element);
+
+// 取出元素, 只能由一个线程调用; 成功返回1, 队列空返回0
+byte ModBus_Queue_pop(ModBus_Queue_T* queue, void* element);
+
+#ifdef MODBUS_MASTER
+// 主机绑定指令提交队列(元素为ModBus_Request_T), 传入NULL解除绑定
+void ModBus_attachSubmitQueue(ModBus_parameter* ModBus_para, ModBus_Queue_T* queue);
+
+// 提交指令, 任意线程可调用; 成功返回1, 队列满返回0
+byte ModBus_submit(ModBus_Queue_T* queue, const ModBus_Request_T* request);
+
+// 主机loop中取出提交的指令放入指令缓存, 不会挤掉已缓存的指令
+void ModBus_drainSubmitQueue(ModBus_parameter* ModBus_para);
+
+// 指令执行结束, 结果放入完成队列(不为NULL时), 或调用带上下文的回调函数; 供自行管理指令的传输方式使用(如UDP)
+// 完成队列满时结果丢失, 计入完成队列的m_dropCount并返回0; 等待结果的应用线程应检查m_dropCount, 避免一直等待
+byte ModBus_deliverResult(ModBus_ResultHandler_T resultHandler, void* context, ModBus_Queue_T* completionQueue, const ModBus_Result_T* result);
+
+// 从完成队列取出一个执行结果; 成功返回1, 没有结果返回0
+byte ModBus_pollCompletion(ModBus_Queue_T* queue, ModBus_Completion_T* completion);
+#endif // MODBUS_MASTER
+
+/**************** 对外接口 END ***************/
+
+#endif
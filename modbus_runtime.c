@@ -0,0 +1,447 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
+
+#include "modbus_runtime.h"
+#include "modbus_queue.h"
+
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MODBUS_RUNTIME_WAKE_ID 0xFFFFFFFFu // 唤醒事件在epoll中的标识, 其他标识为总线序号
+
+// 单调时钟(微秒), 用于负载统计
+static unsigned long long ModBus_Runtime_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ull + (unsigned long long)ts.tv_nsec / 1000ull;
+}
+
+// 关闭工作线程的事件循环
+static void ModBus_Runtime_closeWorker(ModBus_Runtime_Worker_T* worker)
+{
+	if (worker->m_epollFd >= 0)
+	{
+		close(worker->m_epollFd);
+		worker->m_epollFd = -1;
+	}
+	if (worker->m_eventFd >= 0)
+	{
+		close(worker->m_eventFd);
+		worker->m_eventFd = -1;
+	}
+}
+
+// 唤醒工作线程, 已有未处理的唤醒时不再写入
+static void ModBus_Runtime_wake(ModBus_Runtime_Worker_T* worker)
+{
+	uint64_t one = 1;
+	if (atomic_exchange_explicit(&worker->m_wakePending, 1, memory_order_acq_rel) == 0)
+	{
+		ssize_t n = write(worker->m_eventFd, &one, sizeof(one));
+		(void)n; // 失败时由tickTime兜底
+	}
+}
+
+// 工作线程: 等待串口数据或唤醒, 接收数据后运行所属的全部实例
+static void* ModBus_Runtime_workerMain(void* arg)
+{
+	ModBus_Runtime_Worker_T* worker = (ModBus_Runtime_Worker_T*)arg;
+	ModBus_Runtime_T* runtime = worker->m_runtime;
+	struct epoll_event events[MODBUS_RUNTIME_EVENT_N];
+
+	atomic_store_explicit(&worker->m_startTime, ModBus_Runtime_now(), memory_order_relaxed);
+	while (atomic_load_explicit(&runtime->m_running, memory_order_acquire))
+	{
+		unsigned long long begin;
+		int n = epoll_wait(worker->m_epollFd, events, MODBUS_RUNTIME_EVENT_N, (int)runtime->m_tickTime);
+		begin = ModBus_Runtime_now();
+		for (int i = 0; i < n; i++)
+		{
+			if (events[i].data.u32 == MODBUS_RUNTIME_WAKE_ID)
+			{
+				uint64_t value;
+				ssize_t r = read(worker->m_eventFd, &value, sizeof(value));
+				(void)r;
+				atomic_store_explicit(&worker->m_wakePending, 0, memory_order_release); // 先清除再运行loop, 之后提交的指令会重新唤醒
+				atomic_fetch_add_explicit(&worker->m_wakeCount, 1, memory_order_relaxed);
+			}
+			else
+			{
+				int received = ModBus_Serial_poll(runtime->m_buses[events[i].data.u32].m_port, 0); // 未读完的数据保留在内核缓冲区, 下一轮继续
+				if (received > 0)
+				{
+					atomic_fetch_add_explicit(&worker->m_readBytes, (unsigned long long)received, memory_order_relaxed);
+				}
+			}
+		}
+		for (int b = worker->m_firstBus; b >= 0; b = runtime->m_buses[b].m_nextBus)
+		{
+			ModBus_Runtime_Bus_T* bus = runtime->m_buses + b;
+#ifdef MODBUS_MASTER
+			if (bus->m_role == MODBUS_RUNTIME_MASTER)
+			{
+				ModBus_Master_loop(bus->m_modbus);
+			}
+#endif
+#ifdef MODBUS_SLAVE
+			if (bus->m_role == MODBUS_RUNTIME_SLAVE)
+			{
+				ModBus_Slave_loop(bus->m_modbus);
+			}
+#endif
+		}
+		atomic_fetch_add_explicit(&worker->m_busyTime, ModBus_Runtime_now() - begin, memory_order_relaxed);
+		atomic_fetch_add_explicit(&worker->m_loopCount, 1, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+/** 配置运行时 **/
+/*** 参数 ***
+** workers: 工作线程缓冲区
+** buses: 总线缓冲区
+** 成功返回0, 失败返回-1
+***/
+int ModBus_Runtime_setup(ModBus_Runtime_T* runtime, ModBus_Runtime_Setting_T setting, ModBus_Runtime_Worker_T* workers, size_t workerN, ModBus_Runtime_Bus_T* buses, size_t busCapacity)
+{
+	runtime->m_workers = workers;
+	runtime->m_workerN = workerN;
+	runtime->m_buses = buses;
+	runtime->m_busCapacity = busCapacity;
+	runtime->m_busN = 0;
+	runtime->m_tickTime = setting.tickTime != 0 ? setting.tickTime : MODBUS_RUNTIME_DEFAULT_TICK;
+	runtime->m_firstCpu = setting.firstCpu;
+	atomic_init(&runtime->m_running, 0);
+	if (workerN == 0)
+	{
+		return -1;
+	}
+
+	for (size_t i = 0; i < workerN; i++)
+	{
+		ModBus_Runtime_Worker_T* worker = workers + i;
+		struct epoll_event ev;
+		worker->m_runtime = runtime;
+		worker->m_cpu = -1;
+		worker->m_firstBus = -1;
+		worker->m_busN = 0;
+		atomic_init(&worker->m_wakePending, 0);
+		atomic_init(&worker->m_loopCount, 0);
+		atomic_init(&worker->m_wakeCount, 0);
+		atomic_init(&worker->m_readBytes, 0);
+		atomic_init(&worker->m_busyTime, 0);
+		atomic_init(&worker->m_startTime, 0);
+		worker->m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+		worker->m_eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ev.events = EPOLLIN;
+		ev.data.u32 = MODBUS_RUNTIME_WAKE_ID;
+		if (worker->m_epollFd < 0 || worker->m_eventFd < 0 || epoll_ctl(worker->m_epollFd, EPOLL_CTL_ADD, worker->m_eventFd, &ev) < 0)
+		{
+			for (size_t j = 0; j <= i; j++)
+			{
+				ModBus_Runtime_closeWorker(workers + j);
+			}
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/** 添加实例 **/
+/*** 参数 ***
+** port: 实例绑定的串口, NULL表示由其他方式传入数据
+** worker: 工作线程序号, MODBUS_RUNTIME_AUTO 自动选择
+** 返回总线序号, 失败返回-1
+***/
+int ModBus_Runtime_addBus(ModBus_Runtime_T* runtime, ModBus_parameter* modbus, ModBus_Serial_T* port, MODBUS_RUNTIME_ROLE_TYPE role, int worker)
+{
+	ModBus_Runtime_Bus_T* bus;
+	ModBus_Runtime_Worker_T* target;
+	int index, last;
+	if (runtime->m_busN >= runtime->m_busCapacity || atomic_load(&runtime->m_running) || (worker >= 0 && (size_t)worker >= runtime->m_workerN))
+	{
+		return -1;
+	}
+	if (worker < 0) // 实例最少的线程
+	{
+		worker = 0;
+		for (size_t i = 1; i < runtime->m_workerN; i++)
+		{
+			if (runtime->m_workers[i].m_busN < runtime->m_workers[worker].m_busN)
+			{
+				worker = (int)i;
+			}
+		}
+	}
+	target = runtime->m_workers + worker;
+	index = (int)runtime->m_busN;
+	bus = runtime->m_buses + index;
+	bus->m_modbus = modbus;
+	bus->m_port = port;
+	bus->m_role = role;
+	bus->m_worker = (size_t)worker;
+	bus->m_nextBus = -1;
+	if (port != NULL)
+	{
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.u32 = (uint32_t)index;
+		if (epoll_ctl(target->m_epollFd, EPOLL_CTL_ADD, port->m_fd, &ev) < 0)
+		{
+			return -1;
+		}
+	}
+	// 按添加顺序链接到线程的总线列表
+	if (target->m_firstBus < 0)
+	{
+		target->m_firstBus = index;
+	}
+	else
+	{
+		for (last = target->m_firstBus; runtime->m_buses[last].m_nextBus >= 0; last = runtime->m_buses[last].m_nextBus);
+		runtime->m_buses[last].m_nextBus = index;
+	}
+	target->m_busN++;
+	runtime->m_busN++;
+	return index;
+}
+
+// 启动工作线程
+int ModBus_Runtime_start(ModBus_Runtime_T* runtime)
+{
+	long cpuN = sysconf(_SC_NPROCESSORS_ONLN);
+	atomic_store(&runtime->m_running, 1);
+	for (size_t i = 0; i < runtime->m_workerN; i++)
+	{
+		ModBus_Runtime_Worker_T* worker = runtime->m_workers + i;
+		if (pthread_create(&worker->m_thread, NULL, ModBus_Runtime_workerMain, worker) != 0)
+		{
+			atomic_store(&runtime->m_running, 0);
+			for (size_t j = 0; j < i; j++)
+			{
+				ModBus_Runtime_wake(runtime->m_workers + j);
+				pthread_join(runtime->m_workers[j].m_thread, NULL);
+			}
+			return -1;
+		}
+		if (runtime->m_firstCpu >= 0 && cpuN > 0)
+		{
+			cpu_set_t set;
+			int cpu = (int)((runtime->m_firstCpu + (long)i) % cpuN);
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			if (pthread_setaffinity_np(worker->m_thread, sizeof(set), &set) == 0) // 绑定失败(如容器限制)时线程照常运行
+			{
+				worker->m_cpu = cpu;
+			}
+		}
+	}
+	return 0;
+}
+
+#ifdef MODBUS_MASTER
+/** 提交指令 **/
+/*** 参数 ***
+** bus: 主机总线序号
+** 成功返回1, 提交队列满返回0
+***/
+byte ModBus_Runtime_submit(ModBus_Runtime_T* runtime, size_t bus, const ModBus_Request_T* request)
+{
+	ModBus_Runtime_Bus_T* target;
+	if (bus >= runtime->m_busN)
+	{
+		return 0;
+	}
+	target = runtime->m_buses + bus;
+	if (target->m_role != MODBUS_RUNTIME_MASTER || target->m_modbus->m_master.m_submitQueue == NULL
+		|| !ModBus_submit(target->m_modbus->m_master.m_submitQueue, request))
+	{
+		return 0;
+	}
+	ModBus_Runtime_wake(runtime->m_workers + target->m_worker);
+	return 1;
+}
+#endif // MODBUS_MASTER
+
+// 获取工作线程负载统计
+void ModBus_Runtime_getStats(ModBus_Runtime_T* runtime, size_t worker, ModBus_Runtime_Stats_T* stats)
+{
+	ModBus_Runtime_Worker_T* w = runtime->m_workers + worker;
+	unsigned long long start = atomic_load_explicit(&w->m_startTime, memory_order_relaxed);
+	stats->cpu = w->m_cpu;
+	stats->busN = w->m_busN;
+	stats->loopCount = atomic_load_explicit(&w->m_loopCount, memory_order_relaxed);
+	stats->wakeCount = atomic_load_explicit(&w->m_wakeCount, memory_order_relaxed);
+	stats->readBytes = atomic_load_explicit(&w->m_readBytes, memory_order_relaxed);
+	stats->busyTime = atomic_load_explicit(&w->m_busyTime, memory_order_relaxed);
+	stats->elapsedTime = start != 0 ? ModBus_Runtime_now() - start : 0;
+	stats->load = stats->elapsedTime > 0 ? (u32)(stats->busyTime * 1000ull / stats->elapsedTime) : 0;
+}
+
+// 停止并等待工作线程结束
+void ModBus_Runtime_stop(ModBus_Runtime_T* runtime)
+{
+	if (atomic_exchange(&runtime->m_running, 0))
+	{
+		for (size_t i = 0; i < runtime->m_workerN; i++)
+		{
+			ModBus_Runtime_wake(runtime->m_workers + i);
+			pthread_join(runtime->m_workers[i].m_thread, NULL);
+		}
+	}
+	for (size_t i = 0; i < runtime->m_workerN; i++)
+	{
+		ModBus_Runtime_closeWorker(runtime->m_workers + i);
+	}
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+#include <pty.h>
+
+#define MODBUS_RUNTIME_TEST_BUS_N 4 // 主从机对数, 每对一条总线
+#define MODBUS_RUNTIME_TEST_REQUEST_N 8 // 每条总线的指令数
+
+static uint16_t g_runtimeRegisters[MODBUS_RUNTIME_TEST_BUS_N][16];
+static atomic_int g_runtimeBlock; // 为1时总线0的从机读寄存器函数阻塞, 模拟慢回调
+
+#define RUNTIME_REG_HANDLERS(n) \
+static size_t runtimeGetReg##n(uint16_t address, uint16_t count, uint16_t* data) \
+{ \
+	while (n == 0 && atomic_load(&g_runtimeBlock)) \
+		usleep(1000); \
+	if (address + count > 16) \
+		return 0; \
+	memcpy(data, g_runtimeRegisters[n] + address, count * sizeof(uint16_t)); \
+	return count; \
+}
+RUNTIME_REG_HANDLERS(0)
+RUNTIME_REG_HANDLERS(1)
+RUNTIME_REG_HANDLERS(2)
+RUNTIME_REG_HANDLERS(3)
+
+// 等待完成队列中的结果
+static size_t runtimeWait(ModBus_Queue_T* completions, ModBus_Completion_T* out, size_t n, int waitMs)
+{
+	size_t got = 0;
+	for (int i = 0; i < waitMs && got < n; i++)
+	{
+		while (got < n && ModBus_pollCompletion(completions, out + got))
+			got++;
+		if (got < n)
+			usleep(1000);
+	}
+	return got;
+}
+
+// 4对主从机(伪终端)分配到2个工作线程, 应用线程提交指令并从完成队列取结果
+void runtime_unit_test()
+{
+	static ModBus_parameter masters[MODBUS_RUNTIME_TEST_BUS_N], slaves[MODBUS_RUNTIME_TEST_BUS_N];
+	static ModBus_Serial_T masterPorts[MODBUS_RUNTIME_TEST_BUS_N], slavePorts[MODBUS_RUNTIME_TEST_BUS_N];
+	static ModBus_Queue_T submitQueues[MODBUS_RUNTIME_TEST_BUS_N];
+	static byte submitBuffers[MODBUS_RUNTIME_TEST_BUS_N][MODBUS_QUEUE_BUFFER_SIZE(16, sizeof(ModBus_Request_T))] __attribute__((aligned(8)));
+	static ModBus_Queue_T completions;
+	static byte completionBuffer[MODBUS_QUEUE_BUFFER_SIZE(64, sizeof(ModBus_Completion_T))] __attribute__((aligned(8)));
+	static ModBus_Completion_T results[MODBUS_RUNTIME_TEST_BUS_N * MODBUS_RUNTIME_TEST_REQUEST_N];
+	static ModBus_Runtime_Worker_T workers[2];
+	static ModBus_Runtime_Bus_T buses[MODBUS_RUNTIME_TEST_BUS_N * 2];
+	static size_t (*getRegs[MODBUS_RUNTIME_TEST_BUS_N])(uint16_t, uint16_t, uint16_t*) = { runtimeGetReg0, runtimeGetReg1, runtimeGetReg2, runtimeGetReg3 };
+	ModBus_Runtime_T runtime;
+	ModBus_Runtime_Setting_T setting = { 0, 0 }; // 从CPU0开始绑定, CPU数不足时循环使用
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+	int masterBus[MODBUS_RUNTIME_TEST_BUS_N];
+	size_t got;
+	int ret;
+
+	ret = ModBus_Runtime_setup(&runtime, setting, workers, 2, buses, MODBUS_RUNTIME_TEST_BUS_N * 2);
+	assert(ret == 0);
+	ModBus_Queue_setup(&completions, completionBuffer, 64, sizeof(ModBus_Completion_T));
+	modbusSetting.address = 0x11;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	for (int b = 0; b < MODBUS_RUNTIME_TEST_BUS_N; b++)
+	{
+		int ptyMaster, ptySlave;
+		ret = openpty(&ptyMaster, &ptySlave, NULL, NULL, NULL);
+		assert(ret == 0);
+		for (uint16_t i = 0; i < 16; i++)
+			g_runtimeRegisters[b][i] = (uint16_t)(b * 0x100 + i);
+
+		ModBus_setup(masters + b, modbusSetting);
+		ModBus_setup(slaves + b, modbusSetting);
+		ModBus_lengthFraming(masters + b, 1); // 工作线程中不推进测试的虚拟时间, 按长度分帧
+		ModBus_lengthFraming(slaves + b, 1);
+		ModBus_attachRegisterHandler(slaves + b, getRegs[b], NULL);
+		ModBus_Queue_setup(submitQueues + b, submitBuffers[b], 16, sizeof(ModBus_Request_T));
+		ModBus_attachSubmitQueue(masters + b, submitQueues + b);
+		assert(ModBus_Serial_attachFd(masterPorts + b, ptyMaster, masters + b, 0) == 0);
+		assert(ModBus_Serial_attachFd(slavePorts + b, ptySlave, slaves + b, 0) == 0);
+
+		// 总线0,2在线程0, 总线1,3在线程1; 从机与主机在同一线程
+		masterBus[b] = ModBus_Runtime_addBus(&runtime, masters + b, masterPorts + b, MODBUS_RUNTIME_MASTER, b % 2);
+		assert(masterBus[b] >= 0);
+		ret = ModBus_Runtime_addBus(&runtime, slaves + b, slavePorts + b, MODBUS_RUNTIME_SLAVE, b % 2);
+		assert(ret >= 0);
+	}
+	ret = ModBus_Runtime_start(&runtime);
+	assert(ret == 0);
+
+	// 每条总线提交多个读指令, 所有结果通过同一完成队列返回
+	request.type = READ_REGISTER;
+	request.count = 2;
+	request.completionQueue = &completions;
+	for (int b = 0; b < MODBUS_RUNTIME_TEST_BUS_N; b++)
+	{
+		for (uint16_t i = 0; i < MODBUS_RUNTIME_TEST_REQUEST_N; i++)
+		{
+			request.address = i;
+			request.context = (void*)(intptr_t)b;
+			while (!ModBus_Runtime_submit(&runtime, (size_t)masterBus[b], &request))
+				usleep(1000);
+		}
+	}
+	got = runtimeWait(&completions, results, MODBUS_RUNTIME_TEST_BUS_N * MODBUS_RUNTIME_TEST_REQUEST_N, 5000);
+	assert(got == MODBUS_RUNTIME_TEST_BUS_N * MODBUS_RUNTIME_TEST_REQUEST_N);
+	for (size_t i = 0; i < got; i++)
+	{
+		int b = (int)(intptr_t)results[i].context;
+		assert(results[i].result.status == MODBUS_STATUS_OK && results[i].result.count == 2);
+		assert(results[i].data[0] == b * 0x100 + results[i].result.address && results[i].data[1] == results[i].data[0] + 1);
+	}
+
+	// 总线0的从机阻塞时, 线程1的总线照常完成
+	atomic_store(&g_runtimeBlock, 1);
+	request.address = 0;
+	request.context = (void*)(intptr_t)0;
+	assert(ModBus_Runtime_submit(&runtime, (size_t)masterBus[0], &request));
+	request.context = (void*)(intptr_t)1;
+	assert(ModBus_Runtime_submit(&runtime, (size_t)masterBus[1], &request));
+	got = runtimeWait(&completions, results, 1, 5000);
+	assert(got == 1 && (intptr_t)results[0].context == 1);
+	atomic_store(&g_runtimeBlock, 0);
+	got = runtimeWait(&completions, results, 1, 5000);
+	assert(got == 1 && (intptr_t)results[0].context == 0);
+
+	for (size_t i = 0; i < 2; i++)
+	{
+		ModBus_Runtime_Stats_T stats;
+		ModBus_Runtime_getStats(&runtime, i, &stats);
+		assert(stats.busN == MODBUS_RUNTIME_TEST_BUS_N && stats.loopCount > 0 && stats.wakeCount > 0 && stats.readBytes > 0);
+		printf("runtime_unit_test worker %u: cpu %d, buses %u, loops %llu, wakes %llu, read %llu bytes, load %u.%u%%\n", (unsigned)i, stats.cpu, (unsigned)stats.busN,
+			stats.loopCount, stats.wakeCount, stats.readBytes, stats.load / 10, stats.load % 10);
+	}
+	ModBus_Runtime_stop(&runtime);
+	for (int b = 0; b < MODBUS_RUNTIME_TEST_BUS_N; b++)
+	{
+		ModBus_Serial_close(masterPorts + b);
+		ModBus_Serial_close(slavePorts + b);
+	}
+}
+#endif // _UNIT_TEST
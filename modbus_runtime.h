@@ -0,0 +1,127 @@
+#ifndef MOTECMODBUS_RUNTIME_H_
+#define MOTECMODBUS_RUNTIME_H_
+/**** ModBus 多总线运行时 (Linux, pthread) ****
+** 多个实例(每条总线一个)分配到N个工作线程, 每个线程绑定一个CPU, 各自运行事件循环(epoll)
+** 一个实例只在所属线程中运行(接收/loop/回调), 不同线程的实例互不阻塞, 实例本身不需要加锁
+** 跨线程传递: 指令通过实例的提交队列(无锁, 见 modbus_queue.h)进入工作线程, 结果放入指令的完成队列返回应用线程
+** 每个工作线程统计循环次数, 忙碌时间等负载信息, 用于调整实例分配和线程数
+** 使用方法:
+****** 配置实例(ModBus_setup), 主机绑定提交队列(ModBus_attachSubmitQueue), 绑定串口(ModBus_Serial_open)
+****** 调用ModBus_Runtime_setup配置运行时, 传入工作线程和总线缓冲区
+****** 调用ModBus_Runtime_addBus添加实例, 然后调用ModBus_Runtime_start启动工作线程
+****** 任意线程调用ModBus_Runtime_submit提交指令, 调用ModBus_pollCompletion取出结果
+****** 调用ModBus_Runtime_getStats获取各线程负载, 调用ModBus_Runtime_stop停止
+** 注: 编译链接需要 -pthread
+*/
+
+#include "modbus.h"
+#include "modbus_serial.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define MODBUS_RUNTIME_NO_PIN (-1) // 不绑定CPU
+#define MODBUS_RUNTIME_AUTO (-1) // 自动选择实例最少的工作线程
+#define MODBUS_RUNTIME_DEFAULT_TICK 1 // 默认事件循环最长等待时间(毫秒), 决定超时检查的精度
+#define MODBUS_RUNTIME_EVENT_N 16 // 每次epoll_wait最多取出的事件数
+
+typedef enum {
+	MODBUS_RUNTIME_MASTER, // 运行ModBus_Master_loop
+	MODBUS_RUNTIME_SLAVE, // 运行ModBus_Slave_loop
+} MODBUS_RUNTIME_ROLE_TYPE;
+
+typedef struct _MODBUS_RUNTIME_SETTING_T { // 运行时配置信息类型
+	int firstCpu; // 第i个工作线程绑定到CPU (firstCpu + i) % CPU数, MODBUS_RUNTIME_NO_PIN 不绑定
+	u32 tickTime; // 事件循环最长等待时间(毫秒), 0 使用默认值
+} ModBus_Runtime_Setting_T;
+
+typedef struct _MODBUS_RUNTIME_BUS_T { // 总线(实例)
+	ModBus_parameter* m_modbus; // 实例
+	ModBus_Serial_T* m_port; // 绑定的串口, NULL表示由其他方式传入数据
+	MODBUS_RUNTIME_ROLE_TYPE m_role; // 主机/从机
+	size_t m_worker; // 所属工作线程
+	int m_nextBus; // 同一工作线程的下一个总线, -1表示无
+} ModBus_Runtime_Bus_T;
+
+struct __MODBUS_Runtime;
+
+typedef struct _MODBUS_RUNTIME_WORKER_T { // 工作线程
+	struct __MODBUS_Runtime* m_runtime; // 所属运行时
+	pthread_t m_thread; // 线程
+	int m_cpu; // 绑定的CPU, -1表示未绑定
+	int m_epollFd; // 事件循环
+	int m_eventFd; // 唤醒事件, 提交指令时写入
+	atomic_int m_wakePending; // 已写入唤醒事件但线程尚未处理, 避免重复写入
+	int m_firstBus; // 第一个总线, -1表示无
+	size_t m_busN; // 总线个数
+
+	// 负载统计, 工作线程写入, 其他线程读取
+	atomic_ullong m_loopCount; // 循环次数
+	atomic_ullong m_wakeCount; // 被提交指令唤醒的次数
+	atomic_ullong m_readBytes; // 串口接收字节数
+	atomic_ullong m_busyTime; // 处理数据和运行loop的时间(微秒), 不含等待
+	atomic_ullong m_startTime; // 线程启动时刻(微秒)
+} ModBus_Runtime_Worker_T;
+
+typedef struct __MODBUS_Runtime {
+	ModBus_Runtime_Worker_T* m_workers; // 工作线程缓冲区, 由调用者提供
+	size_t m_workerN; // 工作线程个数
+	ModBus_Runtime_Bus_T* m_buses; // 总线缓冲区, 由调用者提供
+	size_t m_busCapacity; // 总线缓冲区个数
+	size_t m_busN; // 已添加的总线个数
+	u32 m_tickTime; // 事件循环最长等待时间
+	int m_firstCpu; // 第一个工作线程绑定的CPU
+	atomic_int m_running; // 工作线程是否运行
+} ModBus_Runtime_T;
+
+typedef struct _MODBUS_RUNTIME_STATS_T { // 工作线程负载统计
+	int cpu; // 绑定的CPU, -1表示未绑定
+	size_t busN; // 总线个数
+	unsigned long long loopCount; // 循环次数
+	unsigned long long wakeCount; // 被提交指令唤醒的次数
+	unsigned long long readBytes; // 串口接收字节数
+	unsigned long long busyTime; // 忙碌时间(微秒)
+	unsigned long long elapsedTime; // 启动至今的时间(微秒)
+	u32 load; // 负载, 忙碌时间占比(千分比)
+} ModBus_Runtime_Stats_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置运行时 **/
+/*** 参数 ***
+** workers: 工作线程缓冲区, 个数workerN即线程数
+** buses: 总线缓冲区, 个数busCapacity为最多添加的实例数
+** 成功返回0, 失败返回-1
+***/
+int ModBus_Runtime_setup(ModBus_Runtime_T* runtime, ModBus_Runtime_Setting_T setting, ModBus_Runtime_Worker_T* workers, size_t workerN, ModBus_Runtime_Bus_T* buses, size_t busCapacity);
+
+/** 添加实例, 只能在启动前调用 **/
+/*** 参数 ***
+** modbus: 已配置的实例, 启动后只能在所属工作线程中访问(提交指令通过ModBus_Runtime_submit)
+** port: 实例绑定的串口, 由工作线程接收数据; NULL表示由其他方式传入数据
+** worker: 工作线程序号, MODBUS_RUNTIME_AUTO 选择实例最少的线程
+** 返回总线序号, 失败返回-1
+***/
+int ModBus_Runtime_addBus(ModBus_Runtime_T* runtime, ModBus_parameter* modbus, ModBus_Serial_T* port, MODBUS_RUNTIME_ROLE_TYPE role, int worker);
+
+// 启动工作线程; 成功返回0, 失败返回-1(已启动的线程被停止)
+int ModBus_Runtime_start(ModBus_Runtime_T* runtime);
+
+#ifdef MODBUS_MASTER
+/** 提交指令, 任意线程可调用 **/
+/*** 参数 ***
+** bus: 主机总线序号, 实例需已绑定提交队列
+** request: 指令, 结果放入request->completionQueue(或在工作线程中调用回调函数)
+** 成功返回1, 提交队列满返回0
+***/
+byte ModBus_Runtime_submit(ModBus_Runtime_T* runtime, size_t bus, const ModBus_Request_T* request);
+#endif // MODBUS_MASTER
+
+// 获取工作线程负载统计, 任意线程可调用
+void ModBus_Runtime_getStats(ModBus_Runtime_T* runtime, size_t worker, ModBus_Runtime_Stats_T* stats);
+
+// 停止并等待工作线程结束, 不关闭串口
+void ModBus_Runtime_stop(ModBus_Runtime_T* runtime);
+
+/**************** 对外接口 END ***************/
+
+#endif
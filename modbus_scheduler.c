@@ -0,0 +1,610 @@
+#include "modbus_scheduler.h"
+
+#define MODBUS_TIMER_SLOT_MASK (MODBUS_TIMER_SLOT_N - 1)
+#define MODBUS_TIMER_RANGE(level) (1u << (((level) + 1) * MODBUS_TIMER_SLOT_BITS)) // 第level层可放入的最大时间差(不含)
+
+// 从所在格中移除定时器
+static void ModBus_Timer_unlink(ModBus_Timer_T* timer)
+{
+	*timer->m_pprev = timer->m_next;
+	if (timer->m_next != NULL)
+	{
+		timer->m_next->m_pprev = timer->m_pprev;
+	}
+	timer->m_next = NULL;
+	timer->m_pprev = NULL;
+}
+
+// 把整格定时器移到链表list, 链表中的定时器仍可被ModBus_Timer_unlink移除
+static void ModBus_TimerWheel_detach(ModBus_Timer_T** slot, ModBus_Timer_T** list)
+{
+	*list = *slot;
+	*slot = NULL;
+	if (*list != NULL)
+	{
+		(*list)->m_pprev = list;
+	}
+}
+
+// 按时刻when放入对应的层和格; when与m_now的差决定层, when的对应位决定格
+static void ModBus_TimerWheel_insert(ModBus_TimerWheel_T* wheel, ModBus_Timer_T* timer, u32 when)
+{
+	u32 delta = when - wheel->m_now;
+	ModBus_Timer_T** head;
+	u8 level = 0;
+	while (level < MODBUS_TIMER_LEVEL_N - 1 && delta >= MODBUS_TIMER_RANGE(level))
+	{
+		level++;
+	}
+	if (delta >= MODBUS_TIMER_RANGE(MODBUS_TIMER_LEVEL_N - 1)) // 超出范围, 放在最高层的最远一格, 到时重新放入
+	{
+		when = wheel->m_now + MODBUS_TIMER_RANGE(MODBUS_TIMER_LEVEL_N - 1) - 1;
+	}
+	head = &wheel->m_slots[level][(when >> (level * MODBUS_TIMER_SLOT_BITS)) & MODBUS_TIMER_SLOT_MASK];
+	timer->m_level = level;
+	timer->m_next = *head;
+	if (*head != NULL)
+	{
+		(*head)->m_pprev = &timer->m_next;
+	}
+	*head = timer;
+	timer->m_pprev = head;
+	if (level == 0)
+	{
+		wheel->m_level0Count++;
+	}
+}
+
+// 移除并更新计数
+static void ModBus_TimerWheel_remove(ModBus_TimerWheel_T* wheel, ModBus_Timer_T* timer)
+{
+	if (timer->m_level == 0)
+	{
+		wheel->m_level0Count--;
+	}
+	ModBus_Timer_unlink(timer);
+}
+
+// 配置时间轮
+void ModBus_TimerWheel_setup(ModBus_TimerWheel_T* wheel, u32 now)
+{
+	memset(wheel->m_slots, 0, sizeof(wheel->m_slots));
+	wheel->m_now = now;
+	wheel->m_count = 0;
+	wheel->m_level0Count = 0;
+}
+
+// 初始化定时器
+void ModBus_Timer_init(ModBus_Timer_T* timer, ModBus_TimerHandler_T handler, void* context)
+{
+	timer->m_next = NULL;
+	timer->m_pprev = NULL;
+	timer->m_expire = 0;
+	timer->m_level = 0;
+	timer->m_handler = handler;
+	timer->m_context = context;
+}
+
+// 启动定时器
+void ModBus_Timer_start(ModBus_TimerWheel_T* wheel, ModBus_Timer_T* timer, u32 expire)
+{
+	u32 when = expire;
+	ModBus_Timer_stop(wheel, timer);
+	if ((int32_t)(expire - wheel->m_now) <= 0) // 已过期, 当前格已处理, 放到下一毫秒
+	{
+		when = wheel->m_now + 1;
+	}
+	timer->m_expire = expire;
+	ModBus_TimerWheel_insert(wheel, timer, when);
+	wheel->m_count++;
+}
+
+// 停止定时器
+void ModBus_Timer_stop(ModBus_TimerWheel_T* wheel, ModBus_Timer_T* timer)
+{
+	if (timer->m_pprev != NULL)
+	{
+		ModBus_TimerWheel_remove(wheel, timer);
+		wheel->m_count--;
+	}
+}
+
+// 定时器是否已启动
+byte ModBus_Timer_active(const ModBus_Timer_T* timer)
+{
+	return timer->m_pprev != NULL;
+}
+
+// 推进时间轮到now时刻, 返回到期的定时器个数
+size_t ModBus_TimerWheel_advance(ModBus_TimerWheel_T* wheel, u32 now)
+{
+	size_t fired = 0;
+	while ((int32_t)(now - wheel->m_now) > 0)
+	{
+		ModBus_Timer_T* list;
+		if (wheel->m_count == 0) // 没有定时器, 直接到达
+		{
+			wheel->m_now = now;
+			break;
+		}
+		if (wheel->m_level0Count == 0 && (wheel->m_now & MODBUS_TIMER_SLOT_MASK) != MODBUS_TIMER_SLOT_MASK) // 最低层为空, 跳到本圈最后一格
+		{
+			u32 last = wheel->m_now | MODBUS_TIMER_SLOT_MASK;
+			wheel->m_now = (int32_t)(now - last) < 0 ? now : last;
+			continue;
+		}
+		wheel->m_now++;
+
+		// 低位全为0时, 上一层对应格的定时器移到下层
+		for (u8 level = 1; level < MODBUS_TIMER_LEVEL_N; level++)
+		{
+			if ((wheel->m_now & (MODBUS_TIMER_RANGE(level - 1) - 1)) != 0)
+			{
+				break;
+			}
+			ModBus_TimerWheel_detach(&wheel->m_slots[level][(wheel->m_now >> (level * MODBUS_TIMER_SLOT_BITS)) & MODBUS_TIMER_SLOT_MASK], &list);
+			while (list != NULL)
+			{
+				ModBus_Timer_T* timer = list;
+				ModBus_Timer_unlink(timer);
+				ModBus_TimerWheel_insert(wheel, timer, timer->m_expire);
+			}
+		}
+
+		// 当前格的定时器到期; 先移出整格, 到期函数中启动的定时器不会在本格重复处理
+		ModBus_TimerWheel_detach(&wheel->m_slots[0][wheel->m_now & MODBUS_TIMER_SLOT_MASK], &list);
+		while (list != NULL)
+		{
+			ModBus_Timer_T* timer = list;
+			ModBus_TimerWheel_remove(wheel, timer);
+			wheel->m_count--;
+			fired++;
+			if (timer->m_handler != NULL)
+			{
+				(*timer->m_handler)(timer, timer->m_context);
+			}
+		}
+	}
+	return fired;
+}
+
+// 距离下一个定时器到期的毫秒数
+u32 ModBus_TimerWheel_nextExpire(const ModBus_TimerWheel_T* wheel)
+{
+	u32 wait = MODBUS_DEADLINE_NONE;
+	if (wheel->m_count == 0)
+	{
+		return wait;
+	}
+	if (wheel->m_level0Count > 0) // 最低层的定时器都在一圈内到期, 比上层的早
+	{
+		for (u32 i = 1; i <= MODBUS_TIMER_SLOT_N; i++)
+		{
+			if (wheel->m_slots[0][(wheel->m_now + i) & MODBUS_TIMER_SLOT_MASK] != NULL)
+			{
+				return i;
+			}
+		}
+	}
+	for (u8 level = 1; level < MODBUS_TIMER_LEVEL_N; level++) // 上层格移到下层的时刻, 不晚于其中定时器的到期时刻
+	{
+		u32 shift = level * MODBUS_TIMER_SLOT_BITS;
+		for (u32 i = 1; i <= MODBUS_TIMER_SLOT_N; i++)
+		{
+			u32 index = (wheel->m_now >> shift) + i;
+			if (wheel->m_slots[level][index & MODBUS_TIMER_SLOT_MASK] != NULL)
+			{
+				u32 cascade = (index << shift) - wheel->m_now;
+				if (cascade < wait)
+				{
+					wait = cascade;
+				}
+				break;
+			}
+		}
+	}
+	return wait;
+}
+
+// 加入就绪链表
+static void ModBus_Scheduler_pushReady(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry)
+{
+	if (entry->m_ready)
+	{
+		return;
+	}
+	entry->m_ready = 1;
+	entry->m_nextReady = NULL;
+	if (scheduler->m_readyTail != NULL)
+	{
+		scheduler->m_readyTail->m_nextReady = entry;
+	}
+	else
+	{
+		scheduler->m_readyHead = entry;
+	}
+	scheduler->m_readyTail = entry;
+}
+
+// 实例的定时器到期
+static void ModBus_Scheduler_entryExpired(ModBus_Timer_T* timer, void* context)
+{
+	ModBus_Scheduler_Entry_T* entry = (ModBus_Scheduler_Entry_T*)context;
+	(void)timer;
+	ModBus_Scheduler_pushReady(entry->m_scheduler, entry);
+}
+
+// 周期任务到期, 先设置下一次执行时刻再调用任务函数(任务函数中可以移除任务)
+static void ModBus_Scheduler_pollExpired(ModBus_Timer_T* timer, void* context)
+{
+	ModBus_Scheduler_Poll_T* poll = (ModBus_Scheduler_Poll_T*)context;
+	ModBus_TimerWheel_T* wheel = &poll->m_scheduler->m_wheel;
+	u32 next = timer->m_expire + poll->m_period;
+	if ((int32_t)(next - wheel->m_now) <= 0) // 落后超过一个周期(如长时间未调用run), 不补执行
+	{
+		next = wheel->m_now + poll->m_period;
+	}
+	ModBus_Timer_start(wheel, timer, next);
+	(*poll->m_handler)(poll->m_context);
+}
+
+// 添加实例
+static void ModBus_Scheduler_add(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry, ModBus_parameter* modbus, void(*loop)(ModBus_parameter*), u32(*nextDeadline)(ModBus_parameter*))
+{
+	ModBus_Timer_init(&entry->m_timer, ModBus_Scheduler_entryExpired, entry);
+	entry->m_scheduler = scheduler;
+	entry->m_modbus = modbus;
+	entry->m_loop = loop;
+	entry->m_nextDeadline = nextDeadline;
+	entry->m_nextReady = NULL;
+	entry->m_ready = 0;
+	entry->m_runCount = 0;
+	ModBus_Scheduler_pushReady(scheduler, entry);
+}
+
+// 配置调度器
+void ModBus_Scheduler_setup(ModBus_Scheduler_T* scheduler)
+{
+	ModBus_TimerWheel_setup(&scheduler->m_wheel, ModBus_millis());
+	scheduler->m_readyHead = NULL;
+	scheduler->m_readyTail = NULL;
+	scheduler->m_runCount = 0;
+	scheduler->m_timerCount = 0;
+}
+
+#ifdef MODBUS_MASTER
+// 添加主机实例
+void ModBus_Scheduler_addMaster(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry, ModBus_parameter* modbus)
+{
+	ModBus_Scheduler_add(scheduler, entry, modbus, ModBus_Master_loop, ModBus_Master_nextDeadline);
+}
+#endif
+
+#ifdef MODBUS_SLAVE
+// 添加从机实例
+void ModBus_Scheduler_addSlave(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry, ModBus_parameter* modbus)
+{
+	ModBus_Scheduler_add(scheduler, entry, modbus, ModBus_Slave_loop, ModBus_Slave_nextDeadline);
+}
+#endif
+
+// 移除实例
+void ModBus_Scheduler_remove(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry)
+{
+	ModBus_Timer_stop(&scheduler->m_wheel, &entry->m_timer);
+	if (entry->m_ready)
+	{
+		ModBus_Scheduler_Entry_T** pp = &scheduler->m_readyHead;
+		ModBus_Scheduler_Entry_T* prev = NULL;
+		while (*pp != NULL && *pp != entry)
+		{
+			prev = *pp;
+			pp = &(*pp)->m_nextReady;
+		}
+		if (*pp == entry)
+		{
+			*pp = entry->m_nextReady;
+			if (scheduler->m_readyTail == entry)
+			{
+				scheduler->m_readyTail = prev;
+			}
+		}
+		entry->m_ready = 0;
+	}
+}
+
+// 实例收到数据或有新指令
+void ModBus_Scheduler_notify(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry)
+{
+	ModBus_Scheduler_pushReady(scheduler, entry);
+}
+
+// 添加周期任务
+void ModBus_Scheduler_addPoll(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Poll_T* poll, u32 period, void(*handler)(void*), void* context)
+{
+	poll->m_scheduler = scheduler;
+	poll->m_period = period > 0 ? period : 1;
+	poll->m_handler = handler;
+	poll->m_context = context;
+	ModBus_Timer_init(&poll->m_timer, ModBus_Scheduler_pollExpired, poll);
+	ModBus_Timer_start(&scheduler->m_wheel, &poll->m_timer, ModBus_millis() + poll->m_period);
+}
+
+// 移除周期任务
+void ModBus_Scheduler_removePoll(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Poll_T* poll)
+{
+	ModBus_Timer_stop(&scheduler->m_wheel, &poll->m_timer);
+}
+
+// 调度器loop函数
+u32 ModBus_Scheduler_run(ModBus_Scheduler_T* scheduler)
+{
+	u32 now = ModBus_millis();
+	ModBus_Scheduler_Entry_T* entry;
+
+	scheduler->m_timerCount += (u32)ModBus_TimerWheel_advance(&scheduler->m_wheel, now);
+
+	// 取出当前就绪的实例; 运行中被通知的实例(如收到本轮其他实例发送的数据)若已运行过, 放入新的就绪链表在下一轮运行
+	entry = scheduler->m_readyHead;
+	scheduler->m_readyHead = NULL;
+	scheduler->m_readyTail = NULL;
+	while (entry != NULL)
+	{
+		ModBus_Scheduler_Entry_T* next = entry->m_nextReady;
+		u32 wait;
+		entry->m_ready = 0;
+		(*entry->m_loop)(entry->m_modbus);
+		entry->m_runCount++;
+		scheduler->m_runCount++;
+
+		wait = (*entry->m_nextDeadline)(entry->m_modbus);
+		if (wait == 0)
+		{
+			ModBus_Timer_stop(&scheduler->m_wheel, &entry->m_timer);
+			ModBus_Scheduler_pushReady(scheduler, entry);
+		}
+		else if (wait == MODBUS_DEADLINE_NONE)
+		{
+			ModBus_Timer_stop(&scheduler->m_wheel, &entry->m_timer);
+		}
+		else
+		{
+			ModBus_Timer_start(&scheduler->m_wheel, &entry->m_timer, now + wait);
+		}
+		entry = next;
+	}
+
+	return scheduler->m_readyHead != NULL ? 0 : ModBus_TimerWheel_nextExpire(&scheduler->m_wheel);
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+
+#define MODBUS_SCHEDULER_TEST_TIMER_N 2000 // 时间轮测试的定时器个数
+#define MODBUS_SCHEDULER_TEST_PAIR_N 64 // 调度器测试的主从机对数
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static u32 g_timerFired[MODBUS_SCHEDULER_TEST_TIMER_N];
+static u32 g_timerFiredN[MODBUS_SCHEDULER_TEST_TIMER_N];
+static ModBus_TimerWheel_T* g_testWheel;
+
+static void timerTestHandler(ModBus_Timer_T* timer, void* context)
+{
+	size_t i = (size_t)(uintptr_t)context;
+	(void)timer;
+	g_timerFired[i] = g_testWheel->m_now;
+	g_timerFiredN[i]++;
+}
+
+// 随机到期时刻(跨越u32回绕), 随机步长推进, 每个定时器恰好在到期时刻触发一次
+static void timerWheelTest()
+{
+	static ModBus_TimerWheel_T wheel;
+	static ModBus_Timer_T timers[MODBUS_SCHEDULER_TEST_TIMER_N];
+	u32 seed = 12345;
+	u32 now = 0xFFFF0000u;
+	size_t firedTotal = 0, expected = 0;
+
+	g_testWheel = &wheel;
+	ModBus_TimerWheel_setup(&wheel, now);
+	for (size_t i = 0; i < MODBUS_SCHEDULER_TEST_TIMER_N; i++)
+	{
+		seed = seed * 1103515245u + 12345u;
+		ModBus_Timer_init(timers + i, timerTestHandler, (void*)(uintptr_t)i);
+		ModBus_Timer_start(&wheel, timers + i, now + 1 + (seed >> 8) % 300000u);
+		g_timerFiredN[i] = 0;
+	}
+	ModBus_Timer_start(&wheel, timers + 0, now + 70000u); // 重新设置到期时刻
+	for (size_t i = 0; i < MODBUS_SCHEDULER_TEST_TIMER_N; i += 7)
+	{
+		ModBus_Timer_stop(&wheel, timers + i);
+	}
+	for (size_t i = 0; i < MODBUS_SCHEDULER_TEST_TIMER_N; i++)
+	{
+		expected += ModBus_Timer_active(timers + i);
+	}
+	assert(wheel.m_count == expected);
+
+	while (wheel.m_count > 0)
+	{
+		u32 wait = ModBus_TimerWheel_nextExpire(&wheel);
+		u32 earliest = MODBUS_DEADLINE_NONE;
+		for (size_t i = 0; i < MODBUS_SCHEDULER_TEST_TIMER_N; i++)
+		{
+			if (ModBus_Timer_active(timers + i) && timers[i].m_expire - wheel.m_now < earliest)
+			{
+				earliest = timers[i].m_expire - wheel.m_now;
+			}
+		}
+		assert(wait >= 1 && wait <= earliest); // 可以提前, 不能推后
+		seed = seed * 1103515245u + 12345u;
+		now += 1 + (seed >> 8) % 5000u;
+		firedTotal += ModBus_TimerWheel_advance(&wheel, now);
+	}
+	assert(firedTotal == expected);
+	for (size_t i = 0; i < MODBUS_SCHEDULER_TEST_TIMER_N; i++)
+	{
+		assert(g_timerFiredN[i] == (i % 7 == 0 ? 0u : 1u));
+		assert(i % 7 == 0 || g_timerFired[i] == timers[i].m_expire);
+	}
+}
+
+typedef struct { // 测试用的线路: 发送的数据直接传给对端实例
+	ModBus_Scheduler_T* scheduler;
+	ModBus_parameter* peer; // NULL表示对端无响应
+	ModBus_Scheduler_Entry_T* peerEntry;
+} SchedulerTestLink_T;
+
+static ModBus_Result_T g_schedulerResults[MODBUS_SCHEDULER_TEST_PAIR_N];
+static int g_schedulerResultTime[MODBUS_SCHEDULER_TEST_PAIR_N];
+static u32 g_schedulerResultN;
+static u32 g_schedulerPollN;
+static uint16_t g_schedulerRegisters[16];
+
+static void schedulerSend(void* context, byte* data, size_t len)
+{
+	SchedulerTestLink_T* link = (SchedulerTestLink_T*)context;
+	if (link->peer != NULL)
+	{
+		ModBus_readBytesFromOuter(link->peer, data, len);
+		ModBus_Scheduler_notify(link->scheduler, link->peerEntry);
+	}
+}
+
+static size_t schedulerGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(data, g_schedulerRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static void schedulerResult(void* context, const ModBus_Result_T* result)
+{
+	size_t i = (size_t)(uintptr_t)context;
+	g_schedulerResults[i] = *result;
+	g_schedulerResultTime[i] = t;
+	g_schedulerResultN++;
+}
+
+static ModBus_parameter* g_schedulerPollMaster;
+static ModBus_Scheduler_Entry_T* g_schedulerPollEntry;
+static ModBus_Scheduler_T* g_schedulerPollScheduler;
+
+static void schedulerPollResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	if (result->status == MODBUS_STATUS_OK)
+		g_schedulerPollN++;
+}
+
+// 周期任务: 读寄存器并通知调度器
+static void schedulerPoll(void* context)
+{
+	ModBus_Request_T request = { 0 };
+	(void)context;
+	request.type = READ_REGISTER;
+	request.count = 1;
+	request.resultHandler = schedulerPollResult;
+	ModBus_request(g_schedulerPollMaster, &request);
+	ModBus_Scheduler_notify(g_schedulerPollScheduler, g_schedulerPollEntry);
+}
+
+void scheduler_unit_test()
+{
+	static ModBus_parameter masters[MODBUS_SCHEDULER_TEST_PAIR_N], slaves[MODBUS_SCHEDULER_TEST_PAIR_N];
+	static ModBus_Scheduler_Entry_T masterEntries[MODBUS_SCHEDULER_TEST_PAIR_N], slaveEntries[MODBUS_SCHEDULER_TEST_PAIR_N];
+	static SchedulerTestLink_T masterLinks[MODBUS_SCHEDULER_TEST_PAIR_N], slaveLinks[MODBUS_SCHEDULER_TEST_PAIR_N];
+	static ModBus_Scheduler_T scheduler;
+	ModBus_Scheduler_Poll_T poll;
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+	const size_t dead = MODBUS_SCHEDULER_TEST_PAIR_N - 1; // 最后一个主机没有从机应答
+	int sentTime;
+	u32 runCount;
+
+	timerWheelTest();
+
+	for (uint16_t i = 0; i < 16; i++)
+		g_schedulerRegisters[i] = 0x300 + i;
+	ModBus_Scheduler_setup(&scheduler);
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	for (size_t i = 0; i < MODBUS_SCHEDULER_TEST_PAIR_N; i++)
+	{
+		ModBus_setup(masters + i, modbusSetting);
+		ModBus_setTimeout(masters + i, 5, 50);
+		ModBus_setup(slaves + i, modbusSetting);
+		ModBus_setTimeout(slaves + i, 5, 50);
+		ModBus_attachRegisterHandler(slaves + i, schedulerGetReg, NULL);
+		masterLinks[i].scheduler = slaveLinks[i].scheduler = &scheduler;
+		masterLinks[i].peer = i == dead ? NULL : slaves + i;
+		masterLinks[i].peerEntry = slaveEntries + i;
+		slaveLinks[i].peer = masters + i;
+		slaveLinks[i].peerEntry = masterEntries + i;
+		ModBus_attachSendHandler(masters + i, schedulerSend, masterLinks + i);
+		ModBus_attachSendHandler(slaves + i, schedulerSend, slaveLinks + i);
+		ModBus_Scheduler_addMaster(&scheduler, masterEntries + i, masters + i);
+		ModBus_Scheduler_addSlave(&scheduler, slaveEntries + i, slaves + i);
+	}
+	ModBus_Scheduler_run(&scheduler);
+	assert(ModBus_Scheduler_run(&scheduler) == MODBUS_DEADLINE_NONE); // 全部空闲
+
+	// 每个主机一个读指令; 从机按帧间隔(接收超时)结束接收, 最后一个主机等待返回帧超时
+	request.type = READ_REGISTER;
+	request.count = 2;
+	request.resultHandler = schedulerResult;
+	g_schedulerResultN = 0;
+	sentTime = t;
+	for (size_t i = 0; i < MODBUS_SCHEDULER_TEST_PAIR_N; i++)
+	{
+		request.address = (uint16_t)(i % 8);
+		request.context = (void*)(uintptr_t)i;
+		ModBus_request(masters + i, &request);
+		ModBus_Scheduler_notify(&scheduler, masterEntries + i);
+	}
+	for (int i = 0; i < 200 && g_schedulerResultN < MODBUS_SCHEDULER_TEST_PAIR_N; i++)
+	{
+		u32 wait = ModBus_Scheduler_run(&scheduler);
+		t += wait == 0 ? 0 : 1;
+	}
+	assert(g_schedulerResultN == MODBUS_SCHEDULER_TEST_PAIR_N);
+	for (size_t i = 0; i < dead; i++)
+	{
+		assert(g_schedulerResults[i].status == MODBUS_STATUS_OK && g_schedulerResults[i].count == 2);
+	}
+	assert(g_schedulerResults[dead].status == MODBUS_STATUS_TIMEOUT && g_schedulerResultTime[dead] - sentTime == 50);
+
+	// 周期任务: 主机0每100毫秒读一次
+	g_schedulerPollMaster = masters;
+	g_schedulerPollEntry = masterEntries;
+	g_schedulerPollScheduler = &scheduler;
+	g_schedulerPollN = 0;
+	ModBus_Scheduler_addPoll(&scheduler, &poll, 100, schedulerPoll, NULL);
+	for (int i = 0; i < 1050; i++) // 最后一次在1000毫秒时发送, 留出从机应答的时间
+	{
+		ModBus_Scheduler_run(&scheduler);
+		t += 1;
+	}
+	ModBus_Scheduler_removePoll(&scheduler, &poll);
+	assert(g_schedulerPollN == 10);
+
+	// 空闲时不运行任何实例
+	for (int i = 0; i < 100; i++)
+	{
+		ModBus_Scheduler_run(&scheduler);
+		t += 1;
+	}
+	runCount = scheduler.m_runCount;
+	for (int i = 0; i < 400; i++)
+	{
+		assert(ModBus_Scheduler_run(&scheduler) == MODBUS_DEADLINE_NONE);
+		t += 1;
+	}
+	assert(scheduler.m_runCount == runCount);
+	printf("scheduler_unit_test: instances %d, loop runs %u (master0 %u, idle master %u), timers %u\n", MODBUS_SCHEDULER_TEST_PAIR_N * 2,
+		scheduler.m_runCount, masterEntries[0].m_runCount, masterEntries[1].m_runCount, scheduler.m_timerCount);
+}
+#endif // _UNIT_TEST
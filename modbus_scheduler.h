@@ -0,0 +1,134 @@
+#ifndef MOTECMODBUS_SCHEDULER_H_
+#define MOTECMODBUS_SCHEDULER_H_
+/**** ModBus 单线程调度器(分层时间轮) ****
+** 时间轮: 4层, 每层64格, 精度1毫秒, 添加/删除/到期均为O(1), 与定时器个数无关
+** 调度器: 每个实例一个定时器, 到期时间为实例下一次需要运行loop的时刻(接收超时/返回帧超时)
+****** 只运行定时器到期或有数据/指令(ModBus_Scheduler_notify)的实例, 空闲实例不被访问
+****** 周期任务(如定时读寄存器)也由时间轮管理
+** 使用方法:
+****** 调用ModBus_Scheduler_setup配置调度器
+****** 调用ModBus_Scheduler_addMaster/addSlave添加实例, ModBus_Scheduler_addPoll添加周期任务
+****** 向实例传入数据(ModBus_readBytesFromOuter)或发送指令(ModBus_request)后调用ModBus_Scheduler_notify
+****** 循环调用ModBus_Scheduler_run, 返回值为下一次需要运行的等待时间, 可作为poll/epoll的超时时间
+** 注: 调度器和所属实例只能在同一线程中使用
+*/
+
+#include "modbus.h"
+
+#define MODBUS_TIMER_SLOT_BITS 6 // 每层格数的位数
+#define MODBUS_TIMER_SLOT_N (1u << MODBUS_TIMER_SLOT_BITS) // 每层格数
+#define MODBUS_TIMER_LEVEL_N 4 // 层数, 最大定时 64^4 毫秒(约4.6小时), 超出的定时器到达最高层后重新放入
+
+struct _MODBUS_TIMER_T;
+typedef void(*ModBus_TimerHandler_T)(struct _MODBUS_TIMER_T*, void*); // 定时器到期函数指针类型, 函数参数(定时器, 上下文)
+
+typedef struct _MODBUS_TIMER_T { // 定时器, 由调用者分配, 可嵌入其他结构
+	struct _MODBUS_TIMER_T* m_next; // 同一格的下一个定时器
+	struct _MODBUS_TIMER_T** m_pprev; // 指向前一个定时器的m_next(或格的链表头), 用于O(1)删除; NULL表示未启动
+	u32 m_expire; // 到期时刻(毫秒)
+	u8 m_level; // 所在层
+	ModBus_TimerHandler_T m_handler; // 到期函数
+	void* m_context; // 传给到期函数的上下文
+} ModBus_Timer_T;
+
+typedef struct __MODBUS_TimerWheel {
+	ModBus_Timer_T* m_slots[MODBUS_TIMER_LEVEL_N][MODBUS_TIMER_SLOT_N]; // 每格的定时器链表
+	u32 m_now; // 已处理到的时刻
+	size_t m_count; // 已启动的定时器个数
+	size_t m_level0Count; // 最低层的定时器个数, 为0时推进可以跳过整圈
+} ModBus_TimerWheel_T;
+
+struct __MODBUS_Scheduler;
+
+typedef struct _MODBUS_SCHEDULER_ENTRY_T { // 调度的实例
+	ModBus_Timer_T m_timer; // 实例下一次需要运行loop的时刻
+	struct __MODBUS_Scheduler* m_scheduler; // 所属调度器
+	ModBus_parameter* m_modbus; // 实例
+	void(*m_loop)(ModBus_parameter*); // loop函数
+	u32(*m_nextDeadline)(ModBus_parameter*); // 计算下一次需要运行loop的时间
+	struct _MODBUS_SCHEDULER_ENTRY_T* m_nextReady; // 就绪链表中的下一个实例
+	byte m_ready; // 是否在就绪链表中
+	u32 m_runCount; // 运行loop的次数
+} ModBus_Scheduler_Entry_T;
+
+typedef struct _MODBUS_SCHEDULER_POLL_T { // 周期任务
+	ModBus_Timer_T m_timer; // 下一次执行时刻
+	struct __MODBUS_Scheduler* m_scheduler; // 所属调度器
+	u32 m_period; // 周期(毫秒)
+	void(*m_handler)(void*); // 任务函数, 函数参数(上下文)
+	void* m_context; // 传给任务函数的上下文
+} ModBus_Scheduler_Poll_T;
+
+typedef struct __MODBUS_Scheduler {
+	ModBus_TimerWheel_T m_wheel; // 时间轮
+	ModBus_Scheduler_Entry_T* m_readyHead; // 就绪链表(需要立即运行loop的实例)
+	ModBus_Scheduler_Entry_T* m_readyTail;
+
+	u32 m_runCount; // 运行loop的总次数
+	u32 m_timerCount; // 到期的定时器总数
+} ModBus_Scheduler_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 时间轮 **/
+// 配置时间轮, now为当前时刻(毫秒)
+void ModBus_TimerWheel_setup(ModBus_TimerWheel_T* wheel, u32 now);
+
+// 初始化定时器, 绑定到期函数
+void ModBus_Timer_init(ModBus_Timer_T* timer, ModBus_TimerHandler_T handler, void* context);
+
+// 启动定时器, 在expire时刻(毫秒)到期; 已启动的定时器重新设置到期时刻; 已过期的时刻在下一毫秒到期
+void ModBus_Timer_start(ModBus_TimerWheel_T* wheel, ModBus_Timer_T* timer, u32 expire);
+
+// 停止定时器, 未启动时无影响
+void ModBus_Timer_stop(ModBus_TimerWheel_T* wheel, ModBus_Timer_T* timer);
+
+// 定时器是否已启动
+byte ModBus_Timer_active(const ModBus_Timer_T* timer);
+
+// 推进时间轮到now时刻, 按到期顺序调用到期的定时器函数(函数中可以启动/停止定时器); 返回到期的定时器个数
+size_t ModBus_TimerWheel_advance(ModBus_TimerWheel_T* wheel, u32 now);
+
+// 距离下一个定时器到期的毫秒数(可能提前, 不会推后), 没有定时器返回 MODBUS_DEADLINE_NONE
+u32 ModBus_TimerWheel_nextExpire(const ModBus_TimerWheel_T* wheel);
+
+/** 调度器 **/
+// 配置调度器
+void ModBus_Scheduler_setup(ModBus_Scheduler_T* scheduler);
+
+#ifdef MODBUS_MASTER
+// 添加主机实例, 添加后立即运行一次
+void ModBus_Scheduler_addMaster(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry, ModBus_parameter* modbus);
+#endif
+
+#ifdef MODBUS_SLAVE
+// 添加从机实例, 添加后立即运行一次
+void ModBus_Scheduler_addSlave(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry, ModBus_parameter* modbus);
+#endif
+
+// 移除实例, 不能在ModBus_Scheduler_run调用的函数中使用
+void ModBus_Scheduler_remove(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry);
+
+// 实例收到数据或有新指令, 下一次ModBus_Scheduler_run时运行loop
+void ModBus_Scheduler_notify(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Entry_T* entry);
+
+/** 添加周期任务 **/
+/*** 参数 ***
+** period: 周期(毫秒), 第一次在添加后一个周期执行
+** handler: 任务函数, 在ModBus_Scheduler_run中调用; 向实例发送指令后需调用ModBus_Scheduler_notify
+***/
+void ModBus_Scheduler_addPoll(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Poll_T* poll, u32 period, void(*handler)(void*), void* context);
+
+// 移除周期任务
+void ModBus_Scheduler_removePoll(ModBus_Scheduler_T* scheduler, ModBus_Scheduler_Poll_T* poll);
+
+/** 调度器loop函数 **/
+/*** 参数 ***
+** 处理到期的定时器, 运行就绪的实例, 并根据实例的下一次超时时刻重新设置定时器
+** 返回距离下一次需要运行的毫秒数, 0 有实例需要立即运行, MODBUS_DEADLINE_NONE 全部空闲
+***/
+u32 ModBus_Scheduler_run(ModBus_Scheduler_T* scheduler);
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,452 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // cfmakeraw
+#endif
+
+#include "modbus_serial.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define MODBUS_SERIAL_WRITE_WAIT 100 // 发送缓冲区满时等待可写的最长毫秒数
+
+// 波特率转换为termios速率, 不支持返回B0
+static speed_t ModBus_Serial_speed(u32 baud)
+{
+	switch (baud)
+	{
+	case 1200: return B1200;
+	case 2400: return B2400;
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 921600: return B921600;
+	default: return B0;
+	}
+}
+
+// 设置为原始模式, 8位数据位; baud为0时不修改速率
+static int ModBus_Serial_configure(int fd, u32 baud, MODBUS_PARITY_TYPE parity, u8 stopBits)
+{
+	struct termios tio;
+	if (tcgetattr(fd, &tio) < 0)
+	{
+		return -1;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag &= ~(CSIZE | PARENB | PARODD | CSTOPB);
+	tio.c_cflag |= CS8 | CLOCAL | CREAD;
+	if (parity == MODBUS_PARITY_EVEN)
+	{
+		tio.c_cflag |= PARENB;
+	}
+	else if (parity == MODBUS_PARITY_ODD)
+	{
+		tio.c_cflag |= PARENB | PARODD;
+	}
+	if (stopBits == 2 || (stopBits == 0 && parity == MODBUS_PARITY_NONE)) // ModBus规定无校验时使用2位停止位
+	{
+		tio.c_cflag |= CSTOPB;
+	}
+	tio.c_cc[VMIN] = 0; // 非阻塞读取, 由poll等待数据
+	tio.c_cc[VTIME] = 0;
+	if (baud != 0)
+	{
+		speed_t speed = ModBus_Serial_speed(baud);
+		if (speed == B0)
+		{
+			errno = EINVAL;
+			return -1;
+		}
+		cfsetispeed(&tio, speed);
+		cfsetospeed(&tio, speed);
+	}
+	tcflush(fd, TCIOFLUSH);
+	return tcsetattr(fd, TCSANOW, &tio);
+}
+
+// 实例的发送函数, 每帧一次write; 内核缓冲区满时等待可写后发送剩余数据
+static void ModBus_Serial_send(void* context, byte* data, size_t size)
+{
+	ModBus_Serial_T* port = (ModBus_Serial_T*)context;
+	size_t sent = 0;
+	while (sent < size)
+	{
+		ssize_t n = write(port->m_fd, data + sent, size - sent);
+		port->m_writeCount++;
+		if (n > 0)
+		{
+			sent += (size_t)n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			struct pollfd pfd;
+			pfd.fd = port->m_fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, MODBUS_SERIAL_WRITE_WAIT) > 0)
+			{
+				continue;
+			}
+		}
+		port->m_errorCount++;
+		break;
+	}
+	port->m_sentBytes += (u32)sent;
+}
+
+/** 绑定已打开的设备到ModBus实例 **/
+/*** 参数 ***
+** fd: 已打开的设备
+** 成功返回0, 失败返回-1
+***/
+int ModBus_Serial_attachFd(ModBus_Serial_T* port, int fd, ModBus_parameter* modbus, u32 batchTime)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		return -1;
+	}
+	if (isatty(fd) && ModBus_Serial_configure(fd, 0, MODBUS_PARITY_NONE, 1) < 0)
+	{
+		return -1;
+	}
+	port->m_fd = fd;
+	port->m_modbus = modbus;
+	port->m_batchTime = batchTime;
+	port->m_readCount = 0;
+	port->m_receivedBytes = 0;
+	port->m_writeCount = 0;
+	port->m_sentBytes = 0;
+	port->m_errorCount = 0;
+	ModBus_attachSendHandler(modbus, ModBus_Serial_send, port);
+	return 0;
+}
+
+/** 打开并配置串口, 绑定到ModBus实例 **/
+/*** 参数 ***
+** modbus: 已配置的ModBus实例
+** 成功返回0, 失败返回-1
+***/
+int ModBus_Serial_open(ModBus_Serial_T* port, ModBus_Serial_Setting_T setting, ModBus_parameter* modbus)
+{
+	int err;
+	int fd = open(setting.device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	if (ModBus_Serial_configure(fd, setting.baudRate != 0 ? setting.baudRate : MODBUS_DEFAULT_BAUD, setting.parity, setting.stopBits) < 0
+		|| ModBus_Serial_attachFd(port, fd, modbus, setting.batchTime) < 0)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	ModBus_setBitRate(modbus, setting.baudRate); // 超时时间与波特率一致
+	return 0;
+}
+
+/** 等待并读取串口数据 **/
+/*** 参数 ***
+** waitTime: 没有数据时最多等待的毫秒数
+** 返回读取的字节数, 出错返回-1
+***/
+int ModBus_Serial_poll(ModBus_Serial_T* port, int waitTime)
+{
+	byte buffer[MODBUS_SERIAL_READ_SIZE];
+	struct pollfd pfd;
+	int total = 0;
+
+	pfd.fd = port->m_fd;
+	pfd.events = POLLIN;
+	while (total < MODBUS_SERIAL_READ_SIZE) // 其余数据等loop处理后再读取
+	{
+		ssize_t n;
+		int ret = poll(&pfd, 1, waitTime);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			port->m_errorCount++;
+			return -1;
+		}
+		if (ret == 0) // 等待超时, 没有更多数据
+		{
+			break;
+		}
+		n = read(port->m_fd, buffer, (size_t)(MODBUS_SERIAL_READ_SIZE - total));
+		port->m_readCount++;
+		if (n < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				continue;
+			}
+			port->m_errorCount++;
+			return total > 0 ? total : -1;
+		}
+		if (n == 0) // 设备已关闭
+		{
+			break;
+		}
+		ModBus_readBytesFromOuter(port->m_modbus, buffer, (size_t)n);
+		port->m_receivedBytes += (u32)n;
+		total += (int)n;
+		if (port->m_batchTime == 0)
+		{
+			break;
+		}
+		waitTime = (int)port->m_batchTime; // 继续收集本帧剩余的数据
+	}
+	return total;
+}
+
+// 关闭串口
+void ModBus_Serial_close(ModBus_Serial_T* port)
+{
+	if (port->m_fd >= 0)
+	{
+		close(port->m_fd);
+		port->m_fd = -1;
+	}
+	if (port->m_modbus != NULL)
+	{
+		ModBus_attachSendHandler(port->m_modbus, NULL, NULL);
+	}
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+#include <pty.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "modbus_tcp.h"
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_serialRegisters[16];
+static uint16_t g_serialReadData[MODBUS_REGISTER_LIMIT];
+static uint16_t g_serialReadCount = 0xFFFF;
+static uint16_t g_serialWriteCount = 0xFFFF;
+
+static size_t serialGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(data, g_serialRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static size_t serialSetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(g_serialRegisters + address, data, n * sizeof(uint16_t));
+	return n;
+}
+
+static void serialReadDone(uint16_t* data, uint16_t count)
+{
+	if (count > 0)
+		memcpy(g_serialReadData, data, count * sizeof(uint16_t));
+	g_serialReadCount = count;
+}
+
+static void serialWriteDone(uint16_t address, uint16_t count)
+{
+	(void)address;
+	g_serialWriteCount = count;
+}
+
+// 运行主从机直到回调被调用
+static void serialRun(ModBus_Serial_T* masterPort, ModBus_parameter* master, ModBus_Serial_T* slavePort, ModBus_parameter* slave, uint16_t* done)
+{
+	for (int i = 0; i < 1000 && *done == 0xFFFF; i++)
+	{
+		ModBus_Master_loop(master);
+		ModBus_Serial_poll(slavePort, 1);
+		ModBus_Slave_loop(slave);
+		ModBus_Serial_poll(masterPort, 1);
+		ModBus_Master_loop(master);
+		t += 1;
+	}
+}
+
+#define MODBUS_SERIAL_TEST_TCP_PORT 15023 // RTU over TCP 测试端口
+
+// 运行主机和RTU over TCP服务器直到回调被调用
+static void serialTcpRun(ModBus_Serial_T* masterPort, ModBus_parameter* master, ModBus_TCP_Server_T* server, uint16_t* done)
+{
+	for (int i = 0; i < 1000 && *done == 0xFFFF; i++)
+	{
+		ModBus_Master_loop(master);
+		ModBus_TCP_Server_loop(server, 1);
+		ModBus_Serial_poll(masterPort, 1);
+		ModBus_Master_loop(master);
+		t += 1;
+	}
+}
+
+// RTU over TCP: 主机通过socket发送RTU帧, 服务器按功能码计算帧长度, 不依赖帧间隔
+static void serialTcpRtuTest()
+{
+	static ModBus_TCP_Connection_T connections[2];
+	ModBus_TCP_Server_T server;
+	ModBus_TCP_Setting_T tcpSetting = { 0 };
+	ModBus_parameter master, slave;
+	ModBus_Serial_T masterPort;
+	ModBus_Setting_T modbusSetting = { 0 };
+	uint16_t data[] = { 0x4444, 0x5555 };
+	byte frames[16] = { 0x11, WRITE_SINGLE_REGISTER, 0, 1, 0x12, 0x34 };
+	byte response[32];
+	size_t len;
+	int fd, raw, ret;
+
+	modbusSetting.address = 0x11;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_attachRegisterHandler(&slave, serialGetReg, serialSetReg);
+	ModBus_setup(&master, modbusSetting);
+	ModBus_setTimeout(&master, 5, 200);
+	ModBus_lengthFraming(&master, 1);
+
+	tcpSetting.port = MODBUS_SERIAL_TEST_TCP_PORT;
+	tcpSetting.bindAddress = INADDR_LOOPBACK;
+	tcpSetting.framing = MODBUS_TCP_FRAMING_RTU;
+	ret = ModBus_TCP_setup(&server, tcpSetting, &slave, connections, 2);
+	assert(ret == 0);
+	fd = ModBus_TCP_connect(INADDR_LOOPBACK, MODBUS_SERIAL_TEST_TCP_PORT);
+	assert(fd >= 0);
+	ret = ModBus_Serial_attachFd(&masterPort, fd, &master, 0);
+	assert(ret == 0);
+
+	for (uint16_t i = 0; i < 16; i++)
+		g_serialRegisters[i] = i;
+
+	// 读寄存器, 写多寄存器
+	g_serialReadCount = 0xFFFF;
+	ModBus_getRegister(&master, 3, 4, serialReadDone);
+	serialTcpRun(&masterPort, &master, &server, &g_serialReadCount);
+	assert(g_serialReadCount == 4 && g_serialReadData[0] == 3 && g_serialReadData[3] == 6);
+	g_serialWriteCount = 0xFFFF;
+	ModBus_setRegisters(&master, 10, data, 2, serialWriteDone);
+	serialTcpRun(&masterPort, &master, &server, &g_serialWriteCount);
+	assert(g_serialWriteCount == 2 && g_serialRegisters[10] == 0x4444 && g_serialRegisters[11] == 0x5555);
+
+	// 两个请求在同一个TCP报文中, 没有帧间隔
+	raw = ModBus_TCP_connect(INADDR_LOOPBACK, MODBUS_SERIAL_TEST_TCP_PORT);
+	assert(raw >= 0);
+	len = ModBus_RTU_appendCRC(frames, 6);
+	memcpy(frames + len, frames, len);
+	frames[len + 3] = 2; // 第二帧写地址2
+	ModBus_RTU_appendCRC(frames + len, 6);
+	send(raw, frames, 2 * len, MSG_NOSIGNAL);
+	for (int i = 0; i < 100 && g_serialRegisters[2] != 0x1234; i++)
+		ModBus_TCP_Server_loop(&server, 1);
+	assert(g_serialRegisters[1] == 0x1234 && g_serialRegisters[2] == 0x1234);
+	ret = 0;
+	for (int i = 0; i < 100 && ret < (int)(2 * len); i++) // 写单寄存器的返回帧与请求相同
+	{
+		ssize_t n = recv(raw, response + ret, sizeof(response) - ret, MSG_DONTWAIT);
+		if (n > 0)
+			ret += (int)n;
+		ModBus_TCP_Server_loop(&server, 1);
+	}
+	assert(ret == (int)(2 * len) && memcmp(response, frames, 2 * len) == 0);
+
+	// 一个请求分两次发送, 间隔超过串口的接收超时, 仍按一帧处理
+	frames[3] = 4;
+	frames[5] = 0x78;
+	ModBus_RTU_appendCRC(frames, 6);
+	send(raw, frames, 3, MSG_NOSIGNAL);
+	ModBus_TCP_Server_loop(&server, 1);
+	t += 100;
+	send(raw, frames + 3, len - 3, MSG_NOSIGNAL);
+	for (int i = 0; i < 100 && g_serialRegisters[4] != 0x1278; i++)
+		ModBus_TCP_Server_loop(&server, 1);
+	assert(g_serialRegisters[4] == 0x1278);
+
+	printf("serial_unit_test RTU over TCP: server requests %u\n", server.m_requestCount);
+	close(raw);
+	ModBus_Serial_close(&masterPort);
+	ModBus_TCP_close(&server);
+}
+
+// 通过openpty得到的伪终端对测试串口收发, 不需要真实硬件
+void serial_unit_test()
+{
+	ModBus_parameter master, slave;
+	ModBus_Serial_T masterPort, slavePort;
+	ModBus_Setting_T modbusSetting;
+	int ptyMaster, ptySlave;
+	uint16_t data[] = { 0x1111, 0x2222, 0x3333 };
+	MODBUS_MODE_TYPE modes[] = { RTU, ASCII };
+
+	for (int m = 0; m < 2; m++)
+	{
+		int ret = openpty(&ptyMaster, &ptySlave, NULL, NULL, NULL);
+		assert(ret == 0);
+
+		modbusSetting.address = 0x11;
+		modbusSetting.baudRate = 115200;
+		modbusSetting.frameType = modes[m];
+		modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+		modbusSetting.sendHandler = NULL;
+		ModBus_setup(&master, modbusSetting);
+		ModBus_setTimeout(&master, 5, 200);
+		ModBus_setup(&slave, modbusSetting);
+		ModBus_setTimeout(&slave, 5, 200);
+		ModBus_attachRegisterHandler(&slave, serialGetReg, serialSetReg);
+		ret = ModBus_Serial_attachFd(&masterPort, ptyMaster, &master, 1);
+		assert(ret == 0);
+		ret = ModBus_Serial_attachFd(&slavePort, ptySlave, &slave, 1);
+		assert(ret == 0);
+
+		for (uint16_t i = 0; i < 16; i++)
+			g_serialRegisters[i] = i;
+
+		// 读寄存器
+		g_serialReadCount = 0xFFFF;
+		ModBus_getRegister(&master, 2, 3, serialReadDone);
+		serialRun(&masterPort, &master, &slavePort, &slave, &g_serialReadCount);
+		assert(g_serialReadCount == 3 && g_serialReadData[0] == 2 && g_serialReadData[2] == 4);
+
+		// 写多寄存器, 再读回
+		g_serialWriteCount = 0xFFFF;
+		ModBus_setRegisters(&master, 5, data, 3, serialWriteDone);
+		serialRun(&masterPort, &master, &slavePort, &slave, &g_serialWriteCount);
+		assert(g_serialWriteCount == 3 && g_serialRegisters[5] == 0x1111 && g_serialRegisters[7] == 0x3333);
+
+		// 写单寄存器
+		g_serialWriteCount = 0xFFFF;
+		ModBus_setRegister(&master, 9, 0xABCD, serialWriteDone);
+		serialRun(&masterPort, &master, &slavePort, &slave, &g_serialWriteCount);
+		assert(g_serialWriteCount == 1 && g_serialRegisters[9] == 0xABCD);
+
+		// 每帧一次write
+		assert(masterPort.m_writeCount == 3 && slavePort.m_writeCount == 3);
+		printf("serial_unit_test %s: master read %u calls / %u bytes, slave read %u calls / %u bytes\n", modes[m] == RTU ? "RTU" : "ASCII",
+			masterPort.m_readCount, masterPort.m_receivedBytes, slavePort.m_readCount, slavePort.m_receivedBytes);
+
+		ModBus_Serial_close(&masterPort);
+		ModBus_Serial_close(&slavePort);
+	}
+	serialTcpRtuTest();
+}
+#endif // _UNIT_TEST
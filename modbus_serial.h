@@ -0,0 +1,71 @@
+#ifndef MOTECMODBUS_SERIAL_H_
+#define MOTECMODBUS_SERIAL_H_
+/**** ModBus POSIX 串口收发 (Linux termios) ****
+** 打开并配置串口(波特率/校验/停止位, 原始模式), 非阻塞收发
+** 接收: poll等待数据, 一次read读取所有可读数据, 通过ModBus_readBytesFromOuter批量传入实例
+** 发送: 每帧一次write
+** 使用方法:
+****** 调用ModBus_setup配置实例
+****** 调用ModBus_Serial_open打开串口并绑定实例的发送函数(也可用ModBus_Serial_attachFd绑定已打开的设备, 如pty)
+****** 循环调用ModBus_Serial_poll, 然后调用ModBus_Master_loop或ModBus_Slave_loop
+*/
+
+#include "modbus.h"
+
+#define MODBUS_SERIAL_READ_SIZE (MODBUS_BUFFER_SIZE - 1) // 每次poll最多读取的字节数, 与实例接收缓冲区容量相同, 其余数据留在内核缓冲区
+
+typedef enum {
+	MODBUS_PARITY_NONE,
+	MODBUS_PARITY_EVEN,
+	MODBUS_PARITY_ODD,
+} MODBUS_PARITY_TYPE;
+
+typedef struct _MODBUS_SERIAL_SETTING_T { // 串口配置信息类型
+	const char* device; // 设备路径, 比如 /dev/ttyS0 或 /dev/ttyUSB0
+	u32 baudRate; // 波特率, 0 使用默认9600
+	MODBUS_PARITY_TYPE parity; // 校验方式
+	u8 stopBits; // 停止位, 1 或 2, 0 按ModBus规定(无校验2位, 有校验1位)
+	u32 batchTime; // 收到数据后继续等待的毫秒数, 期间到达的数据一并读取, 减少唤醒次数; 0 不等待
+} ModBus_Serial_Setting_T;
+
+typedef struct __MODBUS_Serial {
+	int m_fd; // 串口文件描述符
+	ModBus_parameter* m_modbus; // 绑定的ModBus实例
+	u32 m_batchTime; // 收到数据后继续等待的毫秒数
+
+	u32 m_readCount; // read调用次数
+	u32 m_receivedBytes; // 接收字节数
+	u32 m_writeCount; // write调用次数
+	u32 m_sentBytes; // 发送字节数
+	u32 m_errorCount; // 收发错误次数
+} ModBus_Serial_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 打开并配置串口, 绑定到ModBus实例 **/
+/*** 参数 ***
+** modbus: 已配置的ModBus实例, 串口会绑定为其发送函数
+** 成功返回0, 失败返回-1(errno为失败原因)
+***/
+int ModBus_Serial_open(ModBus_Serial_T* port, ModBus_Serial_Setting_T setting, ModBus_parameter* modbus);
+
+/** 绑定已打开的设备到ModBus实例, 设置为原始模式和非阻塞 **/
+/*** 参数 ***
+** fd: 已打开的设备, 比如openpty得到的伪终端; 关闭串口时会被关闭
+** 成功返回0, 失败返回-1
+***/
+int ModBus_Serial_attachFd(ModBus_Serial_T* port, int fd, ModBus_parameter* modbus, u32 batchTime);
+
+/** 等待并读取串口数据 **/
+/*** 参数 ***
+** waitTime: 没有数据时最多等待的毫秒数, 0 不等待, -1 一直等待; 一般取实例的接收超时时间
+** 返回读取的字节数, 出错返回-1
+***/
+int ModBus_Serial_poll(ModBus_Serial_T* port, int waitTime);
+
+// 关闭串口, 并解除实例的发送函数绑定
+void ModBus_Serial_close(ModBus_Serial_T* port);
+
+/**************** 对外接口 END ***************/
+
+#endif
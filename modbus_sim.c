@@ -0,0 +1,415 @@
+#include "modbus_sim.h"
+#ifdef MODBUS_LIFECYCLE
+#include "modbus_lifecycle.h"
+#endif
+
+static ModBus_Sim_T* g_simActive; // 提供时间源的总线
+
+// 时间源: 当前总线的虚拟时钟(毫秒)
+static u32 ModBus_Sim_clock(void)
+{
+	return (u32)(g_simActive->m_nowUs / 1000u);
+}
+
+// 伪随机数(xorshift32), 只由种子决定
+static u32 ModBus_Sim_random(ModBus_Sim_T* sim)
+{
+	u32 x = sim->m_random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	sim->m_random = x;
+	return x;
+}
+
+// 以百万分之ppm的概率返回1
+static byte ModBus_Sim_chance(ModBus_Sim_T* sim, u32 ppm)
+{
+	return ppm > 0 && ModBus_Sim_random(sim) % MODBUS_SIM_PPM < ppm;
+}
+
+// 实例的发送函数: 帧放入节点待发送字节, 节点空闲时经过应答延时后开始发送
+static void ModBus_Sim_send(void* context, byte* data, size_t len)
+{
+	ModBus_Sim_Node_T* node = (ModBus_Sim_Node_T*)context;
+	if (node->m_txPos == node->m_txLen && node->m_byteEndUs == 0) // 空闲
+	{
+		node->m_txLen = 0;
+		node->m_txPos = 0;
+		node->m_txStartUs = node->m_sim->m_nowUs + node->m_turnaroundUs;
+	}
+	if (node->m_txLen + len > MODBUS_SIM_TX_SIZE)
+	{
+		node->m_overflowCount++;
+		return;
+	}
+	memcpy(node->m_tx + node->m_txLen, data, len);
+	node->m_txLen += len;
+	node->m_txFrames++;
+}
+
+// 字节传输结束: 交给其他节点, 按配置丢失或翻转一位; 冲突的字节损坏
+static void ModBus_Sim_deliver(ModBus_Sim_T* sim, ModBus_Sim_Node_T* sender)
+{
+	byte value = sender->m_tx[sender->m_txPos];
+	if (sender->m_collided)
+	{
+		sim->m_collisionCount++;
+	}
+	for (size_t i = 0; i < sim->m_nodeN; i++)
+	{
+		ModBus_Sim_Node_T* receiver = sim->m_nodes + i;
+		byte received = value;
+		if (receiver == sender)
+		{
+			continue;
+		}
+		if (ModBus_Sim_chance(sim, sim->m_setting.dropPpm))
+		{
+			sim->m_dropCount++;
+			continue;
+		}
+		if (sender->m_collided)
+		{
+			received = (byte)ModBus_Sim_random(sim);
+		}
+		else if (ModBus_Sim_chance(sim, sim->m_setting.bitErrorPpm))
+		{
+			received ^= (byte)(1u << (ModBus_Sim_random(sim) & 7u));
+			sim->m_bitErrorCount++;
+		}
+		ModBus_readByteFromOuter(receiver->m_modbus, received);
+		receiver->m_rxBytes++;
+	}
+	sender->m_txBytes++;
+	sender->m_txPos++;
+	sender->m_byteEndUs = 0;
+	sender->m_collided = 0;
+	sender->m_txStartUs = sim->m_nowUs + sim->m_setting.interCharGapUs;
+#ifdef MODBUS_LIFECYCLE
+	if (sender->m_txPos == sender->m_txLen) // 最后一个字节发送完成, 相当于串口发送完成中断
+	{
+		ModBus_Lifecycle_txComplete(sender->m_modbus);
+	}
+#endif
+}
+
+// 节点开始发送一个字节, 与正在发送的其他节点冲突
+static void ModBus_Sim_startByte(ModBus_Sim_T* sim, ModBus_Sim_Node_T* node)
+{
+	unsigned long long end = sim->m_nowUs + sim->m_byteTimeUs;
+	for (size_t i = 0; i < sim->m_nodeN; i++)
+	{
+		ModBus_Sim_Node_T* other = sim->m_nodes + i;
+		if (other != node && other->m_byteEndUs != 0)
+		{
+			other->m_collided = 1;
+			node->m_collided = 1;
+		}
+	}
+	node->m_byteEndUs = end;
+	if (end > sim->m_busyUntilUs) // 只计入与之前字节不重叠的部分
+	{
+		sim->m_busyUs += end - (sim->m_busyUntilUs > sim->m_nowUs ? sim->m_busyUntilUs : sim->m_nowUs);
+		sim->m_busyUntilUs = end;
+	}
+}
+
+/** 配置总线 **/
+/*** 参数 ***
+** nodes: 节点缓冲区
+** capacity: 节点个数
+***/
+void ModBus_Sim_setup(ModBus_Sim_T* sim, ModBus_Sim_Setting_T setting, ModBus_Sim_Node_T* nodes, size_t capacity)
+{
+	u32 bits;
+	if (setting.baudRate == 0)
+	{
+		setting.baudRate = MODBUS_DEFAULT_BAUD;
+	}
+	if (setting.stopBits == 0)
+	{
+		setting.stopBits = 1;
+	}
+	if (setting.loopPeriodUs == 0)
+	{
+		setting.loopPeriodUs = 1000;
+	}
+	if (setting.seed == 0)
+	{
+		setting.seed = 1;
+	}
+	bits = 1u + 8u + (setting.parity != MODBUS_SIM_PARITY_NONE ? 1u : 0u) + setting.stopBits; // 起始位 数据位 校验位 停止位
+	sim->m_setting = setting;
+	sim->m_byteTimeUs = (bits * 1000000u + setting.baudRate / 2u) / setting.baudRate;
+	sim->m_nowUs = 0;
+	sim->m_nextLoopUs = 0;
+	sim->m_random = setting.seed;
+	sim->m_nodes = nodes;
+	sim->m_capacity = capacity;
+	sim->m_nodeN = 0;
+	sim->m_busyUntilUs = 0;
+	sim->m_collisionCount = 0;
+	sim->m_bitErrorCount = 0;
+	sim->m_dropCount = 0;
+	sim->m_busyUs = 0;
+	g_simActive = sim;
+	ModBus_setClock(ModBus_Sim_clock);
+}
+
+// 实例接入总线
+ModBus_Sim_Node_T* ModBus_Sim_attach(ModBus_Sim_T* sim, ModBus_parameter* modbus, MODBUS_SIM_ROLE_TYPE role, u32 turnaroundUs)
+{
+	ModBus_Sim_Node_T* node;
+	if (sim->m_nodeN >= sim->m_capacity)
+	{
+		return NULL;
+	}
+	node = sim->m_nodes + sim->m_nodeN++;
+	memset(node, 0, sizeof(*node));
+	node->m_sim = sim;
+	node->m_modbus = modbus;
+	node->m_role = role;
+	node->m_turnaroundUs = turnaroundUs;
+	ModBus_attachSendHandler(modbus, ModBus_Sim_send, node);
+	return node;
+}
+
+// 运行一段虚拟时间: 依次处理字节结束, 字节开始和loop, 时钟跳到下一个事件
+void ModBus_Sim_run(ModBus_Sim_T* sim, u32 durationUs)
+{
+	unsigned long long end = sim->m_nowUs + durationUs;
+	for (;;)
+	{
+		unsigned long long next = sim->m_nextLoopUs;
+		for (size_t i = 0; i < sim->m_nodeN; i++)
+		{
+			ModBus_Sim_Node_T* node = sim->m_nodes + i;
+			if (node->m_byteEndUs != 0)
+			{
+				next = node->m_byteEndUs < next ? node->m_byteEndUs : next;
+			}
+			else if (node->m_txPos < node->m_txLen)
+			{
+				next = node->m_txStartUs < next ? node->m_txStartUs : next;
+			}
+		}
+		if (next > end)
+		{
+			sim->m_nowUs = end;
+			return;
+		}
+		if (next > sim->m_nowUs)
+		{
+			sim->m_nowUs = next;
+		}
+
+		for (size_t i = 0; i < sim->m_nodeN; i++)
+		{
+			ModBus_Sim_Node_T* node = sim->m_nodes + i;
+			if (node->m_byteEndUs != 0 && node->m_byteEndUs <= sim->m_nowUs)
+			{
+				ModBus_Sim_deliver(sim, node);
+			}
+		}
+		for (size_t i = 0; i < sim->m_nodeN; i++)
+		{
+			ModBus_Sim_Node_T* node = sim->m_nodes + i;
+			if (node->m_byteEndUs == 0 && node->m_txPos < node->m_txLen && node->m_txStartUs <= sim->m_nowUs)
+			{
+				ModBus_Sim_startByte(sim, node);
+			}
+		}
+		if (sim->m_nextLoopUs <= sim->m_nowUs)
+		{
+			for (size_t i = 0; i < sim->m_nodeN; i++)
+			{
+				ModBus_Sim_Node_T* node = sim->m_nodes + i;
+#ifdef MODBUS_MASTER
+				if (node->m_role == MODBUS_SIM_MASTER)
+				{
+					ModBus_Master_loop(node->m_modbus);
+				}
+#endif
+#ifdef MODBUS_SLAVE
+				if (node->m_role == MODBUS_SIM_SLAVE)
+				{
+					ModBus_Slave_loop(node->m_modbus);
+				}
+#endif
+			}
+			sim->m_nextLoopUs += sim->m_setting.loopPeriodUs;
+		}
+	}
+}
+
+// 当前虚拟时间(微秒)
+unsigned long long ModBus_Sim_now(const ModBus_Sim_T* sim)
+{
+	return sim->m_nowUs;
+}
+
+// 运行中总线的虚拟时间(微秒), 可作为高精度计时函数
+u32 ModBus_Sim_micros(void)
+{
+	return g_simActive != NULL ? (u32)g_simActive->m_nowUs : 0;
+}
+
+// 恢复协议的时间源
+void ModBus_Sim_close(ModBus_Sim_T* sim)
+{
+	if (g_simActive == sim)
+	{
+		g_simActive = NULL;
+		ModBus_setClock(NULL);
+	}
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+
+#define MODBUS_SIM_TEST_REQUEST_N 40 // 每种情况的指令数
+#define MODBUS_SIM_TEST_FRAME_GAP_US 8000 // 主机发送前的延时, 保证帧之间有超过从机接收超时的间隔
+
+typedef struct {
+	u32 okCount; // 成功的指令数
+	u32 failCount; // 超时或异常的指令数
+	unsigned long long latencySum; // 发出到结束的时间之和(微秒)
+	unsigned long long latencyMax;
+	unsigned long long totalUs; // 全部指令完成的时间
+	u32 collisionCount, bitErrorCount, dropCount;
+} SimTestResult_T;
+
+static uint16_t g_simRegisters[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+static ModBus_Sim_T g_simBus;
+static byte g_simDone;
+static MODBUS_STATUS_TYPE g_simStatus;
+
+static size_t simGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 8)
+		return 0;
+	memcpy(data, g_simRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static void simResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	g_simDone = 1;
+	g_simStatus = result->status;
+}
+
+/** 一个主机和两个从机(地址1, 2)轮流读2个寄存器 **/
+/*** 参数 ***
+** sameAddress: 两个从机都使用地址1, 同时应答产生冲突
+** turnaroundUs: 从机应答延时
+***/
+static void simScenario(ModBus_Sim_Setting_T setting, byte sameAddress, u32 turnaroundUs, SimTestResult_T* out)
+{
+	static ModBus_Sim_Node_T nodes[3];
+	static ModBus_parameter master, slaves[2];
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+
+	ModBus_Sim_setup(&g_simBus, setting, nodes, 3);
+	modbusSetting.frameType = RTU;
+	modbusSetting.baudRate = g_simBus.m_setting.baudRate;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	modbusSetting.address = 0x01;
+	ModBus_setup(&master, modbusSetting);
+	assert(ModBus_Sim_attach(&g_simBus, &master, MODBUS_SIM_MASTER, MODBUS_SIM_TEST_FRAME_GAP_US) != NULL);
+	for (int s = 0; s < 2; s++)
+	{
+		modbusSetting.address = sameAddress ? 0x01 : (uint8_t)(s + 1);
+		ModBus_setup(slaves + s, modbusSetting);
+		ModBus_attachRegisterHandler(slaves + s, simGetReg, NULL);
+		assert(ModBus_Sim_attach(&g_simBus, slaves + s, MODBUS_SIM_SLAVE, turnaroundUs) != NULL);
+	}
+	assert(ModBus_Sim_attach(&g_simBus, &master, MODBUS_SIM_MASTER, 0) == NULL); // 节点缓冲区已满
+
+	memset(out, 0, sizeof(*out));
+	request.type = READ_REGISTER;
+	request.count = 2;
+	request.resultHandler = simResult;
+	for (int i = 0; i < MODBUS_SIM_TEST_REQUEST_N; i++)
+	{
+		unsigned long long start = ModBus_Sim_now(&g_simBus), latency;
+		request.unit = sameAddress ? 0x01 : (uint8_t)(i % 2 + 1);
+		request.address = (uint16_t)(i % 4);
+		g_simDone = 0;
+		assert(ModBus_request(&master, &request));
+		while (!g_simDone)
+		{
+			ModBus_Sim_run(&g_simBus, 100);
+			assert(ModBus_Sim_now(&g_simBus) - start < 2000000u);
+		}
+		latency = ModBus_Sim_now(&g_simBus) - start;
+		if (g_simStatus == MODBUS_STATUS_OK)
+			out->okCount++;
+		else
+			out->failCount++;
+		out->latencySum += latency;
+		out->latencyMax = latency > out->latencyMax ? latency : out->latencyMax;
+	}
+	out->totalUs = ModBus_Sim_now(&g_simBus);
+	out->collisionCount = g_simBus.m_collisionCount;
+	out->bitErrorCount = g_simBus.m_bitErrorCount;
+	out->dropCount = g_simBus.m_dropCount;
+	ModBus_Sim_close(&g_simBus);
+}
+
+void sim_unit_test()
+{
+	ModBus_Sim_Setting_T setting = { 0 };
+	SimTestResult_T clean, fast, noisy, noisyAgain, otherSeed, collide, gap;
+	u32 wireUs;
+
+	// 9600 8E1: 每字节11位; 读2个寄存器请求8字节, 返回9字节
+	setting.baudRate = 9600;
+	setting.parity = MODBUS_SIM_PARITY_EVEN;
+	simScenario(setting, 0, 2000, &clean);
+	assert(g_simBus.m_byteTimeUs == 1146);
+	wireUs = 17 * 1146;
+	assert(clean.okCount == MODBUS_SIM_TEST_REQUEST_N && clean.collisionCount == 0);
+	assert(clean.latencySum / MODBUS_SIM_TEST_REQUEST_N > wireUs + 2000 + MODBUS_SIM_TEST_FRAME_GAP_US); // 至少为传输时间加主从机延时
+	assert(clean.latencyMax < wireUs + 2000 + MODBUS_SIM_TEST_FRAME_GAP_US + 10000); // 另有从机接收超时和loop周期
+	assert(g_simBus.m_busyUs >= (unsigned long long)wireUs * MODBUS_SIM_TEST_REQUEST_N && g_simBus.m_busyUs < clean.totalUs);
+
+	// 19200: 延时减小
+	setting.baudRate = 19200;
+	simScenario(setting, 0, 2000, &fast);
+	assert(fast.okCount == MODBUS_SIM_TEST_REQUEST_N && fast.latencySum < clean.latencySum * 3 / 4);
+	setting.baudRate = 9600;
+
+	// 误码和丢字节: 相同种子结果完全相同, 不同种子结果不同
+	setting.bitErrorPpm = 5000;
+	setting.dropPpm = 2000;
+	setting.seed = 12345;
+	simScenario(setting, 0, 2000, &noisy);
+	simScenario(setting, 0, 2000, &noisyAgain);
+	assert(memcmp(&noisy, &noisyAgain, sizeof(noisy)) == 0);
+	assert(noisy.bitErrorCount > 0 && noisy.dropCount > 0 && noisy.failCount > 0 && noisy.okCount > 0);
+	setting.seed = 54321;
+	simScenario(setting, 0, 2000, &otherSeed);
+	assert(memcmp(&noisy, &otherSeed, sizeof(noisy)) != 0);
+	setting.bitErrorPpm = 0;
+	setting.dropPpm = 0;
+
+	// 两个从机地址相同, 同时应答产生冲突, 主机收不到有效返回帧
+	simScenario(setting, 1, 2000, &collide);
+	assert(collide.collisionCount > 0 && collide.okCount == 0);
+
+	// 帧内字节间隔超过从机接收超时, 请求帧被拆开
+	setting.interCharGapUs = 500;
+	simScenario(setting, 0, 2000, &gap);
+	assert(gap.okCount == MODBUS_SIM_TEST_REQUEST_N && gap.latencySum > clean.latencySum);
+	setting.interCharGapUs = 8000;
+	simScenario(setting, 0, 2000, &gap);
+	assert(gap.okCount == 0);
+
+	printf("sim_unit_test: 9600 8E1 %u requests in %.1f ms, latency avg %.2f ms max %.2f ms; noisy ok %u fail %u (bit errors %u, drops %u)\n",
+		clean.okCount, clean.totalUs / 1000.0, clean.latencySum / 1000.0 / MODBUS_SIM_TEST_REQUEST_N, clean.latencyMax / 1000.0,
+		noisy.okCount, noisy.failCount, noisy.bitErrorCount, noisy.dropCount);
+}
+#endif // _UNIT_TEST
@@ -0,0 +1,114 @@
+#ifndef MOTECMODBUS_SIM_H_
+#define MOTECMODBUS_SIM_H_
+/**** ModBus 虚拟串口总线 ****
+** 在虚拟时钟下模拟多个实例共用的半双工总线(RS-485), 用于可重复地比较调度和超时参数
+** 按波特率, 校验位和停止位计算每字节的传输时间; 可配置字节间隔, 从机应答延时(收到请求到开始发送)
+** 多个节点同时发送时产生冲突, 冲突期间的字节在接收端损坏
+** 可配置误码率(随机翻转一位)和丢字节率, 随机数由种子决定, 相同种子和参数得到相同的吞吐量和延时
+** 使用方法:
+****** 调用ModBus_Sim_setup配置总线, 传入节点缓冲区; 协议的时间源(ModBus_millis)切换为总线的虚拟时钟
+****** 再配置实例(ModBus_setup), 使实例的时间从虚拟时钟开始; 不需要绑定发送函数
+****** 调用ModBus_Sim_attach把实例接入总线, 指定主机/从机和应答延时
+****** 调用ModBus_Sim_run运行一段虚拟时间: 按字节传输时间收发, 按loop周期运行全部实例的loop
+****** 调用ModBus_Sim_close恢复时间源
+** 注: 同一时刻只能有一个总线在运行(时间源为全局); 单线程使用
+*/
+
+#include "modbus.h"
+
+#define MODBUS_SIM_TX_SIZE (MODBUS_BUFFER_SIZE * 2) // 每个节点待发送的字节数上限, 超出的帧丢弃并计入溢出
+#define MODBUS_SIM_PPM 1000000u // 误码率和丢字节率的单位: 百万分之一
+
+typedef enum {
+	MODBUS_SIM_MASTER, // 运行ModBus_Master_loop
+	MODBUS_SIM_SLAVE, // 运行ModBus_Slave_loop
+} MODBUS_SIM_ROLE_TYPE;
+
+typedef enum {
+	MODBUS_SIM_PARITY_NONE, // 无校验
+	MODBUS_SIM_PARITY_EVEN, // 偶校验(ModBus RTU 默认 8E1)
+	MODBUS_SIM_PARITY_ODD, // 奇校验
+} MODBUS_SIM_PARITY_TYPE;
+
+typedef struct _MODBUS_SIM_SETTING_T { // 总线配置
+	u32 baudRate; // 波特率, 0为MODBUS_DEFAULT_BAUD
+	MODBUS_SIM_PARITY_TYPE parity; // 校验位
+	u8 stopBits; // 停止位个数, 0为1
+	u32 interCharGapUs; // 帧内字节之间的额外间隔(微秒)
+	u32 loopPeriodUs; // 运行实例loop的周期(微秒), 0为1000
+	u32 bitErrorPpm; // 每个接收字节翻转一位的概率(百万分之一)
+	u32 dropPpm; // 每个接收字节丢失的概率(百万分之一)
+	u32 seed; // 随机数种子, 0使用1
+} ModBus_Sim_Setting_T;
+
+struct __MODBUS_Sim;
+
+typedef struct _MODBUS_SIM_NODE_T { // 总线上的节点
+	struct __MODBUS_Sim* m_sim; // 所属总线
+	ModBus_parameter* m_modbus; // 绑定的实例
+	MODBUS_SIM_ROLE_TYPE m_role; // 主机/从机
+	u32 m_turnaroundUs; // 调用发送函数到开始发送的延时(微秒), 模拟从机应答延时和收发切换
+	byte m_tx[MODBUS_SIM_TX_SIZE]; // 待发送的字节
+	size_t m_txLen; // 待发送的字节数
+	size_t m_txPos; // 正在发送或下一个发送的字节
+	unsigned long long m_txStartUs; // 下一个字节开始发送的时刻
+	unsigned long long m_byteEndUs; // 正在发送的字节结束的时刻, 0表示没有正在发送的字节
+	byte m_collided; // 正在发送的字节与其他节点重叠
+
+	u32 m_txFrames; // 发送帧数
+	u32 m_txBytes; // 发送字节数
+	u32 m_rxBytes; // 接收到的字节数(不含丢失的字节)
+	u32 m_overflowCount; // 待发送字节超出上限丢弃的帧数
+} ModBus_Sim_Node_T;
+
+typedef struct __MODBUS_Sim {
+	ModBus_Sim_Setting_T m_setting; // 总线配置
+	u32 m_byteTimeUs; // 每字节传输时间(微秒)
+	unsigned long long m_nowUs; // 虚拟时钟(微秒)
+	unsigned long long m_nextLoopUs; // 下一次运行loop的时刻
+	u32 m_random; // 随机数状态(xorshift32)
+
+	ModBus_Sim_Node_T* m_nodes; // 节点缓冲区, 由调用者提供
+	size_t m_capacity; // 节点缓冲区个数
+	size_t m_nodeN; // 已接入的节点个数
+
+	unsigned long long m_busyUntilUs; // 总线上最后一个字节结束的时刻
+	u32 m_collisionCount; // 冲突损坏的字节数
+	u32 m_bitErrorCount; // 误码的字节数
+	u32 m_dropCount; // 丢失的字节数
+	unsigned long long m_busyUs; // 总线上有字节传输的时间之和, 除以运行时间为总线利用率
+} ModBus_Sim_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置总线 **/
+/*** 参数 ***
+** nodes: 节点缓冲区
+** capacity: 节点个数
+** 虚拟时钟从0开始, 协议的时间源切换为此总线的虚拟时钟
+***/
+void ModBus_Sim_setup(ModBus_Sim_T* sim, ModBus_Sim_Setting_T setting, ModBus_Sim_Node_T* nodes, size_t capacity);
+
+/** 实例接入总线 **/
+/*** 参数 ***
+** role: 主机/从机, 决定运行的loop
+** turnaroundUs: 调用发送函数到开始发送的延时(微秒)
+** 返回节点, 节点缓冲区已满返回NULL; 实例的发送函数被替换为总线发送
+***/
+ModBus_Sim_Node_T* ModBus_Sim_attach(ModBus_Sim_T* sim, ModBus_parameter* modbus, MODBUS_SIM_ROLE_TYPE role, u32 turnaroundUs);
+
+// 运行一段虚拟时间(微秒)
+void ModBus_Sim_run(ModBus_Sim_T* sim, u32 durationUs);
+
+// 当前虚拟时间(微秒)
+unsigned long long ModBus_Sim_now(const ModBus_Sim_T* sim);
+
+// 运行中总线的虚拟时间(微秒), 可作为生命周期记录的计时函数(见 modbus_lifecycle.h)
+u32 ModBus_Sim_micros(void);
+
+// 恢复协议的时间源为millis(), 实例的发送函数需重新绑定
+void ModBus_Sim_close(ModBus_Sim_T* sim);
+
+/**************** 对外接口 END ***************/
+
+#endif
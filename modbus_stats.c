@@ -0,0 +1,460 @@
+#include "modbus_stats.h"
+
+// 开始更新: 序号变为奇数
+static void ModBus_Stats_beginWrite(ModBus_Stats_T* stats)
+{
+	atomic_store_explicit(&stats->m_sequence, atomic_load_explicit(&stats->m_sequence, memory_order_relaxed) + 1u, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+// 结束更新: 序号变为偶数
+static void ModBus_Stats_endWrite(ModBus_Stats_T* stats)
+{
+	atomic_store_explicit(&stats->m_sequence, atomic_load_explicit(&stats->m_sequence, memory_order_relaxed) + 1u, memory_order_release);
+}
+
+// 加入直方图样本
+void ModBus_Histogram_add(ModBus_Histogram_T* histogram, u32 value)
+{
+	u32 bucket = 0;
+	while (value >> bucket != 0 && bucket < MODBUS_HISTOGRAM_BUCKET_N - 1)
+	{
+		bucket++;
+	}
+	histogram->buckets[bucket]++;
+	histogram->count++;
+	if (value > histogram->max)
+	{
+		histogram->max = value;
+	}
+}
+
+// 设备地址对应的统计, 首次出现时分配; 缓冲区已满返回NULL
+static ModBus_Stats_Unit_T* ModBus_Stats_unit(ModBus_Stats_T* stats, uint8_t unit)
+{
+	ModBus_Stats_Unit_T* pUnit;
+	if (stats->m_unitIndex[unit] != MODBUS_STATS_UNIT_NONE)
+	{
+		return stats->m_units + (stats->m_unitIndex[unit] - 1);
+	}
+	if (stats->m_unitN >= stats->m_unitCapacity)
+	{
+		stats->m_counters.untrackedUnits++;
+		return NULL;
+	}
+	pUnit = stats->m_units + stats->m_unitN;
+	memset(pUnit, 0, sizeof(*pUnit));
+	pUnit->unit = unit;
+	stats->m_unitIndex[unit] = (u8)(++stats->m_unitN);
+	return pUnit;
+}
+
+/** 配置统计 **/
+/*** 参数 ***
+** units: 设备统计缓冲区
+** unitCapacity: 设备统计缓冲区个数, 最多255
+***/
+void ModBus_Stats_setup(ModBus_Stats_T* stats, ModBus_Stats_Unit_T* units, size_t unitCapacity)
+{
+	atomic_init(&stats->m_sequence, 0u);
+	stats->m_units = units;
+	stats->m_unitCapacity = units == NULL ? 0 : (unitCapacity < 255 ? unitCapacity : 255);
+	stats->m_unitN = 0;
+	memset(&stats->m_counters, 0, sizeof(stats->m_counters));
+	memset(stats->m_unitIndex, 0, sizeof(stats->m_unitIndex));
+}
+
+// 实例绑定统计
+void ModBus_attachStats(ModBus_parameter* ModBus_para, ModBus_Stats_T* stats)
+{
+#ifdef MODBUS_STATS
+	ModBus_para->m_stats = stats;
+#endif
+}
+
+// 清零全部计数
+void ModBus_Stats_reset(ModBus_Stats_T* stats)
+{
+	ModBus_Stats_beginWrite(stats);
+	memset(&stats->m_counters, 0, sizeof(stats->m_counters));
+	memset(stats->m_unitIndex, 0, sizeof(stats->m_unitIndex));
+	stats->m_unitN = 0;
+	ModBus_Stats_endWrite(stats);
+}
+
+/** 获取快照 **/
+/*** 参数 ***
+** counters: 实例计数
+** units: 设备计数
+** unitCapacity: 最多复制的设备个数
+***/
+size_t ModBus_Stats_snapshot(const ModBus_Stats_T* stats, ModBus_Stats_Counters_T* counters, ModBus_Stats_Unit_T* units, size_t unitCapacity)
+{
+	atomic_uint* sequence = (atomic_uint*)&stats->m_sequence;
+	size_t unitN;
+	for (;;)
+	{
+		u32 begin = atomic_load_explicit(sequence, memory_order_acquire);
+		if (begin & 1u) // 正在更新
+		{
+			continue;
+		}
+		memcpy(counters, &stats->m_counters, sizeof(*counters));
+		unitN = stats->m_unitN;
+		if (units != NULL)
+		{
+			memcpy(units, stats->m_units, (unitN < unitCapacity ? unitN : unitCapacity) * sizeof(*units));
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(sequence, memory_order_relaxed) == begin) // 复制期间没有更新
+		{
+			return unitN;
+		}
+	}
+}
+
+// 直方图百分位所在分桶的上限
+u32 ModBus_Histogram_percentile(const ModBus_Histogram_T* histogram, u32 percent)
+{
+	u32 target, sum = 0;
+	if (histogram->count == 0)
+	{
+		return 0;
+	}
+	target = (u32)(((unsigned long long)histogram->count * percent + 99u) / 100u); // 向上取整, 至少1个样本
+	if (target == 0)
+	{
+		target = 1;
+	}
+	for (u32 k = 0; k < MODBUS_HISTOGRAM_BUCKET_N; k++)
+	{
+		sum += histogram->buckets[k];
+		if (sum >= target)
+		{
+			u32 upper = k == 0 ? 0 : k == MODBUS_HISTOGRAM_BUCKET_N - 1 ? histogram->max : (1u << k) - 1u; // 第k桶最大值, 最后一桶没有上限
+			return upper < histogram->max ? upper : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+// 发送一帧
+void ModBus_Stats_countTx(ModBus_Stats_T* stats, size_t bytes)
+{
+	ModBus_Stats_beginWrite(stats);
+	stats->m_counters.txFrames++;
+	stats->m_counters.txBytes += (u32)bytes;
+	ModBus_Stats_endWrite(stats);
+}
+
+// 接收字节或完整帧
+void ModBus_Stats_countRx(ModBus_Stats_T* stats, size_t bytes, u32 frames)
+{
+	ModBus_Stats_beginWrite(stats);
+	stats->m_counters.rxBytes += (u32)bytes;
+	stats->m_counters.rxFrames += frames;
+	ModBus_Stats_endWrite(stats);
+}
+
+// 接收错误
+void ModBus_Stats_countError(ModBus_Stats_T* stats, MODBUS_STATS_ERROR_TYPE error)
+{
+	ModBus_Stats_beginWrite(stats);
+	if (error == MODBUS_STATS_CHECK_ERROR)
+	{
+		stats->m_counters.checkErrors++;
+	}
+	else
+	{
+		stats->m_counters.resyncs++;
+	}
+	ModBus_Stats_endWrite(stats);
+}
+
+// 指令放入缓存后的深度
+void ModBus_Stats_countQueue(ModBus_Stats_T* stats, size_t depth)
+{
+	if (depth <= stats->m_counters.queueHighWater) // 只有写入者修改, 可直接读取
+	{
+		return;
+	}
+	ModBus_Stats_beginWrite(stats);
+	stats->m_counters.queueHighWater = (u32)depth;
+	ModBus_Stats_endWrite(stats);
+}
+
+// 主机发送指令
+void ModBus_Stats_countSend(ModBus_Stats_T* stats, uint8_t unit, u32 queueWait)
+{
+	ModBus_Stats_Unit_T* pUnit;
+	ModBus_Stats_beginWrite(stats);
+	ModBus_Histogram_add(&stats->m_counters.queueWait, queueWait);
+	pUnit = ModBus_Stats_unit(stats, unit);
+	if (pUnit != NULL)
+	{
+		pUnit->requests++;
+	}
+	ModBus_Stats_endWrite(stats);
+}
+
+// 指令结束: 未发送的指令(丢弃/无效)只计丢弃数
+void ModBus_Stats_countResult(ModBus_Stats_T* stats, uint8_t unit, MODBUS_STATUS_TYPE status, u32 responseTime, u32 callbackTime)
+{
+	ModBus_Stats_Unit_T* pUnit = NULL;
+	ModBus_Stats_beginWrite(stats);
+	ModBus_Histogram_add(&stats->m_counters.callbackTime, callbackTime);
+	if (status == MODBUS_STATUS_DROPPED)
+	{
+		stats->m_counters.drops++;
+	}
+	else if (status != MODBUS_STATUS_INVALID)
+	{
+		pUnit = ModBus_Stats_unit(stats, unit);
+	}
+	switch (status)
+	{
+	case MODBUS_STATUS_OK:
+	case MODBUS_STATUS_EXCEPTION:
+		ModBus_Histogram_add(&stats->m_counters.responseTime, responseTime);
+		if (status == MODBUS_STATUS_EXCEPTION)
+		{
+			stats->m_counters.exceptions++;
+		}
+		if (pUnit != NULL)
+		{
+			if (status == MODBUS_STATUS_OK)
+				pUnit->responses++;
+			else
+				pUnit->exceptions++;
+			pUnit->consecutiveTimeouts = 0;
+			pUnit->latencySum += responseTime;
+			if (responseTime > pUnit->latencyMax)
+			{
+				pUnit->latencyMax = responseTime;
+			}
+		}
+		break;
+	case MODBUS_STATUS_TIMEOUT:
+		stats->m_counters.timeouts++;
+		if (pUnit != NULL)
+		{
+			pUnit->timeouts++;
+			pUnit->consecutiveTimeouts++;
+		}
+		break;
+	default:
+		break;
+	}
+	ModBus_Stats_endWrite(stats);
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_STATS) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+#include <pthread.h>
+
+#define MODBUS_STATS_TEST_REQUEST_N 2000 // 并发读取快照时发送的指令数
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_statsRegisters[4] = { 0x11, 0x22, 0x33, 0x44 };
+static byte g_statsCorrupt; // 下一个发送的帧最后一个字节取反一次
+static byte g_statsNoise; // 下一个发送的帧前插入的干扰字节数
+static int g_statsResultN;
+
+static size_t statsGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 4)
+		return 0;
+	memcpy(data, g_statsRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static void statsSend(void* context, byte* data, size_t len)
+{
+	if (context == NULL) // 设备不存在
+		return;
+	for (; g_statsNoise > 0; g_statsNoise--)
+		ModBus_readByteFromOuter((ModBus_parameter*)context, 0x55);
+	if (g_statsCorrupt)
+	{
+		g_statsCorrupt = 0;
+		data[len - 1] ^= 0xFF;
+	}
+	ModBus_readBytesFromOuter((ModBus_parameter*)context, data, len);
+}
+
+// 代替从机返回异常码(串口从机不返回异常帧)
+static void statsExceptionSend(void* context, byte* data, size_t len)
+{
+	byte response[8] = { data[0], (byte)(data[1] | 0x80), EXCEPTION_ILLEGAL_DATA_ADDRESS };
+	(void)len;
+	ModBus_readBytesFromOuter((ModBus_parameter*)context, response, ModBus_RTU_appendCRC(response, 3));
+}
+
+static void statsResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	(void)result;
+	g_statsResultN++;
+}
+
+// 发送一条读指令并运行至结束
+static void statsRead(ModBus_parameter* master, ModBus_parameter* slave, uint8_t unit, uint16_t address)
+{
+	ModBus_Request_T request = { 0 };
+	int n = g_statsResultN;
+	request.unit = unit;
+	request.type = READ_REGISTER;
+	request.address = address;
+	request.count = 1;
+	request.resultHandler = statsResult;
+	ModBus_request(master, &request);
+	for (int i = 0; i < 200 && g_statsResultN == n; i++)
+	{
+		ModBus_Master_loop(master);
+		ModBus_Slave_loop(slave);
+		t += 1;
+	}
+	assert(g_statsResultN == n + 1);
+}
+
+// 读取线程: 反复获取快照, 检查同一次更新中修改的计数一致
+static ModBus_Stats_T g_statsConcurrent;
+static atomic_int g_statsRunning;
+static atomic_uint g_statsSnapshotN;
+
+static void* statsReader(void* arg)
+{
+	ModBus_Stats_Counters_T counters;
+	ModBus_Stats_Unit_T units[4];
+	(void)arg;
+	while (atomic_load(&g_statsRunning))
+	{
+		size_t unitN = ModBus_Stats_snapshot(&g_statsConcurrent, &counters, units, 4);
+		u32 sum = 0;
+		for (int k = 0; k < MODBUS_HISTOGRAM_BUCKET_N; k++)
+			sum += counters.responseTime.buckets[k];
+		assert(sum == counters.responseTime.count);
+		assert(counters.txFrames * 8u == counters.txBytes); // 读一个寄存器的请求为8字节
+		if (unitN > 0)
+		{
+			assert(unitN == 1 && units[0].requests == counters.queueWait.count);
+			assert(units[0].responses == counters.responseTime.count && units[0].requests - units[0].responses <= 1);
+		}
+		atomic_fetch_add(&g_statsSnapshotN, 1u);
+	}
+	return NULL;
+}
+
+void stats_unit_test()
+{
+	static ModBus_Stats_Unit_T unitBuffer[2];
+	ModBus_Stats_T masterStats, slaveStats;
+	ModBus_Stats_Counters_T counters;
+	ModBus_Stats_Unit_T units[2];
+	ModBus_parameter master, slave;
+	ModBus_Setting_T modbusSetting = { 0 };
+	size_t unitN;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(&master, modbusSetting);
+	ModBus_setTimeout(&master, 5, 50);
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_setTimeout(&slave, 5, 50);
+	ModBus_attachRegisterHandler(&slave, statsGetReg, NULL);
+	ModBus_attachSendHandler(&master, statsSend, &slave);
+	ModBus_attachSendHandler(&slave, statsSend, &master);
+	ModBus_Stats_setup(&masterStats, unitBuffer, 2);
+	ModBus_Stats_setup(&slaveStats, NULL, 0);
+	ModBus_attachStats(&master, &masterStats);
+	ModBus_attachStats(&slave, &slaveStats);
+
+	// 正常读取: 收发帧数和字节数, 设备计数, 直方图
+	for (uint16_t k = 0; k < 4; k++)
+		statsRead(&master, &slave, 0, k);
+	unitN = ModBus_Stats_snapshot(&masterStats, &counters, units, 2);
+	assert(counters.txFrames == 4 && counters.txBytes == 32 && counters.rxFrames == 4 && counters.rxBytes == 28); // 返回帧7字节
+	assert(counters.checkErrors == 0 && counters.resyncs == 0 && counters.timeouts == 0 && counters.drops == 0);
+	assert(counters.queueHighWater == 1 && counters.queueWait.count == 4 && counters.responseTime.count == 4 && counters.callbackTime.count == 4);
+	assert(unitN == 1 && units[0].unit == 0x01 && units[0].requests == 4 && units[0].responses == 4 && units[0].latencyMax > 0);
+	assert(ModBus_Histogram_percentile(&counters.responseTime, 99) >= units[0].latencyMax / 2 && ModBus_Histogram_percentile(&counters.responseTime, 99) <= units[0].latencyMax);
+	ModBus_Stats_snapshot(&slaveStats, &counters, NULL, 0);
+	assert(counters.rxFrames == 4 && counters.rxBytes == 32 && counters.txFrames == 4 && counters.txBytes == 28);
+
+	// 异常返回
+	ModBus_attachSendHandler(&master, statsExceptionSend, &master);
+	statsRead(&master, &slave, 0, 8);
+	ModBus_attachSendHandler(&master, statsSend, &slave);
+	unitN = ModBus_Stats_snapshot(&masterStats, &counters, units, 2);
+	assert(counters.exceptions == 1 && units[0].exceptions == 1 && counters.responseTime.count == 5);
+
+	// 无应答的设备: 超时计数和连续超时数; 设备缓冲区满后不再统计新设备
+	ModBus_attachSendHandler(&master, statsSend, NULL);
+	statsRead(&master, &slave, 0x07, 0);
+	statsRead(&master, &slave, 0x07, 0);
+	statsRead(&master, &slave, 0x09, 0);
+	ModBus_attachSendHandler(&master, statsSend, &slave);
+	unitN = ModBus_Stats_snapshot(&masterStats, &counters, units, 2);
+	assert(unitN == 2 && units[1].unit == 0x07 && units[1].timeouts == 2 && units[1].consecutiveTimeouts == 2 && units[1].responses == 0);
+	assert(counters.timeouts == 3 && counters.untrackedUnits == 2); // 0x09 的发送和结果
+	assert(counters.responseTime.count == 5); // 超时不计入返回延时
+
+	// 帧前的干扰字节: 从机重新同步后正常返回
+	g_statsNoise = 3;
+	statsRead(&master, &slave, 0, 1);
+	ModBus_Stats_snapshot(&slaveStats, &counters, NULL, 0);
+	assert(counters.resyncs >= 1 && counters.txFrames == 5 && counters.checkErrors == 0);
+
+	// 请求帧校验失败: 从机计校验错误, 主机超时
+	g_statsCorrupt = 1;
+	statsRead(&master, &slave, 0, 0);
+	ModBus_Stats_snapshot(&slaveStats, &counters, NULL, 0);
+	assert(counters.checkErrors == 1 && counters.txFrames == 5);
+
+	// 指令缓存满: 丢弃计数, 缓存最大深度
+	ModBus_Stats_reset(&masterStats);
+	g_statsResultN = 0;
+	for (int k = 0; k < MODBUS_WAITFRAME_N + 3; k++)
+		ModBus_getRegister(&master, 0, 1, NULL);
+	for (int i = 0; i < 200; i++)
+	{
+		ModBus_Master_loop(&master);
+		ModBus_Slave_loop(&slave);
+		t += 1;
+	}
+	unitN = ModBus_Stats_snapshot(&masterStats, &counters, units, 2);
+	assert(counters.queueHighWater == MODBUS_WAITFRAME_N && counters.drops == 3 && counters.txFrames == MODBUS_WAITFRAME_N);
+	assert(unitN == 1 && units[0].responses == MODBUS_WAITFRAME_N && units[0].consecutiveTimeouts == 0);
+	assert(counters.queueWait.max > 0); // 缓存中的指令等待前一条返回
+
+	// 解除绑定后不再统计
+	ModBus_attachStats(&master, NULL);
+	statsRead(&master, &slave, 0, 0);
+	ModBus_Stats_snapshot(&masterStats, &counters, NULL, 0);
+	assert(counters.txFrames == MODBUS_WAITFRAME_N);
+
+	// 读取线程同时获取快照: 每个快照内部一致
+	{
+		pthread_t thread;
+		ModBus_Stats_setup(&g_statsConcurrent, unitBuffer, 2);
+		ModBus_attachStats(&master, &g_statsConcurrent);
+		atomic_store(&g_statsRunning, 1);
+		pthread_create(&thread, NULL, statsReader, NULL);
+		while (atomic_load(&g_statsSnapshotN) == 0) // 等待读取线程开始
+			;
+		for (int k = 0; k < MODBUS_STATS_TEST_REQUEST_N; k++)
+			statsRead(&master, &slave, 0, (uint16_t)(k & 3));
+		atomic_store(&g_statsRunning, 0);
+		pthread_join(thread, NULL);
+		ModBus_Stats_snapshot(&g_statsConcurrent, &counters, units, 2);
+		assert(counters.txFrames == MODBUS_STATS_TEST_REQUEST_N && units[0].responses == MODBUS_STATS_TEST_REQUEST_N);
+		printf("stats_unit_test: %d requests, %u snapshots, response p50 %u ms p99 %u ms max %u ms\n", MODBUS_STATS_TEST_REQUEST_N,
+			atomic_load(&g_statsSnapshotN), (unsigned)ModBus_Histogram_percentile(&counters.responseTime, 50),
+			(unsigned)ModBus_Histogram_percentile(&counters.responseTime, 99), (unsigned)counters.responseTime.max);
+	}
+	ModBus_attachStats(&master, NULL);
+	ModBus_attachStats(&slave, NULL);
+}
+#endif // _UNIT_TEST
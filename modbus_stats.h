@@ -0,0 +1,112 @@
+#ifndef MOTECMODBUS_STATS_H_
+#define MOTECMODBUS_STATS_H_
+/**** ModBus 实例统计 ****
+** 每个实例的计数: 收发帧数和字节数, CRC/LRC校验错误, 重新同步(丢弃帧起始前的数据), 超时, 异常码, 指令缓存丢弃, 缓存最大深度
+** 每个目标设备(主机按设备地址)的计数: 请求, 返回, 超时, 异常码, 返回延时; 用于发现响应变慢的设备
+** 对数分桶直方图: 入队到发送, 发送到返回(毫秒), 回调函数耗时(MODBUS_STATS_CLOCK 单位)
+** 统计只在实例的loop线程中更新(中断中不更新), 其他线程通过ModBus_Stats_snapshot无锁读取一致的快照
+** 使用方法:
+****** 在 modbus.h 中开启 MODBUS_STATS(默认开启); 实例未绑定统计时只多一次判断
+****** 调用ModBus_Stats_setup配置, 传入设备统计缓冲区(按首次出现的设备地址分配, 用完后不再统计新设备)
+****** 调用ModBus_attachStats将实例绑定到统计
+****** 任意线程调用ModBus_Stats_snapshot获取快照, ModBus_Histogram_percentile计算百分位
+*/
+
+#include "modbus.h"
+#include <stdatomic.h>
+
+#ifndef MODBUS_STATS_CLOCK
+#define MODBUS_STATS_CLOCK() (ModBus_millis()) // 回调耗时的计时函数, 可重新定义为微秒或时钟周期计数
+#endif
+#ifndef MODBUS_HISTOGRAM_BUCKET_N
+#define MODBUS_HISTOGRAM_BUCKET_N 24 // 直方图分桶数: 0, 1, 2~3, 4~7, ..., 2^22以上; 微秒的直方图可到4秒
+#endif
+#define MODBUS_STATS_UNIT_NONE 0 // 设备地址未分配统计
+
+typedef enum {
+	MODBUS_STATS_CHECK_ERROR, // CRC/LRC校验错误
+	MODBUS_STATS_RESYNC, // 丢弃帧起始前的数据, 重新同步
+} MODBUS_STATS_ERROR_TYPE;
+
+typedef struct _MODBUS_HISTOGRAM_T { // 对数分桶直方图, 第k桶(k>0)统计 [2^(k-1), 2^k) 的值
+	u32 buckets[MODBUS_HISTOGRAM_BUCKET_N];
+	u32 count; // 样本数
+	u32 max; // 最大值
+} ModBus_Histogram_T;
+
+typedef struct _MODBUS_STATS_COUNTERS_T { // 实例计数
+	u32 txFrames; // 发送帧数
+	u32 rxFrames; // 接收到的完整帧数(校验通过)
+	u32 txBytes; // 发送字节数
+	u32 rxBytes; // 接收字节数
+	u32 checkErrors; // CRC/LRC校验错误
+	u32 resyncs; // 丢弃帧起始前的数据重新同步的次数
+	u32 timeouts; // 主机等待返回帧超时
+	u32 exceptions; // 主机收到的异常返回帧
+	u32 drops; // 主机指令缓存满或快速模式丢弃的指令
+	u32 queueHighWater; // 主机指令缓存的最大深度
+	u32 untrackedUnits; // 设备统计缓冲区已满, 未统计的结果数
+	ModBus_Histogram_T queueWait; // 入队到发送(毫秒)
+	ModBus_Histogram_T responseTime; // 发送到返回(毫秒), 不含超时
+	ModBus_Histogram_T callbackTime; // 回调函数耗时(MODBUS_STATS_CLOCK 单位)
+} ModBus_Stats_Counters_T;
+
+typedef struct _MODBUS_STATS_UNIT_T { // 目标设备计数
+	uint8_t unit; // 设备地址
+	u32 requests; // 发送的请求数
+	u32 responses; // 正常返回数
+	u32 timeouts; // 超时数
+	u32 exceptions; // 异常返回数
+	u32 consecutiveTimeouts; // 连续超时数, 返回后清零
+	u32 latencySum; // 返回延时之和(毫秒), 除以 responses + exceptions 为平均延时
+	u32 latencyMax; // 最大返回延时(毫秒)
+} ModBus_Stats_Unit_T;
+
+typedef struct __MODBUS_Stats {
+	atomic_uint m_sequence; // 更新时为奇数, 读取者据此判断快照是否一致
+	ModBus_Stats_Counters_T m_counters; // 实例计数
+	ModBus_Stats_Unit_T* m_units; // 设备统计缓冲区, 由调用者提供
+	size_t m_unitCapacity; // 设备统计缓冲区个数
+	size_t m_unitN; // 已分配的设备个数
+	u8 m_unitIndex[256]; // 设备地址到统计序号+1的映射, 0表示未分配
+} ModBus_Stats_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置统计 **/
+/*** 参数 ***
+** units: 设备统计缓冲区, 可以为NULL(不统计设备); 个数unitCapacity最多255
+***/
+void ModBus_Stats_setup(ModBus_Stats_T* stats, ModBus_Stats_Unit_T* units, size_t unitCapacity);
+
+// 实例绑定统计, 传入NULL解除绑定; 多个实例可绑定同一统计(需在同一线程中运行)
+void ModBus_attachStats(ModBus_parameter* ModBus_para, ModBus_Stats_T* stats);
+
+// 清零全部计数, 只能在实例的loop线程中调用
+void ModBus_Stats_reset(ModBus_Stats_T* stats);
+
+/** 获取快照, 任意线程可调用, 不加锁 **/
+/*** 参数 ***
+** counters: 实例计数
+** units: 设备计数, 可以为NULL; 最多复制unitCapacity个
+** 返回已统计的设备个数
+***/
+size_t ModBus_Stats_snapshot(const ModBus_Stats_T* stats, ModBus_Stats_Counters_T* counters, ModBus_Stats_Unit_T* units, size_t unitCapacity);
+
+// 直方图百分位(0~100)所在分桶的上限, 没有样本返回0
+u32 ModBus_Histogram_percentile(const ModBus_Histogram_T* histogram, u32 percent);
+
+// 加入直方图样本, 也用于其他模块的延时直方图(见 modbus_lifecycle.h)
+void ModBus_Histogram_add(ModBus_Histogram_T* histogram, u32 value);
+
+// 以下由协议内部在loop线程中调用
+void ModBus_Stats_countTx(ModBus_Stats_T* stats, size_t bytes); // 发送一帧
+void ModBus_Stats_countRx(ModBus_Stats_T* stats, size_t bytes, u32 frames); // 接收字节或完整帧
+void ModBus_Stats_countError(ModBus_Stats_T* stats, MODBUS_STATS_ERROR_TYPE error); // 接收错误
+void ModBus_Stats_countQueue(ModBus_Stats_T* stats, size_t depth); // 指令放入缓存后的深度
+void ModBus_Stats_countSend(ModBus_Stats_T* stats, uint8_t unit, u32 queueWait); // 主机发送指令
+void ModBus_Stats_countResult(ModBus_Stats_T* stats, uint8_t unit, MODBUS_STATUS_TYPE status, u32 responseTime, u32 callbackTime); // 指令结束
+
+/**************** 对外接口 END ***************/
+
+#endif
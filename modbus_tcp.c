@@ -0,0 +1,816 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // accept4
+#endif
+
+#include "modbus_tcp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// 关闭连接并放回空闲链表
+static void ModBus_TCP_closeConnection(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn)
+{
+	epoll_ctl(server->m_epollFd, EPOLL_CTL_DEL, conn->m_fd, NULL);
+	close(conn->m_fd);
+	conn->m_fd = -1;
+	conn->m_nextFree = server->m_freeHead;
+	server->m_freeHead = (int)(conn - server->m_connections);
+	server->m_connectionCount--;
+}
+
+// 修改连接关注的epoll事件, 事件未变化时不调用系统函数
+static void ModBus_TCP_setEvents(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn, u32 events)
+{
+	struct epoll_event ev;
+	if (conn->m_events == events)
+	{
+		return;
+	}
+	ev.events = events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(server->m_epollFd, EPOLL_CTL_MOD, conn->m_fd, &ev) == 0)
+	{
+		conn->m_events = events;
+	}
+}
+
+// 接收新连接, 超出最大连接数的连接直接关闭
+static void ModBus_TCP_accept(ModBus_TCP_Server_T* server)
+{
+	for (;;)
+	{
+		ModBus_TCP_Connection_T* conn;
+		struct epoll_event ev;
+		int on = 1;
+		int fd = accept4(server->m_listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			return; // EAGAIN: 没有待接收的连接; 其他错误(如EMFILE)下次再试
+		}
+		if (server->m_connectionCount >= server->m_maxConnections || server->m_freeHead < 0)
+		{
+			close(fd);
+			server->m_rejectedCount++;
+			continue;
+		}
+		conn = server->m_connections + server->m_freeHead;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // 返回帧小, 关闭Nagle算法降低延迟
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = conn;
+		if (epoll_ctl(server->m_epollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			close(fd);
+			continue;
+		}
+		server->m_freeHead = conn->m_nextFree;
+		server->m_connectionCount++;
+
+		conn->m_fd = fd;
+		conn->m_nextFree = -1;
+		conn->m_generation++;
+		conn->m_paused = 0;
+		conn->m_events = EPOLLIN;
+		conn->m_lastActiveTime = ModBus_millis();
+		conn->m_receiveLen = 0;
+		conn->m_sendLen = 0;
+		conn->m_sendOffset = 0;
+	}
+}
+
+// 发送缓冲区中的数据, 不能立即发送完的数据等待EPOLLOUT, 连接异常返回-1
+static int ModBus_TCP_flush(ModBus_TCP_Connection_T* conn)
+{
+	while (conn->m_sendOffset < conn->m_sendLen)
+	{
+		ssize_t n = send(conn->m_fd, conn->m_sendBuffer + conn->m_sendOffset, conn->m_sendLen - conn->m_sendOffset, MSG_NOSIGNAL);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				return 0;
+			}
+			return -1;
+		}
+		conn->m_sendOffset += (size_t)n;
+	}
+	conn->m_sendOffset = 0;
+	conn->m_sendLen = 0;
+	return 0;
+}
+
+// 移除已处理的请求
+static void ModBus_TCP_consume(ModBus_TCP_Connection_T* conn, size_t offset)
+{
+	if (offset > 0)
+	{
+		// 只移动未接收完整的剩余数据, 通常为0或很少的字节
+		conn->m_receiveLen -= offset;
+		if (conn->m_receiveLen > 0)
+		{
+			memmove(conn->m_receiveBuffer, conn->m_receiveBuffer + offset, conn->m_receiveLen);
+		}
+	}
+}
+
+// RTU over TCP: 按功能码计算帧长度, 原地解析完整的请求, 返回值与ModBus_TCP_process相同
+static int ModBus_TCP_processRTU(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn)
+{
+#ifdef MODBUS_SLAVE
+	int ret = 0;
+	size_t offset = 0;
+	while (conn->m_receiveLen - offset >= 2)
+	{
+		byte* frame = conn->m_receiveBuffer + offset;
+		size_t frameLen = ModBus_RTU_requestSize(frame, conn->m_receiveLen - offset);
+		if (frameLen == 0)
+		{
+			if (conn->m_receiveLen - offset >= 7) // 功能码未知, 无法再找到帧边界
+			{
+				return -1;
+			}
+			break;
+		}
+		if (conn->m_receiveLen - offset < frameLen) // 请求未接收完整
+		{
+			break;
+		}
+		if (MODBUS_TCP_SEND_SIZE - conn->m_sendLen < MODBUS_TCP_ADU_SIZE) // 发送缓冲区不足, 等待发送后继续处理
+		{
+			ret = 1;
+			break;
+		}
+		// 校验错误或不是本机地址的帧丢弃, 与串口从机相同; 地址0为广播, 执行但不返回
+		if (ModBus_RTU_checkCRC(frame, frameLen) && (frame[0] == server->m_slave->m_address || frame[0] == 0))
+		{
+			byte* response = conn->m_sendBuffer + conn->m_sendLen;
+			size_t responseLen = ModBus_Slave_handlePDU(server->m_slave, frame + 1, frameLen - 3, response + 1);
+			if (responseLen > 0 && frame[0] != 0)
+			{
+				response[0] = frame[0];
+				conn->m_sendLen += ModBus_RTU_appendCRC(response, responseLen + 1);
+			}
+			server->m_requestCount++;
+		}
+		offset += frameLen;
+	}
+	ModBus_TCP_consume(conn, offset);
+	return ret;
+#else
+	(void)server;
+	(void)conn;
+	return -1;
+#endif
+}
+
+// 在接收缓冲区中原地解析完整的请求, 返回帧直接生成到发送缓冲区
+// 全部处理返回0, 因发送缓冲区满而暂停返回1, 协议错误返回-1
+static int ModBus_TCP_process(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn)
+{
+	int ret = 0;
+	size_t offset = 0;
+	if (server->m_framing == MODBUS_TCP_FRAMING_RTU)
+	{
+		return ModBus_TCP_processRTU(server, conn);
+	}
+	while (conn->m_receiveLen - offset >= MODBUS_MBAP_SIZE)
+	{
+		byte* adu = conn->m_receiveBuffer + offset;
+		byte* response;
+		size_t length = ((size_t)adu[4] << 8) + adu[5]; // 单元号 + PDU 长度
+		size_t responseLen;
+		if (adu[2] != 0 || adu[3] != 0 || length < 2 || length > MODBUS_PDU_SIZE + 1) // 协议号不为0或长度异常, 无法再找到帧边界
+		{
+			return -1;
+		}
+		if (conn->m_receiveLen - offset < 6 + length) // 请求未接收完整
+		{
+			break;
+		}
+		if (MODBUS_TCP_SEND_SIZE - conn->m_sendLen < MODBUS_TCP_ADU_SIZE) // 发送缓冲区不足, 等待发送后继续处理
+		{
+			ret = 1;
+			break;
+		}
+
+		response = conn->m_sendBuffer + conn->m_sendLen;
+		if (server->m_requestHandler != NULL)
+		{
+			int handled = (*server->m_requestHandler)(server->m_requestContext, server, conn, adu, 6 + length, response);
+			if (handled < 0) // 忙, 请求留在接收缓冲区
+			{
+				conn->m_paused = 1;
+				break;
+			}
+			conn->m_sendLen += (size_t)handled;
+			responseLen = 0;
+		}
+		else
+		{
+#ifdef MODBUS_SLAVE
+			if (server->m_slave == NULL) // 没有从机实例也没有请求处理函数, 关闭连接, 不让客户端一直等待
+			{
+				return -1;
+			}
+			responseLen = ModBus_Slave_handlePDU(server->m_slave, adu + MODBUS_MBAP_SIZE, length - 1, response + MODBUS_MBAP_SIZE);
+#else
+			return -1;
+#endif
+		}
+		if (responseLen > 0)
+		{
+			memcpy(response, adu, 4); // 事务号和协议号与请求相同
+			response[4] = ((responseLen + 1) >> 8) & 0x0FF; // 长度高位
+			response[5] = (responseLen + 1) & 0x0FF; // 长度低位
+			response[6] = adu[6]; // 单元号
+			conn->m_sendLen += MODBUS_MBAP_SIZE + responseLen;
+		}
+		server->m_requestCount++;
+		offset += 6 + length;
+	}
+	ModBus_TCP_consume(conn, offset);
+	return ret;
+}
+
+// 有未发送完的数据时暂停接收, 等待可写; 暂停处理时不关注可读, 避免未读取的数据反复触发事件; 否则只关注可读
+static void ModBus_TCP_updateEvents(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn)
+{
+	ModBus_TCP_setEvents(server, conn, conn->m_sendLen > 0 ? EPOLLOUT : (conn->m_paused ? 0 : EPOLLIN));
+}
+
+// 处理接收缓冲区中的请求并发送返回帧, 连接异常返回-1
+static int ModBus_TCP_processAndFlush(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn)
+{
+	int ret;
+	conn->m_paused = 0;
+	do
+	{
+		ret = ModBus_TCP_process(server, conn);
+		if (ret < 0 || ModBus_TCP_flush(conn) < 0)
+		{
+			return -1;
+		}
+	} while (ret > 0 && conn->m_sendLen == 0); // 发送缓冲区已清空, 继续处理剩余请求
+
+	ModBus_TCP_updateEvents(server, conn);
+	return 0;
+}
+
+// 处理连接上的事件, 需要关闭连接返回-1
+static int ModBus_TCP_service(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn, u32 events)
+{
+	if (events & (EPOLLERR | EPOLLHUP))
+	{
+		return -1;
+	}
+	if ((events & EPOLLIN) && conn->m_receiveLen < MODBUS_TCP_RECEIVE_SIZE)
+	{
+		ssize_t n = recv(conn->m_fd, conn->m_receiveBuffer + conn->m_receiveLen, MODBUS_TCP_RECEIVE_SIZE - conn->m_receiveLen, 0);
+		if (n == 0) // 对方关闭连接
+		{
+			return -1;
+		}
+		if (n < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			conn->m_receiveLen += (size_t)n;
+			conn->m_lastActiveTime = ModBus_millis();
+		}
+	}
+	return ModBus_TCP_processAndFlush(server, conn);
+}
+
+// 关闭空闲超时的连接, 每四分之一超时时间检查一次
+static void ModBus_TCP_checkIdle(ModBus_TCP_Server_T* server)
+{
+	u32 now = ModBus_millis();
+	if (server->m_idleTimeout == 0 || now - server->m_lastIdleCheckTime < (server->m_idleTimeout >> 2))
+	{
+		return;
+	}
+	server->m_lastIdleCheckTime = now;
+	for (size_t i = 0; i < server->m_connectionCapacity && server->m_connectionCount > 0; i++)
+	{
+		ModBus_TCP_Connection_T* conn = server->m_connections + i;
+		if (conn->m_fd >= 0 && now - conn->m_lastActiveTime >= server->m_idleTimeout)
+		{
+			ModBus_TCP_closeConnection(server, conn);
+		}
+	}
+}
+
+/** 配置ModBus TCP服务器 **/
+/*** 参数 ***
+** slave: 处理请求的从机实例
+** connections: 连接缓冲区
+** connectionCapacity: 连接缓冲区个数
+** 成功返回0, 失败返回-1; 未开启MODBUS_SLAVE时传入从机实例失败(ENOTSUP)
+***/
+int ModBus_TCP_setup(ModBus_TCP_Server_T* server, ModBus_TCP_Setting_T setting, ModBus_parameter* slave, ModBus_TCP_Connection_T* connections, size_t connectionCapacity)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int on = 1;
+	int err;
+
+	server->m_slave = slave;
+	server->m_framing = setting.framing;
+	server->m_connections = connections;
+	server->m_connectionCapacity = connectionCapacity;
+	server->m_maxConnections = setting.maxConnections;
+	if (server->m_maxConnections == 0 || server->m_maxConnections > connectionCapacity)
+	{
+		server->m_maxConnections = connectionCapacity;
+	}
+	server->m_connectionCount = 0;
+	for (size_t i = 0; i < connectionCapacity; i++) // 所有连接放入空闲链表
+	{
+		connections[i].m_fd = -1;
+		connections[i].m_generation = 0;
+		connections[i].m_nextFree = (i + 1 < connectionCapacity) ? (int)(i + 1) : -1;
+	}
+	server->m_freeHead = connectionCapacity > 0 ? 0 : -1;
+	server->m_idleTimeout = setting.idleTimeout;
+	server->m_lastIdleCheckTime = ModBus_millis();
+	server->m_requestCount = 0;
+	server->m_rejectedCount = 0;
+	server->m_replyDropCount = 0;
+	server->m_requestHandler = NULL;
+	server->m_requestContext = NULL;
+	server->m_epollFd = -1;
+	server->m_listenFd = -1;
+#ifndef MODBUS_SLAVE
+	if (slave != NULL) // 从机功能未编译, 无法应答请求; 只能绑定请求处理函数(如网关)
+	{
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+
+	server->m_listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->m_listenFd < 0)
+	{
+		return -1;
+	}
+	setsockopt(server->m_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(setting.port != 0 ? setting.port : MODBUS_TCP_DEFAULT_PORT);
+	addr.sin_addr.s_addr = htonl(setting.bindAddress);
+	if (bind(server->m_listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server->m_listenFd, SOMAXCONN) < 0)
+	{
+		goto fail;
+	}
+
+	server->m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (server->m_epollFd < 0)
+	{
+		goto fail;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // 监听socket的data为NULL, 以区分连接
+	if (epoll_ctl(server->m_epollFd, EPOLL_CTL_ADD, server->m_listenFd, &ev) < 0)
+	{
+		goto fail;
+	}
+	return 0;
+
+fail:
+	err = errno;
+	ModBus_TCP_close(server);
+	errno = err;
+	return -1;
+}
+
+/** 服务器loop函数 **/
+/*** 参数 ***
+** waitTime: 没有事件时最多等待的毫秒数
+** 返回处理的事件数, 出错返回-1
+***/
+int ModBus_TCP_Server_loop(ModBus_TCP_Server_T* server, int waitTime)
+{
+	struct epoll_event events[MODBUS_TCP_EVENTS_N];
+	int n = epoll_wait(server->m_epollFd, events, MODBUS_TCP_EVENTS_N, waitTime);
+	if (n < 0)
+	{
+		if (errno != EINTR)
+		{
+			return -1;
+		}
+		n = 0;
+	}
+	for (int i = 0; i < n; i++)
+	{
+		ModBus_TCP_Connection_T* conn = (ModBus_TCP_Connection_T*)events[i].data.ptr;
+		if (conn == NULL)
+		{
+			ModBus_TCP_accept(server);
+			continue;
+		}
+		if (conn->m_fd < 0) // 本轮中已被关闭
+		{
+			continue;
+		}
+		if (ModBus_TCP_service(server, conn, events[i].events) < 0)
+		{
+			ModBus_TCP_closeConnection(server, conn);
+		}
+	}
+	ModBus_TCP_checkIdle(server);
+	return n;
+}
+
+// 关闭服务器及所有连接
+void ModBus_TCP_close(ModBus_TCP_Server_T* server)
+{
+	for (size_t i = 0; i < server->m_connectionCapacity; i++)
+	{
+		if (server->m_connections[i].m_fd >= 0)
+		{
+			ModBus_TCP_closeConnection(server, server->m_connections + i);
+		}
+	}
+	if (server->m_epollFd >= 0)
+	{
+		close(server->m_epollFd);
+		server->m_epollFd = -1;
+	}
+	if (server->m_listenFd >= 0)
+	{
+		close(server->m_listenFd);
+		server->m_listenFd = -1;
+	}
+}
+
+/** 连接到ModBus TCP服务器或RTU over TCP设备 **/
+/*** 参数 ***
+** address: 服务器地址(主机字节序)
+** 返回已连接的非阻塞socket, 失败返回-1
+***/
+int ModBus_TCP_connect(u32 address, uint16_t port)
+{
+	struct sockaddr_in addr;
+	int on = 1;
+	int err;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(address);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+	{
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // 每帧一次write, 关闭Nagle算法降低延迟
+	return fd;
+}
+
+// 绑定请求处理函数
+void ModBus_TCP_attachRequestHandler(ModBus_TCP_Server_T* server, ModBus_TCP_RequestHandler_T handler, void* context)
+{
+	server->m_requestHandler = handler;
+	server->m_requestContext = context;
+}
+
+/** 异步发送返回帧 **/
+/*** 参数 ***
+** generation: 收到请求时连接的m_generation
+** 成功返回0, 连接已不存在或发送缓冲区满返回-1
+***/
+int ModBus_TCP_reply(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn, u32 generation, const byte* adu, size_t aduLen)
+{
+	if (conn->m_fd < 0 || conn->m_generation != generation)
+	{
+		return -1;
+	}
+	if (MODBUS_TCP_SEND_SIZE - conn->m_sendLen < aduLen) // 对方长时间不接收, 丢弃返回帧
+	{
+		server->m_replyDropCount++;
+		return -1;
+	}
+	memcpy(conn->m_sendBuffer + conn->m_sendLen, adu, aduLen);
+	conn->m_sendLen += aduLen;
+	if (ModBus_TCP_flush(conn) < 0)
+	{
+		ModBus_TCP_closeConnection(server, conn);
+		return -1;
+	}
+	ModBus_TCP_updateEvents(server, conn);
+	return 0;
+}
+
+// 继续处理暂停的连接
+void ModBus_TCP_resume(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn, u32 generation)
+{
+	if (conn->m_fd < 0 || conn->m_generation != generation || !conn->m_paused)
+	{
+		return;
+	}
+	if (ModBus_TCP_processAndFlush(server, conn) < 0)
+	{
+		ModBus_TCP_closeConnection(server, conn);
+	}
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+
+#define MODBUS_TCP_TEST_PORT 15026 // 测试端口
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_tcpRegisters[8];
+
+static size_t tcpGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 8)
+		return 0;
+	memcpy(data, g_tcpRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static size_t tcpSetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 8)
+		return 0;
+	memcpy(g_tcpRegisters + address, data, n * sizeof(uint16_t));
+	return n;
+}
+
+// 生成MBAP请求: 事务号, 单元号1, PDU
+static size_t tcpAdu(byte* adu, uint16_t transaction, const byte* pdu, size_t pduLen)
+{
+	adu[0] = transaction >> 8;
+	adu[1] = transaction & 0xFF;
+	adu[2] = 0;
+	adu[3] = 0;
+	adu[4] = (byte)((pduLen + 1) >> 8);
+	adu[5] = (byte)(pduLen + 1);
+	adu[6] = 1;
+	memcpy(adu + MODBUS_MBAP_SIZE, pdu, pduLen);
+	return MODBUS_MBAP_SIZE + pduLen;
+}
+
+// 运行服务器直到收到len字节; 连接被关闭时返回-1
+static int tcpReceive(ModBus_TCP_Server_T* server, int fd, byte* data, size_t len)
+{
+	size_t received = 0;
+	for (int i = 0; i < 200 && received < len; i++)
+	{
+		ssize_t n;
+		ModBus_TCP_Server_loop(server, 1);
+		n = recv(fd, data + received, len - received, MSG_DONTWAIT);
+		if (n == 0)
+			return -1;
+		if (n > 0)
+			received += (size_t)n;
+	}
+	return (int)received;
+}
+
+// 运行服务器直到连接被关闭
+static byte tcpClosed(ModBus_TCP_Server_T* server, int fd)
+{
+	byte data[8];
+	for (int i = 0; i < 200; i++)
+	{
+		ModBus_TCP_Server_loop(server, 1);
+		if (recv(fd, data, sizeof(data), MSG_DONTWAIT) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+// MBAP从机服务器: 正常和异常返回, 分段和多个请求在一次接收中, 协议错误, 连接数上限和空闲超时
+void tcp_unit_test()
+{
+	static ModBus_TCP_Connection_T connections[3];
+	ModBus_TCP_Server_T server;
+	ModBus_TCP_Setting_T tcpSetting = { 0 };
+	ModBus_parameter slave;
+	ModBus_Setting_T modbusSetting = { 0 };
+	const byte readPdu[] = { READ_REGISTER, 0, 2, 0, 2 };
+	const byte badAddressPdu[] = { READ_REGISTER, 0, 7, 0, 2 };
+	const byte unknownPdu[] = { 0x2B, 0x0E, 0x01, 0x00 };
+	const byte writePdu[] = { WRITE_SINGLE_REGISTER, 0, 5, 0xAB, 0xCD };
+	byte adu[3 * MODBUS_TCP_ADU_SIZE], response[3 * MODBUS_TCP_ADU_SIZE];
+	size_t len, total;
+	int fd, other, extra, ret;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = 4;
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_attachRegisterHandler(&slave, tcpGetReg, tcpSetReg);
+	for (uint16_t i = 0; i < 8; i++)
+		g_tcpRegisters[i] = (uint16_t)(0x0100 + i);
+
+	tcpSetting.port = MODBUS_TCP_TEST_PORT;
+	tcpSetting.bindAddress = INADDR_LOOPBACK;
+	tcpSetting.maxConnections = 2;
+	tcpSetting.idleTimeout = 1000;
+	ret = ModBus_TCP_setup(&server, tcpSetting, &slave, connections, 3);
+	assert(ret == 0);
+	fd = ModBus_TCP_connect(INADDR_LOOPBACK, MODBUS_TCP_TEST_PORT);
+	assert(fd >= 0);
+
+	// 读寄存器, 返回帧的事务号和单元号与请求相同
+	len = tcpAdu(adu, 0x1201, readPdu, sizeof(readPdu));
+	send(fd, adu, len, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, 13) == 13);
+	assert(response[0] == 0x12 && response[1] == 0x01 && response[5] == 7 && response[6] == 1);
+	assert(response[7] == READ_REGISTER && response[8] == 4 && response[9] == 0x01 && response[10] == 0x02 && response[12] == 0x03);
+
+	// 异常返回: 地址超出范围0x02, 未知功能码0x01
+	len = tcpAdu(adu, 0x1202, badAddressPdu, sizeof(badAddressPdu));
+	send(fd, adu, len, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, 9) == 9);
+	assert(response[1] == 0x02 && response[5] == 3 && response[7] == (READ_REGISTER | MODBUS_EXCEPTION_FLAG) && response[8] == EXCEPTION_ILLEGAL_DATA_ADDRESS);
+	len = tcpAdu(adu, 0x1203, unknownPdu, sizeof(unknownPdu));
+	send(fd, adu, len, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, 9) == 9);
+	assert(response[1] == 0x03 && response[7] == (0x2B | MODBUS_EXCEPTION_FLAG) && response[8] == EXCEPTION_ILLEGAL_FUNCTION);
+
+	// 一个请求分两次接收, MBAP报文头也被分开
+	len = tcpAdu(adu, 0x1204, writePdu, sizeof(writePdu));
+	send(fd, adu, 4, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, 1) == 0);
+	send(fd, adu + 4, len - 4, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, len) == (int)len && memcmp(response, adu, len) == 0 && g_tcpRegisters[5] == 0xABCD);
+
+	// 两个完整请求和第三个请求的前半部分在一次接收中, 前两个按顺序返回, 第三个接收完整后返回
+	total = tcpAdu(adu, 0x1205, readPdu, sizeof(readPdu));
+	total += tcpAdu(adu + total, 0x1206, unknownPdu, sizeof(unknownPdu));
+	len = tcpAdu(adu + total, 0x1207, writePdu, sizeof(writePdu));
+	send(fd, adu, total + 5, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, 13 + 9) == 13 + 9);
+	assert(response[1] == 0x05 && response[7] == READ_REGISTER && response[13 + 1] == 0x06 && response[13 + 8] == EXCEPTION_ILLEGAL_FUNCTION);
+	assert(tcpReceive(&server, fd, response, 1) == 0);
+	send(fd, adu + total + 5, len - 5, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, len) == (int)len && response[1] == 0x07 && response[7] == WRITE_SINGLE_REGISTER);
+	assert(server.m_requestCount == 7);
+
+	// 连接数上限: 第三个连接被关闭
+	other = ModBus_TCP_connect(INADDR_LOOPBACK, MODBUS_TCP_TEST_PORT);
+	extra = ModBus_TCP_connect(INADDR_LOOPBACK, MODBUS_TCP_TEST_PORT);
+	assert(other >= 0 && extra >= 0);
+	assert(tcpClosed(&server, extra) && server.m_rejectedCount == 1 && server.m_connectionCount == 2);
+	close(extra);
+
+	// 协议号不为0: 无法找到帧边界, 关闭连接
+	len = tcpAdu(adu, 0x1301, readPdu, sizeof(readPdu));
+	adu[3] = 1;
+	send(other, adu, len, MSG_NOSIGNAL);
+	assert(tcpClosed(&server, other) && server.m_connectionCount == 1);
+	close(other);
+
+	// 空闲超时: 有请求的连接保持, 超时未收到数据的连接被关闭
+	t += 600;
+	len = tcpAdu(adu, 0x1208, readPdu, sizeof(readPdu));
+	send(fd, adu, len, MSG_NOSIGNAL);
+	assert(tcpReceive(&server, fd, response, 13) == 13);
+	t += 600;
+	assert(tcpReceive(&server, fd, response, 1) == 0 && server.m_connectionCount == 1);
+	t += 600;
+	assert(tcpClosed(&server, fd) && server.m_connectionCount == 0);
+	close(fd);
+
+	printf("tcp_unit_test: requests %u, rejected %u\n", server.m_requestCount, server.m_rejectedCount);
+	ModBus_TCP_close(&server);
+}
+#endif // _UNIT_TEST
+
+#if defined(_BENCHMARK) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+
+#define MODBUS_TCP_BENCH_PORT 15020 // 测试端口
+#define MODBUS_TCP_BENCH_CLIENTS 64 // 回环客户端个数
+#define MODBUS_TCP_BENCH_SECONDS 2.0 // 测试时长
+
+static size_t tcpBenchGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	for (uint16_t i = 0; i < n; i++)
+	{
+		data[i] = (uint16_t)(address + i);
+	}
+	return n;
+}
+
+static double tcpBenchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 本机回环测试: 多个客户端各自保持一个未完成请求, 统计每秒处理的请求数
+void tcp_benchmark()
+{
+	static ModBus_TCP_Connection_T connections[MODBUS_TCP_BENCH_CLIENTS];
+	static ModBus_TCP_Server_T server;
+	static ModBus_parameter slave;
+	int clients[MODBUS_TCP_BENCH_CLIENTS];
+	byte waiting[MODBUS_TCP_BENCH_CLIENTS] = { 0 };
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_TCP_Setting_T tcpSetting = { 0 };
+	struct sockaddr_in addr;
+	u32 completed = 0;
+	uint16_t transaction = 0;
+	double begin, elapsed;
+
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_attachRegisterHandler(&slave, tcpBenchGetReg, NULL);
+
+	tcpSetting.port = MODBUS_TCP_BENCH_PORT;
+	tcpSetting.bindAddress = INADDR_LOOPBACK;
+	if (ModBus_TCP_setup(&server, tcpSetting, &slave, connections, MODBUS_TCP_BENCH_CLIENTS) < 0)
+	{
+		perror("ModBus_TCP_setup");
+		return;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(MODBUS_TCP_BENCH_PORT);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (int i = 0; i < MODBUS_TCP_BENCH_CLIENTS; i++)
+	{
+		int on = 1;
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		connect(clients[i], (struct sockaddr*)&addr, sizeof(addr));
+		setsockopt(clients[i], IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		fcntl(clients[i], F_SETFL, O_NONBLOCK);
+		ModBus_TCP_Server_loop(&server, 0);
+	}
+
+	begin = tcpBenchNow();
+	do
+	{
+		for (int i = 0; i < MODBUS_TCP_BENCH_CLIENTS; i++)
+		{
+			if (!waiting[i])
+			{
+				byte request[12] = { 0, 0, 0, 0, 0, 6, 0x01, READ_REGISTER, 0, 0, 0, MODBUS_REGISTER_LIMIT };
+				transaction++;
+				request[0] = (transaction >> 8) & 0x0FF;
+				request[1] = transaction & 0x0FF;
+				if (send(clients[i], request, sizeof(request), MSG_NOSIGNAL) == sizeof(request))
+				{
+					waiting[i] = 1;
+				}
+			}
+		}
+		ModBus_TCP_Server_loop(&server, 0);
+		for (int i = 0; i < MODBUS_TCP_BENCH_CLIENTS; i++)
+		{
+			byte response[MODBUS_TCP_ADU_SIZE];
+			if (waiting[i] && recv(clients[i], response, sizeof(response), 0) == MODBUS_MBAP_SIZE + 2 + MODBUS_REGISTER_LIMIT * 2)
+			{
+				waiting[i] = 0;
+				completed++;
+			}
+		}
+		elapsed = tcpBenchNow() - begin;
+	} while (elapsed < MODBUS_TCP_BENCH_SECONDS);
+
+	printf("tcp_benchmark: clients %d, requests %u, time %.3f s, %.0f req/s\n", MODBUS_TCP_BENCH_CLIENTS, completed, elapsed, completed / elapsed);
+
+	for (int i = 0; i < MODBUS_TCP_BENCH_CLIENTS; i++)
+	{
+		close(clients[i]);
+	}
+	ModBus_TCP_close(&server);
+}
+#endif // _BENCHMARK
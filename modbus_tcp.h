@@ -0,0 +1,135 @@
+#ifndef MOTECMODBUS_TCP_H_
+#define MOTECMODBUS_TCP_H_
+/**** ModBus TCP 从机服务器 (Linux) ****
+** 非阻塞socket + epoll, 单线程可服务数千个并发连接
+** MBAP报文头解析, 每个连接独立的接收状态
+** 请求在连接接收缓冲区中原地解析, 通过从机实例的寄存器读写函数(ModBus_attachRegisterHandler)处理
+** 也可绑定请求处理函数(ModBus_TCP_attachRequestHandler)异步处理请求, 比如转发到串口的网关(见 modbus_gateway.h)
+** RTU over TCP: 配置framing为MODBUS_TCP_FRAMING_RTU, 收发带CRC的RTU帧, 按功能码计算帧长度, 不依赖静默间隔
+****** 主机端调用ModBus_TCP_connect连接后, 用ModBus_Serial_attachFd(见 modbus_serial.h)绑定到RTU主机实例, 并调用ModBus_lengthFraming开启按长度分帧
+** 使用方法:
+****** 调用ModBus_setup/ModBus_attachRegisterHandler配置从机实例
+****** 调用ModBus_TCP_setup配置服务器, 传入连接缓冲区
+****** 循环调用ModBus_TCP_Server_loop
+*/
+
+#include "modbus.h"
+
+#define MODBUS_TCP_DEFAULT_PORT 502 // 默认端口
+#define MODBUS_MBAP_SIZE 7 // MBAP报文头长度: 事务号(2) 协议号(2) 长度(2) 单元号(1)
+#define MODBUS_TCP_ADU_SIZE (MODBUS_MBAP_SIZE + MODBUS_PDU_SIZE) // TCP数据包最大长度
+#define MODBUS_TCP_RECEIVE_SIZE (MODBUS_TCP_ADU_SIZE * 2) // 每个连接的接收缓冲区大小
+#define MODBUS_TCP_SEND_SIZE (MODBUS_TCP_ADU_SIZE * 2) // 每个连接的发送缓冲区大小
+#define MODBUS_TCP_EVENTS_N 64 // 每次epoll_wait最多处理的事件数
+
+struct __MODBUS_TCP_Server;
+struct __MODBUS_TCP_Connection;
+
+/** 请求处理函数指针类型 **/
+/*** 参数 ***
+** (void* context, server, conn, const byte* adu, size_t aduLen, byte* response)
+** adu: 完整的请求(MBAP报文头+PDU), 只在函数内有效
+** response: 立即返回时在此生成返回帧(MBAP报文头+PDU), 至少 MODBUS_TCP_ADU_SIZE 字节
+** 返回立即返回帧的长度; 0 不立即返回(稍后调用ModBus_TCP_reply); -1 忙, 请求留在接收缓冲区, 暂停处理此连接直到调用ModBus_TCP_resume
+***/
+typedef int(*ModBus_TCP_RequestHandler_T)(void*, struct __MODBUS_TCP_Server*, struct __MODBUS_TCP_Connection*, const byte*, size_t, byte*);
+
+typedef enum {
+	MODBUS_TCP_FRAMING_MBAP, // ModBus TCP: MBAP报文头+PDU
+	MODBUS_TCP_FRAMING_RTU, // RTU over TCP: 地址+PDU+CRC, 只使用从机实例处理请求
+} MODBUS_TCP_FRAMING_TYPE;
+
+typedef struct _MODBUS_TCP_SETTING_T { // ModBus TCP服务器配置信息类型
+	uint16_t port; // 监听端口, 0 使用默认端口502
+	u32 bindAddress; // 监听地址(主机字节序), 0 监听所有地址
+	size_t maxConnections; // 最大连接数, 0 或超过连接缓冲区个数时使用连接缓冲区个数
+	u32 idleTimeout; // 连接空闲超时时间(毫秒), 0 不超时
+	MODBUS_TCP_FRAMING_TYPE framing; // 帧格式, 默认MBAP
+} ModBus_TCP_Setting_T;
+
+typedef struct __MODBUS_TCP_Connection {
+	int m_fd; // socket, 未使用时为-1
+	int m_nextFree; // 空闲链表中下一个连接的序号
+	u32 m_generation; // 连接序号, 每次接收新连接加1, 用于识别异步返回时连接是否已被复用
+	u32 m_lastActiveTime; // 最近一次收到数据的时刻
+	u32 m_events; // 当前注册的epoll事件
+	byte m_paused; // 请求处理函数忙, 暂停处理接收的请求
+
+	byte m_receiveBuffer[MODBUS_TCP_RECEIVE_SIZE]; // 接收缓冲区, 请求在此原地解析
+	size_t m_receiveLen; // 接收缓冲区中的数据字节数
+
+	byte m_sendBuffer[MODBUS_TCP_SEND_SIZE]; // 发送缓冲区, 返回帧直接在此生成
+	size_t m_sendLen; // 发送缓冲区中的数据字节数
+	size_t m_sendOffset; // 已发送的字节数
+} ModBus_TCP_Connection_T;
+
+typedef struct __MODBUS_TCP_Server {
+	int m_listenFd; // 监听socket
+	int m_epollFd; // epoll
+	ModBus_parameter* m_slave; // 处理请求的从机实例
+	MODBUS_TCP_FRAMING_TYPE m_framing; // 帧格式
+	ModBus_TCP_RequestHandler_T m_requestHandler; // 请求处理函数, 设置后代替从机实例
+	void* m_requestContext; // 传给请求处理函数的上下文
+
+	ModBus_TCP_Connection_T* m_connections; // 连接缓冲区, 由调用者提供
+	size_t m_connectionCapacity; // 连接缓冲区个数
+	size_t m_maxConnections; // 最大连接数
+	size_t m_connectionCount; // 当前连接数
+	int m_freeHead; // 空闲连接链表头, -1表示无空闲连接
+
+	u32 m_idleTimeout; // 连接空闲超时时间
+	u32 m_lastIdleCheckTime; // 最近一次检查空闲连接的时刻
+
+	u32 m_requestCount; // 已处理的请求数
+	u32 m_rejectedCount; // 因连接数超限被拒绝的连接数
+	u32 m_replyDropCount; // 因发送缓冲区满而丢弃的异步返回帧数
+} ModBus_TCP_Server_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置ModBus TCP服务器 **/
+/*** 参数 ***
+** slave: 处理请求的从机实例, 需已绑定寄存器读写函数; 使用请求处理函数时可以为NULL
+** connections: 连接缓冲区, 个数决定最大可服务的连接数, 不在库内分配内存
+** connectionCapacity: 连接缓冲区个数
+** 成功返回0, 失败返回-1(errno为失败原因); 未开启MODBUS_SLAVE时传入从机实例返回-1(ENOTSUP), 只能使用请求处理函数
+** 既没有从机实例也没有绑定请求处理函数时, 收到请求即关闭连接
+***/
+int ModBus_TCP_setup(ModBus_TCP_Server_T* server, ModBus_TCP_Setting_T setting, ModBus_parameter* slave, ModBus_TCP_Connection_T* connections, size_t connectionCapacity);
+
+/** 服务器loop函数 **/
+/*** 参数 ***
+** waitTime: 没有事件时最多等待的毫秒数, 0 不等待, -1 一直等待
+** 返回处理的事件数, 出错返回-1
+***/
+int ModBus_TCP_Server_loop(ModBus_TCP_Server_T* server, int waitTime);
+
+// 关闭服务器及所有连接
+void ModBus_TCP_close(ModBus_TCP_Server_T* server);
+
+/** 连接到ModBus TCP服务器或RTU over TCP设备 **/
+/*** 参数 ***
+** address: 服务器地址(主机字节序), 如 INADDR_LOOPBACK
+** port: 端口
+** 返回已连接的非阻塞socket, 失败返回-1
+***/
+int ModBus_TCP_connect(u32 address, uint16_t port);
+
+// 绑定请求处理函数, 设置后代替从机实例处理请求, 传入NULL恢复
+void ModBus_TCP_attachRequestHandler(ModBus_TCP_Server_T* server, ModBus_TCP_RequestHandler_T handler, void* context);
+
+/** 异步发送返回帧 **/
+/*** 参数 ***
+** conn: 请求所在的连接
+** generation: 收到请求时连接的m_generation, 连接已关闭或被复用时不发送
+** adu: 返回帧(MBAP报文头+PDU)
+** 成功放入发送缓冲区返回0; 连接已不存在或发送缓冲区满(对方不接收)返回-1, 返回帧被丢弃
+***/
+int ModBus_TCP_reply(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn, u32 generation, const byte* adu, size_t aduLen);
+
+// 请求处理函数不再忙, 继续处理暂停的连接
+void ModBus_TCP_resume(ModBus_TCP_Server_T* server, ModBus_TCP_Connection_T* conn, u32 generation);
+
+/**************** 对外接口 END ***************/
+
+#endif
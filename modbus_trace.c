@@ -0,0 +1,429 @@
+#include "modbus_trace.h"
+#include <stdio.h>
+
+/** 配置跟踪缓冲区 **/
+/*** 参数 ***
+** events: 事件缓冲区
+** capacity: 事件个数, 必须是2的整数次幂
+***/
+byte ModBus_Trace_setup(ModBus_Trace_T* trace, ModBus_Trace_Event_T* events, size_t capacity)
+{
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+	{
+		return 0;
+	}
+	trace->m_events = events;
+	trace->m_capacityMask = (u32)(capacity - 1);
+	for (size_t i = 0; i < capacity; i++)
+	{
+		atomic_init(&events[i].m_sequence, 0u);
+	}
+	atomic_init(&trace->m_mask, MODBUS_TRACE_MASK_ALL);
+	atomic_init(&trace->m_head, 0u);
+	return 1;
+}
+
+// 设置记录的事件
+void ModBus_Trace_setMask(ModBus_Trace_T* trace, u32 mask)
+{
+	atomic_store_explicit(&trace->m_mask, mask, memory_order_relaxed);
+}
+
+// 写入一个事件: 取得位置后先标记为正在写入, 写完后设置序号, 读取者据此判断事件是否完整
+void ModBus_Trace_record(ModBus_Trace_T* trace, u8 source, MODBUS_TRACE_EVENT_TYPE event, uint16_t arg, u32 time)
+{
+	u32 position;
+	ModBus_Trace_Event_T* pEvent;
+	if ((atomic_load_explicit(&trace->m_mask, memory_order_relaxed) & MODBUS_TRACE_MASK(event)) == 0)
+	{
+		return;
+	}
+	position = atomic_fetch_add_explicit(&trace->m_head, 1u, memory_order_relaxed);
+	pEvent = trace->m_events + (position & trace->m_capacityMask);
+	atomic_store_explicit(&pEvent->m_sequence, 0u, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release); // 读取者看到新数据前先看到正在写入标记
+	pEvent->m_time = time;
+	pEvent->m_event = (u8)event;
+	pEvent->m_source = source;
+	pEvent->m_arg = arg;
+	atomic_store_explicit(&pEvent->m_sequence, position + 1u, memory_order_release);
+}
+
+// 实例绑定跟踪缓冲区, 未开启MODBUS_TRACE时不记录实例的事件
+void ModBus_attachTrace(ModBus_parameter* ModBus_para, ModBus_Trace_T* trace, u8 source)
+{
+#ifdef MODBUS_TRACE
+	ModBus_para->m_traceId = source;
+	ModBus_para->m_trace = trace;
+#endif
+}
+
+// 初始化读取位置
+void ModBus_Trace_Reader_init(const ModBus_Trace_T* trace, ModBus_Trace_Reader_T* reader)
+{
+	u32 head = atomic_load_explicit((atomic_uint*)&trace->m_head, memory_order_acquire);
+	reader->m_position = head > trace->m_capacityMask + 1u ? head - (trace->m_capacityMask + 1u) : 0;
+	reader->m_lostCount = 0;
+}
+
+/** 读取新事件 **/
+/*** 参数 ***
+** events: 读出的事件
+** maxCount: 最多读取个数
+***/
+size_t ModBus_Trace_read(const ModBus_Trace_T* trace, ModBus_Trace_Reader_T* reader, ModBus_Trace_Event_T* events, size_t maxCount)
+{
+	u32 head = atomic_load_explicit((atomic_uint*)&trace->m_head, memory_order_acquire);
+	u32 capacity = trace->m_capacityMask + 1u;
+	size_t n = 0;
+	if (head - reader->m_position > capacity) // 读取太慢, 最早的事件已被覆盖
+	{
+		reader->m_lostCount += head - reader->m_position - capacity;
+		reader->m_position = head - capacity;
+	}
+	while (n < maxCount && reader->m_position != head)
+	{
+		ModBus_Trace_Event_T* pEvent = trace->m_events + (reader->m_position & trace->m_capacityMask);
+		u32 expected = reader->m_position + 1u;
+		u32 sequence = atomic_load_explicit(&pEvent->m_sequence, memory_order_acquire);
+		u32 time;
+		u8 event, source;
+		uint16_t arg;
+		if (sequence == 0 || (int)(sequence - expected) < 0) // 正在写入, 下次读取
+		{
+			break;
+		}
+		if (sequence == expected)
+		{
+			time = pEvent->m_time;
+			event = pEvent->m_event;
+			source = pEvent->m_source;
+			arg = pEvent->m_arg;
+			atomic_thread_fence(memory_order_acquire);
+			sequence = atomic_load_explicit(&pEvent->m_sequence, memory_order_relaxed); // 读取期间未被覆盖才有效
+		}
+		reader->m_position++;
+		if (sequence != expected) // 已被之后的事件覆盖
+		{
+			reader->m_lostCount++;
+			continue;
+		}
+		atomic_init(&events[n].m_sequence, expected);
+		events[n].m_time = time;
+		events[n].m_event = event;
+		events[n].m_source = source;
+		events[n].m_arg = arg;
+		n++;
+	}
+	return n;
+}
+
+// 事件转换为一行文字
+size_t ModBus_Trace_format(const ModBus_Trace_Event_T* event, char* text, size_t size)
+{
+	static const char* const names[MODBUS_TRACE_EVENT_N] = {
+		"rx byte", "rx block", "frame start", "frame end", "check fail", "timeout", "tx", "response", "exception", "queue",
+	};
+	static const char* const argFormats[MODBUS_TRACE_EVENT_N] = {
+		"0x%02x", "%u bytes", "0x%02x", "%u bytes", "%u bytes", "frame %u", "%u bytes", "function 0x%02x", "code 0x%02x", "%u frames",
+	};
+	int len;
+	if (event->m_event >= MODBUS_TRACE_EVENT_N)
+	{
+		len = snprintf(text, size, "%10u [%u] event %u arg %u", event->m_time, event->m_source, event->m_event, event->m_arg);
+	}
+	else
+	{
+		len = snprintf(text, size, "%10u [%u] %-11s ", event->m_time, event->m_source, names[event->m_event]);
+		if (len > 0 && (size_t)len < size)
+		{
+			len += snprintf(text + len, size - len, argFormats[event->m_event], event->m_arg);
+		}
+	}
+	if (len < 0)
+	{
+		return 0;
+	}
+	return (size_t)len < size ? (size_t)len : size - 1;
+}
+
+/** 读取新事件并逐行输出 **/
+/*** 参数 ***
+** writeLine: 输出一行文字的函数
+***/
+size_t ModBus_Trace_dump(const ModBus_Trace_T* trace, ModBus_Trace_Reader_T* reader, void(*writeLine)(void*, const char*), void* context)
+{
+	ModBus_Trace_Event_T events[16];
+	char line[MODBUS_TRACE_LINE_SIZE];
+	size_t total = 0, n;
+	u32 lostCount = reader->m_lostCount;
+	do
+	{
+		n = ModBus_Trace_read(trace, reader, events, sizeof(events) / sizeof(events[0]));
+		if (reader->m_lostCount != lostCount)
+		{
+			snprintf(line, sizeof(line), "... %u events lost", reader->m_lostCount - lostCount);
+			(*writeLine)(context, line);
+			lostCount = reader->m_lostCount;
+		}
+		for (size_t i = 0; i < n; i++)
+		{
+			ModBus_Trace_format(events + i, line, sizeof(line));
+			(*writeLine)(context, line);
+		}
+		total += n;
+	} while (n == sizeof(events) / sizeof(events[0]));
+	return total;
+}
+
+#if defined(_UNIT_TEST) && defined(MODBUS_TRACE) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <pthread.h>
+
+#define MODBUS_TRACE_TEST_THREAD_N 4 // 并发写入线程数
+#define MODBUS_TRACE_TEST_EVENT_N 200000 // 每个线程写入的事件数
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_traceRegisters[4] = { 0x11, 0x22, 0x33, 0x44 };
+static byte g_traceCorrupt; // 下一个发送的帧最后一个字节取反一次
+
+static size_t traceGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 4)
+		return 0;
+	memcpy(data, g_traceRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static void traceSend(void* context, byte* data, size_t len)
+{
+	if (context == NULL) // 从机不应答
+		return;
+	if (g_traceCorrupt)
+	{
+		g_traceCorrupt = 0;
+		data[len - 1] ^= 0xFF;
+	}
+	for (size_t i = 0; i < len; i++)
+		ModBus_readByteFromOuter((ModBus_parameter*)context, data[i]);
+}
+
+static void traceWriteLine(void* context, const char* line)
+{
+	size_t* lineCount = (size_t*)context;
+	(*lineCount)++;
+	printf("trace: %s\n", line);
+}
+
+// 查找事件, 返回序号, 没有返回-1
+static int traceFind(const ModBus_Trace_Event_T* events, size_t n, u8 source, MODBUS_TRACE_EVENT_TYPE event, size_t from)
+{
+	for (size_t i = from; i < n; i++)
+		if (events[i].m_source == source && events[i].m_event == event)
+			return (int)i;
+	return -1;
+}
+
+// 多线程写入: 每个事件的时间为线程内计数, 参数为计数低16位, 读取时检查事件完整
+static ModBus_Trace_T g_traceConcurrent;
+static atomic_int g_traceWriting;
+
+static void* traceWriter(void* arg)
+{
+	u8 source = (u8)(uintptr_t)arg;
+	for (u32 i = 0; i < MODBUS_TRACE_TEST_EVENT_N; i++)
+		ModBus_Trace_record(&g_traceConcurrent, source, MODBUS_TRACE_RX_BYTE, (uint16_t)i, i);
+	atomic_fetch_sub(&g_traceWriting, 1);
+	return NULL;
+}
+
+void trace_unit_test()
+{
+	static ModBus_Trace_Event_T buffer[256];
+	static ModBus_Trace_Event_T concurrentBuffer[1024];
+	static ModBus_Trace_Event_T events[256];
+	ModBus_Trace_T trace;
+	ModBus_Trace_Reader_T reader;
+	ModBus_parameter master, slave;
+	ModBus_Setting_T modbusSetting = { 0 };
+	size_t n, lineCount = 0;
+	int i, start, end;
+
+	assert(sizeof(ModBus_Trace_Event_T) == 12);
+	assert(!ModBus_Trace_setup(&trace, buffer, 100));
+	assert(ModBus_Trace_setup(&trace, buffer, 256));
+	ModBus_Trace_Reader_init(&trace, &reader);
+
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(&master, modbusSetting);
+	ModBus_setTimeout(&master, 5, 50);
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_setTimeout(&slave, 5, 50);
+	ModBus_attachRegisterHandler(&slave, traceGetReg, NULL);
+	ModBus_attachSendHandler(&master, traceSend, &slave);
+	ModBus_attachSendHandler(&slave, traceSend, &master);
+	ModBus_attachTrace(&master, &trace, 1);
+	ModBus_attachTrace(&slave, &trace, 2);
+
+	// 读寄存器: 主机入队/发送, 从机逐字节接收/帧开始/帧结束/发送, 主机收到返回帧
+	ModBus_getRegister(&master, 0, 2, NULL);
+	for (i = 0; i < 20; i++)
+	{
+		ModBus_Master_loop(&master);
+		ModBus_Slave_loop(&slave);
+		t += 1;
+	}
+	n = ModBus_Trace_read(&trace, &reader, events, 256);
+	assert(traceFind(events, n, 1, MODBUS_TRACE_QUEUE, 0) == 0 && events[0].m_arg == 1);
+	assert(traceFind(events, n, 1, MODBUS_TRACE_TX, 0) == 1 && events[1].m_arg == 8);
+	assert(events[2].m_source == 2 && events[2].m_event == MODBUS_TRACE_RX_BYTE && events[2].m_arg == 0x01);
+	assert(events[3].m_arg == READ_REGISTER);
+	start = traceFind(events, n, 2, MODBUS_TRACE_FRAME_START, 0);
+	end = traceFind(events, n, 2, MODBUS_TRACE_FRAME_END, 0);
+	assert(start > 9 && end > start && events[end].m_arg == 7); // 8字节请求去除校验码
+	assert(traceFind(events, n, 2, MODBUS_TRACE_TX, end) > end);
+	i = traceFind(events, n, 1, MODBUS_TRACE_RESPONSE, 0);
+	assert(i > end && events[i].m_arg == READ_REGISTER && traceFind(events, n, 1, MODBUS_TRACE_CHECK_FAIL, 0) < 0);
+	assert(ModBus_Trace_dump(&trace, &reader, traceWriteLine, &lineCount) == 0); // 已全部读出
+
+	// 请求帧校验失败: 从机丢弃, 主机等待返回帧超时
+	g_traceCorrupt = 1;
+	ModBus_getRegister(&master, 0, 1, NULL);
+	for (i = 0; i < 100; i++)
+	{
+		ModBus_Master_loop(&master);
+		ModBus_Slave_loop(&slave);
+		t += 1;
+	}
+	{
+		ModBus_Trace_Reader_T dumpReader = reader;
+		n = ModBus_Trace_read(&trace, &reader, events, 256);
+		i = traceFind(events, n, 2, MODBUS_TRACE_CHECK_FAIL, 0);
+		assert(i >= 0 && events[i].m_arg == 8 && traceFind(events, n, 2, MODBUS_TRACE_TX, 0) < 0);
+		assert(traceFind(events, n, 1, MODBUS_TRACE_TIMEOUT, i) > i);
+		assert(traceFind(events, n, 1, MODBUS_TRACE_RESPONSE, 0) < 0);
+		lineCount = 0;
+		assert(ModBus_Trace_dump(&trace, &dumpReader, traceWriteLine, &lineCount) == n && lineCount == n); // 转换为文字输出
+	}
+
+	// 关闭逐字节事件; 解除绑定后不再记录
+	ModBus_Trace_setMask(&trace, MODBUS_TRACE_MASK_ALL & ~MODBUS_TRACE_MASK(MODBUS_TRACE_RX_BYTE));
+	ModBus_getRegister(&master, 1, 1, NULL);
+	for (i = 0; i < 20; i++)
+	{
+		ModBus_Master_loop(&master);
+		ModBus_Slave_loop(&slave);
+		t += 1;
+	}
+	n = ModBus_Trace_read(&trace, &reader, events, 256);
+	assert(n > 0 && traceFind(events, n, 2, MODBUS_TRACE_RX_BYTE, 0) < 0 && traceFind(events, n, 1, MODBUS_TRACE_RESPONSE, 0) >= 0);
+	ModBus_attachTrace(&master, NULL, 0);
+	ModBus_attachTrace(&slave, NULL, 0);
+	ModBus_getRegister(&master, 1, 1, NULL);
+	for (i = 0; i < 20; i++)
+	{
+		ModBus_Master_loop(&master);
+		ModBus_Slave_loop(&slave);
+		t += 1;
+	}
+	assert(ModBus_Trace_read(&trace, &reader, events, 256) == 0);
+
+	// 写满后覆盖最早的事件, 读取时计入丢失个数
+	ModBus_Trace_setMask(&trace, MODBUS_TRACE_MASK_ALL);
+	for (u32 k = 0; k < 300; k++)
+		ModBus_Trace_record(&trace, 3, MODBUS_TRACE_RX_BYTE, (uint16_t)k, k);
+	n = ModBus_Trace_read(&trace, &reader, events, 256);
+	assert(n == 256 && reader.m_lostCount == 44 && events[0].m_arg == 44 && events[255].m_arg == 299);
+
+	// 多线程同时写入, 读取线程同时读取: 读出的事件都完整, 同一线程的事件按顺序
+	{
+		pthread_t threads[MODBUS_TRACE_TEST_THREAD_N];
+		u32 last[MODBUS_TRACE_TEST_THREAD_N];
+		u32 readCount = 0;
+		ModBus_Trace_setup(&g_traceConcurrent, concurrentBuffer, 1024);
+		ModBus_Trace_Reader_init(&g_traceConcurrent, &reader);
+		atomic_store(&g_traceWriting, MODBUS_TRACE_TEST_THREAD_N);
+		for (int k = 0; k < MODBUS_TRACE_TEST_THREAD_N; k++)
+		{
+			last[k] = 0xFFFFFFFFu;
+			pthread_create(threads + k, NULL, traceWriter, (void*)(uintptr_t)k);
+		}
+		for (;;)
+		{
+			int writing = atomic_load(&g_traceWriting);
+			n = ModBus_Trace_read(&g_traceConcurrent, &reader, events, 256);
+			for (size_t k = 0; k < n; k++)
+			{
+				u8 source = events[k].m_source;
+				assert(source < MODBUS_TRACE_TEST_THREAD_N && events[k].m_event == MODBUS_TRACE_RX_BYTE);
+				assert((events[k].m_time & 0xFFFF) == events[k].m_arg);
+				assert(last[source] == 0xFFFFFFFFu || events[k].m_time > last[source]);
+				last[source] = events[k].m_time;
+			}
+			readCount += (u32)n;
+			if (writing == 0 && n == 0)
+				break;
+		}
+		for (int k = 0; k < MODBUS_TRACE_TEST_THREAD_N; k++)
+		{
+			pthread_join(threads[k], NULL);
+		}
+		assert(readCount + reader.m_lostCount == MODBUS_TRACE_TEST_THREAD_N * MODBUS_TRACE_TEST_EVENT_N); // 每个事件读出或计入丢失
+		printf("trace_unit_test: %d threads wrote %u events, read %u, overwritten %u\n", MODBUS_TRACE_TEST_THREAD_N,
+			(unsigned)(MODBUS_TRACE_TEST_THREAD_N * MODBUS_TRACE_TEST_EVENT_N), readCount, reader.m_lostCount);
+	}
+}
+#endif // _UNIT_TEST
+
+#if defined(_BENCHMARK)
+#include <time.h>
+
+#define MODBUS_TRACE_BENCH_BYTE_N 10000000 // 每种情况接收的字节数
+
+static double traceBenchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// 接收中断路径的开销: 不绑定, 绑定但关闭逐字节事件, 记录逐字节事件; 以及单独写入一个事件
+void trace_benchmark()
+{
+	static ModBus_Trace_Event_T buffer[4096];
+	static ModBus_parameter modbus;
+	ModBus_Trace_T trace;
+	ModBus_Setting_T modbusSetting = { 0 };
+	const char* names[3] = { "untraced", "masked", "traced" };
+	double seconds[4];
+
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	ModBus_setup(&modbus, modbusSetting);
+	ModBus_Trace_setup(&trace, buffer, 4096);
+	for (int mode = 0; mode < 3; mode++)
+	{
+		double start;
+		ModBus_attachTrace(&modbus, mode == 0 ? NULL : &trace, 1);
+		ModBus_Trace_setMask(&trace, mode == 1 ? MODBUS_TRACE_MASK_ALL & ~MODBUS_TRACE_MASK(MODBUS_TRACE_RX_BYTE) : MODBUS_TRACE_MASK_ALL);
+		start = traceBenchNow();
+		for (u32 i = 0; i < MODBUS_TRACE_BENCH_BYTE_N; i++)
+		{
+			ModBus_readByteFromOuter(&modbus, (byte)i);
+			modbus.m_pBeginReceiveBufferTmp = modbus.m_pEndReceiveBufferTmp; // 代替loop取出数据
+		}
+		seconds[mode] = traceBenchNow() - start;
+	}
+	{
+		double start = traceBenchNow();
+		for (u32 i = 0; i < MODBUS_TRACE_BENCH_BYTE_N; i++)
+			ModBus_Trace_record(&trace, 1, MODBUS_TRACE_TX, (uint16_t)i, i);
+		seconds[3] = traceBenchNow() - start;
+	}
+	for (int mode = 0; mode < 3; mode++)
+		printf("trace_benchmark: readByteFromOuter %s %.1f ns/byte\n", names[mode], seconds[mode] * 1e9 / MODBUS_TRACE_BENCH_BYTE_N);
+	printf("trace_benchmark: record %.1f ns/event\n", seconds[3] * 1e9 / MODBUS_TRACE_BENCH_BYTE_N);
+}
+#endif // _BENCHMARK
@@ -0,0 +1,103 @@
+#ifndef MOTECMODBUS_TRACE_H_
+#define MOTECMODBUS_TRACE_H_
+/**** ModBus 二进制跟踪缓冲区 ****
+** 代替收发路径(包括接收中断)中的printf: 只写入定长的二进制事件(12字节), 不格式化, 不加锁, 不分配内存
+** 事件: 接收字节, 帧开始/结束, 校验失败, 等待返回帧超时, 发送, 返回帧, 异常码, 指令入队
+** 多个实例(可在不同线程/中断中)写入同一缓冲区, 写满后覆盖最早的事件
+** 读取和转换为文字(ModBus_Trace_read/ModBus_Trace_dump)在其他线程或空闲时进行, 不影响收发
+** 使用方法:
+****** 在 modbus.h 中开启 MODBUS_TRACE(默认开启); 实例未绑定跟踪缓冲区时只多一次判断
+****** 调用ModBus_Trace_setup配置, 传入事件缓冲区
+****** 调用ModBus_attachTrace将实例绑定到跟踪缓冲区, 传入实例编号(输出时区分实例)
+****** 需要时调用ModBus_Trace_setMask关闭部分事件, 如逐字节接收事件
+****** 调用ModBus_Trace_dump读取新事件并逐行输出文字
+*/
+
+#include "modbus.h"
+#include <stdatomic.h>
+
+typedef enum {
+	MODBUS_TRACE_RX_BYTE = 0, // 接收一个字节(ModBus_readByteFromOuter), 参数为字节值
+	MODBUS_TRACE_RX_BLOCK, // 接收多个字节(ModBus_readBytesFromOuter), 参数为字节数
+	MODBUS_TRACE_FRAME_START, // 检测到帧起始, 参数为起始字节
+	MODBUS_TRACE_FRAME_END, // 接收到完整的帧, 参数为帧长度(不含校验码)
+	MODBUS_TRACE_CHECK_FAIL, // CRC/LRC校验失败, 丢弃帧, 参数为帧长度
+	MODBUS_TRACE_TIMEOUT, // 主机等待返回帧超时, 参数为指令序号
+	MODBUS_TRACE_TX, // 发送帧, 参数为字节数
+	MODBUS_TRACE_RESPONSE, // 主机收到返回帧, 参数为功能码
+	MODBUS_TRACE_EXCEPTION, // 主机收到异常返回帧, 参数为异常码
+	MODBUS_TRACE_QUEUE, // 主机指令放入缓存, 参数为缓存中的指令个数
+	MODBUS_TRACE_EVENT_N
+} MODBUS_TRACE_EVENT_TYPE;
+
+#define MODBUS_TRACE_MASK_ALL ((1u << MODBUS_TRACE_EVENT_N) - 1u) // 全部事件
+#define MODBUS_TRACE_MASK(event) (1u << (event)) // 单个事件
+#define MODBUS_TRACE_LINE_SIZE 64 // 一个事件转换为文字的最大长度
+
+typedef struct _MODBUS_TRACE_EVENT_T { // 事件记录
+	atomic_uint m_sequence; // 写入位置+1, 写完后设置; 0表示正在写入
+	u32 m_time; // millis() 时间
+	u8 m_event; // 事件类型, MODBUS_TRACE_EVENT_TYPE
+	u8 m_source; // 实例编号, 见 ModBus_attachTrace
+	uint16_t m_arg; // 参数, 含义见事件类型
+} ModBus_Trace_Event_T;
+
+typedef struct __MODBUS_Trace {
+	atomic_uint m_head; // 下一个写入位置, 所有写入者共用
+	atomic_uint m_mask; // 记录的事件, MODBUS_TRACE_MASK 组合
+	ModBus_Trace_Event_T* m_events; // 事件缓冲区, 由调用者提供
+	u32 m_capacityMask; // 容量-1
+} ModBus_Trace_T;
+
+typedef struct _MODBUS_TRACE_READER_T { // 读取位置, 每个读取者一个
+	u32 m_position; // 下一个读取的位置
+	u32 m_lostCount; // 读取前已被覆盖的事件数
+} ModBus_Trace_Reader_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置跟踪缓冲区 **/
+/*** 参数 ***
+** events: 事件缓冲区, 每个事件12字节
+** capacity: 事件个数, 必须是2的整数次幂
+** 成功返回1, 容量不是2的整数次幂返回0
+***/
+byte ModBus_Trace_setup(ModBus_Trace_T* trace, ModBus_Trace_Event_T* events, size_t capacity);
+
+// 设置记录的事件(MODBUS_TRACE_MASK 组合), 默认全部记录
+void ModBus_Trace_setMask(ModBus_Trace_T* trace, u32 mask);
+
+// 写入一个事件, 任意线程和中断中可调用; 一般由协议内部调用
+void ModBus_Trace_record(ModBus_Trace_T* trace, u8 source, MODBUS_TRACE_EVENT_TYPE event, uint16_t arg, u32 time);
+
+/** 实例绑定跟踪缓冲区 **/
+/*** 参数 ***
+** trace: 跟踪缓冲区, 传入NULL解除绑定
+** source: 实例编号, 记录在每个事件中
+***/
+void ModBus_attachTrace(ModBus_parameter* ModBus_para, ModBus_Trace_T* trace, u8 source);
+
+// 初始化读取位置, 从缓冲区中现存最早的事件开始读取
+void ModBus_Trace_Reader_init(const ModBus_Trace_T* trace, ModBus_Trace_Reader_T* reader);
+
+/** 读取新事件 **/
+/*** 参数 ***
+** events: 读出的事件
+** maxCount: 最多读取个数
+** 返回读取个数; 正在写入的事件及之后的事件下次读取
+***/
+size_t ModBus_Trace_read(const ModBus_Trace_T* trace, ModBus_Trace_Reader_T* reader, ModBus_Trace_Event_T* events, size_t maxCount);
+
+// 事件转换为一行文字(不含换行), 返回文字长度
+size_t ModBus_Trace_format(const ModBus_Trace_Event_T* event, char* text, size_t size);
+
+/** 读取新事件并逐行输出 **/
+/*** 参数 ***
+** writeLine: 输出一行文字的函数, 函数参数(上下文, 文字)
+** 返回输出的事件个数; 有事件被覆盖时先输出一行丢失个数
+***/
+size_t ModBus_Trace_dump(const ModBus_Trace_T* trace, ModBus_Trace_Reader_T* reader, void(*writeLine)(void*, const char*), void* context);
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,422 @@
+#include "modbus_udp.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// 等待socket可读, 超时返回0
+static int ModBus_UDP_wait(int fd, int waitTime)
+{
+	struct pollfd pfd;
+	int ret;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do
+	{
+		ret = poll(&pfd, 1, waitTime);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+#ifdef MODBUS_SLAVE
+
+/** 配置ModBus UDP服务器 **/
+/*** 参数 ***
+** slave: 处理请求的从机实例
+** 成功返回0, 失败返回-1
+***/
+int ModBus_UDP_setup(ModBus_UDP_Server_T* server, ModBus_UDP_Setting_T setting, ModBus_parameter* slave)
+{
+	struct sockaddr_in addr;
+	int err;
+
+	server->m_slave = slave;
+	server->m_requestCount = 0;
+	server->m_errorCount = 0;
+	server->m_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->m_fd < 0)
+	{
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(setting.port != 0 ? setting.port : MODBUS_UDP_DEFAULT_PORT);
+	addr.sin_addr.s_addr = htonl(setting.bindAddress);
+	if (bind(server->m_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+	{
+		err = errno;
+		ModBus_UDP_close(server);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/** 服务器loop函数 **/
+/*** 参数 ***
+** waitTime: 没有请求时最多等待的毫秒数
+** 返回处理的请求数, 出错返回-1
+***/
+int ModBus_UDP_Server_loop(ModBus_UDP_Server_T* server, int waitTime)
+{
+	byte adu[MODBUS_UDP_ADU_SIZE];
+	int handled = 0;
+	if (ModBus_UDP_wait(server->m_fd, waitTime) < 0)
+	{
+		return -1;
+	}
+	while (handled < MODBUS_UDP_BATCH_N)
+	{
+		struct sockaddr_in from;
+		socklen_t fromLen = sizeof(from);
+		size_t length, responseLen;
+		ssize_t n = recvfrom(server->m_fd, adu, sizeof(adu), 0, (struct sockaddr*)&from, &fromLen);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			break; // EAGAIN: 没有更多请求
+		}
+		length = ((size_t)adu[4] << 8) + adu[5]; // 单元号 + PDU 长度
+		if (n < MODBUS_UDP_MBAP_SIZE + 1 || adu[2] != 0 || adu[3] != 0 || length < 2 || (size_t)n != 6 + length) // 一个数据报必须正好是一个ADU
+		{
+			server->m_errorCount++;
+			continue;
+		}
+		// 返回帧原地生成, 覆盖请求的PDU
+		responseLen = ModBus_Slave_handlePDU(server->m_slave, adu + MODBUS_UDP_MBAP_SIZE, length - 1, adu + MODBUS_UDP_MBAP_SIZE);
+		handled++;
+		server->m_requestCount++;
+		if (responseLen == 0)
+		{
+			continue;
+		}
+		adu[4] = ((responseLen + 1) >> 8) & 0x0FF; // 长度高位
+		adu[5] = (responseLen + 1) & 0x0FF; // 长度低位
+		sendto(server->m_fd, adu, MODBUS_UDP_MBAP_SIZE + responseLen, MSG_DONTWAIT, (struct sockaddr*)&from, fromLen); // 发送失败与丢包相同, 由主机重发
+	}
+	return handled;
+}
+
+// 关闭服务器
+void ModBus_UDP_close(ModBus_UDP_Server_T* server)
+{
+	if (server->m_fd >= 0)
+	{
+		close(server->m_fd);
+		server->m_fd = -1;
+	}
+}
+
+#endif // MODBUS_SLAVE
+
+#ifdef MODBUS_MASTER
+#include "modbus_queue.h"
+
+// 结束等待返回的指令
+static void ModBus_UDP_complete(ModBus_UDP_Client_T* client, ModBus_UDP_Pending_T* pending, ModBus_Result_T* result)
+{
+	ModBus_Request_T request = pending->m_request; // 回调函数中可能发送新指令并复用此位置
+	pending->m_active = 0;
+	client->m_pendingN--;
+	result->index = (u8)pending->m_transaction;
+	ModBus_deliverResult(request.resultHandler, request.context, request.completionQueue, result);
+}
+
+/** 连接ModBus UDP服务器 **/
+/*** 参数 ***
+** address: 服务器地址(主机字节序)
+** unit: MBAP单元号
+** 成功返回0, 失败返回-1
+***/
+int ModBus_UDP_Client_open(ModBus_UDP_Client_T* client, u32 address, uint16_t port, uint8_t unit, u32 timeout)
+{
+	struct sockaddr_in addr;
+	int err;
+
+	client->m_unit = unit;
+	client->m_timeout = timeout != 0 ? timeout : MODBUS_UDP_DEFAULT_TIMEOUT;
+	client->m_nextTransaction = 1;
+	client->m_pendingN = 0;
+	for (size_t i = 0; i < MODBUS_UDP_PENDING_N; i++)
+	{
+		client->m_pending[i].m_active = 0;
+	}
+	client->m_sentCount = 0;
+	client->m_timeoutCount = 0;
+	client->m_unmatchedCount = 0;
+
+	client->m_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (client->m_fd < 0)
+	{
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port != 0 ? port : MODBUS_UDP_DEFAULT_PORT);
+	addr.sin_addr.s_addr = htonl(address);
+	if (connect(client->m_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) // 只接收服务器的数据报
+	{
+		err = errno;
+		close(client->m_fd);
+		client->m_fd = -1;
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+/** 发送指令 **/
+/*** 参数 ***
+** request: 指令描述
+** 发送返回1, 否则结束指令并返回0
+***/
+byte ModBus_UDP_request(ModBus_UDP_Client_T* client, const ModBus_Request_T* request)
+{
+	byte adu[MODBUS_UDP_ADU_SIZE];
+	ModBus_UDP_Pending_T* pending = NULL;
+	ModBus_Result_T result;
+	size_t pduLen = ModBus_Master_buildPDU(request, adu + MODBUS_UDP_MBAP_SIZE);
+
+	for (size_t i = 0; pduLen > 0 && i < MODBUS_UDP_PENDING_N; i++)
+	{
+		if (!client->m_pending[i].m_active)
+		{
+			pending = client->m_pending + i;
+			break;
+		}
+	}
+	if (pending == NULL) // 参数无效, 或等待返回的指令已满
+	{
+		result.index = 0;
+		result.status = pduLen == 0 ? MODBUS_STATUS_INVALID : MODBUS_STATUS_DROPPED;
+		result.type = request->type;
+		result.address = request->address;
+		result.count = 0;
+		result.data = NULL;
+		result.exception = 0;
+		ModBus_deliverResult(request->resultHandler, request->context, request->completionQueue, &result);
+		return 0;
+	}
+
+	pending->m_transaction = client->m_nextTransaction++;
+	adu[0] = (pending->m_transaction >> 8) & 0x0FF; // 事务号
+	adu[1] = pending->m_transaction & 0x0FF;
+	adu[2] = adu[3] = 0; // 协议号
+	adu[4] = ((pduLen + 1) >> 8) & 0x0FF; // 长度
+	adu[5] = (pduLen + 1) & 0x0FF;
+	adu[6] = request->unit != 0 ? request->unit : client->m_unit; // 单元号
+	pending->m_request = *request;
+	pending->m_time = ModBus_millis();
+	pending->m_active = 1;
+	client->m_pendingN++;
+	client->m_sentCount++;
+	send(client->m_fd, adu, MODBUS_UDP_MBAP_SIZE + pduLen, MSG_DONTWAIT); // 发送失败与丢包相同, 超时结束
+	return 1;
+}
+
+/** 主机loop函数 **/
+/*** 参数 ***
+** waitTime: 没有返回帧时最多等待的毫秒数
+** 返回结束的指令数
+***/
+int ModBus_UDP_Client_loop(ModBus_UDP_Client_T* client, int waitTime)
+{
+	byte adu[MODBUS_UDP_ADU_SIZE];
+	uint16_t data[MODBUS_REGISTER_LIMIT];
+	ModBus_Result_T result;
+	int completed = 0;
+	u32 now;
+
+	if (client->m_pendingN > 0 && ModBus_UDP_wait(client->m_fd, waitTime) > 0)
+	{
+		for (int k = 0; k < MODBUS_UDP_BATCH_N; k++)
+		{
+			uint16_t transaction;
+			size_t i;
+			ssize_t n = recv(client->m_fd, adu, sizeof(adu), 0);
+			if (n < 0)
+			{
+				if (errno == EINTR || errno == ECONNREFUSED) // ECONNREFUSED: 服务器未运行(ICMP端口不可达), 指令超时结束
+				{
+					continue;
+				}
+				break;
+			}
+			if (n < MODBUS_UDP_MBAP_SIZE + 2 || (size_t)n != 6 + (((size_t)adu[4] << 8) + adu[5]))
+			{
+				client->m_unmatchedCount++;
+				continue;
+			}
+			transaction = ((uint16_t)adu[0] << 8) + adu[1];
+			for (i = 0; i < MODBUS_UDP_PENDING_N; i++)
+			{
+				ModBus_UDP_Pending_T* pending = client->m_pending + i;
+				if (pending->m_active && pending->m_transaction == transaction
+					&& ModBus_Master_parsePDU(&pending->m_request, adu + MODBUS_UDP_MBAP_SIZE, (size_t)n - MODBUS_UDP_MBAP_SIZE, &result, data) != MODBUS_STATUS_INVALID)
+				{
+					ModBus_UDP_complete(client, pending, &result);
+					completed++;
+					break;
+				}
+			}
+			if (i == MODBUS_UDP_PENDING_N) // 超时后到达的返回帧
+			{
+				client->m_unmatchedCount++;
+			}
+		}
+	}
+
+	now = ModBus_millis();
+	for (size_t i = 0; i < MODBUS_UDP_PENDING_N && client->m_pendingN > 0; i++)
+	{
+		ModBus_UDP_Pending_T* pending = client->m_pending + i;
+		if (pending->m_active && now - pending->m_time >= client->m_timeout)
+		{
+			result.status = MODBUS_STATUS_TIMEOUT;
+			result.type = pending->m_request.type;
+			result.address = pending->m_request.address;
+			result.count = 0;
+			result.data = NULL;
+			result.exception = 0;
+			client->m_timeoutCount++;
+			ModBus_UDP_complete(client, pending, &result);
+			completed++;
+		}
+	}
+	return completed;
+}
+
+// 关闭客户端
+void ModBus_UDP_Client_close(ModBus_UDP_Client_T* client)
+{
+	if (client->m_fd >= 0)
+	{
+		close(client->m_fd);
+		client->m_fd = -1;
+	}
+	client->m_pendingN = 0;
+	for (size_t i = 0; i < MODBUS_UDP_PENDING_N; i++)
+	{
+		client->m_pending[i].m_active = 0;
+	}
+}
+
+#endif // MODBUS_MASTER
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+
+#define MODBUS_UDP_TEST_PORT 15022 // 测试端口
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+static uint16_t g_udpRegisters[16];
+static ModBus_Result_T g_udpResults[MODBUS_UDP_PENDING_N];
+static uint16_t g_udpData[MODBUS_UDP_PENDING_N];
+static size_t g_udpResultN = 0;
+
+static size_t udpGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(data, g_udpRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static size_t udpSetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(g_udpRegisters + address, data, n * sizeof(uint16_t));
+	return n;
+}
+
+static void udpResult(void* context, const ModBus_Result_T* result)
+{
+	(void)context;
+	g_udpResults[g_udpResultN] = *result;
+	g_udpData[g_udpResultN] = result->data != NULL ? result->data[0] : 0;
+	g_udpResultN++;
+}
+
+// 本机回环: 多个指令同时等待返回, 异常码, 服务器关闭后超时
+void udp_unit_test()
+{
+	ModBus_parameter slave;
+	ModBus_UDP_Server_T server;
+	ModBus_UDP_Client_T client;
+	ModBus_Setting_T modbusSetting = { 0 };
+	ModBus_UDP_Setting_T udpSetting = { 0 };
+	ModBus_Request_T request = { 0 };
+	int ret;
+
+	for (uint16_t i = 0; i < 16; i++)
+		g_udpRegisters[i] = 0x200 + i;
+	modbusSetting.address = 0x01;
+	modbusSetting.frameType = RTU;
+	modbusSetting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(&slave, modbusSetting);
+	ModBus_attachRegisterHandler(&slave, udpGetReg, udpSetReg);
+
+	udpSetting.port = MODBUS_UDP_TEST_PORT;
+	udpSetting.bindAddress = INADDR_LOOPBACK;
+	ret = ModBus_UDP_setup(&server, udpSetting, &slave);
+	assert(ret == 0);
+	ret = ModBus_UDP_Client_open(&client, INADDR_LOOPBACK, MODBUS_UDP_TEST_PORT, 0x01, 100);
+	assert(ret == 0);
+
+	// 8个读指令同时发送, 不等待前一个返回
+	request.type = READ_REGISTER;
+	request.count = 2;
+	request.resultHandler = udpResult;
+	for (uint16_t i = 0; i < 8; i++)
+	{
+		request.address = i;
+		assert(ModBus_UDP_request(&client, &request) == 1);
+	}
+	assert(client.m_pendingN == 8);
+	// 写多寄存器, 以及地址越界返回异常码
+	request.type = WRITE_MULTI_REGISTER;
+	request.address = 12;
+	request.count = 2;
+	request.data[0] = 0xCAFE;
+	request.data[1] = 0xBEEF;
+	assert(ModBus_UDP_request(&client, &request) == 1);
+	request.type = READ_REGISTER;
+	request.address = 15;
+	assert(ModBus_UDP_request(&client, &request) == 1);
+
+	for (int i = 0; i < 100 && client.m_pendingN > 0; i++)
+	{
+		ModBus_UDP_Server_loop(&server, 1);
+		ModBus_UDP_Client_loop(&client, 1);
+	}
+	assert(g_udpResultN == 10 && client.m_pendingN == 0 && server.m_requestCount == 10);
+	for (size_t i = 0; i < 8; i++)
+	{
+		assert(g_udpResults[i].status == MODBUS_STATUS_OK && g_udpResults[i].count == 2 && g_udpData[i] == 0x200 + g_udpResults[i].address);
+	}
+	assert(g_udpResults[8].status == MODBUS_STATUS_OK && g_udpResults[8].count == 2 && g_udpRegisters[12] == 0xCAFE && g_udpRegisters[13] == 0xBEEF);
+	assert(g_udpResults[9].status == MODBUS_STATUS_EXCEPTION && g_udpResults[9].exception == EXCEPTION_ILLEGAL_DATA_ADDRESS);
+
+	// 服务器关闭后指令超时
+	ModBus_UDP_close(&server);
+	g_udpResultN = 0;
+	request.address = 0;
+	assert(ModBus_UDP_request(&client, &request) == 1);
+	for (int i = 0; i < 10 && g_udpResultN == 0; i++)
+	{
+		ModBus_UDP_Client_loop(&client, 1);
+		t += 50;
+	}
+	assert(g_udpResultN == 1 && g_udpResults[0].status == MODBUS_STATUS_TIMEOUT && client.m_timeoutCount == 1);
+
+	printf("udp_unit_test: sent %u, timeout %u, unmatched %u\n", client.m_sentCount, client.m_timeoutCount, client.m_unmatchedCount);
+	ModBus_UDP_Client_close(&client);
+}
+#endif // _UNIT_TEST
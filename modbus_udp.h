@@ -0,0 +1,114 @@
+#ifndef MOTECMODBUS_UDP_H_
+#define MOTECMODBUS_UDP_H_
+/**** ModBus UDP (Linux) ****
+** 每个数据报一个完整的ADU(MBAP报文头+PDU), 不需要分帧, 丢包只影响对应的指令
+** 从机服务器: 收到请求后通过从机实例处理, 返回帧发送到请求的来源地址
+** 主机客户端: 多个指令同时等待返回(按事务号对应), 一个指令丢包或超时不阻塞其他指令
+** 使用方法:
+**** 1.从机
+****** 配置从机实例(ModBus_setup, ModBus_attachRegisterHandler)
+****** 调用ModBus_UDP_setup配置服务器, 循环调用ModBus_UDP_Server_loop
+**** 2.主机
+****** 调用ModBus_UDP_Client_open连接服务器
+****** 调用ModBus_UDP_request发送指令, 结果通过指令的回调函数或完成队列返回(同ModBus_request)
+****** 循环调用ModBus_UDP_Client_loop
+*/
+
+#include "modbus.h"
+
+#define MODBUS_UDP_DEFAULT_PORT 502 // 默认端口
+#define MODBUS_UDP_MBAP_SIZE 7 // MBAP报文头长度, 与TCP相同
+#define MODBUS_UDP_ADU_SIZE (MODBUS_UDP_MBAP_SIZE + MODBUS_PDU_SIZE) // 数据报最大长度
+#define MODBUS_UDP_BATCH_N 32 // 每次loop最多处理的数据报数, 避免一直占用loop
+#define MODBUS_UDP_PENDING_N 16 // 主机同时等待返回的指令数
+#define MODBUS_UDP_DEFAULT_TIMEOUT 1000 // 主机默认等待返回超时时间(毫秒)
+
+typedef struct _MODBUS_UDP_SETTING_T { // ModBus UDP服务器配置信息类型
+	uint16_t port; // 监听端口, 0 使用默认端口502
+	u32 bindAddress; // 监听地址(主机字节序), 0 监听所有地址
+} ModBus_UDP_Setting_T;
+
+#ifdef MODBUS_SLAVE
+typedef struct __MODBUS_UDP_Server {
+	int m_fd; // socket
+	ModBus_parameter* m_slave; // 处理请求的从机实例
+
+	u32 m_requestCount; // 已处理的请求数
+	u32 m_errorCount; // 格式错误的数据报数
+} ModBus_UDP_Server_T;
+#endif // MODBUS_SLAVE
+
+#ifdef MODBUS_MASTER
+typedef struct _MODBUS_UDP_PENDING_T { // 等待返回的指令
+	uint16_t m_transaction; // 事务号
+	u32 m_time; // 发送时刻
+	byte m_active; // 是否在等待返回
+	ModBus_Request_T m_request; // 指令
+} ModBus_UDP_Pending_T;
+
+typedef struct __MODBUS_UDP_Client {
+	int m_fd; // 已连接到服务器的socket
+	uint8_t m_unit; // MBAP单元号
+	u32 m_timeout; // 等待返回超时时间
+	uint16_t m_nextTransaction; // 下一个事务号
+	ModBus_UDP_Pending_T m_pending[MODBUS_UDP_PENDING_N]; // 等待返回的指令
+	size_t m_pendingN; // 等待返回的指令数
+
+	u32 m_sentCount; // 发送的指令数
+	u32 m_timeoutCount; // 超时的指令数
+	u32 m_unmatchedCount; // 没有对应指令的返回帧数(超时后到达, 或重复)
+} ModBus_UDP_Client_T;
+#endif // MODBUS_MASTER
+
+/************ 对外接口 BEGIN ***********/
+
+#ifdef MODBUS_SLAVE
+/** 配置ModBus UDP服务器 **/
+/*** 参数 ***
+** slave: 处理请求的从机实例
+** 成功返回0, 失败返回-1(errno为失败原因)
+***/
+int ModBus_UDP_setup(ModBus_UDP_Server_T* server, ModBus_UDP_Setting_T setting, ModBus_parameter* slave);
+
+/** 服务器loop函数 **/
+/*** 参数 ***
+** waitTime: 没有请求时最多等待的毫秒数, 0 不等待, -1 一直等待
+** 返回处理的请求数, 出错返回-1
+***/
+int ModBus_UDP_Server_loop(ModBus_UDP_Server_T* server, int waitTime);
+
+// 关闭服务器
+void ModBus_UDP_close(ModBus_UDP_Server_T* server);
+#endif // MODBUS_SLAVE
+
+#ifdef MODBUS_MASTER
+/** 连接ModBus UDP服务器 **/
+/*** 参数 ***
+** address: 服务器地址(主机字节序), port: 端口, 0 使用默认端口502
+** unit: MBAP单元号
+** timeout: 等待返回超时时间(毫秒), 0 使用默认值
+** 成功返回0, 失败返回-1
+***/
+int ModBus_UDP_Client_open(ModBus_UDP_Client_T* client, u32 address, uint16_t port, uint8_t unit, u32 timeout);
+
+/** 发送指令 **/
+/*** 参数 ***
+** request: 指令描述, 函数返回后可释放; request->unit不为0时代替配置的单元号
+** 发送返回1; 参数无效以 MODBUS_STATUS_INVALID, 等待返回的指令已满以 MODBUS_STATUS_DROPPED 结束指令并返回0
+***/
+byte ModBus_UDP_request(ModBus_UDP_Client_T* client, const ModBus_Request_T* request);
+
+/** 主机loop函数, 接收返回帧并结束超时的指令 **/
+/*** 参数 ***
+** waitTime: 没有返回帧时最多等待的毫秒数
+** 返回结束的指令数
+***/
+int ModBus_UDP_Client_loop(ModBus_UDP_Client_T* client, int waitTime);
+
+// 关闭客户端, 等待返回的指令不再结束
+void ModBus_UDP_Client_close(ModBus_UDP_Client_T* client);
+#endif // MODBUS_MASTER
+
+/**************** 对外接口 END ***************/
+
+#endif
@@ -0,0 +1,863 @@
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE // cfmakeraw
+#endif
+
+#include "modbus_uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define MODBUS_URING_OP_READ 0 // 操作标识的最低位: 读/写, 其余位为通道序号
+#define MODBUS_URING_OP_WRITE 1
+
+static int ModBus_Uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+// 取一个空闲提交项, 提交队列满时先提交已排队的操作(按通道数分配队列, 一般不会满)
+static struct io_uring_sqe* ModBus_Uring_getSqe(ModBus_Uring_T* ring)
+{
+	unsigned tail = *ring->m_sqTail;
+	unsigned index;
+	struct io_uring_sqe* sqe;
+	if (tail - __atomic_load_n(ring->m_sqHead, __ATOMIC_ACQUIRE) >= ring->m_sqEntries)
+	{
+		int ret = ModBus_Uring_enter(ring->m_fd, ring->m_sqPending, 0, 0, NULL, 0);
+		ring->m_enterCount++;
+		if (ret <= 0)
+		{
+			return NULL;
+		}
+		ring->m_sqPending -= (unsigned)ret;
+	}
+	index = tail & ring->m_sqMask;
+	sqe = (struct io_uring_sqe*)ring->m_sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	ring->m_sqArray[index] = index;
+	__atomic_store_n(ring->m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	ring->m_sqPending++;
+	ring->m_sqeCount++;
+	return sqe;
+}
+
+// 排队一个读写操作, 数据在已注册的通道缓冲区中
+static byte ModBus_Uring_queue(ModBus_Uring_T* ring, ModBus_Uring_Channel_T* channel, byte op, byte* data, size_t size)
+{
+	struct io_uring_sqe* sqe = ModBus_Uring_getSqe(ring);
+	if (sqe == NULL)
+	{
+		return 0;
+	}
+	if (ring->m_fixedBuffers)
+	{
+		sqe->opcode = op == MODBUS_URING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+		sqe->buf_index = 0; // 全部通道注册为一个缓冲区
+	}
+	else
+	{
+		sqe->opcode = op == MODBUS_URING_OP_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	}
+	sqe->fd = channel->m_fd;
+	sqe->off = (__u64)-1; // 流式设备, 使用当前位置
+	sqe->addr = (__u64)(uintptr_t)data;
+	sqe->len = (__u32)size;
+	sqe->user_data = (__u64)(channel - ring->m_channels) * 2 + op;
+	return 1;
+}
+
+static void ModBus_Uring_queueRead(ModBus_Uring_T* ring, ModBus_Uring_Channel_T* channel)
+{
+	channel->m_reading = ModBus_Uring_queue(ring, channel, MODBUS_URING_OP_READ, channel->m_rxBuffer, MODBUS_URING_READ_SIZE);
+}
+
+// 发送队列中的第一帧(剩余部分)
+static void ModBus_Uring_queueWrite(ModBus_Uring_T* ring, ModBus_Uring_Channel_T* channel)
+{
+	u32 slot = channel->m_txHead % MODBUS_URING_TX_N;
+	channel->m_writing = ModBus_Uring_queue(ring, channel, MODBUS_URING_OP_WRITE, channel->m_txBuffer[slot] + channel->m_txOffset,
+		channel->m_txLength[slot] - channel->m_txOffset);
+	if (!channel->m_writing) // 无法排队, 丢弃队列中的帧
+	{
+		channel->m_errorCount += channel->m_txTail - channel->m_txHead;
+		channel->m_txHead = channel->m_txTail;
+		channel->m_txOffset = 0;
+	}
+}
+
+// 实例的发送函数: 复制到通道发送队列, 在下一次ModBus_Uring_run中提交
+static void ModBus_Uring_send(void* context, byte* data, size_t size)
+{
+	ModBus_Uring_Channel_T* channel = (ModBus_Uring_Channel_T*)context;
+	u32 slot;
+	if (size == 0 || size > MODBUS_BUFFER_SIZE || channel->m_txTail - channel->m_txHead >= MODBUS_URING_TX_N || channel->m_closed)
+	{
+		channel->m_errorCount++;
+		return;
+	}
+	slot = channel->m_txTail % MODBUS_URING_TX_N;
+	memcpy(channel->m_txBuffer[slot], data, size);
+	channel->m_txLength[slot] = (uint16_t)size;
+	channel->m_txTail++;
+	if (!channel->m_writing)
+	{
+		ModBus_Uring_queueWrite(channel->m_ring, channel);
+	}
+}
+
+// 处理一个完成事件, 接收的数据直接传入实例
+static void ModBus_Uring_complete(ModBus_Uring_T* ring, const struct io_uring_cqe* cqe)
+{
+	ModBus_Uring_Channel_T* channel = ring->m_channels + (cqe->user_data >> 1);
+	int res = cqe->res;
+	if ((cqe->user_data & 1) == MODBUS_URING_OP_READ)
+	{
+		channel->m_reading = 0; // 在下一次ModBus_Uring_run中重新排队
+		if (res > 0)
+		{
+			ModBus_readBytesFromOuter(channel->m_modbus, channel->m_rxBuffer, (size_t)res);
+			channel->m_receivedBytes += (u32)res;
+		}
+		else if (res == 0 || (res != -EAGAIN && res != -EINTR)) // 对端关闭或出错
+		{
+			channel->m_closed = 1;
+			channel->m_errorCount += res != 0;
+		}
+		return;
+	}
+
+	channel->m_writing = 0;
+	if (res > 0)
+	{
+		channel->m_sentBytes += (u32)res;
+		channel->m_txOffset += (u32)res;
+		if (channel->m_txOffset >= channel->m_txLength[channel->m_txHead % MODBUS_URING_TX_N])
+		{
+			channel->m_txHead++;
+			channel->m_txOffset = 0;
+		}
+	}
+	else if (res != -EAGAIN && res != -EINTR) // 发送失败, 丢弃该帧
+	{
+		channel->m_errorCount++;
+		channel->m_txHead++;
+		channel->m_txOffset = 0;
+	}
+	if (channel->m_txHead != channel->m_txTail)
+	{
+		ModBus_Uring_queueWrite(ring, channel);
+	}
+}
+
+// 映射提交/完成队列
+static int ModBus_Uring_map(ModBus_Uring_T* ring, const struct io_uring_params* p)
+{
+	ring->m_sqRingSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	ring->m_cqRingSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	if (p->features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->m_cqRingSize > ring->m_sqRingSize)
+		{
+			ring->m_sqRingSize = ring->m_cqRingSize;
+		}
+		ring->m_cqRingSize = 0;
+	}
+	ring->m_sqRing = mmap(NULL, ring->m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->m_fd, IORING_OFF_SQ_RING);
+	if (ring->m_sqRing == MAP_FAILED)
+	{
+		ring->m_sqRing = NULL;
+		return -1;
+	}
+	if (ring->m_cqRingSize == 0)
+	{
+		ring->m_cqRing = ring->m_sqRing;
+	}
+	else
+	{
+		ring->m_cqRing = mmap(NULL, ring->m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->m_fd, IORING_OFF_CQ_RING);
+		if (ring->m_cqRing == MAP_FAILED)
+		{
+			ring->m_cqRing = NULL;
+			return -1;
+		}
+	}
+	ring->m_sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->m_sqes = mmap(NULL, ring->m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->m_fd, IORING_OFF_SQES);
+	if (ring->m_sqes == MAP_FAILED)
+	{
+		ring->m_sqes = NULL;
+		return -1;
+	}
+
+	ring->m_sqHead = (unsigned*)((byte*)ring->m_sqRing + p->sq_off.head);
+	ring->m_sqTail = (unsigned*)((byte*)ring->m_sqRing + p->sq_off.tail);
+	ring->m_sqArray = (unsigned*)((byte*)ring->m_sqRing + p->sq_off.array);
+	ring->m_sqMask = *(unsigned*)((byte*)ring->m_sqRing + p->sq_off.ring_mask);
+	ring->m_sqEntries = p->sq_entries;
+	ring->m_cqHead = (unsigned*)((byte*)ring->m_cqRing + p->cq_off.head);
+	ring->m_cqTail = (unsigned*)((byte*)ring->m_cqRing + p->cq_off.tail);
+	ring->m_cqMask = *(unsigned*)((byte*)ring->m_cqRing + p->cq_off.ring_mask);
+	ring->m_cqes = (byte*)ring->m_cqRing + p->cq_off.cqes;
+	return 0;
+}
+
+// 释放io_uring映射和文件描述符
+static void ModBus_Uring_release(ModBus_Uring_T* ring)
+{
+	if (ring->m_sqes != NULL)
+	{
+		munmap(ring->m_sqes, ring->m_sqesSize);
+		ring->m_sqes = NULL;
+	}
+	if (ring->m_cqRing != NULL && ring->m_cqRing != ring->m_sqRing)
+	{
+		munmap(ring->m_cqRing, ring->m_cqRingSize);
+	}
+	ring->m_cqRing = NULL;
+	if (ring->m_sqRing != NULL)
+	{
+		munmap(ring->m_sqRing, ring->m_sqRingSize);
+		ring->m_sqRing = NULL;
+	}
+	if (ring->m_fd >= 0)
+	{
+		close(ring->m_fd);
+		ring->m_fd = -1;
+	}
+}
+
+/** 配置io_uring **/
+/*** 参数 ***
+** channels: 通道缓冲区, 整体注册为固定缓冲区
+** 成功返回0, 失败返回-1
+***/
+int ModBus_Uring_setup(ModBus_Uring_T* ring, ModBus_Uring_Channel_T* channels, size_t capacity)
+{
+	struct io_uring_params p;
+	struct iovec iov;
+	int err;
+	memset(ring, 0, sizeof(*ring));
+	ring->m_channels = channels;
+	ring->m_capacity = capacity;
+	if (capacity == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset(&p, 0, sizeof(p));
+	ring->m_fd = (int)syscall(__NR_io_uring_setup, (unsigned)(capacity * 2), &p); // 每个通道最多一个读一个写
+	if (ring->m_fd < 0)
+	{
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG) || ModBus_Uring_map(ring, &p) < 0) // 等待超时需要5.11+
+	{
+		err = (p.features & IORING_FEAT_EXT_ARG) ? errno : ENOSYS;
+		ModBus_Uring_release(ring);
+		errno = err;
+		return -1;
+	}
+
+	memset(channels, 0, capacity * sizeof(ModBus_Uring_Channel_T)); // 注册前填充, 页面已分配
+	iov.iov_base = channels;
+	iov.iov_len = capacity * sizeof(ModBus_Uring_Channel_T);
+	ring->m_fixedBuffers = syscall(__NR_io_uring_register, ring->m_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+	return 0;
+}
+
+/** 绑定已打开的设备或socket到实例 **/
+/*** 参数 ***
+** fd: 设备或已连接的socket
+** 返回通道序号, 失败返回-1
+***/
+int ModBus_Uring_attachFd(ModBus_Uring_T* ring, int fd, ModBus_parameter* modbus, MODBUS_URING_ROLE_TYPE role)
+{
+	ModBus_Uring_Channel_T* channel;
+	int flags;
+	if (ring->m_channelN >= ring->m_capacity)
+	{
+		return -1;
+	}
+	// 非阻塞: 读操作暂无数据时由io_uring内部等待可读, 不占用内核工作线程
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		return -1;
+	}
+	if (isatty(fd))
+	{
+		// 原始模式; VMIN=0时非阻塞读在无数据时返回0而不是EAGAIN, io_uring会当作读完成, 因此设为1
+		struct termios tio;
+		if (tcgetattr(fd, &tio) < 0)
+		{
+			return -1;
+		}
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+		if (tcsetattr(fd, TCSANOW, &tio) < 0)
+		{
+			return -1;
+		}
+	}
+
+	channel = ring->m_channels + ring->m_channelN;
+	channel->m_txHead = 0;
+	channel->m_txTail = 0;
+	channel->m_txOffset = 0;
+	channel->m_ring = ring;
+	channel->m_fd = fd;
+	channel->m_modbus = modbus;
+	channel->m_role = role;
+	channel->m_reading = 0;
+	channel->m_writing = 0;
+	channel->m_closed = 0;
+	channel->m_receivedBytes = 0;
+	channel->m_sentBytes = 0;
+	channel->m_errorCount = 0;
+	ModBus_attachSendHandler(modbus, ModBus_Uring_send, channel);
+	return (int)ring->m_channelN++;
+}
+
+// 全部实例中最近的超时/待发送时刻(毫秒), 见 ModBus_Master_nextDeadline
+static u32 ModBus_Uring_nextDeadline(ModBus_Uring_T* ring)
+{
+	u32 wait = MODBUS_DEADLINE_NONE;
+	for (size_t i = 0; i < ring->m_channelN && wait > 0; i++)
+	{
+		ModBus_Uring_Channel_T* channel = ring->m_channels + i;
+		u32 deadline = MODBUS_DEADLINE_NONE;
+#ifdef MODBUS_MASTER
+		if (channel->m_role == MODBUS_URING_MASTER)
+		{
+			deadline = ModBus_Master_nextDeadline(channel->m_modbus);
+		}
+#endif
+#ifdef MODBUS_SLAVE
+		if (channel->m_role == MODBUS_URING_SLAVE)
+		{
+			deadline = ModBus_Slave_nextDeadline(channel->m_modbus);
+		}
+#endif
+		if (deadline < wait)
+		{
+			wait = deadline;
+		}
+	}
+	return wait;
+}
+
+/** 提交排队的读写操作, 等待并处理完成事件, 然后运行全部实例的loop **/
+/*** 参数 ***
+** waitTime: 没有完成事件时最多等待的毫秒数, 0 不等待, -1 一直等待
+** 返回处理的完成事件数, 出错返回-1
+***/
+int ModBus_Uring_run(ModBus_Uring_T* ring, int waitTime)
+{
+	unsigned head, tail;
+	int completed = 0;
+
+	for (size_t i = 0; i < ring->m_channelN; i++)
+	{
+		ModBus_Uring_Channel_T* channel = ring->m_channels + i;
+		if (!channel->m_reading && !channel->m_closed)
+		{
+			ModBus_Uring_queueRead(ring, channel);
+		}
+	}
+
+	// 一次系统调用: 提交全部通道排队的读写, 并等待至少一个完成事件
+	head = *ring->m_cqHead;
+	if (head != __atomic_load_n(ring->m_cqTail, __ATOMIC_ACQUIRE))
+	{
+		waitTime = 0; // 已有完成事件
+	}
+	else if (waitTime != 0)
+	{
+		u32 deadline = ModBus_Uring_nextDeadline(ring); // 不等待超过实例下一次需要运行的时刻(如新指令待发送)
+		if (deadline != MODBUS_DEADLINE_NONE && (waitTime < 0 || deadline < (u32)waitTime))
+		{
+			waitTime = (int)deadline;
+		}
+	}
+	if (ring->m_sqPending > 0 || waitTime != 0)
+	{
+		struct io_uring_getevents_arg arg;
+		struct __kernel_timespec ts;
+		unsigned flags = 0;
+		int ret;
+		memset(&arg, 0, sizeof(arg));
+		if (waitTime != 0)
+		{
+			flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+			if (waitTime > 0)
+			{
+				ts.tv_sec = waitTime / 1000;
+				ts.tv_nsec = (long long)(waitTime % 1000) * 1000000;
+				arg.ts = (__u64)(uintptr_t)&ts;
+			}
+		}
+		ret = ModBus_Uring_enter(ring->m_fd, ring->m_sqPending, waitTime != 0 ? 1 : 0, flags, waitTime != 0 ? &arg : NULL, waitTime != 0 ? sizeof(arg) : 0);
+		ring->m_enterCount++;
+		if (ret >= 0)
+		{
+			ring->m_sqPending -= (unsigned)ret <= ring->m_sqPending ? (unsigned)ret : ring->m_sqPending;
+		}
+		else if (errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+		{
+			return -1;
+		}
+	}
+
+	tail = __atomic_load_n(ring->m_cqTail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++, completed++)
+	{
+		ModBus_Uring_complete(ring, (const struct io_uring_cqe*)ring->m_cqes + (head & ring->m_cqMask));
+	}
+	__atomic_store_n(ring->m_cqHead, head, __ATOMIC_RELEASE);
+	ring->m_cqeCount += (unsigned long long)completed;
+
+	// 运行全部实例: 处理接收的数据和超时, 发送的帧排队到下一次提交
+	for (size_t i = 0; i < ring->m_channelN; i++)
+	{
+		ModBus_Uring_Channel_T* channel = ring->m_channels + i;
+#ifdef MODBUS_MASTER
+		if (channel->m_role == MODBUS_URING_MASTER)
+		{
+			ModBus_Master_loop(channel->m_modbus);
+		}
+#endif
+#ifdef MODBUS_SLAVE
+		if (channel->m_role == MODBUS_URING_SLAVE)
+		{
+			ModBus_Slave_loop(channel->m_modbus);
+		}
+#endif
+	}
+	return completed;
+}
+
+// 关闭io_uring和全部通道
+void ModBus_Uring_close(ModBus_Uring_T* ring)
+{
+	ModBus_Uring_release(ring); // 先关闭io_uring, 取消未完成的操作后再关闭通道
+	for (size_t i = 0; i < ring->m_channelN; i++)
+	{
+		ModBus_Uring_Channel_T* channel = ring->m_channels + i;
+		if (channel->m_fd >= 0)
+		{
+			close(channel->m_fd);
+			channel->m_fd = -1;
+		}
+		ModBus_attachSendHandler(channel->m_modbus, NULL, NULL);
+	}
+	ring->m_channelN = 0;
+}
+
+#if (defined(_UNIT_TEST) || defined(_BENCHMARK)) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <stdio.h>
+#include <pty.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "modbus_tcp.h"
+
+static uint16_t g_uringRegisters[16];
+
+static size_t uringGetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(data, g_uringRegisters + address, n * sizeof(uint16_t));
+	return n;
+}
+
+static size_t uringSetReg(uint16_t address, uint16_t n, uint16_t* data)
+{
+	if (address + n > 16)
+		return 0;
+	memcpy(g_uringRegisters + address, data, n * sizeof(uint16_t));
+	return n;
+}
+
+// 本机回环TCP连接, fds[0]为主动连接端, fds[1]为接受端
+static int uringTcpPair(uint16_t port, int fds[2])
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd < 0)
+		return -1;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listenFd, 1) < 0)
+	{
+		close(listenFd);
+		return -1;
+	}
+	fds[0] = ModBus_TCP_connect(INADDR_LOOPBACK, port);
+	fds[1] = fds[0] >= 0 ? accept(listenFd, NULL, NULL) : -1;
+	close(listenFd);
+	if (fds[1] < 0)
+	{
+		if (fds[0] >= 0)
+			close(fds[0]);
+		return -1;
+	}
+	setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+// 配置一对按长度分帧的主从机
+static void uringSetupPair(ModBus_parameter* master, ModBus_parameter* slave)
+{
+	ModBus_Setting_T setting = { 0 };
+	setting.address = 0x11;
+	setting.frameType = RTU;
+	setting.register_access_limit = MODBUS_REGISTER_LIMIT;
+	ModBus_setup(master, setting);
+	ModBus_setup(slave, setting);
+	ModBus_setTimeout(master, 5, 1000);
+	ModBus_lengthFraming(master, 1);
+	ModBus_lengthFraming(slave, 1);
+	ModBus_attachRegisterHandler(slave, uringGetReg, uringSetReg);
+}
+#endif
+
+#if defined(_UNIT_TEST) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#define MODBUS_URING_TEST_PTY_N 4 // 伪终端主从机对数
+#define MODBUS_URING_TEST_TCP_PORT 15024
+
+extern int t; // 单元测试的虚拟时间, 见 modbus.c
+
+typedef struct {
+	MODBUS_STATUS_TYPE status;
+	uint16_t count;
+	uint16_t data[MODBUS_REGISTER_LIMIT];
+	byte done;
+} UringTestResult_T;
+
+static void uringResult(void* context, const ModBus_Result_T* result)
+{
+	UringTestResult_T* r = (UringTestResult_T*)context;
+	r->status = result->status;
+	r->count = result->count;
+	if (result->data != NULL)
+		memcpy(r->data, result->data, result->count * sizeof(uint16_t));
+	r->done = 1;
+}
+
+// 运行直到全部结果返回
+static void uringRunUntil(ModBus_Uring_T* ring, UringTestResult_T* results, size_t n)
+{
+	for (int i = 0; i < 2000; i++)
+	{
+		size_t done = 0;
+		for (size_t j = 0; j < n; j++)
+			done += results[j].done;
+		if (done == n)
+			return;
+		assert(ModBus_Uring_run(ring, 10) >= 0);
+		t++;
+	}
+	assert(0);
+}
+
+// 4对伪终端主从机和1对RTU over TCP主从机共用一个io_uring
+void uring_unit_test()
+{
+	enum { PAIR_N = MODBUS_URING_TEST_PTY_N + 1 };
+	static ModBus_Uring_Channel_T channels[PAIR_N * 2 + 1];
+	static ModBus_parameter masters[PAIR_N], slaves[PAIR_N], raw, unused;
+	UringTestResult_T results[PAIR_N];
+	ModBus_Uring_T ring;
+	ModBus_Request_T request = { 0 };
+	ModBus_Uring_Channel_T* channel;
+	byte frames[MODBUS_URING_TX_N + 1][8];
+	byte received[sizeof(frames)];
+	int fds[2], ret;
+	size_t got;
+
+	if (ModBus_Uring_setup(&ring, channels, PAIR_N * 2 + 1) < 0)
+	{
+		printf("uring_unit_test: io_uring unavailable (errno %d), skipped\n", errno);
+		return;
+	}
+	for (uint16_t i = 0; i < 16; i++)
+		g_uringRegisters[i] = (uint16_t)(0x100 + i);
+	for (int b = 0; b < PAIR_N; b++)
+	{
+		if (b < MODBUS_URING_TEST_PTY_N)
+			ret = openpty(fds, fds + 1, NULL, NULL, NULL);
+		else
+			ret = uringTcpPair(MODBUS_URING_TEST_TCP_PORT, fds);
+		assert(ret == 0);
+		uringSetupPair(masters + b, slaves + b);
+		assert(ModBus_Uring_attachFd(&ring, fds[0], masters + b, MODBUS_URING_MASTER) == 2 * b);
+		assert(ModBus_Uring_attachFd(&ring, fds[1], slaves + b, MODBUS_URING_SLAVE) == 2 * b + 1);
+	}
+
+	// 每个主机读不同地址, 所有总线的收发在同一批系统调用中
+	request.type = READ_REGISTER;
+	request.count = 2;
+	request.resultHandler = uringResult;
+	memset(results, 0, sizeof(results));
+	for (int b = 0; b < PAIR_N; b++)
+	{
+		request.address = (uint16_t)b;
+		request.context = results + b;
+		assert(ModBus_request(masters + b, &request));
+	}
+	uringRunUntil(&ring, results, PAIR_N);
+	for (int b = 0; b < PAIR_N; b++)
+	{
+		assert(results[b].status == MODBUS_STATUS_OK && results[b].count == 2);
+		assert(results[b].data[0] == 0x100 + b && results[b].data[1] == 0x101 + b);
+	}
+	assert(ring.m_enterCount < ring.m_sqeCount); // 多个通道的读写合并提交
+
+	// TCP主机写多个寄存器
+	request.type = WRITE_MULTI_REGISTER;
+	request.address = 12;
+	request.count = 3;
+	request.data[0] = 0xAAAA;
+	request.data[1] = 0xBBBB;
+	request.data[2] = 0xCCCC;
+	request.context = results;
+	results[0].done = 0;
+	assert(ModBus_request(masters + MODBUS_URING_TEST_PTY_N, &request));
+	uringRunUntil(&ring, results, 1);
+	assert(results[0].status == MODBUS_STATUS_OK && results[0].count == 3);
+	assert(g_uringRegisters[12] == 0xAAAA && g_uringRegisters[14] == 0xCCCC);
+
+	// 发送队列: 连续发送的帧按顺序写出, 队列满时丢弃
+	ret = openpty(fds, fds + 1, NULL, NULL, NULL);
+	assert(ret == 0);
+	uringSetupPair(&raw, &unused); // 只用raw作为发送方
+	ret = ModBus_Uring_attachFd(&ring, fds[0], &raw, MODBUS_URING_MASTER);
+	assert(ret == PAIR_N * 2);
+	channel = channels + ret;
+	for (int i = 0; i < MODBUS_URING_TX_N + 1; i++)
+	{
+		memset(frames[i], 0x30 + i, sizeof(frames[i]));
+		raw.m_SendHandlerEx(raw.m_sendContext, frames[i], sizeof(frames[i]));
+	}
+	assert(channel->m_errorCount == 1);
+	for (int i = 0; i < 100 && channel->m_sentBytes < MODBUS_URING_TX_N * sizeof(frames[0]); i++)
+		ModBus_Uring_run(&ring, 10);
+	assert(channel->m_sentBytes == MODBUS_URING_TX_N * sizeof(frames[0]) && !channel->m_writing);
+	{
+		struct termios tio;
+		tcgetattr(fds[1], &tio);
+		cfmakeraw(&tio);
+		tcsetattr(fds[1], TCSANOW, &tio);
+	}
+	got = 0;
+	for (int i = 0; i < 100 && got < MODBUS_URING_TX_N * sizeof(frames[0]); i++)
+	{
+		ssize_t n = read(fds[1], received + got, sizeof(received) - got);
+		if (n > 0)
+			got += (size_t)n;
+	}
+	assert(got == MODBUS_URING_TX_N * sizeof(frames[0]) && memcmp(received, frames, got) == 0);
+
+	printf("uring_unit_test: %s buffers, %llu sqes in %llu io_uring_enter calls, %llu completions\n", ring.m_fixedBuffers ? "registered" : "plain",
+		ring.m_sqeCount, ring.m_enterCount, ring.m_cqeCount);
+	ModBus_Uring_close(&ring);
+	assert(fcntl(channel->m_fd, F_GETFD) < 0 && raw.m_SendHandlerEx == NULL);
+	close(fds[1]);
+}
+#endif // _UNIT_TEST
+
+#if defined(_BENCHMARK) && defined(MODBUS_MASTER) && defined(MODBUS_SLAVE)
+#include <time.h>
+#include <sys/epoll.h>
+#include "modbus_serial.h"
+
+#define MODBUS_URING_BENCH_BUS_N 16 // 主从机对数
+#define MODBUS_URING_BENCH_REQUEST_N 2000 // 每个主机的读指令数
+#define MODBUS_URING_BENCH_TCP_PORT 15025
+
+typedef struct {
+	ModBus_parameter master;
+	ModBus_parameter slave;
+	byte pending; // 有未完成的指令
+	u32 done; // 已完成的指令数
+	u32 okCount; // 成功的指令数
+} UringBenchBus_T;
+
+static void uringBenchResult(void* context, const ModBus_Result_T* result)
+{
+	UringBenchBus_T* bus = (UringBenchBus_T*)context;
+	bus->pending = 0;
+	bus->done++;
+	bus->okCount += result->status == MODBUS_STATUS_OK;
+}
+
+// 空闲的主机发出下一个读指令, 全部完成返回1
+static byte uringBenchIssue(UringBenchBus_T* buses)
+{
+	ModBus_Request_T request = { 0 };
+	byte finished = 1;
+	request.type = READ_REGISTER;
+	request.count = MODBUS_REGISTER_LIMIT;
+	request.resultHandler = uringBenchResult;
+	for (int b = 0; b < MODBUS_URING_BENCH_BUS_N; b++)
+	{
+		if (buses[b].done < MODBUS_URING_BENCH_REQUEST_N)
+		{
+			finished = 0;
+			if (!buses[b].pending)
+			{
+				request.context = buses + b;
+				buses[b].pending = ModBus_request(&buses[b].master, &request);
+			}
+		}
+	}
+	return finished;
+}
+
+static double uringBenchNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// 创建主从机对, tcp为0时使用伪终端
+static void uringBenchOpen(UringBenchBus_T* buses, int fds[][2], byte tcp)
+{
+	memset(buses, 0, MODBUS_URING_BENCH_BUS_N * sizeof(UringBenchBus_T));
+	for (int b = 0; b < MODBUS_URING_BENCH_BUS_N; b++)
+	{
+		int ret = tcp ? uringTcpPair(MODBUS_URING_BENCH_TCP_PORT + b, fds[b]) : openpty(fds[b], fds[b] + 1, NULL, NULL, NULL);
+		assert(ret == 0);
+		(void)ret;
+		uringSetupPair(&buses[b].master, &buses[b].slave);
+	}
+}
+
+// epoll后端(与 modbus_runtime.c 的工作线程相同): epoll_wait, 每个可读的串口read一次, 每帧write一次
+static void uringBenchEpoll(UringBenchBus_T* buses, byte tcp, double* seconds, unsigned long long* syscalls)
+{
+	static ModBus_Serial_T ports[MODBUS_URING_BENCH_BUS_N * 2];
+	struct epoll_event events[MODBUS_URING_BENCH_BUS_N * 2];
+	int fds[MODBUS_URING_BENCH_BUS_N][2];
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	unsigned long long waitCount = 0;
+	double begin;
+
+	uringBenchOpen(buses, fds, tcp);
+	for (int i = 0; i < MODBUS_URING_BENCH_BUS_N * 2; i++)
+	{
+		struct epoll_event ev;
+		ModBus_parameter* modbus = (i & 1) ? &buses[i / 2].slave : &buses[i / 2].master;
+		int ret = ModBus_Serial_attachFd(ports + i, fds[i / 2][i & 1], modbus, 0); // 不放在assert中, 定义NDEBUG时也要执行
+		assert(ret == 0);
+		(void)ret;
+		ev.events = EPOLLIN;
+		ev.data.u32 = (uint32_t)i;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, ports[i].m_fd, &ev);
+	}
+	begin = uringBenchNow();
+	while (!uringBenchIssue(buses))
+	{
+		u32 wait = 10;
+		int n;
+		for (int b = 0; b < MODBUS_URING_BENCH_BUS_N; b++) // 与ModBus_Uring_run相同, 不等待超过实例下一次需要运行的时刻
+		{
+			u32 deadline = ModBus_Master_nextDeadline(&buses[b].master);
+			wait = deadline < wait ? deadline : wait;
+			deadline = ModBus_Slave_nextDeadline(&buses[b].slave);
+			wait = deadline < wait ? deadline : wait;
+		}
+		n = epoll_wait(epollFd, events, MODBUS_URING_BENCH_BUS_N * 2, (int)wait);
+		waitCount++;
+		for (int i = 0; i < n; i++)
+			ModBus_Serial_poll(ports + events[i].data.u32, 0);
+		for (int b = 0; b < MODBUS_URING_BENCH_BUS_N; b++)
+		{
+			ModBus_Master_loop(&buses[b].master);
+			ModBus_Slave_loop(&buses[b].slave);
+		}
+	}
+	*seconds = uringBenchNow() - begin;
+	*syscalls = waitCount;
+	for (int i = 0; i < MODBUS_URING_BENCH_BUS_N * 2; i++)
+	{
+		*syscalls += ports[i].m_readCount + ports[i].m_writeCount + ports[i].m_readCount; // 每次读取前还有一次poll
+		ModBus_Serial_close(ports + i);
+	}
+	close(epollFd);
+}
+
+// io_uring后端: 每轮一次io_uring_enter
+static void uringBenchUring(UringBenchBus_T* buses, byte tcp, double* seconds, unsigned long long* syscalls)
+{
+	static ModBus_Uring_Channel_T channels[MODBUS_URING_BENCH_BUS_N * 2];
+	ModBus_Uring_T ring;
+	int fds[MODBUS_URING_BENCH_BUS_N][2];
+	double begin;
+	int ret = ModBus_Uring_setup(&ring, channels, MODBUS_URING_BENCH_BUS_N * 2);
+
+	assert(ret == 0);
+	(void)ret;
+	uringBenchOpen(buses, fds, tcp);
+	for (int b = 0; b < MODBUS_URING_BENCH_BUS_N; b++)
+	{
+		ModBus_Uring_attachFd(&ring, fds[b][0], &buses[b].master, MODBUS_URING_MASTER);
+		ModBus_Uring_attachFd(&ring, fds[b][1], &buses[b].slave, MODBUS_URING_SLAVE);
+	}
+	begin = uringBenchNow();
+	while (!uringBenchIssue(buses))
+	{
+		ModBus_Uring_run(&ring, 10);
+	}
+	*seconds = uringBenchNow() - begin;
+	*syscalls = ring.m_enterCount;
+	ModBus_Uring_close(&ring);
+}
+
+// 16对主从机同时顺序读寄存器, 比较epoll与io_uring后端的耗时和系统调用次数
+void uring_benchmark()
+{
+	static UringBenchBus_T buses[MODBUS_URING_BENCH_BUS_N];
+	const char* names[2] = { "pty", "tcp" };
+	u32 total = MODBUS_URING_BENCH_BUS_N * MODBUS_URING_BENCH_REQUEST_N;
+	ModBus_Uring_Channel_T probe;
+	ModBus_Uring_T ring;
+
+	if (ModBus_Uring_setup(&ring, &probe, 1) < 0)
+	{
+		printf("uring_benchmark: io_uring unavailable (errno %d), skipped\n", errno);
+		return;
+	}
+	ModBus_Uring_close(&ring);
+	for (byte tcp = 0; tcp < 2; tcp++)
+	{
+		double seconds[2];
+		unsigned long long syscalls[2];
+		u32 okCount[2] = { 0, 0 };
+		uringBenchEpoll(buses, tcp, seconds, syscalls);
+		for (int b = 0; b < MODBUS_URING_BENCH_BUS_N; b++)
+			okCount[0] += buses[b].okCount;
+		uringBenchUring(buses, tcp, seconds + 1, syscalls + 1);
+		for (int b = 0; b < MODBUS_URING_BENCH_BUS_N; b++)
+			okCount[1] += buses[b].okCount;
+		printf("uring_benchmark %s x%d: epoll %.1f us/req %.2f syscalls/req (ok %u), io_uring %.1f us/req %.2f syscalls/req (ok %u)\n",
+			names[tcp], MODBUS_URING_BENCH_BUS_N, seconds[0] * 1e6 / total, (double)syscalls[0] / total, okCount[0],
+			seconds[1] * 1e6 / total, (double)syscalls[1] / total, okCount[1]);
+	}
+}
+#endif // _BENCHMARK
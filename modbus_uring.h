@@ -0,0 +1,108 @@
+#ifndef MOTECMODBUS_URING_H_
+#define MOTECMODBUS_URING_H_
+/**** ModBus io_uring 收发后端 (Linux 5.11+) ****
+** 多个实例(串口/伪终端/TCP连接, 每个一个通道)共用一个io_uring, 代替epoll + 每次唤醒read + 每帧write
+** 接收: 每个通道常驻一个读操作, 数据直接读入已注册的通道接收缓冲区(READ_FIXED), 完成后传入实例
+** 发送: 实例的发送函数只把帧复制到通道的发送缓冲区(已注册)并排队, 不调用系统调用
+****** 所有通道排队的读写操作在下一次ModBus_Uring_run中与等待完成合并为一次io_uring_enter提交
+** 完成事件在ModBus_Uring_run中处理: 接收数据传入实例, 发送完成后继续发送排队的帧, 然后运行全部实例的loop
+** 使用方法:
+****** 配置实例(ModBus_setup), 通过RTU over TCP或伪终端等流式通道收发时开启ModBus_lengthFraming
+****** 调用ModBus_Uring_setup配置, 传入通道缓冲区; 失败(内核不支持或被禁用)时可改用epoll(见 modbus_runtime.h)
+****** 调用ModBus_Uring_attachFd绑定已打开的设备或socket到实例
+****** 循环调用ModBus_Uring_run, 调用ModBus_Uring_close关闭
+** 注: 不依赖liburing, 直接使用系统调用; 同一个io_uring和所属实例只能在同一线程中使用
+*/
+
+#include "modbus.h"
+
+#define MODBUS_URING_READ_SIZE (MODBUS_BUFFER_SIZE - 1) // 每次读操作最多读取的字节数, 与实例接收缓冲区容量相同
+#define MODBUS_URING_TX_N 4 // 每个通道排队发送的帧数, 队列满时丢弃新帧并计入错误
+
+typedef enum {
+	MODBUS_URING_MASTER, // 运行ModBus_Master_loop
+	MODBUS_URING_SLAVE, // 运行ModBus_Slave_loop
+} MODBUS_URING_ROLE_TYPE;
+
+struct __MODBUS_Uring;
+
+typedef struct _MODBUS_URING_CHANNEL_T { // 通道, 收发缓冲区在通道内, 整个通道缓冲区注册到io_uring
+	byte m_rxBuffer[MODBUS_URING_READ_SIZE]; // 接收缓冲区
+	byte m_txBuffer[MODBUS_URING_TX_N][MODBUS_BUFFER_SIZE]; // 发送帧队列
+	uint16_t m_txLength[MODBUS_URING_TX_N]; // 各帧长度, MODBUS_BUFFER_SIZE可能超过255
+	u32 m_txHead; // 正在发送的帧序号
+	u32 m_txTail; // 下一个写入的帧序号
+	u32 m_txOffset; // 正在发送的帧已发送的字节数
+
+	struct __MODBUS_Uring* m_ring; // 所属io_uring
+	int m_fd; // 设备或socket
+	ModBus_parameter* m_modbus; // 绑定的实例
+	MODBUS_URING_ROLE_TYPE m_role; // 主机/从机
+	byte m_reading; // 读操作已排队或未完成
+	byte m_writing; // 写操作已排队或未完成, 同一通道只有一个写操作, 保证帧顺序
+	byte m_closed; // 对端关闭或出错, 不再接收
+
+	u32 m_receivedBytes; // 接收字节数
+	u32 m_sentBytes; // 发送字节数
+	u32 m_errorCount; // 收发错误和发送队列满丢弃的帧数
+} ModBus_Uring_Channel_T;
+
+typedef struct __MODBUS_Uring {
+	int m_fd; // io_uring文件描述符
+	void* m_sqRing; // 提交队列映射
+	size_t m_sqRingSize;
+	void* m_cqRing; // 完成队列映射, 内核支持单次映射时与m_sqRing相同
+	size_t m_cqRingSize;
+	void* m_sqes; // 提交项数组映射
+	size_t m_sqesSize;
+	unsigned* m_sqHead;
+	unsigned* m_sqTail;
+	unsigned* m_sqArray;
+	unsigned m_sqMask;
+	unsigned m_sqEntries;
+	unsigned m_sqPending; // 已排队未提交的操作数
+	unsigned* m_cqHead;
+	unsigned* m_cqTail;
+	unsigned m_cqMask;
+	void* m_cqes;
+	byte m_fixedBuffers; // 通道缓冲区已注册, 使用READ_FIXED/WRITE_FIXED; 注册失败(如内存锁定限制)时使用READ/WRITE
+
+	ModBus_Uring_Channel_T* m_channels; // 通道缓冲区, 由调用者提供
+	size_t m_capacity; // 通道缓冲区个数
+	size_t m_channelN; // 已绑定的通道个数
+
+	unsigned long long m_enterCount; // io_uring_enter调用次数(即收发的系统调用次数)
+	unsigned long long m_sqeCount; // 提交的读写操作数
+	unsigned long long m_cqeCount; // 处理的完成事件数
+} ModBus_Uring_T;
+
+/************ 对外接口 BEGIN ***********/
+
+/** 配置io_uring **/
+/*** 参数 ***
+** channels: 通道缓冲区, 个数capacity为最多绑定的通道数; 需为普通内存(静态变量/堆), 整体注册为io_uring固定缓冲区
+** 成功返回0, 失败返回-1(errno为失败原因, ENOSYS/EPERM表示内核不支持或禁用io_uring)
+***/
+int ModBus_Uring_setup(ModBus_Uring_T* ring, ModBus_Uring_Channel_T* channels, size_t capacity);
+
+/** 绑定已打开的设备或socket到实例 **/
+/*** 参数 ***
+** fd: 设备(串口/伪终端, 设置为原始模式)或已连接的socket, 设置为非阻塞; 关闭io_uring时会被关闭
+** modbus: 已配置的实例, 绑定发送函数
+** 返回通道序号, 失败返回-1
+***/
+int ModBus_Uring_attachFd(ModBus_Uring_T* ring, int fd, ModBus_parameter* modbus, MODBUS_URING_ROLE_TYPE role);
+
+/** 提交排队的读写操作, 等待并处理完成事件, 然后运行全部实例的loop **/
+/*** 参数 ***
+** waitTime: 没有完成事件时最多等待的毫秒数, 0 不等待, -1 一直等待; 实例有待发送的指令或超时到期时等待时间相应缩短
+** 返回处理的完成事件数, 出错返回-1
+***/
+int ModBus_Uring_run(ModBus_Uring_T* ring, int waitTime);
+
+// 关闭io_uring和全部通道的文件描述符, 并解除实例的发送函数绑定
+void ModBus_Uring_close(ModBus_Uring_T* ring);
+
+/**************** 对外接口 END ***************/
+
+#endif